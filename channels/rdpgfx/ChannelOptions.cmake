@@ -1,7 +1,7 @@
 
 set(OPTION_DEFAULT OFF)
 set(OPTION_CLIENT_DEFAULT ON)
-set(OPTION_SERVER_DEFAULT OFF)
+set(OPTION_SERVER_DEFAULT ON)
 
 define_channel_options(NAME "rdpgfx" TYPE "dynamic"
 	DESCRIPTION "Graphics Pipeline Extension"
@@ -0,0 +1,954 @@
+/**
+ * FreeRDP: A Remote Desktop Protocol Implementation
+ * Graphics Pipeline Extension
+ *
+ * Copyright 2026 agent <agent@local>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <winpr/crt.h>
+#include <winpr/print.h>
+#include <winpr/stream.h>
+#include <winpr/sysinfo.h>
+
+#include <freerdp/channels/log.h>
+
+#include "rdpgfx_common.h"
+
+#include "rdpgfx_main.h"
+
+/**
+ *                                    Initialization Sequence\n
+ *     Client                                                                    Server\n
+ *        |                                                                         |\n
+ *        |-----------------------------Caps Advertise PDU------------------------->|\n
+ *        |<-----------------------------Caps Confirm PDU---------------------------|\n
+ *        |<----------------------------Reset Graphics PDU--------------------------|\n
+ *        |<---------------------Create Surface / Map Surface PDUs------------------|\n
+ *
+ *                                       Frame Sequence\n
+ *     Client                                                                    Server\n
+ *        |                                                                         |\n
+ *        |<------------------------------Start Frame PDU---------------------------|\n
+ *        |<-------------------Wire To Surface / Solid Fill / Cache PDUs------------|\n
+ *        |<-------------------------------End Frame PDU----------------------------|\n
+ *        |---------------------------Frame Acknowledge PDU------------------------>|\n
+ *
+ * All server to client PDUs are ZGFX (RDP8) segmented, the client to server
+ * PDUs are not compressed.
+ */
+
+static wStream* rdpgfx_server_packet_new(UINT16 cmdId, UINT32 dataLen)
+{
+	wStream* s;
+	RDPGFX_HEADER header;
+
+	s = Stream_New(NULL, RDPGFX_HEADER_SIZE + dataLen);
+
+	if (!s)
+		return NULL;
+
+	header.cmdId = cmdId;
+	header.flags = 0;
+	header.pduLength = 0; /* written when the packet is sent */
+
+	rdpgfx_write_header(s, &header);
+
+	return s;
+}
+
+static int rdpgfx_server_packet_send(RdpgfxServerContext* context, wStream* s)
+{
+	int status;
+	UINT32 flags;
+	UINT32 pduLength;
+	UINT32 DstSize = 0;
+	BYTE* pDstData = NULL;
+	RdpgfxServerPrivate* priv = context->priv;
+
+	pduLength = (UINT32) Stream_GetPosition(s);
+
+	Stream_SetPosition(s, 4);
+	Stream_Write_UINT32(s, pduLength); /* pduLength (4 bytes) */
+	Stream_SetPosition(s, pduLength);
+
+	EnterCriticalSection(&priv->lock);
+
+	status = -1;
+
+	if (priv->ChannelHandle)
+	{
+		if (zgfx_compress(priv->zgfx, Stream_Buffer(s), pduLength, &pDstData, &DstSize, &flags) >= 0)
+		{
+			if (WTSVirtualChannelWrite(priv->ChannelHandle, (PCHAR) pDstData, DstSize, NULL))
+				status = 1;
+		}
+	}
+
+	LeaveCriticalSection(&priv->lock);
+
+	if (status < 0)
+		WLog_ERR(TAG, "failed to send PDU (%d bytes)", pduLength);
+
+	free(pDstData);
+	Stream_Free(s, TRUE);
+
+	return status;
+}
+
+static int rdpgfx_server_caps_confirm(RdpgfxServerContext* context, RDPGFX_CAPS_CONFIRM_PDU* capsConfirm)
+{
+	int status;
+	wStream* s;
+	RdpgfxServerPrivate* priv = context->priv;
+
+	s = rdpgfx_server_packet_new(RDPGFX_CMDID_CAPSCONFIRM, RDPGFX_CAPSET_SIZE);
+
+	if (!s)
+		return -1;
+
+	Stream_Write_UINT32(s, capsConfirm->capsSet->version); /* version (4 bytes) */
+	Stream_Write_UINT32(s, 4); /* capsDataLength (4 bytes) */
+	Stream_Write_UINT32(s, capsConfirm->capsSet->flags); /* capsData (4 bytes) */
+
+	context->Caps.version = capsConfirm->capsSet->version;
+	context->Caps.flags = capsConfirm->capsSet->flags;
+
+	priv->MaxCacheSlots = (context->Caps.flags & RDPGFX_CAPS_FLAG_SMALL_CACHE) ? 4096 : 25600;
+
+	status = rdpgfx_server_packet_send(context, s);
+
+	/* graphics PDUs may only follow the confirmation */
+	if (status >= 0)
+	{
+		context->CapsConfirmed = TRUE;
+		IFCALL(context->OnCapsConfirmed, context);
+	}
+
+	return status;
+}
+
+static int rdpgfx_server_reset_graphics(RdpgfxServerContext* context, RDPGFX_RESET_GRAPHICS_PDU* resetGraphics)
+{
+	UINT32 index;
+	wStream* s;
+	MONITOR_DEF* monitor;
+
+	if (resetGraphics->monitorCount > 16)
+		return -1;
+
+	/* the PDU is padded to a total size of 340 bytes */
+
+	s = rdpgfx_server_packet_new(RDPGFX_CMDID_RESETGRAPHICS, 340 - RDPGFX_HEADER_SIZE);
+
+	if (!s)
+		return -1;
+
+	Stream_Write_UINT32(s, resetGraphics->width); /* width (4 bytes) */
+	Stream_Write_UINT32(s, resetGraphics->height); /* height (4 bytes) */
+	Stream_Write_UINT32(s, resetGraphics->monitorCount); /* monitorCount (4 bytes) */
+
+	for (index = 0; index < resetGraphics->monitorCount; index++)
+	{
+		monitor = &(resetGraphics->monitorDefArray[index]);
+		Stream_Write_UINT32(s, monitor->left); /* left (4 bytes) */
+		Stream_Write_UINT32(s, monitor->top); /* top (4 bytes) */
+		Stream_Write_UINT32(s, monitor->right); /* right (4 bytes) */
+		Stream_Write_UINT32(s, monitor->bottom); /* bottom (4 bytes) */
+		Stream_Write_UINT32(s, monitor->flags); /* flags (4 bytes) */
+	}
+
+	Stream_Zero(s, 340 - Stream_GetPosition(s)); /* pad (total size is 340 bytes) */
+
+	return rdpgfx_server_packet_send(context, s);
+}
+
+static int rdpgfx_server_start_frame(RdpgfxServerContext* context, RDPGFX_START_FRAME_PDU* startFrame)
+{
+	wStream* s;
+
+	s = rdpgfx_server_packet_new(RDPGFX_CMDID_STARTFRAME, 8);
+
+	if (!s)
+		return -1;
+
+	Stream_Write_UINT32(s, startFrame->timestamp); /* timestamp (4 bytes) */
+	Stream_Write_UINT32(s, startFrame->frameId); /* frameId (4 bytes) */
+
+	return rdpgfx_server_packet_send(context, s);
+}
+
+static int rdpgfx_server_end_frame(RdpgfxServerContext* context, RDPGFX_END_FRAME_PDU* endFrame)
+{
+	wStream* s;
+	RdpgfxServerPrivate* priv = context->priv;
+
+	s = rdpgfx_server_packet_new(RDPGFX_CMDID_ENDFRAME, 4);
+
+	if (!s)
+		return -1;
+
+	Stream_Write_UINT32(s, endFrame->frameId); /* frameId (4 bytes) */
+
+	EnterCriticalSection(&priv->lock);
+
+	if (!context->FrameAckSuspended)
+		context->FramesInFlight++;
+
+	LeaveCriticalSection(&priv->lock);
+
+	return rdpgfx_server_packet_send(context, s);
+}
+
+static int rdpgfx_server_wire_to_surface_1(RdpgfxServerContext* context, RDPGFX_WIRE_TO_SURFACE_PDU_1* wireToSurface1)
+{
+	wStream* s;
+
+	s = rdpgfx_server_packet_new(RDPGFX_CMDID_WIRETOSURFACE_1, 17 + wireToSurface1->bitmapDataLength);
+
+	if (!s)
+		return -1;
+
+	Stream_Write_UINT16(s, wireToSurface1->surfaceId); /* surfaceId (2 bytes) */
+	Stream_Write_UINT16(s, wireToSurface1->codecId); /* codecId (2 bytes) */
+	Stream_Write_UINT8(s, wireToSurface1->pixelFormat); /* pixelFormat (1 byte) */
+	rdpgfx_write_rect16(s, &(wireToSurface1->destRect)); /* destRect (8 bytes) */
+	Stream_Write_UINT32(s, wireToSurface1->bitmapDataLength); /* bitmapDataLength (4 bytes) */
+	Stream_Write(s, wireToSurface1->bitmapData, wireToSurface1->bitmapDataLength);
+
+	return rdpgfx_server_packet_send(context, s);
+}
+
+static int rdpgfx_server_wire_to_surface_2(RdpgfxServerContext* context, RDPGFX_WIRE_TO_SURFACE_PDU_2* wireToSurface2)
+{
+	wStream* s;
+
+	s = rdpgfx_server_packet_new(RDPGFX_CMDID_WIRETOSURFACE_2, 13 + wireToSurface2->bitmapDataLength);
+
+	if (!s)
+		return -1;
+
+	Stream_Write_UINT16(s, wireToSurface2->surfaceId); /* surfaceId (2 bytes) */
+	Stream_Write_UINT16(s, wireToSurface2->codecId); /* codecId (2 bytes) */
+	Stream_Write_UINT32(s, wireToSurface2->codecContextId); /* codecContextId (4 bytes) */
+	Stream_Write_UINT8(s, wireToSurface2->pixelFormat); /* pixelFormat (1 byte) */
+	Stream_Write_UINT32(s, wireToSurface2->bitmapDataLength); /* bitmapDataLength (4 bytes) */
+	Stream_Write(s, wireToSurface2->bitmapData, wireToSurface2->bitmapDataLength);
+
+	return rdpgfx_server_packet_send(context, s);
+}
+
+static int rdpgfx_server_delete_encoding_context(RdpgfxServerContext* context,
+		RDPGFX_DELETE_ENCODING_CONTEXT_PDU* deleteEncodingContext)
+{
+	wStream* s;
+
+	s = rdpgfx_server_packet_new(RDPGFX_CMDID_DELETEENCODINGCONTEXT, 6);
+
+	if (!s)
+		return -1;
+
+	Stream_Write_UINT16(s, deleteEncodingContext->surfaceId); /* surfaceId (2 bytes) */
+	Stream_Write_UINT32(s, deleteEncodingContext->codecContextId); /* codecContextId (4 bytes) */
+
+	return rdpgfx_server_packet_send(context, s);
+}
+
+static int rdpgfx_server_solid_fill(RdpgfxServerContext* context, RDPGFX_SOLID_FILL_PDU* solidFill)
+{
+	UINT16 index;
+	wStream* s;
+
+	s = rdpgfx_server_packet_new(RDPGFX_CMDID_SOLIDFILL, 8 + (solidFill->fillRectCount * 8));
+
+	if (!s)
+		return -1;
+
+	Stream_Write_UINT16(s, solidFill->surfaceId); /* surfaceId (2 bytes) */
+	rdpgfx_write_color32(s, &(solidFill->fillPixel)); /* fillPixel (4 bytes) */
+	Stream_Write_UINT16(s, solidFill->fillRectCount); /* fillRectCount (2 bytes) */
+
+	for (index = 0; index < solidFill->fillRectCount; index++)
+		rdpgfx_write_rect16(s, &(solidFill->fillRects[index])); /* fillRects (8 bytes) */
+
+	return rdpgfx_server_packet_send(context, s);
+}
+
+static int rdpgfx_server_surface_to_surface(RdpgfxServerContext* context, RDPGFX_SURFACE_TO_SURFACE_PDU* surfaceToSurface)
+{
+	UINT16 index;
+	wStream* s;
+
+	s = rdpgfx_server_packet_new(RDPGFX_CMDID_SURFACETOSURFACE, 14 + (surfaceToSurface->destPtsCount * 4));
+
+	if (!s)
+		return -1;
+
+	Stream_Write_UINT16(s, surfaceToSurface->surfaceIdSrc); /* surfaceIdSrc (2 bytes) */
+	Stream_Write_UINT16(s, surfaceToSurface->surfaceIdDest); /* surfaceIdDest (2 bytes) */
+	rdpgfx_write_rect16(s, &(surfaceToSurface->rectSrc)); /* rectSrc (8 bytes) */
+	Stream_Write_UINT16(s, surfaceToSurface->destPtsCount); /* destPtsCount (2 bytes) */
+
+	for (index = 0; index < surfaceToSurface->destPtsCount; index++)
+		rdpgfx_write_point16(s, &(surfaceToSurface->destPts[index])); /* destPts (4 bytes) */
+
+	return rdpgfx_server_packet_send(context, s);
+}
+
+static int rdpgfx_server_surface_to_cache(RdpgfxServerContext* context, RDPGFX_SURFACE_TO_CACHE_PDU* surfaceToCache)
+{
+	wStream* s;
+	RdpgfxServerPrivate* priv = context->priv;
+
+	if (surfaceToCache->cacheSlot >= priv->MaxCacheSlots)
+		return -1;
+
+	s = rdpgfx_server_packet_new(RDPGFX_CMDID_SURFACETOCACHE, 20);
+
+	if (!s)
+		return -1;
+
+	Stream_Write_UINT16(s, surfaceToCache->surfaceId); /* surfaceId (2 bytes) */
+	Stream_Write_UINT64(s, surfaceToCache->cacheKey); /* cacheKey (8 bytes) */
+	Stream_Write_UINT16(s, surfaceToCache->cacheSlot); /* cacheSlot (2 bytes) */
+	rdpgfx_write_rect16(s, &(surfaceToCache->rectSrc)); /* rectSrc (8 bytes) */
+
+	return rdpgfx_server_packet_send(context, s);
+}
+
+static int rdpgfx_server_cache_to_surface(RdpgfxServerContext* context, RDPGFX_CACHE_TO_SURFACE_PDU* cacheToSurface)
+{
+	UINT16 index;
+	wStream* s;
+	RdpgfxServerPrivate* priv = context->priv;
+
+	if (cacheToSurface->cacheSlot >= priv->MaxCacheSlots)
+		return -1;
+
+	s = rdpgfx_server_packet_new(RDPGFX_CMDID_CACHETOSURFACE, 6 + (cacheToSurface->destPtsCount * 4));
+
+	if (!s)
+		return -1;
+
+	Stream_Write_UINT16(s, cacheToSurface->cacheSlot); /* cacheSlot (2 bytes) */
+	Stream_Write_UINT16(s, cacheToSurface->surfaceId); /* surfaceId (2 bytes) */
+	Stream_Write_UINT16(s, cacheToSurface->destPtsCount); /* destPtsCount (2 bytes) */
+
+	for (index = 0; index < cacheToSurface->destPtsCount; index++)
+		rdpgfx_write_point16(s, &(cacheToSurface->destPts[index])); /* destPts (4 bytes) */
+
+	return rdpgfx_server_packet_send(context, s);
+}
+
+static int rdpgfx_server_cache_import_reply(RdpgfxServerContext* context, RDPGFX_CACHE_IMPORT_REPLY_PDU* cacheImportReply)
+{
+	UINT16 index;
+	wStream* s;
+
+	if (cacheImportReply->importedEntriesCount > 5462)
+		return -1;
+
+	s = rdpgfx_server_packet_new(RDPGFX_CMDID_CACHEIMPORTREPLY, 2 + (cacheImportReply->importedEntriesCount * 2));
+
+	if (!s)
+		return -1;
+
+	Stream_Write_UINT16(s, cacheImportReply->importedEntriesCount); /* importedEntriesCount (2 bytes) */
+
+	for (index = 0; index < cacheImportReply->importedEntriesCount; index++)
+		Stream_Write_UINT16(s, cacheImportReply->cacheSlots[index]); /* cacheSlot (2 bytes) */
+
+	return rdpgfx_server_packet_send(context, s);
+}
+
+static int rdpgfx_server_evict_cache_entry(RdpgfxServerContext* context, RDPGFX_EVICT_CACHE_ENTRY_PDU* evictCacheEntry)
+{
+	wStream* s;
+	RdpgfxServerPrivate* priv = context->priv;
+
+	if (evictCacheEntry->cacheSlot >= priv->MaxCacheSlots)
+		return -1;
+
+	s = rdpgfx_server_packet_new(RDPGFX_CMDID_EVICTCACHEENTRY, 2);
+
+	if (!s)
+		return -1;
+
+	Stream_Write_UINT16(s, evictCacheEntry->cacheSlot); /* cacheSlot (2 bytes) */
+
+	return rdpgfx_server_packet_send(context, s);
+}
+
+static int rdpgfx_server_create_surface(RdpgfxServerContext* context, RDPGFX_CREATE_SURFACE_PDU* createSurface)
+{
+	wStream* s;
+
+	s = rdpgfx_server_packet_new(RDPGFX_CMDID_CREATESURFACE, 7);
+
+	if (!s)
+		return -1;
+
+	Stream_Write_UINT16(s, createSurface->surfaceId); /* surfaceId (2 bytes) */
+	Stream_Write_UINT16(s, createSurface->width); /* width (2 bytes) */
+	Stream_Write_UINT16(s, createSurface->height); /* height (2 bytes) */
+	Stream_Write_UINT8(s, createSurface->pixelFormat); /* RDPGFX_PIXELFORMAT (1 byte) */
+
+	return rdpgfx_server_packet_send(context, s);
+}
+
+static int rdpgfx_server_delete_surface(RdpgfxServerContext* context, RDPGFX_DELETE_SURFACE_PDU* deleteSurface)
+{
+	wStream* s;
+
+	s = rdpgfx_server_packet_new(RDPGFX_CMDID_DELETESURFACE, 2);
+
+	if (!s)
+		return -1;
+
+	Stream_Write_UINT16(s, deleteSurface->surfaceId); /* surfaceId (2 bytes) */
+
+	return rdpgfx_server_packet_send(context, s);
+}
+
+static int rdpgfx_server_map_surface_to_output(RdpgfxServerContext* context, RDPGFX_MAP_SURFACE_TO_OUTPUT_PDU* surfaceToOutput)
+{
+	wStream* s;
+
+	s = rdpgfx_server_packet_new(RDPGFX_CMDID_MAPSURFACETOOUTPUT, 12);
+
+	if (!s)
+		return -1;
+
+	Stream_Write_UINT16(s, surfaceToOutput->surfaceId); /* surfaceId (2 bytes) */
+	Stream_Write_UINT16(s, 0); /* reserved (2 bytes) */
+	Stream_Write_UINT32(s, surfaceToOutput->outputOriginX); /* outputOriginX (4 bytes) */
+	Stream_Write_UINT32(s, surfaceToOutput->outputOriginY); /* outputOriginY (4 bytes) */
+
+	return rdpgfx_server_packet_send(context, s);
+}
+
+static BOOL rdpgfx_server_can_send_frame(RdpgfxServerContext* context)
+{
+	BOOL status;
+	RdpgfxServerPrivate* priv = context->priv;
+
+	EnterCriticalSection(&priv->lock);
+
+	status = context->FrameAckSuspended || (context->FramesInFlight < context->MaxFramesInFlight);
+
+	LeaveCriticalSection(&priv->lock);
+
+	return status;
+}
+
+static int rdpgfx_server_recv_caps_advertise_pdu(RdpgfxServerContext* context, wStream* s)
+{
+	int status;
+	UINT16 index;
+	UINT32 capsDataLength;
+	RDPGFX_CAPSET* capsSet;
+	RDPGFX_CAPSET* capsSets;
+	RDPGFX_CAPS_CONFIRM_PDU capsConfirm;
+	RDPGFX_CAPS_ADVERTISE_PDU pdu;
+
+	if (Stream_GetRemainingLength(s) < 2)
+		return -1;
+
+	Stream_Read_UINT16(s, pdu.capsSetCount); /* capsSetCount (2 bytes) */
+
+	capsSets = (RDPGFX_CAPSET*) calloc(pdu.capsSetCount + 1, sizeof(RDPGFX_CAPSET));
+
+	if (!capsSets)
+		return -1;
+
+	pdu.capsSets = capsSets;
+
+	for (index = 0; index < pdu.capsSetCount; index++)
+	{
+		capsSet = &(pdu.capsSets[index]);
+
+		if (Stream_GetRemainingLength(s) < 8)
+			goto fail;
+
+		Stream_Read_UINT32(s, capsSet->version); /* version (4 bytes) */
+		Stream_Read_UINT32(s, capsDataLength); /* capsDataLength (4 bytes) */
+
+		if ((capsDataLength < 4) || (Stream_GetRemainingLength(s) < capsDataLength))
+			goto fail;
+
+		Stream_Read_UINT32(s, capsSet->flags); /* capsData (4 bytes) */
+		Stream_Seek(s, capsDataLength - 4);
+	}
+
+	WLog_DBG(TAG, "RecvCapsAdvertisePdu: capsSetCount: %d", pdu.capsSetCount);
+
+	if (context->CapsAdvertise)
+	{
+		status = context->CapsAdvertise(context, &pdu);
+	}
+	else
+	{
+		/* confirm the highest version we know about */
+
+		capsSet = NULL;
+
+		for (index = 0; index < pdu.capsSetCount; index++)
+		{
+			if ((pdu.capsSets[index].version != RDPGFX_CAPVERSION_8) &&
+					(pdu.capsSets[index].version != RDPGFX_CAPVERSION_81))
+				continue;
+
+			if (!capsSet || (pdu.capsSets[index].version > capsSet->version))
+				capsSet = &(pdu.capsSets[index]);
+		}
+
+		if (!capsSet)
+		{
+			WLog_ERR(TAG, "no supported capability set advertised");
+			goto fail;
+		}
+
+		capsConfirm.capsSet = capsSet;
+		status = context->CapsConfirm(context, &capsConfirm);
+	}
+
+	free(capsSets);
+
+	return status;
+
+fail:
+	free(capsSets);
+	return -1;
+}
+
+static int rdpgfx_server_recv_frame_acknowledge_pdu(RdpgfxServerContext* context, wStream* s)
+{
+	RDPGFX_FRAME_ACKNOWLEDGE_PDU pdu;
+	RdpgfxServerPrivate* priv = context->priv;
+
+	if (Stream_GetRemainingLength(s) < 12)
+		return -1;
+
+	Stream_Read_UINT32(s, pdu.queueDepth); /* queueDepth (4 bytes) */
+	Stream_Read_UINT32(s, pdu.frameId); /* frameId (4 bytes) */
+	Stream_Read_UINT32(s, pdu.totalFramesDecoded); /* totalFramesDecoded (4 bytes) */
+
+	EnterCriticalSection(&priv->lock);
+
+	if (pdu.queueDepth == SUSPEND_FRAME_ACKNOWLEDGEMENT)
+	{
+		/* the client no longer acknowledges frames, stop throttling */
+		context->FrameAckSuspended = TRUE;
+		context->FramesInFlight = 0;
+	}
+	else
+	{
+		context->FrameAckSuspended = FALSE;
+		context->QueueDepth = pdu.queueDepth;
+
+		if (context->FramesInFlight > 0)
+			context->FramesInFlight--;
+	}
+
+	context->TotalFramesDecoded = pdu.totalFramesDecoded;
+
+	LeaveCriticalSection(&priv->lock);
+
+	WLog_DBG(TAG, "RecvFrameAcknowledgePdu: frameId: %d queueDepth: %d totalFramesDecoded: %d",
+			pdu.frameId, pdu.queueDepth, pdu.totalFramesDecoded);
+
+	IFCALL(context->FrameAcknowledge, context, &pdu);
+
+	return 1;
+}
+
+static int rdpgfx_server_recv_cache_import_offer_pdu(RdpgfxServerContext* context, wStream* s)
+{
+	int status;
+	UINT16 index;
+	RDPGFX_CACHE_ENTRY_METADATA* cacheEntry;
+	RDPGFX_CACHE_IMPORT_OFFER_PDU pdu;
+	RDPGFX_CACHE_IMPORT_REPLY_PDU reply;
+
+	if (Stream_GetRemainingLength(s) < 2)
+		return -1;
+
+	Stream_Read_UINT16(s, pdu.cacheEntriesCount); /* cacheEntriesCount (2 bytes) */
+
+	if (pdu.cacheEntriesCount > 5462)
+		return -1;
+
+	if (Stream_GetRemainingLength(s) < (size_t) (pdu.cacheEntriesCount * 12))
+		return -1;
+
+	pdu.cacheEntries = (RDPGFX_CACHE_ENTRY_METADATA*) calloc(pdu.cacheEntriesCount + 1,
+			sizeof(RDPGFX_CACHE_ENTRY_METADATA));
+
+	if (!pdu.cacheEntries)
+		return -1;
+
+	for (index = 0; index < pdu.cacheEntriesCount; index++)
+	{
+		cacheEntry = &(pdu.cacheEntries[index]);
+		Stream_Read_UINT64(s, cacheEntry->cacheKey); /* cacheKey (8 bytes) */
+		Stream_Read_UINT32(s, cacheEntry->bitmapLength); /* bitmapLength (4 bytes) */
+	}
+
+	WLog_DBG(TAG, "RecvCacheImportOfferPdu: cacheEntriesCount: %d", pdu.cacheEntriesCount);
+
+	if (context->CacheImportOffer)
+	{
+		status = context->CacheImportOffer(context, &pdu);
+	}
+	else
+	{
+		reply.importedEntriesCount = 0;
+		reply.cacheSlots = NULL;
+		status = context->CacheImportReply(context, &reply);
+	}
+
+	free(pdu.cacheEntries);
+
+	return status;
+}
+
+static int rdpgfx_server_recv_pdu(RdpgfxServerContext* context, wStream* s)
+{
+	int status;
+	size_t beg, end;
+	RDPGFX_HEADER header;
+
+	beg = Stream_GetPosition(s);
+
+	if (rdpgfx_read_header(s, &header) < 0)
+		return -1;
+
+	if ((header.pduLength < RDPGFX_HEADER_SIZE) || (Stream_GetRemainingLength(s) < (header.pduLength - RDPGFX_HEADER_SIZE)))
+		return -1;
+
+	WLog_DBG(TAG, "cmdId: %s (0x%04X) flags: 0x%04X pduLength: %d",
+			rdpgfx_get_cmd_id_string(header.cmdId), header.cmdId, header.flags, header.pduLength);
+
+	switch (header.cmdId)
+	{
+		case RDPGFX_CMDID_CAPSADVERTISE:
+			status = rdpgfx_server_recv_caps_advertise_pdu(context, s);
+			break;
+
+		case RDPGFX_CMDID_FRAMEACKNOWLEDGE:
+			status = rdpgfx_server_recv_frame_acknowledge_pdu(context, s);
+			break;
+
+		case RDPGFX_CMDID_CACHEIMPORTOFFER:
+			status = rdpgfx_server_recv_cache_import_offer_pdu(context, s);
+			break;
+
+		default:
+			WLog_WARN(TAG, "unexpected GFX cmdId: %s (0x%04X)",
+					rdpgfx_get_cmd_id_string(header.cmdId), header.cmdId);
+			status = 1;
+			break;
+	}
+
+	if (status < 0)
+	{
+		WLog_ERR(TAG, "Error while parsing GFX cmdId: %s (0x%04X)",
+				rdpgfx_get_cmd_id_string(header.cmdId), header.cmdId);
+		return -1;
+	}
+
+	end = beg + header.pduLength;
+	Stream_SetPosition(s, end);
+
+	return status;
+}
+
+static BOOL rdpgfx_server_open_channel(RdpgfxServerContext* context)
+{
+	DWORD Error;
+	HANDLE hEvent;
+	DWORD StartTick;
+	DWORD BytesReturned = 0;
+	PULONG pSessionId = NULL;
+	void* ChannelHandle = NULL;
+	RdpgfxServerPrivate* priv = context->priv;
+
+	if (!WTSQuerySessionInformationA(context->vcm, WTS_CURRENT_SESSION,
+			WTSSessionId, (LPSTR*) &pSessionId, &BytesReturned))
+	{
+		return FALSE;
+	}
+
+	priv->SessionId = (DWORD) *pSessionId;
+	WTSFreeMemory(pSessionId);
+
+	hEvent = WTSVirtualChannelManagerGetEventHandle(context->vcm);
+	StartTick = GetTickCount();
+
+	while (!ChannelHandle)
+	{
+		if (WaitForSingleObject(priv->StopEvent, 0) == WAIT_OBJECT_0)
+			break;
+
+		WaitForSingleObject(hEvent, 1000);
+
+		ChannelHandle = WTSVirtualChannelOpenEx(priv->SessionId,
+				RDPGFX_DVC_CHANNEL_NAME, WTS_CHANNEL_OPTION_DYNAMIC);
+
+		if (ChannelHandle)
+			break;
+
+		Error = GetLastError();
+
+		if (Error == ERROR_NOT_FOUND)
+			break;
+
+		if (GetTickCount() - StartTick > 5000)
+			break;
+	}
+
+	EnterCriticalSection(&priv->lock);
+	priv->ChannelHandle = ChannelHandle;
+	LeaveCriticalSection(&priv->lock);
+
+	return ChannelHandle ? TRUE : FALSE;
+}
+
+static int rdpgfx_server_read(RdpgfxServerContext* context)
+{
+	wStream* s;
+	DWORD BytesReturned = 0;
+	RdpgfxServerPrivate* priv = context->priv;
+
+	s = priv->s;
+	Stream_SetPosition(s, 0);
+
+	WTSVirtualChannelRead(priv->ChannelHandle, 0, NULL, 0, &BytesReturned);
+
+	if (BytesReturned < 1)
+		return 1;
+
+	if (!Stream_EnsureCapacity(s, BytesReturned))
+		return -1;
+
+	if (!WTSVirtualChannelRead(priv->ChannelHandle, 0, (PCHAR) Stream_Buffer(s),
+			(ULONG) Stream_Capacity(s), &BytesReturned))
+	{
+		return -1;
+	}
+
+	Stream_SetLength(s, BytesReturned);
+
+	while (Stream_GetRemainingLength(s) >= RDPGFX_HEADER_SIZE)
+	{
+		if (rdpgfx_server_recv_pdu(context, s) < 0)
+			return -1;
+	}
+
+	return 1;
+}
+
+static void* rdpgfx_server_thread(void* arg)
+{
+	DWORD nCount;
+	HANDLE events[8];
+	void* buffer = NULL;
+	BOOL ready = FALSE;
+	DWORD BytesReturned = 0;
+	RdpgfxServerContext* context = (RdpgfxServerContext*) arg;
+	RdpgfxServerPrivate* priv = context->priv;
+
+	if (!rdpgfx_server_open_channel(context))
+	{
+		WLog_ERR(TAG, "failed to open the graphics pipeline channel");
+		return NULL;
+	}
+
+	if (WTSVirtualChannelQuery(priv->ChannelHandle, WTSVirtualEventHandle, &buffer, &BytesReturned))
+	{
+		if (BytesReturned == sizeof(HANDLE))
+			CopyMemory(&(priv->ChannelEvent), buffer, sizeof(HANDLE));
+
+		WTSFreeMemory(buffer);
+	}
+
+	nCount = 0;
+	events[nCount++] = priv->StopEvent;
+	events[nCount++] = priv->ChannelEvent;
+
+	/* Wait for the client to confirm that the Graphics Pipeline dynamic channel is ready */
+
+	while (1)
+	{
+		if (WaitForMultipleObjects(nCount, events, FALSE, 100) == WAIT_OBJECT_0)
+			break;
+
+		if (!WTSVirtualChannelQuery(priv->ChannelHandle, WTSVirtualChannelReady, &buffer, &BytesReturned))
+			break;
+
+		ready = *((BOOL*) buffer);
+
+		WTSFreeMemory(buffer);
+
+		if (ready)
+			break;
+	}
+
+	while (ready)
+	{
+		if (WaitForMultipleObjects(nCount, events, FALSE, INFINITE) == WAIT_OBJECT_0)
+			break;
+
+		if (rdpgfx_server_read(context) < 0)
+			break;
+	}
+
+	EnterCriticalSection(&priv->lock);
+	WTSVirtualChannelClose(priv->ChannelHandle);
+	priv->ChannelHandle = NULL;
+	priv->ChannelEvent = NULL;
+	LeaveCriticalSection(&priv->lock);
+
+	return NULL;
+}
+
+static int rdpgfx_server_open(RdpgfxServerContext* context)
+{
+	RdpgfxServerPrivate* priv = context->priv;
+
+	if (priv->Thread)
+		return 1;
+
+	context->CapsConfirmed = FALSE;
+	context->FramesInFlight = 0;
+	context->FrameAckSuspended = FALSE;
+
+	zgfx_context_reset(priv->zgfx, FALSE);
+
+	if (!(priv->StopEvent = CreateEvent(NULL, TRUE, FALSE, NULL)))
+		return -1;
+
+	priv->Thread = CreateThread(NULL, 0,
+			(LPTHREAD_START_ROUTINE) rdpgfx_server_thread, (void*) context, 0, NULL);
+
+	if (!priv->Thread)
+	{
+		CloseHandle(priv->StopEvent);
+		priv->StopEvent = NULL;
+		return -1;
+	}
+
+	return 1;
+}
+
+static int rdpgfx_server_close(RdpgfxServerContext* context)
+{
+	RdpgfxServerPrivate* priv = context->priv;
+
+	if (priv->Thread)
+	{
+		SetEvent(priv->StopEvent);
+		WaitForSingleObject(priv->Thread, INFINITE);
+		CloseHandle(priv->Thread);
+		CloseHandle(priv->StopEvent);
+		priv->Thread = NULL;
+		priv->StopEvent = NULL;
+	}
+
+	context->CapsConfirmed = FALSE;
+
+	return 1;
+}
+
+RdpgfxServerContext* rdpgfx_server_context_new(HANDLE vcm)
+{
+	RdpgfxServerContext* context;
+	RdpgfxServerPrivate* priv;
+
+	context = (RdpgfxServerContext*) calloc(1, sizeof(RdpgfxServerContext));
+
+	if (!context)
+		return NULL;
+
+	context->vcm = vcm;
+	context->MaxFramesInFlight = RDPGFX_MAX_FRAMES_IN_FLIGHT;
+
+	context->Open = rdpgfx_server_open;
+	context->Close = rdpgfx_server_close;
+
+	context->ResetGraphics = rdpgfx_server_reset_graphics;
+	context->StartFrame = rdpgfx_server_start_frame;
+	context->EndFrame = rdpgfx_server_end_frame;
+	context->WireToSurface1 = rdpgfx_server_wire_to_surface_1;
+	context->WireToSurface2 = rdpgfx_server_wire_to_surface_2;
+	context->DeleteEncodingContext = rdpgfx_server_delete_encoding_context;
+	context->SolidFill = rdpgfx_server_solid_fill;
+	context->SurfaceToSurface = rdpgfx_server_surface_to_surface;
+	context->SurfaceToCache = rdpgfx_server_surface_to_cache;
+	context->CacheToSurface = rdpgfx_server_cache_to_surface;
+	context->CacheImportReply = rdpgfx_server_cache_import_reply;
+	context->EvictCacheEntry = rdpgfx_server_evict_cache_entry;
+	context->CreateSurface = rdpgfx_server_create_surface;
+	context->DeleteSurface = rdpgfx_server_delete_surface;
+	context->MapSurfaceToOutput = rdpgfx_server_map_surface_to_output;
+	context->CapsConfirm = rdpgfx_server_caps_confirm;
+	context->CanSendFrame = rdpgfx_server_can_send_frame;
+
+	priv = context->priv = (RdpgfxServerPrivate*) calloc(1, sizeof(RdpgfxServerPrivate));
+
+	if (!priv)
+		goto fail;
+
+	InitializeCriticalSectionAndSpinCount(&priv->lock, 4000);
+
+	priv->MaxCacheSlots = 4096;
+
+	if (!(priv->zgfx = zgfx_context_new(TRUE)))
+		goto fail;
+
+	if (!(priv->s = Stream_New(NULL, 4096)))
+		goto fail;
+
+	return context;
+
+fail:
+	rdpgfx_server_context_free(context);
+	return NULL;
+}
+
+void rdpgfx_server_context_free(RdpgfxServerContext* context)
+{
+	RdpgfxServerPrivate* priv;
+
+	if (!context)
+		return;
+
+	priv = context->priv;
+
+	if (priv)
+	{
+		rdpgfx_server_close(context);
+
+		zgfx_context_free(priv->zgfx);
+		Stream_Free(priv->s, TRUE);
+		DeleteCriticalSection(&priv->lock);
+		free(priv);
+	}
+
+	free(context);
+}
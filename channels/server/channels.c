@@ -47,6 +47,7 @@
 #include <freerdp/server/rdpdr.h>
 #include <freerdp/server/rdpei.h>
 #include <freerdp/server/drdynvc.h>
+#include <freerdp/server/rdpgfx.h>
 
 void freerdp_channels_dummy() 
 {
@@ -70,6 +71,9 @@ void freerdp_channels_dummy()
 
 	rdpei_server_context_new(NULL);
 	rdpei_server_context_free(NULL);
+
+	rdpgfx_server_context_new(NULL);
+	rdpgfx_server_context_free(NULL);
 }
 
 /**
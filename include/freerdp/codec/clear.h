@@ -32,6 +32,10 @@ typedef struct _CLEAR_CONTEXT CLEAR_CONTEXT;
 #define CLEARCODEC_FLAG_GLYPH_HIT	0x02
 #define CLEARCODEC_FLAG_CACHE_RESET	0x04
 
+#define CLEARCODEC_SUBCODEC_UNCOMPRESSED	0x00
+#define CLEARCODEC_SUBCODEC_NSCODEC		0x01
+#define CLEARCODEC_SUBCODEC_RLEX		0x02
+
 struct _CLEAR_GLYPH_ENTRY
 {
 	UINT32 size;
@@ -60,13 +64,18 @@ struct _CLEAR_CONTEXT
 	CLEAR_VBAR_ENTRY VBarStorage[32768];
 	UINT32 ShortVBarStorageCursor;
 	CLEAR_VBAR_ENTRY ShortVBarStorage[16384];
+	UINT32 GlyphCacheCursor;
+	UINT16* GlyphHashTable;
+	UINT16* VBarHashTable;
+	UINT16* ShortVBarHashTable;
 };
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
-FREERDP_API int clear_compress(CLEAR_CONTEXT* clear, BYTE* pSrcData, UINT32 SrcSize, BYTE** ppDstData, UINT32* pDstSize);
+FREERDP_API int clear_compress(CLEAR_CONTEXT* clear, BYTE* pSrcData, DWORD SrcFormat, int nSrcStep,
+		int nWidth, int nHeight, BYTE** ppDstData, UINT32* pDstSize);
 
 FREERDP_API int clear_decompress(CLEAR_CONTEXT* clear, BYTE* pSrcData, UINT32 SrcSize,
 		BYTE** ppDstData, DWORD DstFormat, int nDstStep, int nXDst, int nYDst, int nWidth, int nHeight);
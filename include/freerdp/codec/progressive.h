@@ -304,13 +304,19 @@ struct _PROGRESSIVE_CONTEXT
 	RFX_PROGRESSIVE_CODEC_QUANT quantProgValFull;
 
 	wHashTable* SurfaceContexts;
+
+	BOOL SyncSent;
+	UINT32 FrameIndex;
 };
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
-FREERDP_API int progressive_compress(PROGRESSIVE_CONTEXT* progressive, BYTE* pSrcData, UINT32 SrcSize, BYTE** ppDstData, UINT32* pDstSize);
+FREERDP_API int progressive_compress(PROGRESSIVE_CONTEXT* progressive, BYTE* pSrcData, DWORD SrcFormat, int nSrcStep,
+		UINT16 surfaceId, const RFX_RECT* rects, int numRects, BYTE** ppDstData, UINT32* pDstSize);
+FREERDP_API int progressive_compress_upgrade(PROGRESSIVE_CONTEXT* progressive, UINT16 surfaceId, int maxTiles,
+		BYTE** ppDstData, UINT32* pDstSize);
 
 FREERDP_API int progressive_decompress(PROGRESSIVE_CONTEXT* progressive, BYTE* pSrcData, UINT32 SrcSize,
 		BYTE** ppDstData, DWORD DstFormat, int nDstStep, int nXDst, int nYDst, int nWidth, int nHeight, UINT16 surfaceId);
@@ -86,8 +86,11 @@ struct _XCRUSH_CONTEXT
 
 	UINT32 ChunkHead;
 	UINT32 ChunkTail;
+	BOOL ChunkWrapped;
 	XCRUSH_CHUNK Chunks[65534];
 	UINT16 NextChunks[65536];
+	UINT16 NextChunksEpoch[65536];
+	UINT16 ChunkEpoch;
 
 	UINT32 OriginalMatchCount;
 	UINT32 OptimizedMatchCount;
@@ -23,11 +23,21 @@
 #include <freerdp/api.h>
 #include <freerdp/types.h>
 
+#include <winpr/bitstream.h>
+
 #include <freerdp/codec/bulk.h>
 
 #define ZGFX_SEGMENTED_SINGLE			0xE0
 #define ZGFX_SEGMENTED_MULTIPART		0xE1
 
+#define ZGFX_PACKET_COMPR_TYPE_RDP8		0x04
+
+#define ZGFX_SEGMENTED_MAXSIZE			65535
+
+#define ZGFX_COMPRESSION_LEVEL_FAST		0
+#define ZGFX_COMPRESSION_LEVEL_DEFAULT		1
+#define ZGFX_COMPRESSION_LEVEL_BEST		2
+
 struct _ZGFX_CONTEXT
 {
 	BOOL Compressor;
@@ -46,6 +56,13 @@ struct _ZGFX_CONTEXT
 	BYTE HistoryBuffer[2500000];
 	UINT32 HistoryIndex;
 	UINT32 HistoryBufferSize;
+
+	wBitStream* bs;
+	UINT32 CompressionLevel;
+	UINT32 HistoryPosition;
+	UINT32 HistoryFill;
+	UINT32* MatchHashTable;
+	UINT32* MatchChainTable;
 };
 typedef struct _ZGFX_CONTEXT ZGFX_CONTEXT;
 
@@ -56,6 +73,8 @@ extern "C" {
 FREERDP_API int zgfx_compress(ZGFX_CONTEXT* zgfx, BYTE* pSrcData, UINT32 SrcSize, BYTE** ppDstData, UINT32* pDstSize, UINT32* pFlags);
 FREERDP_API int zgfx_decompress(ZGFX_CONTEXT* zgfx, BYTE* pSrcData, UINT32 SrcSize, BYTE** ppDstData, UINT32* pDstSize, UINT32 flags);
 
+FREERDP_API void zgfx_set_compression_level(ZGFX_CONTEXT* zgfx, DWORD CompressionLevel);
+
 FREERDP_API void zgfx_context_reset(ZGFX_CONTEXT* zgfx, BOOL flush);
 
 FREERDP_API ZGFX_CONTEXT* zgfx_context_new(BOOL Compressor);
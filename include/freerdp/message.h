@@ -55,6 +55,7 @@
 #define Update_SurfaceFrameMarker				13
 #define Update_SurfaceFrameAcknowledge				14
 #define Update_SetKeyboardIndicators				15
+#define Update_Batch						16
 
 #define FREERDP_UPDATE_BEGIN_PAINT				MakeMessageId(Update, BeginPaint)
 #define FREERDP_UPDATE_	END_PAINT				MakeMessageId(Update, EndPaint)
@@ -71,6 +72,7 @@
 #define FREERDP_UPDATE_SURFACE_FRAME_MARKER			MakeMessageId(Update, SurfaceFrameMarker)
 #define FREERDP_UPDATE_SURFACE_FRAME_ACKNOWLEDGE		MakeMessageId(Update, SurfaceFrameAcknowledge)
 #define FREERDP_UPDATE_SET_KEYBOARD_INDICATORS			MakeMessageId(Update, SetKeyboardIndicators)
+#define FREERDP_UPDATE_BATCH					MakeMessageId(Update, Batch)
 
 /* Primary Update */
 
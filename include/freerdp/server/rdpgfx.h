@@ -0,0 +1,141 @@
+/**
+ * FreeRDP: A Remote Desktop Protocol Implementation
+ * Graphics Pipeline Extension
+ *
+ * Copyright 2026 agent <agent@local>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef FREERDP_CHANNEL_SERVER_RDPGFX_H
+#define FREERDP_CHANNEL_SERVER_RDPGFX_H
+
+#include <freerdp/api.h>
+#include <freerdp/types.h>
+#include <freerdp/channels/wtsvc.h>
+
+#include <freerdp/channels/rdpgfx.h>
+
+/**
+ * Server Interface
+ */
+
+typedef struct _rdpgfx_server_context RdpgfxServerContext;
+typedef struct _rdpgfx_server_private RdpgfxServerPrivate;
+
+typedef int (*psRdpgfxServerOpen)(RdpgfxServerContext* context);
+typedef int (*psRdpgfxServerClose)(RdpgfxServerContext* context);
+
+typedef int (*psRdpgfxResetGraphics)(RdpgfxServerContext* context, RDPGFX_RESET_GRAPHICS_PDU* resetGraphics);
+typedef int (*psRdpgfxStartFrame)(RdpgfxServerContext* context, RDPGFX_START_FRAME_PDU* startFrame);
+typedef int (*psRdpgfxEndFrame)(RdpgfxServerContext* context, RDPGFX_END_FRAME_PDU* endFrame);
+typedef int (*psRdpgfxWireToSurface1)(RdpgfxServerContext* context, RDPGFX_WIRE_TO_SURFACE_PDU_1* wireToSurface1);
+typedef int (*psRdpgfxWireToSurface2)(RdpgfxServerContext* context, RDPGFX_WIRE_TO_SURFACE_PDU_2* wireToSurface2);
+typedef int (*psRdpgfxDeleteEncodingContext)(RdpgfxServerContext* context, RDPGFX_DELETE_ENCODING_CONTEXT_PDU* deleteEncodingContext);
+typedef int (*psRdpgfxSolidFill)(RdpgfxServerContext* context, RDPGFX_SOLID_FILL_PDU* solidFill);
+typedef int (*psRdpgfxSurfaceToSurface)(RdpgfxServerContext* context, RDPGFX_SURFACE_TO_SURFACE_PDU* surfaceToSurface);
+typedef int (*psRdpgfxSurfaceToCache)(RdpgfxServerContext* context, RDPGFX_SURFACE_TO_CACHE_PDU* surfaceToCache);
+typedef int (*psRdpgfxCacheToSurface)(RdpgfxServerContext* context, RDPGFX_CACHE_TO_SURFACE_PDU* cacheToSurface);
+typedef int (*psRdpgfxCacheImportOffer)(RdpgfxServerContext* context, RDPGFX_CACHE_IMPORT_OFFER_PDU* cacheImportOffer);
+typedef int (*psRdpgfxCacheImportReply)(RdpgfxServerContext* context, RDPGFX_CACHE_IMPORT_REPLY_PDU* cacheImportReply);
+typedef int (*psRdpgfxEvictCacheEntry)(RdpgfxServerContext* context, RDPGFX_EVICT_CACHE_ENTRY_PDU* evictCacheEntry);
+typedef int (*psRdpgfxCreateSurface)(RdpgfxServerContext* context, RDPGFX_CREATE_SURFACE_PDU* createSurface);
+typedef int (*psRdpgfxDeleteSurface)(RdpgfxServerContext* context, RDPGFX_DELETE_SURFACE_PDU* deleteSurface);
+typedef int (*psRdpgfxMapSurfaceToOutput)(RdpgfxServerContext* context, RDPGFX_MAP_SURFACE_TO_OUTPUT_PDU* surfaceToOutput);
+typedef int (*psRdpgfxCapsAdvertise)(RdpgfxServerContext* context, RDPGFX_CAPS_ADVERTISE_PDU* capsAdvertise);
+typedef int (*psRdpgfxCapsConfirm)(RdpgfxServerContext* context, RDPGFX_CAPS_CONFIRM_PDU* capsConfirm);
+typedef int (*psRdpgfxFrameAcknowledge)(RdpgfxServerContext* context, RDPGFX_FRAME_ACKNOWLEDGE_PDU* frameAcknowledge);
+typedef void (*psRdpgfxOnCapsConfirmed)(RdpgfxServerContext* context);
+
+typedef BOOL (*psRdpgfxCanSendFrame)(RdpgfxServerContext* context);
+
+struct _rdpgfx_server_context
+{
+	HANDLE vcm;
+	void* custom;
+
+	RdpgfxServerPrivate* priv;
+
+	/**
+	 * Negotiated capability set, valid once CapsConfirmed is set.
+	 */
+	BOOL CapsConfirmed;
+	RDPGFX_CAPSET Caps;
+
+	/**
+	 * Flow control: a frame is in flight from its EndFrame PDU until the client
+	 * acknowledges it. CanSendFrame returns FALSE once MaxFramesInFlight frames
+	 * are unacknowledged, unless the client suspended frame acknowledgement.
+	 */
+	UINT32 MaxFramesInFlight;
+	UINT32 FramesInFlight;
+	UINT32 QueueDepth;
+	UINT32 TotalFramesDecoded;
+	BOOL FrameAckSuspended;
+
+	psRdpgfxServerOpen Open;
+	psRdpgfxServerClose Close;
+
+	/*** APIs called by the server. ***/
+
+	psRdpgfxResetGraphics ResetGraphics;
+	psRdpgfxStartFrame StartFrame;
+	psRdpgfxEndFrame EndFrame;
+	psRdpgfxWireToSurface1 WireToSurface1;
+	psRdpgfxWireToSurface2 WireToSurface2;
+	psRdpgfxDeleteEncodingContext DeleteEncodingContext;
+	psRdpgfxSolidFill SolidFill;
+	psRdpgfxSurfaceToSurface SurfaceToSurface;
+	psRdpgfxSurfaceToCache SurfaceToCache;
+	psRdpgfxCacheToSurface CacheToSurface;
+	psRdpgfxCacheImportReply CacheImportReply;
+	psRdpgfxEvictCacheEntry EvictCacheEntry;
+	psRdpgfxCreateSurface CreateSurface;
+	psRdpgfxDeleteSurface DeleteSurface;
+	psRdpgfxMapSurfaceToOutput MapSurfaceToOutput;
+	psRdpgfxCapsConfirm CapsConfirm;
+	psRdpgfxCanSendFrame CanSendFrame;
+
+	/*** Callbacks registered by the server. ***/
+
+	/**
+	 * Receive the client capability sets. If not set, the highest advertised
+	 * version is confirmed. A callback must call CapsConfirm itself.
+	 */
+	psRdpgfxCapsAdvertise CapsAdvertise;
+	/**
+	 * Receive a cache import offer. If not set, no entry is imported.
+	 */
+	psRdpgfxCacheImportOffer CacheImportOffer;
+	/**
+	 * Receive a frame acknowledgement, after the flow control state is updated.
+	 */
+	psRdpgfxFrameAcknowledge FrameAcknowledge;
+	/**
+	 * Notified on the channel thread once the capability set is confirmed.
+	 */
+	psRdpgfxOnCapsConfirmed OnCapsConfirmed;
+};
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+FREERDP_API RdpgfxServerContext* rdpgfx_server_context_new(HANDLE vcm);
+FREERDP_API void rdpgfx_server_context_free(RdpgfxServerContext* context);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* FREERDP_CHANNEL_SERVER_RDPGFX_H */
@@ -31,6 +31,7 @@
 
 #include <freerdp/server/encomsp.h>
 #include <freerdp/server/remdesk.h>
+#include <freerdp/server/rdpgfx.h>
 
 #include <freerdp/codec/color.h>
 #include <freerdp/codec/region.h>
@@ -45,8 +46,12 @@ typedef struct rdp_shadow_screen rdpShadowScreen;
 typedef struct rdp_shadow_surface rdpShadowSurface;
 typedef struct rdp_shadow_encoder rdpShadowEncoder;
 typedef struct rdp_shadow_capture rdpShadowCapture;
+typedef struct rdp_shadow_encode_cache rdpShadowEncodeCache;
+typedef struct rdp_shadow_classifier rdpShadowClassifier;
 typedef struct rdp_shadow_subsystem rdpShadowSubsystem;
 typedef struct rdp_shadow_multiclient_event rdpShadowMultiClientEvent;
+typedef struct rdp_shadow_move rdpShadowMove;
+typedef struct rdp_shadow_client_stats rdpShadowClientStats;
 
 typedef struct _RDP_SHADOW_ENTRY_POINTS RDP_SHADOW_ENTRY_POINTS;
 typedef int (*pfnShadowSubsystemEntry)(RDP_SHADOW_ENTRY_POINTS* pEntryPoints);
@@ -71,6 +76,62 @@ typedef int (*pfnShadowUnicodeKeyboardEvent)(rdpShadowSubsystem* subsystem, UINT
 typedef int (*pfnShadowMouseEvent)(rdpShadowSubsystem* subsystem, UINT16 flags, UINT16 x, UINT16 y);
 typedef int (*pfnShadowExtendedMouseEvent)(rdpShadowSubsystem* subsystem, UINT16 flags, UINT16 x, UINT16 y);
 
+#define SHADOW_CLIENT_MAX_MOVES		16
+
+#define SHADOW_STATS_CODEC_UNCOMPRESSED		0
+#define SHADOW_STATS_CODEC_REMOTEFX		1
+#define SHADOW_STATS_CODEC_NSCODEC		2
+#define SHADOW_STATS_CODEC_H264			3
+#define SHADOW_STATS_CODEC_PLANAR		4
+#define SHADOW_STATS_CODEC_INTERLEAVED		5
+#define SHADOW_STATS_CODEC_CLEARCODEC		6
+#define SHADOW_STATS_CODECS			7
+
+/**
+ * Per-client statistics: counters are totals since the client connected,
+ * times are in milliseconds. They are updated by the client thread once per
+ * frame and acknowledgement, read them with shadow_client_get_stats.
+ */
+struct rdp_shadow_client_stats
+{
+	UINT64 connectTime; /* GetTickCount64() at connection */
+
+	UINT64 frames;
+	UINT64 bytes;
+	UINT64 codecFrames[SHADOW_STATS_CODECS];
+	UINT64 codecBytes[SHADOW_STATS_CODECS];
+	UINT64 pixels; /* area of the updates sent */
+	UINT64 moves; /* block moves sent as screen copies */
+	UINT64 deferredUpdates; /* updates held back by flow control */
+
+	UINT64 encodeTime; /* from the invalid region to the frame written out */
+	UINT32 maxEncodeTime;
+
+	UINT64 acks;
+	UINT64 ackLatency;
+	UINT32 maxAckLatency;
+	UINT64 ackTimeouts; /* frames dropped without acknowledgement */
+
+	/* current values */
+	UINT32 inFlightFrames;
+	UINT32 pendingPixels; /* area of the invalid region not sent yet */
+	UINT32 rtt;
+	UINT32 bandwidth; /* bytes per second */
+	UINT32 fps;
+	UINT32 qualityLevel;
+};
+
+/**
+ * A block of the screen moved by (dx, dy), as in scrolling: dst holds the
+ * content that was at dst offset by (-dx, -dy) before the move.
+ */
+struct rdp_shadow_move
+{
+	RECTANGLE_16 dst;
+	INT16 dx;
+	INT16 dy;
+};
+
 struct rdp_shadow_client
 {
 	rdpContext context;
@@ -83,6 +144,12 @@ struct rdp_shadow_client
 	HANDLE StopEvent;
 	CRITICAL_SECTION lock;
 	REGION16 invalidRegion;
+	int numMoves;
+	rdpShadowMove moves[SHADOW_CLIENT_MAX_MOVES];
+	rdpShadowClientStats stats;
+	void* updateSubscriber;
+	BYTE* surfaceData; /* Surface buffer pinned while sending an update */
+	UINT32 surfaceFrame; /* Encode cache frame held by surfaceData */
 	rdpShadowServer* server;
 	rdpShadowSurface* lobby;
 	rdpShadowEncoder* encoder;
@@ -94,6 +161,10 @@ struct rdp_shadow_client
 	HANDLE vcm;
 	EncomspServerContext* encomsp;
 	RemdeskServerContext* remdesk;
+	RdpgfxServerContext* rdpgfx;
+	BOOL gfxSurfaceCreated;
+	UINT64 gfxOpenTime;
+	HANDLE gfxCapsEvent;
 };
 
 struct rdp_shadow_server
@@ -106,14 +177,22 @@ struct rdp_shadow_server
 	rdpShadowSurface* surface;
 	rdpShadowCapture* capture;
 	rdpShadowSubsystem* subsystem;
+	rdpShadowEncodeCache* encodeCache;
 
 	DWORD port;
 	BOOL mayView;
 	BOOL mayInteract;
 	BOOL shareSubRect;
 	BOOL authentication;
+	BOOL h264;
+	BOOL sharedEncoding;
+	BOOL tileClassify;
+	BOOL x11Damage;
+	DWORD statsInterval;
 	int selectedMonitor;
 	RECTANGLE_16 subRect;
+	char* subsystemName;
+	char* syntheticOptions;
 	char* ipcSocket;
 	char* ConfigPath;
 	char* CertificateFile;
@@ -181,6 +260,9 @@ FREERDP_API int shadow_server_uninit(rdpShadowServer* server);
 
 FREERDP_API int shadow_enum_monitors(MONITOR_DEF* monitors, int maxMonitors, const char* name);
 
+FREERDP_API int shadow_client_get_stats(rdpShadowClient* client, rdpShadowClientStats* stats);
+FREERDP_API void shadow_server_log_stats(rdpShadowServer* server);
+
 FREERDP_API rdpShadowServer* shadow_server_new();
 FREERDP_API void shadow_server_free(rdpShadowServer* server);
 
@@ -210,6 +210,7 @@ struct rdp_update
 	wMessageQueue* queue;
 
 	wStream* us;
+	wStream* pdu; /* received PDU being dispatched, see update->queue */
 	UINT16 numberOrders;
 	BOOL combineUpdates;
 	rdpBounds currentBounds;
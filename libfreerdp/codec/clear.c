@@ -822,9 +822,717 @@ int clear_decompress(CLEAR_CONTEXT* clear, BYTE* pSrcData, UINT32 SrcSize,
 	return 1;
 }
 
-int clear_compress(CLEAR_CONTEXT* clear, BYTE* pSrcData, UINT32 SrcSize, BYTE** ppDstData, UINT32* pDstSize)
+#define CLEAR_BAND_HEIGHT		32
+#define CLEAR_GLYPH_MAX_PIXELS		1024
+#define CLEAR_HASH_TABLE_SIZE		65536
+#define CLEAR_SEEN_TABLE_SIZE		1024
+
+#define CLEAR_LAYER_BANDS		0
+#define CLEAR_LAYER_SUBCODEC		1
+
+struct _CLEAR_PALETTE
 {
-	return 1;
+	UINT32 count;
+	BOOL overflow;
+	UINT32 colors[127];
+	UINT32 hits[127];
+	BYTE slots[256];
+};
+typedef struct _CLEAR_PALETTE CLEAR_PALETTE;
+
+static UINT32 clear_hash_pixels(const UINT32* pixels, UINT32 count, UINT32 step)
+{
+	UINT32 index;
+	UINT32 hash = 2166136261;
+
+	for (index = 0; index < count; index++)
+		hash = (hash ^ pixels[index * step]) * 16777619;
+
+	return hash;
+}
+
+static BOOL clear_resize_pixels(UINT32** ppPixels, UINT32* pSize, UINT32 count)
+{
+	UINT32* pixels;
+
+	if (count <= *pSize)
+		return TRUE;
+
+	if (!(pixels = (UINT32*) realloc(*ppPixels, count * 4)))
+		return FALSE;
+
+	*ppPixels = pixels;
+	*pSize = count;
+
+	return TRUE;
+}
+
+static int clear_palette_index(CLEAR_PALETTE* palette, UINT32 color)
+{
+	UINT32 slot = (color * 2654435761U) >> 24;
+
+	while (palette->slots[slot])
+	{
+		if (palette->colors[palette->slots[slot] - 1] == color)
+			return palette->slots[slot] - 1;
+
+		slot = (slot + 1) & 0xFF;
+	}
+
+	if (palette->count >= 127)
+	{
+		palette->overflow = TRUE;
+		return -1;
+	}
+
+	palette->colors[palette->count] = color;
+	palette->hits[palette->count] = 0;
+	palette->slots[slot] = (BYTE) ++palette->count;
+
+	return palette->count - 1;
+}
+
+static void clear_palette_build(CLEAR_PALETTE* palette, const UINT32* pixels, UINT32 count)
+{
+	int index;
+	UINT32 i;
+
+	ZeroMemory(palette, sizeof(CLEAR_PALETTE));
+
+	for (i = 0; i < count; i++)
+	{
+		if ((index = clear_palette_index(palette, pixels[i])) >= 0)
+			palette->hits[index]++;
+	}
+}
+
+static UINT32 clear_palette_background(CLEAR_PALETTE* palette)
+{
+	UINT32 index;
+	UINT32 best = 0;
+
+	for (index = 1; index < palette->count; index++)
+	{
+		if (palette->hits[index] > palette->hits[best])
+			best = index;
+	}
+
+	return palette->colors[best];
+}
+
+static UINT32 clear_run_length_size(UINT32 runLength)
+{
+	if (runLength < 0xFF)
+		return 1;
+
+	if (runLength < 0xFFFF)
+		return 3;
+
+	return 7;
+}
+
+static void clear_write_run_length(wStream* s, UINT32 runLength)
+{
+	if (runLength < 0xFF)
+	{
+		Stream_Write_UINT8(s, runLength);
+	}
+	else if (runLength < 0xFFFF)
+	{
+		Stream_Write_UINT8(s, 0xFF);
+		Stream_Write_UINT16(s, runLength);
+	}
+	else
+	{
+		Stream_Write_UINT8(s, 0xFF);
+		Stream_Write_UINT16(s, 0xFFFF);
+		Stream_Write_UINT32(s, runLength);
+	}
+}
+
+static void clear_write_color(wStream* s, UINT32 color)
+{
+	Stream_Write_UINT8(s, color & 0xFF); /* blue */
+	Stream_Write_UINT8(s, (color >> 8) & 0xFF); /* green */
+	Stream_Write_UINT8(s, (color >> 16) & 0xFF); /* red */
+}
+
+/**
+ * Converts the source bitmap into packed 0xFFRRGGBB pixels in TempBuffer,
+ * which is the representation all encoder layers and caches work on.
+ */
+
+static UINT32* clear_load_pixels(CLEAR_CONTEXT* clear, BYTE* pSrcData, DWORD SrcFormat, int nSrcStep, int nWidth, int nHeight)
+{
+	int x, y;
+	BOOL invert;
+	UINT32 color;
+	UINT32* pSrcPixel;
+	UINT32* pDstPixel;
+
+	if ((UINT32) (nWidth * nHeight * 4) > clear->TempSize)
+	{
+		clear->TempSize = nWidth * nHeight * 4;
+		clear->TempBuffer = (BYTE*) realloc(clear->TempBuffer, clear->TempSize);
+
+		if (!clear->TempBuffer)
+			return NULL;
+	}
+
+	invert = FREERDP_PIXEL_FORMAT_IS_ABGR(SrcFormat) ? TRUE : FALSE;
+	pDstPixel = (UINT32*) clear->TempBuffer;
+
+	for (y = 0; y < nHeight; y++)
+	{
+		pSrcPixel = (UINT32*) &pSrcData[y * nSrcStep];
+
+		for (x = 0; x < nWidth; x++)
+		{
+			color = *pSrcPixel++;
+
+			if (invert)
+				color = (color & 0xFF00) | ((color >> 16) & 0xFF) | ((color & 0xFF) << 16);
+
+			*pDstPixel++ = 0xFF000000 | (color & 0xFFFFFF);
+		}
+	}
+
+	return (UINT32*) clear->TempBuffer;
+}
+
+static UINT32 clear_residual_size(const UINT32* pixels, UINT32 count)
+{
+	UINT32 i = 0;
+	UINT32 run;
+	UINT32 size = 0;
+
+	while (i < count)
+	{
+		for (run = 1; ((i + run) < count) && (pixels[i + run] == pixels[i]); run++);
+
+		size += 3 + clear_run_length_size(run);
+		i += run;
+	}
+
+	return size;
+}
+
+static BOOL clear_write_residual(wStream* s, const UINT32* pixels, UINT32 count)
+{
+	UINT32 i = 0;
+	UINT32 run;
+
+	while (i < count)
+	{
+		for (run = 1; ((i + run) < count) && (pixels[i + run] == pixels[i]); run++);
+
+		if (!Stream_EnsureRemainingCapacity(s, 10))
+			return FALSE;
+
+		clear_write_color(s, pixels[i]);
+		clear_write_run_length(s, run);
+		i += run;
+	}
+
+	return TRUE;
+}
+
+static int clear_vbar_lookup(CLEAR_VBAR_ENTRY* storage, UINT16* table, UINT32 hash, const UINT32* pixels, UINT32 count)
+{
+	UINT32 index = table[hash % CLEAR_HASH_TABLE_SIZE];
+	CLEAR_VBAR_ENTRY* entry;
+
+	if (!index)
+		return -1;
+
+	entry = &storage[index - 1];
+
+	if (entry->count != count)
+		return -1;
+
+	if (count && (memcmp(entry->pixels, pixels, count * 4) != 0))
+		return -1;
+
+	return index - 1;
+}
+
+static BOOL clear_vbar_insert(CLEAR_VBAR_ENTRY* storage, UINT16* table, UINT32 hash, UINT32 index,
+		const UINT32* pixels, UINT32 count)
+{
+	CLEAR_VBAR_ENTRY* entry = &storage[index];
+
+	if (!clear_resize_pixels(&entry->pixels, &entry->size, count))
+		return FALSE;
+
+	if (count)
+		CopyMemory(entry->pixels, pixels, count * 4);
+
+	entry->count = count;
+	table[hash % CLEAR_HASH_TABLE_SIZE] = (UINT16) (index + 1);
+
+	return TRUE;
+}
+
+static void clear_vbar_extents(const UINT32* column, UINT32 count, UINT32 colorBkg, UINT32* pYOn, UINT32* pYOff)
+{
+	UINT32 yOn = 0;
+	UINT32 yOff = count;
+
+	while ((yOn < count) && (column[yOn] == colorBkg))
+		yOn++;
+
+	while ((yOff > yOn) && (column[yOff - 1] == colorBkg))
+		yOff--;
+
+	if (yOn == count)
+		yOn = yOff = 0;
+
+	*pYOn = yOn;
+	*pYOff = yOff;
+}
+
+/**
+ * Estimates the size of a band without touching the vBar caches: entries that
+ * would be inserted while encoding the band itself are approximated by a small
+ * set of column hashes already seen in the band.
+ */
+
+static UINT32 clear_band_size(CLEAR_CONTEXT* clear, const UINT32* pixels, UINT32 nWidth, UINT32 height, UINT32 colorBkg)
+{
+	UINT32 x, y;
+	UINT32 hash;
+	UINT32 yOn, yOff;
+	UINT32 key;
+	UINT32 slot;
+	UINT32 size = 11;
+	UINT32 column[52];
+	UINT32 seen[CLEAR_SEEN_TABLE_SIZE];
+
+	ZeroMemory(seen, sizeof(seen));
+
+	for (x = 0; x < nWidth; x++)
+	{
+		for (y = 0; y < height; y++)
+			column[y] = pixels[(y * nWidth) + x];
+
+		hash = clear_hash_pixels(column, height, 1);
+		key = hash | 1;
+		slot = key % CLEAR_SEEN_TABLE_SIZE;
+
+		while (seen[slot] && (seen[slot] != key))
+			slot = (slot + 1) % CLEAR_SEEN_TABLE_SIZE;
+
+		if (seen[slot] ||
+			(clear_vbar_lookup(clear->VBarStorage, clear->VBarHashTable, hash, column, height) >= 0))
+		{
+			size += 2;
+		}
+		else
+		{
+			clear_vbar_extents(column, height, colorBkg, &yOn, &yOff);
+
+			if (clear_vbar_lookup(clear->ShortVBarStorage, clear->ShortVBarHashTable,
+					clear_hash_pixels(&column[yOn], yOff - yOn, 1), &column[yOn], yOff - yOn) >= 0)
+				size += 3;
+			else
+				size += 2 + ((yOff - yOn) * 3);
+
+			if (x < (CLEAR_SEEN_TABLE_SIZE / 2))
+				seen[slot] = key;
+		}
+	}
+
+	return size;
+}
+
+/**
+ * Encodes one band and updates the vBar and short vBar caches exactly the way
+ * clear_decompress does when it decodes the band.
+ */
+
+static BOOL clear_write_band(CLEAR_CONTEXT* clear, wStream* s, const UINT32* pixels, UINT32 nWidth,
+		UINT32 yStart, UINT32 height, UINT32 colorBkg)
+{
+	int index;
+	UINT32 x, y;
+	UINT32 hash;
+	UINT32 shortHash;
+	UINT32 yOn, yOff;
+	UINT32 column[52];
+
+	if (!Stream_EnsureRemainingCapacity(s, 11 + (nWidth * (2 + (height * 3)))))
+		return FALSE;
+
+	Stream_Write_UINT16(s, 0); /* xStart (2 bytes) */
+	Stream_Write_UINT16(s, nWidth - 1); /* xEnd (2 bytes) */
+	Stream_Write_UINT16(s, yStart); /* yStart (2 bytes) */
+	Stream_Write_UINT16(s, yStart + height - 1); /* yEnd (2 bytes) */
+	clear_write_color(s, colorBkg); /* colorBkg (3 bytes) */
+
+	for (x = 0; x < nWidth; x++)
+	{
+		for (y = 0; y < height; y++)
+			column[y] = pixels[(y * nWidth) + x];
+
+		hash = clear_hash_pixels(column, height, 1);
+		index = clear_vbar_lookup(clear->VBarStorage, clear->VBarHashTable, hash, column, height);
+
+		if (index >= 0)
+		{
+			Stream_Write_UINT16(s, 0x8000 | index); /* VBAR_CACHE_HIT */
+			continue;
+		}
+
+		clear_vbar_extents(column, height, colorBkg, &yOn, &yOff);
+		shortHash = clear_hash_pixels(&column[yOn], yOff - yOn, 1);
+		index = clear_vbar_lookup(clear->ShortVBarStorage, clear->ShortVBarHashTable, shortHash,
+				&column[yOn], yOff - yOn);
+
+		if (index >= 0)
+		{
+			Stream_Write_UINT16(s, 0x4000 | index); /* SHORT_VBAR_CACHE_HIT */
+			Stream_Write_UINT8(s, yOn);
+		}
+		else
+		{
+			Stream_Write_UINT16(s, yOn | (yOff << 8)); /* SHORT_VBAR_CACHE_MISS */
+
+			for (y = yOn; y < yOff; y++)
+				clear_write_color(s, column[y]);
+
+			if (!clear_vbar_insert(clear->ShortVBarStorage, clear->ShortVBarHashTable, shortHash,
+					clear->ShortVBarStorageCursor, &column[yOn], yOff - yOn))
+				return FALSE;
+
+			clear->ShortVBarStorageCursor = (clear->ShortVBarStorageCursor + 1) % 16384;
+		}
+
+		if (!clear_vbar_insert(clear->VBarStorage, clear->VBarHashTable, hash,
+				clear->VBarStorageCursor, column, height))
+			return FALSE;
+
+		clear->VBarStorageCursor = (clear->VBarStorageCursor + 1) % 32768;
+	}
+
+	return TRUE;
+}
+
+static BOOL clear_write_rlex(wStream* s, CLEAR_PALETTE* palette, const UINT32* pixels, UINT32 count)
+{
+	UINT32 i = 0;
+	UINT32 run;
+	UINT32 depth;
+	UINT32 numBits;
+	UINT32 maxDepth;
+	UINT32 startIndex;
+
+	if (!Stream_EnsureRemainingCapacity(s, 1 + (palette->count * 3) + (count * 8)))
+		return FALSE;
+
+	Stream_Write_UINT8(s, palette->count); /* paletteCount (1 byte) */
+
+	for (i = 0; i < palette->count; i++)
+		clear_write_color(s, palette->colors[i]);
+
+	numBits = CLEAR_LOG2_FLOOR[palette->count - 1] + 1;
+	maxDepth = CLEAR_8BIT_MASKS[8 - numBits];
+
+	i = 0;
+
+	while (i < count)
+	{
+		/* a segment is a run of palette[start] followed by the suite start + 1 .. stop */
+		startIndex = clear_palette_index(palette, pixels[i]);
+
+		for (run = 1; ((i + run) < count) && (pixels[i + run] == pixels[i]); run++);
+
+		for (depth = 0; (depth < maxDepth) && ((i + run + depth) < count) &&
+				((startIndex + depth + 1) < palette->count) &&
+				(pixels[i + run + depth] == palette->colors[startIndex + depth + 1]); depth++);
+
+		Stream_Write_UINT8(s, (startIndex + depth) | (depth << numBits));
+		clear_write_run_length(s, run - 1);
+
+		i += run + depth;
+	}
+
+	return TRUE;
+}
+
+static BOOL clear_write_subcodec_header(wStream* s, UINT32 yStart, UINT32 width, UINT32 height,
+		UINT32 bitmapDataByteCount, BYTE subcodecId)
+{
+	if (!Stream_EnsureRemainingCapacity(s, 13))
+		return FALSE;
+
+	Stream_Write_UINT16(s, 0); /* xStart (2 bytes) */
+	Stream_Write_UINT16(s, yStart); /* yStart (2 bytes) */
+	Stream_Write_UINT16(s, width); /* width (2 bytes) */
+	Stream_Write_UINT16(s, height); /* height (2 bytes) */
+	Stream_Write_UINT32(s, bitmapDataByteCount); /* bitmapDataByteCount (4 bytes) */
+	Stream_Write_UINT8(s, subcodecId); /* subcodecId (1 byte) */
+
+	return TRUE;
+}
+
+/**
+ * Encodes one band as a subcodec (RLEX for palettized content, NSCodec or
+ * uncompressed otherwise) and returns its size, or 0 if the vBar band
+ * estimate is smaller, in which case nothing is written.
+ */
+
+static UINT32 clear_write_band_subcodec(CLEAR_CONTEXT* clear, wStream* s, const UINT32* pixels, UINT32 nWidth,
+		UINT32 yStart, UINT32 height, CLEAR_PALETTE* palette, UINT32 bandSize)
+{
+	UINT32 x;
+	size_t start;
+	size_t dataStart;
+	UINT32 dataSize;
+	UINT32 count = nWidth * height;
+
+	start = Stream_GetPosition(s);
+
+	if (!clear_write_subcodec_header(s, yStart, nWidth, height, 0, CLEARCODEC_SUBCODEC_RLEX))
+		return 0;
+
+	dataStart = Stream_GetPosition(s);
+
+	if (!palette->overflow)
+	{
+		if (!clear_write_rlex(s, palette, pixels, count))
+			return 0;
+	}
+	else
+	{
+		/* the NSCodec encoder reads scanlines bottom-up */
+		nsc_compose_message(clear->nsc, s, (BYTE*) &pixels[(height - 1) * nWidth],
+				nWidth, height, -((int) nWidth * 4));
+		Stream_Buffer(s)[start + 12] = CLEARCODEC_SUBCODEC_NSCODEC;
+
+		if ((Stream_GetPosition(s) - dataStart) > (count * 3))
+		{
+			Stream_SetPosition(s, dataStart);
+
+			if (!Stream_EnsureRemainingCapacity(s, count * 3))
+				return 0;
+
+			for (x = 0; x < count; x++)
+				clear_write_color(s, pixels[x]);
+
+			Stream_Buffer(s)[start + 12] = CLEARCODEC_SUBCODEC_UNCOMPRESSED;
+		}
+	}
+
+	dataSize = (UINT32) (Stream_GetPosition(s) - dataStart);
+
+	if ((13 + dataSize) >= bandSize)
+	{
+		Stream_SetPosition(s, start);
+		return 0;
+	}
+
+	Stream_SetPosition(s, start + 8);
+	Stream_Write_UINT32(s, dataSize); /* bitmapDataByteCount (4 bytes) */
+	Stream_SetPosition(s, dataStart + dataSize);
+
+	return 13 + dataSize;
+}
+
+static int clear_glyph_lookup(CLEAR_CONTEXT* clear, UINT32 hash, const UINT32* pixels, UINT32 count)
+{
+	UINT32 index = clear->GlyphHashTable[hash % CLEAR_HASH_TABLE_SIZE];
+	CLEAR_GLYPH_ENTRY* entry;
+
+	if (!index)
+		return -1;
+
+	entry = &clear->GlyphCache[index - 1];
+
+	if ((entry->count != count) || (memcmp(entry->pixels, pixels, count * 4) != 0))
+		return -1;
+
+	return index - 1;
+}
+
+/**
+ * Encodes a 32bpp bitmap as a ClearCodec composition payload. The result is
+ * returned in a newly allocated buffer owned by the caller.
+ */
+
+int clear_compress(CLEAR_CONTEXT* clear, BYTE* pSrcData, DWORD SrcFormat, int nSrcStep,
+		int nWidth, int nHeight, BYTE** ppDstData, UINT32* pDstSize)
+{
+	int status = -1;
+	UINT32 band;
+	UINT32 yStart;
+	UINT32 height;
+	UINT32 hash = 0;
+	UINT32 count;
+	UINT32* pixels;
+	BYTE glyphFlags = 0;
+	UINT32 glyphIndex = 0;
+	UINT32 bandSize;
+	UINT32 bandCount;
+	UINT32 totalSize;
+	UINT32 subcodecSize;
+	UINT32 residualSize;
+	BYTE* bandLayers = NULL;
+	UINT32* bandColors = NULL;
+	CLEAR_PALETTE palette;
+	CLEAR_GLYPH_ENTRY* glyphEntry;
+	wStream* s = NULL;
+	wStream* bands = NULL;
+	wStream* subcodecs = NULL;
+
+	if (!clear->Compressor || !ppDstData || !pDstSize)
+		return -1;
+
+	if ((nWidth < 1) || (nHeight < 1) || (nWidth > 0xFFFF) || (nHeight > 0xFFFF))
+		return -1;
+
+	if (FREERDP_PIXEL_FORMAT_BPP(SrcFormat) != 32)
+		return -1;
+
+	if (!(pixels = clear_load_pixels(clear, pSrcData, SrcFormat, nSrcStep, nWidth, nHeight)))
+		return -1;
+
+	count = nWidth * nHeight;
+
+	if (!(s = Stream_New(NULL, 64)))
+		return -1;
+
+	if (clear->seqNumber == 0)
+	{
+		/* keep the decoder vBar cursors in step with ours */
+		glyphFlags |= CLEARCODEC_FLAG_CACHE_RESET;
+		clear->VBarStorageCursor = 0;
+		clear->ShortVBarStorageCursor = 0;
+	}
+
+	if (count <= CLEAR_GLYPH_MAX_PIXELS)
+	{
+		hash = clear_hash_pixels(pixels, count, 1);
+		status = clear_glyph_lookup(clear, hash, pixels, count);
+
+		if (status >= 0)
+		{
+			Stream_Write_UINT8(s, glyphFlags | CLEARCODEC_FLAG_GLYPH_INDEX | CLEARCODEC_FLAG_GLYPH_HIT);
+			Stream_Write_UINT8(s, clear->seqNumber);
+			Stream_Write_UINT16(s, status); /* glyphIndex (2 bytes) */
+			goto finish;
+		}
+
+		glyphFlags |= CLEARCODEC_FLAG_GLYPH_INDEX;
+		glyphIndex = clear->GlyphCacheCursor;
+		clear->GlyphCacheCursor = (clear->GlyphCacheCursor + 1) % 4000;
+	}
+
+	status = -1;
+	bandCount = (nHeight + CLEAR_BAND_HEIGHT - 1) / CLEAR_BAND_HEIGHT;
+	bandLayers = (BYTE*) calloc(bandCount, sizeof(BYTE));
+	bandColors = (UINT32*) calloc(bandCount, sizeof(UINT32));
+	bands = Stream_New(NULL, 1024);
+	subcodecs = Stream_New(NULL, 1024);
+
+	if (!bandLayers || !bandColors || !bands || !subcodecs)
+		goto fail;
+
+	/* first pass: pick a layer per band without touching the vBar caches */
+
+	totalSize = 0;
+
+	for (band = 0; band < bandCount; band++)
+	{
+		yStart = band * CLEAR_BAND_HEIGHT;
+		height = MIN(CLEAR_BAND_HEIGHT, nHeight - yStart);
+
+		clear_palette_build(&palette, &pixels[yStart * nWidth], nWidth * height);
+		bandColors[band] = clear_palette_background(&palette);
+		bandSize = clear_band_size(clear, &pixels[yStart * nWidth], nWidth, height, bandColors[band]);
+
+		subcodecSize = clear_write_band_subcodec(clear, subcodecs, &pixels[yStart * nWidth],
+				nWidth, yStart, height, &palette, bandSize);
+
+		bandLayers[band] = subcodecSize ? CLEAR_LAYER_SUBCODEC : CLEAR_LAYER_BANDS;
+		totalSize += subcodecSize ? subcodecSize : bandSize;
+	}
+
+	residualSize = clear_residual_size(pixels, count);
+
+	Stream_Write_UINT8(s, glyphFlags);
+	Stream_Write_UINT8(s, clear->seqNumber);
+
+	if (glyphFlags & CLEARCODEC_FLAG_GLYPH_INDEX)
+		Stream_Write_UINT16(s, glyphIndex); /* glyphIndex (2 bytes) */
+
+	if (residualSize <= totalSize)
+	{
+		/* the residual layer alone reproduces the whole bitmap */
+		Stream_SetPosition(subcodecs, 0);
+
+		if (!Stream_EnsureRemainingCapacity(s, 12))
+			goto fail;
+
+		Stream_Write_UINT32(s, residualSize); /* residualByteCount (4 bytes) */
+		Stream_Write_UINT32(s, 0); /* bandsByteCount (4 bytes) */
+		Stream_Write_UINT32(s, 0); /* subcodecByteCount (4 bytes) */
+
+		if (!clear_write_residual(s, pixels, count))
+			goto fail;
+	}
+	else
+	{
+		for (band = 0; band < bandCount; band++)
+		{
+			if (bandLayers[band] != CLEAR_LAYER_BANDS)
+				continue;
+
+			yStart = band * CLEAR_BAND_HEIGHT;
+			height = MIN(CLEAR_BAND_HEIGHT, nHeight - yStart);
+
+			if (!clear_write_band(clear, bands, &pixels[yStart * nWidth], nWidth, yStart, height, bandColors[band]))
+				goto fail;
+		}
+
+		if (!Stream_EnsureRemainingCapacity(s, 12 + Stream_GetPosition(bands) + Stream_GetPosition(subcodecs)))
+			goto fail;
+
+		Stream_Write_UINT32(s, 0); /* residualByteCount (4 bytes) */
+		Stream_Write_UINT32(s, Stream_GetPosition(bands)); /* bandsByteCount (4 bytes) */
+		Stream_Write_UINT32(s, Stream_GetPosition(subcodecs)); /* subcodecByteCount (4 bytes) */
+		Stream_Write(s, Stream_Buffer(bands), Stream_GetPosition(bands));
+		Stream_Write(s, Stream_Buffer(subcodecs), Stream_GetPosition(subcodecs));
+	}
+
+	if (glyphFlags & CLEARCODEC_FLAG_GLYPH_INDEX)
+	{
+		glyphEntry = &(clear->GlyphCache[glyphIndex]);
+
+		if (!clear_resize_pixels(&glyphEntry->pixels, &glyphEntry->size, count))
+			goto fail;
+
+		CopyMemory(glyphEntry->pixels, pixels, count * 4);
+		glyphEntry->count = count;
+		clear->GlyphHashTable[hash % CLEAR_HASH_TABLE_SIZE] = (UINT16) (glyphIndex + 1);
+	}
+
+finish:
+	clear->seqNumber = (clear->seqNumber + 1) % 256;
+
+	*ppDstData = Stream_Buffer(s);
+	*pDstSize = (UINT32) Stream_GetPosition(s);
+	Stream_Free(s, FALSE);
+	s = NULL;
+	status = 1;
+
+fail:
+	Stream_Free(s, TRUE);
+	Stream_Free(bands, TRUE);
+	Stream_Free(subcodecs, TRUE);
+	free(bandLayers);
+	free(bandColors);
+
+	return status;
 }
 
 int clear_context_reset(CLEAR_CONTEXT* clear)
@@ -832,6 +1540,11 @@ int clear_context_reset(CLEAR_CONTEXT* clear)
 	clear->seqNumber = 0;
 	clear->VBarStorageCursor = 0;
 	clear->ShortVBarStorageCursor = 0;
+	clear->GlyphCacheCursor = 0;
+
+	if (clear->GlyphHashTable)
+		ZeroMemory(clear->GlyphHashTable, CLEAR_HASH_TABLE_SIZE * sizeof(UINT16));
+
 	return 1;
 }
 
@@ -853,7 +1566,27 @@ CLEAR_CONTEXT* clear_context_new(BOOL Compressor)
 			return NULL;
 		}
 
-		nsc_context_set_pixel_format(clear->nsc, RDP_PIXEL_FORMAT_R8G8B8);
+		if (Compressor)
+		{
+			/* NSCodec subcodec input is the packed 0xFFRRGGBB encoder representation */
+			nsc_context_set_pixel_format(clear->nsc, RDP_PIXEL_FORMAT_B8G8R8A8);
+			clear->nsc->ColorLossLevel = 1;
+			clear->nsc->ChromaSubsamplingLevel = 0;
+
+			clear->GlyphHashTable = (UINT16*) calloc(CLEAR_HASH_TABLE_SIZE, sizeof(UINT16));
+			clear->VBarHashTable = (UINT16*) calloc(CLEAR_HASH_TABLE_SIZE, sizeof(UINT16));
+			clear->ShortVBarHashTable = (UINT16*) calloc(CLEAR_HASH_TABLE_SIZE, sizeof(UINT16));
+
+			if (!clear->GlyphHashTable || !clear->VBarHashTable || !clear->ShortVBarHashTable)
+			{
+				clear_context_free(clear);
+				return NULL;
+			}
+		}
+		else
+		{
+			nsc_context_set_pixel_format(clear->nsc, RDP_PIXEL_FORMAT_R8G8B8);
+		}
 
 		clear->TempSize = 512 * 512 * 4;
 		clear->TempBuffer = (BYTE*) malloc(clear->TempSize);
@@ -874,6 +1607,9 @@ void clear_context_free(CLEAR_CONTEXT* clear)
 	nsc_context_free(clear->nsc);
 
 	free(clear->TempBuffer);
+	free(clear->GlyphHashTable);
+	free(clear->VBarHashTable);
+	free(clear->ShortVBarHashTable);
 
 	for (i = 0; i < 4000; i++)
 		free(clear->GlyphCache[i].pixels);
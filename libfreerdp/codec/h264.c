@@ -196,7 +196,9 @@ static int openh264_compress(H264_CONTEXT* h264, BYTE** ppDstData, UINT32* pDstS
 
 		if (sys->EncParamExt.iMultipleThreadIdc > 1)
 		{
-			sys->EncParamExt.sSpatialLayers[0].sSliceCfg.uiSliceMode = SM_AUTO_SLICE;
+			/* one slice per thread, so that slices are encoded in parallel */
+			sys->EncParamExt.sSpatialLayers[0].sSliceCfg.uiSliceMode = SM_FIXEDSLCNUM_SLICE;
+			sys->EncParamExt.sSpatialLayers[0].sSliceCfg.sSliceArgument.uiSliceNum = h264->NumberOfThreads;
 		}
 
 		status = (*sys->pEncoder)->InitializeExt(sys->pEncoder, &sys->EncParamExt);
@@ -638,12 +640,57 @@ int h264_decompress(H264_CONTEXT* h264, BYTE* pSrcData, UINT32 SrcSize,
 	return 1;
 }
 
+static BOOL h264_prepare_yuv_buffers(H264_CONTEXT* h264, int nWidth, int nHeight)
+{
+	if ((h264->width == (UINT32) nWidth) && (h264->height == (UINT32) nHeight) &&
+			h264->pYUVData[0] && h264->pYUVData[1] && h264->pYUVData[2])
+		return TRUE;
+
+	free(h264->pYUVData[0]);
+	free(h264->pYUVData[1]);
+	free(h264->pYUVData[2]);
+
+	h264->pYUVData[0] = (BYTE*) malloc(nWidth * nHeight);
+	h264->iStride[0] = nWidth;
+	h264->pYUVData[1] = (BYTE*) malloc(nWidth * nHeight / 4);
+	h264->iStride[1] = nWidth / 2;
+	h264->pYUVData[2] = (BYTE*) malloc(nWidth * nHeight / 4);
+	h264->iStride[2] = nWidth / 2;
+
+	if (!h264->pYUVData[0] || !h264->pYUVData[1] || !h264->pYUVData[2])
+	{
+		free(h264->pYUVData[0]);
+		free(h264->pYUVData[1]);
+		free(h264->pYUVData[2]);
+		h264->pYUVData[0] = NULL;
+		h264->pYUVData[1] = NULL;
+		h264->pYUVData[2] = NULL;
+		h264->width = h264->height = 0;
+		return FALSE;
+	}
+
+	h264->width = nWidth;
+	h264->height = nHeight;
+
+	return TRUE;
+}
+
+/**
+ * The YUV420 planes are kept between frames, so that only the region rects
+ * (when given) need to be converted again. Rects are widened to even
+ * coordinates to match the 2x2 chroma subsampling.
+ */
+
 int h264_compress(H264_CONTEXT* h264, BYTE* pSrcData, DWORD SrcFormat,
-		int nSrcStep, int nSrcWidth, int nSrcHeight, BYTE** ppDstData, UINT32* pDstSize)
+		int nSrcStep, int nSrcWidth, int nSrcHeight, RDPGFX_RECT16* regionRects,
+		int numRegionRects, BYTE** ppDstData, UINT32* pDstSize)
 {
+	int index;
 	int status;
 	prim_size_t roi;
 	int nWidth, nHeight;
+	int left, top, right, bottom;
+	BYTE* pYUVData[3];
 	primitives_t *prims = primitives_get();
 
 	if (!h264)
@@ -653,27 +700,51 @@ int h264_compress(H264_CONTEXT* h264, BYTE* pSrcData, DWORD SrcFormat,
 
 	nWidth = (nSrcWidth + 1) & ~1;
 	nHeight = (nSrcHeight + 1) & ~1;
-	h264->pYUVData[0] = (BYTE*) malloc(nWidth * nHeight);
-	h264->iStride[0] = nWidth;
-	h264->pYUVData[1] = (BYTE*) malloc(nWidth * nHeight / 4);
-	h264->iStride[1] = nWidth / 2;
-	h264->pYUVData[2] = (BYTE*) malloc(nWidth * nHeight / 4);
-	h264->iStride[2] = nWidth / 2;
-	h264->width = nWidth;
-	h264->height = nHeight;
-	roi.width = nSrcWidth;
-	roi.height = nSrcHeight;
 
-	prims->RGBToYUV420_8u_P3AC4R(pSrcData, nSrcStep, h264->pYUVData, h264->iStride, &roi);
+	if ((h264->width != (UINT32) nWidth) || (h264->height != (UINT32) nHeight))
+		regionRects = NULL; /* the previous frame is gone, convert everything */
 
-	status = h264->subsystem->Compress(h264, ppDstData, pDstSize);
+	if (!h264_prepare_yuv_buffers(h264, nWidth, nHeight))
+		return -1;
 
-	free(h264->pYUVData[0]);
-	free(h264->pYUVData[1]);
-	free(h264->pYUVData[2]);
-	h264->pYUVData[0] = NULL;
-	h264->pYUVData[1] = NULL;
-	h264->pYUVData[2] = NULL;
+	if (!regionRects)
+	{
+		roi.width = nSrcWidth;
+		roi.height = nSrcHeight;
+
+		prims->RGBToYUV420_8u_P3AC4R(pSrcData, nSrcStep, h264->pYUVData, h264->iStride, &roi);
+	}
+	else
+	{
+		for (index = 0; index < numRegionRects; index++)
+		{
+			left = regionRects[index].left & ~1;
+			top = regionRects[index].top & ~1;
+			right = (regionRects[index].right + 1) & ~1;
+			bottom = (regionRects[index].bottom + 1) & ~1;
+
+			if (right > nSrcWidth)
+				right = nSrcWidth;
+
+			if (bottom > nSrcHeight)
+				bottom = nSrcHeight;
+
+			if ((left >= right) || (top >= bottom))
+				continue;
+
+			roi.width = right - left;
+			roi.height = bottom - top;
+
+			pYUVData[0] = &(h264->pYUVData[0][(top * h264->iStride[0]) + left]);
+			pYUVData[1] = &(h264->pYUVData[1][((top / 2) * h264->iStride[1]) + (left / 2)]);
+			pYUVData[2] = &(h264->pYUVData[2][((top / 2) * h264->iStride[2]) + (left / 2)]);
+
+			prims->RGBToYUV420_8u_P3AC4R(&pSrcData[(top * nSrcStep) + (left * 4)], nSrcStep,
+					pYUVData, h264->iStride, &roi);
+		}
+	}
+
+	status = h264->subsystem->Compress(h264, ppDstData, pDstSize);
 
 	return status;
 }
@@ -739,6 +810,13 @@ void h264_context_free(H264_CONTEXT* h264)
 	{
 		h264->subsystem->Uninit(h264);
 
+		if (h264->Compressor)
+		{
+			free(h264->pYUVData[0]);
+			free(h264->pYUVData[1]);
+			free(h264->pYUVData[2]);
+		}
+
 		free(h264);
 	}
 }
@@ -32,6 +32,7 @@
 
 #include "rfx_differential.h"
 #include "rfx_quantization.h"
+#include "rfx_rlgr.h"
 
 #define TAG FREERDP_TAG("codec.progressive")
 
@@ -1797,13 +1798,935 @@ int progressive_decompress(PROGRESSIVE_CONTEXT* progressive, BYTE* pSrcData, UIN
 	return 1;
 }
 
-int progressive_compress(PROGRESSIVE_CONTEXT* progressive, BYTE* pSrcData, UINT32 SrcSize, BYTE** ppDstData, UINT32* pDstSize)
+/**
+ * Encoder
+ *
+ * Tiles are first sent with TILE_FIRST at the coarsest entry of the
+ * progressive quantization ladder below, then refined by TILE_UPGRADE
+ * blocks, one ladder step at a time, until full quality (0xFF) is reached.
+ * The encoder keeps the unquantized DWT coefficients in tile->current and
+ * mirrors the decoder sign state in tile->sign to produce the SRL/RAW data.
+ */
+
+#define PROGRESSIVE_NUM_PROG_QUANT	3
+
+static const RFX_COMPONENT_CODEC_QUANT progressive_default_quant =
+{
+	6, 6, 6, 6, 7, 7, 8, 8, 8, 9 /* LL3, HL3, LH3, HH3, HL2, LH2, HH2, HL1, LH1, HH1 */
+};
+
+static const RFX_PROGRESSIVE_CODEC_QUANT progressive_default_prog_quant[PROGRESSIVE_NUM_PROG_QUANT] =
+{
+	{ 25, { 2, 3, 3, 3, 4, 4, 4, 5, 5, 5 }, { 3, 4, 4, 4, 5, 5, 5, 6, 6, 6 }, { 3, 4, 4, 4, 5, 5, 5, 6, 6, 6 } },
+	{ 50, { 1, 2, 2, 2, 3, 3, 3, 3, 3, 3 }, { 2, 3, 3, 3, 4, 4, 4, 4, 4, 4 }, { 2, 3, 3, 3, 4, 4, 4, 4, 4, 4 } },
+	{ 75, { 0, 1, 1, 1, 1, 1, 1, 1, 1, 1 }, { 1, 1, 1, 1, 2, 2, 2, 2, 2, 2 }, { 1, 1, 1, 1, 2, 2, 2, 2, 2, 2 } }
+};
+
+/* band offsets and lengths in decoding order: HL1, LH1, HH1, HL2, LH2, HH2, HL3, LH3, HH3, LL3 */
+
+static const int progressive_band_offsets[10] = { 0, 1023, 2046, 3007, 3279, 3551, 3807, 3879, 3951, 4015 };
+static const int progressive_band_lengths[10] = { 1023, 1023, 961, 272, 272, 256, 72, 72, 64, 81 };
+
+static void progressive_rfx_quant_to_bands(const RFX_COMPONENT_CODEC_QUANT* q, BYTE* bands)
+{
+	bands[0] = q->HL1;
+	bands[1] = q->LH1;
+	bands[2] = q->HH1;
+	bands[3] = q->HL2;
+	bands[4] = q->LH2;
+	bands[5] = q->HH2;
+	bands[6] = q->HL3;
+	bands[7] = q->LH3;
+	bands[8] = q->HH3;
+	bands[9] = q->LL3;
+}
+
+static void progressive_component_codec_quant_write(wStream* s, const RFX_COMPONENT_CODEC_QUANT* quantVal)
+{
+	Stream_Write_UINT8(s, quantVal->LL3 | (quantVal->HL3 << 4));
+	Stream_Write_UINT8(s, quantVal->LH3 | (quantVal->HH3 << 4));
+	Stream_Write_UINT8(s, quantVal->HL2 | (quantVal->LH2 << 4));
+	Stream_Write_UINT8(s, quantVal->HH2 | (quantVal->HL1 << 4));
+	Stream_Write_UINT8(s, quantVal->LH1 | (quantVal->HH1 << 4));
+}
+
+static const RFX_PROGRESSIVE_CODEC_QUANT* progressive_encode_get_prog_quant(PROGRESSIVE_CONTEXT* progressive, BYTE quality)
+{
+	if (quality == 0xFF)
+		return &(progressive->quantProgValFull);
+
+	return &progressive_default_prog_quant[quality];
+}
+
+static INT16 progressive_rfx_clamp_16s(INT32 value)
+{
+	if (value > 32767)
+		return 32767;
+
+	if (value < -32768)
+		return -32768;
+
+	return (INT16) value;
+}
+
+/**
+ * Forward lifting step matching progressive_rfx_idwt_x/y: an even input
+ * (64 samples) is extended by one linearly extrapolated sample so that the
+ * last high band coefficient is zero and can be dropped.
+ */
+
+static void progressive_rfx_dwt_1d_encode(INT16* pX, int nXStep, int nXCount, INT16* pLowBand, int nLowStep,
+		INT16* pHighBand, int nHighStep, int nHighCount)
+{
+	int k;
+	INT32 x[66];
+	INT32 h[33] = { 0 };
+
+	for (k = 0; k < nXCount; k++)
+		x[k] = pX[k * nXStep];
+
+	if (!(nXCount % 2))
+		x[nXCount] = (2 * x[nXCount - 1]) - x[nXCount - 2];
+
+	for (k = 0; k < nHighCount; k++)
+	{
+		h[k] = (x[(2 * k) + 1] - ((x[2 * k] + x[(2 * k) + 2]) / 2)) / 2;
+		pHighBand[k * nHighStep] = progressive_rfx_clamp_16s(h[k]);
+		h[k] = pHighBand[k * nHighStep];
+	}
+
+	pLowBand[0] = progressive_rfx_clamp_16s(x[0] + h[0]);
+
+	for (k = 1; k < nHighCount; k++)
+		pLowBand[k * nLowStep] = progressive_rfx_clamp_16s(x[2 * k] + ((h[k - 1] + h[k]) / 2));
+
+	if (!(nXCount % 2))
+	{
+		pLowBand[nHighCount * nLowStep] = progressive_rfx_clamp_16s(x[2 * nHighCount] + (h[nHighCount - 1] / 2));
+		pLowBand[(nHighCount + 1) * nLowStep] = progressive_rfx_clamp_16s(x[nXCount]);
+	}
+	else
+	{
+		pLowBand[nHighCount * nLowStep] = progressive_rfx_clamp_16s(x[2 * nHighCount] + h[nHighCount - 1]);
+	}
+}
+
+static void progressive_rfx_dwt_2d_encode_block(INT16* buffer, INT16* temp, int level)
+{
+	int i;
+	int nCount;
+	int nBandL;
+	int nBandH;
+	INT16 *HL, *LH;
+	INT16 *HH, *LL;
+	INT16 *L, *H;
+
+	nBandL = progressive_rfx_get_band_l_count(level);
+	nBandH = progressive_rfx_get_band_h_count(level);
+	nCount = (level == 1) ? 64 : (nBandL + nBandH);
+
+	HL = &buffer[0];
+	LH = &HL[nBandH * nBandL];
+	HH = &LH[nBandL * nBandH];
+	LL = &HH[nBandH * nBandH];
+
+	L = &temp[0];
+	H = &temp[nBandL * nCount];
+
+	/* vertical (input -> L + H) */
+
+	for (i = 0; i < nCount; i++)
+		progressive_rfx_dwt_1d_encode(&buffer[i], nCount, nCount, &L[i], nCount, &H[i], nCount, nBandH);
+
+	/* horizontal (L -> LL + HL, H -> LH + HH) */
+
+	for (i = 0; i < nBandL; i++)
+		progressive_rfx_dwt_1d_encode(&L[i * nCount], 1, nCount, &LL[i * nBandL], 1, &HL[i * nBandH], 1, nBandH);
+
+	for (i = 0; i < nBandH; i++)
+		progressive_rfx_dwt_1d_encode(&H[i * nCount], 1, nCount, &LH[i * nBandL], 1, &HH[i * nBandH], 1, nBandH);
+}
+
+void progressive_rfx_dwt_2d_encode(INT16* buffer, INT16* temp)
+{
+	progressive_rfx_dwt_2d_encode_block(&buffer[0], temp, 1);
+	progressive_rfx_dwt_2d_encode_block(&buffer[3007], temp, 2);
+	progressive_rfx_dwt_2d_encode_block(&buffer[3807], temp, 3);
+}
+
+/**
+ * Quantization truncates magnitudes for the high bands and floors LL3, so that
+ * upgrade passes only ever add magnitude bits (raw LL3 bits are unsigned).
+ */
+
+static void progressive_rfx_quantize_component(const INT16* coeffs, INT16* buffer, const BYTE* bitPos)
+{
+	int band;
+	int index;
+	INT16* dst;
+	const INT16* src;
+	int shift;
+
+	for (band = 0; band < 10; band++)
+	{
+		src = &coeffs[progressive_band_offsets[band]];
+		dst = &buffer[progressive_band_offsets[band]];
+		shift = bitPos[band] - 1;
+
+		for (index = 0; index < progressive_band_lengths[band]; index++)
+		{
+			if (band == 9)
+				dst[index] = src[index] >> shift;
+			else if (src[index] < 0)
+				dst[index] = -((-src[index]) >> shift);
+			else
+				dst[index] = src[index] >> shift;
+		}
+	}
+}
+
+static void progressive_bitstream_write(wBitStream* bs, UINT32 bits, UINT32 nbits)
+{
+	UINT32 chunk;
+	UINT32 value;
+
+	while (nbits > 0)
+	{
+		chunk = (nbits > 16) ? 16 : nbits;
+		value = ((nbits - chunk) < 32) ? ((bits >> (nbits - chunk)) & ((1 << chunk) - 1)) : 0;
+		BitStream_Write_Bits(bs, value, chunk);
+		nbits -= chunk;
+	}
+}
+
+static int progressive_bitstream_finish(wBitStream* bs)
+{
+	int length = (bs->position + 7) / 8;
+
+	if (length > (bs->capacity - 4))
+		return -1;
+
+	BitStream_Flush(bs);
+
+	return length;
+}
+
+/**
+ * Encodes the SRL stream for the coefficients that are not yet significant,
+ * mirroring the adaptive state machine of progressive_rfx_srl_read.
+ */
+
+static void progressive_rfx_srl_write(wBitStream* bs, const INT16* values, const BYTE* numBits, int count)
+{
+	int k;
+	int kp = 8;
+	int zeros;
+	int index = 0;
+	UINT32 mag;
+	UINT32 max;
+
+	while (index < count)
+	{
+		k = kp / 8;
+
+		for (zeros = 0; ((index + zeros) < count) && !values[index + zeros]; zeros++);
+
+		if ((zeros >= (1 << k)) || ((index + zeros) == count))
+		{
+			/* '0' bit, a full run of (1 << k) zeros */
+
+			progressive_bitstream_write(bs, 0, 1);
+			index += (1 << k);
+
+			kp += 4;
+
+			if (kp > 80)
+				kp = 80;
+
+			continue;
+		}
+
+		/* '1' bit, followed by the number of zeros on k bits */
+
+		progressive_bitstream_write(bs, 1, 1);
+
+		if (k)
+			progressive_bitstream_write(bs, zeros, k);
+
+		index += zeros;
+
+		/* sign bit and unary magnitude */
+
+		progressive_bitstream_write(bs, (values[index] < 0) ? 1 : 0, 1);
+
+		kp -= 6;
+
+		if (kp < 0)
+			kp = 0;
+
+		if (numBits[index] > 1)
+		{
+			mag = (values[index] < 0) ? -values[index] : values[index];
+			max = (1 << numBits[index]) - 1;
+
+			if (mag > 1)
+				progressive_bitstream_write(bs, 0, mag - 1);
+
+			if (mag < max)
+				progressive_bitstream_write(bs, 1, 1);
+		}
+
+		index++;
+	}
+}
+
+static int progressive_rfx_upgrade_encode_component(const INT16* current, INT16* sign, const BYTE* bitPos,
+		const BYTE* nextBitPos, wBitStream* srl, wBitStream* raw)
+{
+	int band;
+	int index;
+	int count = 0;
+	int shift;
+	UINT32 input;
+	UINT32 numBits;
+	INT16 coeff;
+	INT16 srlValues[4096];
+	BYTE srlNumBits[4096];
+
+	for (band = 0; band < 10; band++)
+	{
+		numBits = bitPos[band] - nextBitPos[band];
+		shift = nextBitPos[band] - 1;
+
+		if (!numBits)
+			continue;
+
+		for (index = progressive_band_offsets[band];
+				index < (progressive_band_offsets[band] + progressive_band_lengths[band]); index++)
+		{
+			coeff = current[index];
+
+			if (band == 9)
+			{
+				/* LL3 is always sent raw */
+				input = (coeff >> shift) & ((1 << numBits) - 1);
+				progressive_bitstream_write(raw, input, numBits);
+			}
+			else if (sign[index])
+			{
+				input = (((coeff < 0) ? -coeff : coeff) >> shift) & ((1 << numBits) - 1);
+				progressive_bitstream_write(raw, input, numBits);
+			}
+			else
+			{
+				input = ((coeff < 0) ? -coeff : coeff) >> shift;
+				sign[index] = (coeff < 0) ? -((INT16) input) : (INT16) input;
+				srlValues[count] = sign[index];
+				srlNumBits[count] = numBits;
+				count++;
+			}
+		}
+	}
+
+	progressive_rfx_srl_write(srl, srlValues, srlNumBits, count);
+
+	return 1;
+}
+
+static void progressive_encode_load_tile(BYTE* pSrcData, DWORD SrcFormat, int nSrcStep, int nXSrc, int nYSrc,
+		int nWidth, int nHeight, INT16** pPlanes)
+{
+	int x, y;
+	int sx, sy;
+	BOOL invert;
+	UINT32 pixel;
+	INT16* pR = pPlanes[0];
+	INT16* pG = pPlanes[1];
+	INT16* pB = pPlanes[2];
+
+	invert = FREERDP_PIXEL_FORMAT_IS_ABGR(SrcFormat) ? TRUE : FALSE;
+
+	/* pad the area outside of the surface with the last column and row */
+
+	for (y = 0; y < 64; y++)
+	{
+		sy = (y < nHeight) ? y : (nHeight - 1);
+
+		for (x = 0; x < 64; x++)
+		{
+			sx = (x < nWidth) ? x : (nWidth - 1);
+			pixel = *((UINT32*) &pSrcData[((nYSrc + sy) * nSrcStep) + ((nXSrc + sx) * 4)]);
+
+			*pR++ = (INT16) ((pixel >> (invert ? 0 : 16)) & 0xFF);
+			*pG++ = (INT16) ((pixel >> 8) & 0xFF);
+			*pB++ = (INT16) ((pixel >> (invert ? 16 : 0)) & 0xFF);
+		}
+	}
+}
+
+static void progressive_encode_get_buffers(BYTE* pBuffer, INT16** pPlanes)
+{
+	pPlanes[0] = (INT16*)((BYTE*)(&pBuffer[((8192 + 32) * 0) + 16])); /* Y/R buffer */
+	pPlanes[1] = (INT16*)((BYTE*)(&pBuffer[((8192 + 32) * 1) + 16])); /* Cb/G buffer */
+	pPlanes[2] = (INT16*)((BYTE*)(&pBuffer[((8192 + 32) * 2) + 16])); /* Cr/B buffer */
+}
+
+static int progressive_encode_tile_first(PROGRESSIVE_CONTEXT* progressive, RFX_PROGRESSIVE_TILE* tile,
+		BYTE* pSrcData, DWORD SrcFormat, int nSrcStep, PROGRESSIVE_SURFACE_CONTEXT* surface, wStream* s)
+{
+	int index;
+	int status;
+	size_t start;
+	size_t end;
+	UINT16 lengths[3];
+	BYTE* pBuffer;
+	INT16* temp;
+	INT16* pSign[3];
+	INT16* pSrcDst[3];
+	INT16* pCurrent[3];
+	BYTE bitPos[10];
+	RFX_COMPONENT_CODEC_QUANT* pBitPos[3];
+	const RFX_PROGRESSIVE_CODEC_QUANT* quantProg;
+	static const prim_size_t roi_64x64 = { 64, 64 };
+	const primitives_t* prims = primitives_get();
+
+	if (!tile->current)
+		tile->current = (BYTE*) _aligned_malloc((8192 + 32) * 3, 16);
+
+	if (!tile->sign)
+		tile->sign = (BYTE*) _aligned_malloc((8192 + 32) * 3, 16);
+
+	if (!tile->current || !tile->sign)
+		return -1;
+
+	tile->x = tile->xIdx * 64;
+	tile->y = tile->yIdx * 64;
+	tile->width = MIN(64, surface->width - tile->x);
+	tile->height = MIN(64, surface->height - tile->y);
+	tile->quality = 0;
+	tile->pass = 1;
+
+	quantProg = progressive_encode_get_prog_quant(progressive, tile->quality);
+
+	progressive_rfx_quant_add((RFX_COMPONENT_CODEC_QUANT*) &progressive_default_quant,
+			(RFX_COMPONENT_CODEC_QUANT*) &(quantProg->yQuantValues), &(tile->yBitPos));
+	progressive_rfx_quant_add((RFX_COMPONENT_CODEC_QUANT*) &progressive_default_quant,
+			(RFX_COMPONENT_CODEC_QUANT*) &(quantProg->cbQuantValues), &(tile->cbBitPos));
+	progressive_rfx_quant_add((RFX_COMPONENT_CODEC_QUANT*) &progressive_default_quant,
+			(RFX_COMPONENT_CODEC_QUANT*) &(quantProg->crQuantValues), &(tile->crBitPos));
+
+	pBitPos[0] = &(tile->yBitPos);
+	pBitPos[1] = &(tile->cbBitPos);
+	pBitPos[2] = &(tile->crBitPos);
+
+	progressive_encode_get_buffers(tile->sign, pSign);
+	progressive_encode_get_buffers(tile->current, pCurrent);
+
+	pBuffer = (BYTE*) BufferPool_Take(progressive->bufferPool, -1);
+	temp = (INT16*) BufferPool_Take(progressive->bufferPool, -1); /* DWT buffer */
+
+	if (!pBuffer || !temp)
+	{
+		BufferPool_Return(progressive->bufferPool, pBuffer);
+		BufferPool_Return(progressive->bufferPool, temp);
+		return -1;
+	}
+
+	progressive_encode_get_buffers(pBuffer, pSrcDst);
+
+	progressive_encode_load_tile(pSrcData, SrcFormat, nSrcStep, tile->x, tile->y,
+			tile->width, tile->height, pSrcDst);
+
+	prims->RGBToYCbCr_16s16s_P3P3((const INT16**) pSrcDst, 64 * sizeof(INT16),
+			pSrcDst, 64 * sizeof(INT16), &roi_64x64);
+
+	start = Stream_GetPosition(s);
+
+	if (!Stream_EnsureRemainingCapacity(s, 23))
+		goto fail;
+
+	Stream_Seek(s, 23); /* written below */
+
+	for (index = 0; index < 3; index++)
+	{
+		progressive_rfx_dwt_2d_encode(pSrcDst[index], temp);
+		CopyMemory(pCurrent[index], pSrcDst[index], 4096 * 2);
+
+		progressive_rfx_quant_to_bands(pBitPos[index], bitPos);
+		progressive_rfx_quantize_component(pCurrent[index], pSrcDst[index], bitPos);
+		CopyMemory(pSign[index], pSrcDst[index], 4096 * 2);
+
+		rfx_differential_encode(&pSrcDst[index][4015], 81); /* LL3 */
+
+		if (!Stream_EnsureRemainingCapacity(s, 16384))
+			goto fail;
+
+		status = rfx_rlgr_encode(RLGR1, pSrcDst[index], 4096, Stream_Pointer(s), 16384);
+
+		if ((status <= 0) || (status > 0xFFFF))
+			goto fail;
+
+		lengths[index] = (UINT16) status;
+		Stream_Seek(s, status);
+	}
+
+	end = Stream_GetPosition(s);
+	Stream_SetPosition(s, start);
+
+	Stream_Write_UINT16(s, PROGRESSIVE_WBT_TILE_FIRST); /* blockType (2 bytes) */
+	Stream_Write_UINT32(s, (UINT32) (end - start)); /* blockLen (4 bytes) */
+	Stream_Write_UINT8(s, 0); /* quantIdxY (1 byte) */
+	Stream_Write_UINT8(s, 0); /* quantIdxCb (1 byte) */
+	Stream_Write_UINT8(s, 0); /* quantIdxCr (1 byte) */
+	Stream_Write_UINT16(s, tile->xIdx); /* xIdx (2 bytes) */
+	Stream_Write_UINT16(s, tile->yIdx); /* yIdx (2 bytes) */
+	Stream_Write_UINT8(s, 0); /* flags (1 byte) */
+	Stream_Write_UINT8(s, tile->quality); /* quality (1 byte) */
+	Stream_Write_UINT16(s, lengths[0]); /* yLen (2 bytes) */
+	Stream_Write_UINT16(s, lengths[1]); /* cbLen (2 bytes) */
+	Stream_Write_UINT16(s, lengths[2]); /* crLen (2 bytes) */
+	Stream_Write_UINT16(s, 0); /* tailLen (2 bytes) */
+
+	Stream_SetPosition(s, end);
+
+	BufferPool_Return(progressive->bufferPool, pBuffer);
+	BufferPool_Return(progressive->bufferPool, temp);
+
+	return 1;
+
+fail:
+	BufferPool_Return(progressive->bufferPool, pBuffer);
+	BufferPool_Return(progressive->bufferPool, temp);
+	return -1;
+}
+
+static int progressive_encode_tile_upgrade(PROGRESSIVE_CONTEXT* progressive, RFX_PROGRESSIVE_TILE* tile, wStream* s)
 {
+	int index;
+	int length;
+	size_t start;
+	size_t end;
+	BYTE quality;
+	BYTE* pSrlBuffer;
+	BYTE* pRawBuffer;
+	wBitStream s_srl;
+	wBitStream s_raw;
+	UINT16 lengths[6];
+	INT16* pSign[3];
+	INT16* pCurrent[3];
+	BYTE bitPos[10];
+	BYTE nextBitPos[10];
+	RFX_COMPONENT_CODEC_QUANT next[3];
+	RFX_COMPONENT_CODEC_QUANT* pBitPos[3];
+	const RFX_PROGRESSIVE_CODEC_QUANT* quantProg;
+	int capacity = (8192 + 32) * 3;
+
+	quality = tile->quality + 1;
+
+	if (quality >= PROGRESSIVE_NUM_PROG_QUANT)
+		quality = 0xFF;
+
+	quantProg = progressive_encode_get_prog_quant(progressive, quality);
+
+	progressive_rfx_quant_add((RFX_COMPONENT_CODEC_QUANT*) &progressive_default_quant,
+			(RFX_COMPONENT_CODEC_QUANT*) &(quantProg->yQuantValues), &next[0]);
+	progressive_rfx_quant_add((RFX_COMPONENT_CODEC_QUANT*) &progressive_default_quant,
+			(RFX_COMPONENT_CODEC_QUANT*) &(quantProg->cbQuantValues), &next[1]);
+	progressive_rfx_quant_add((RFX_COMPONENT_CODEC_QUANT*) &progressive_default_quant,
+			(RFX_COMPONENT_CODEC_QUANT*) &(quantProg->crQuantValues), &next[2]);
+
+	pBitPos[0] = &(tile->yBitPos);
+	pBitPos[1] = &(tile->cbBitPos);
+	pBitPos[2] = &(tile->crBitPos);
+
+	progressive_encode_get_buffers(tile->sign, pSign);
+	progressive_encode_get_buffers(tile->current, pCurrent);
+
+	pSrlBuffer = (BYTE*) BufferPool_Take(progressive->bufferPool, -1);
+	pRawBuffer = (BYTE*) BufferPool_Take(progressive->bufferPool, -1);
+
+	if (!pSrlBuffer || !pRawBuffer)
+		goto fail;
+
+	start = Stream_GetPosition(s);
+
+	if (!Stream_EnsureRemainingCapacity(s, 26))
+		goto fail;
+
+	Stream_Seek(s, 26); /* written below */
+
+	for (index = 0; index < 3; index++)
+	{
+		ZeroMemory(&s_srl, sizeof(wBitStream));
+		ZeroMemory(&s_raw, sizeof(wBitStream));
+		BitStream_Attach(&s_srl, pSrlBuffer, capacity);
+		BitStream_Attach(&s_raw, pRawBuffer, capacity);
+
+		progressive_rfx_quant_to_bands(pBitPos[index], bitPos);
+		progressive_rfx_quant_to_bands(&next[index], nextBitPos);
+
+		progressive_rfx_upgrade_encode_component(pCurrent[index], pSign[index], bitPos, nextBitPos, &s_srl, &s_raw);
+
+		if ((length = progressive_bitstream_finish(&s_srl)) < 0)
+			goto fail;
+
+		lengths[index * 2] = (UINT16) length;
+
+		if ((length = progressive_bitstream_finish(&s_raw)) < 0)
+			goto fail;
+
+		lengths[(index * 2) + 1] = (UINT16) length;
+
+		if (!Stream_EnsureRemainingCapacity(s, lengths[index * 2] + lengths[(index * 2) + 1]))
+			goto fail;
+
+		Stream_Write(s, pSrlBuffer, lengths[index * 2]);
+		Stream_Write(s, pRawBuffer, lengths[(index * 2) + 1]);
+
+		CopyMemory(pBitPos[index], &next[index], sizeof(RFX_COMPONENT_CODEC_QUANT));
+	}
+
+	tile->quality = quality;
+	tile->pass++;
+
+	end = Stream_GetPosition(s);
+	Stream_SetPosition(s, start);
+
+	Stream_Write_UINT16(s, PROGRESSIVE_WBT_TILE_UPGRADE); /* blockType (2 bytes) */
+	Stream_Write_UINT32(s, (UINT32) (end - start)); /* blockLen (4 bytes) */
+	Stream_Write_UINT8(s, 0); /* quantIdxY (1 byte) */
+	Stream_Write_UINT8(s, 0); /* quantIdxCb (1 byte) */
+	Stream_Write_UINT8(s, 0); /* quantIdxCr (1 byte) */
+	Stream_Write_UINT16(s, tile->xIdx); /* xIdx (2 bytes) */
+	Stream_Write_UINT16(s, tile->yIdx); /* yIdx (2 bytes) */
+	Stream_Write_UINT8(s, tile->quality); /* quality (1 byte) */
+
+	for (index = 0; index < 6; index++)
+		Stream_Write_UINT16(s, lengths[index]); /* srlLen/rawLen (2 bytes) */
+
+	Stream_SetPosition(s, end);
+
+	BufferPool_Return(progressive->bufferPool, pSrlBuffer);
+	BufferPool_Return(progressive->bufferPool, pRawBuffer);
+
 	return 1;
+
+fail:
+	BufferPool_Return(progressive->bufferPool, pSrlBuffer);
+	BufferPool_Return(progressive->bufferPool, pRawBuffer);
+	return -1;
+}
+
+static BOOL progressive_write_frame_begin(PROGRESSIVE_CONTEXT* progressive, wStream* s)
+{
+	if (!Stream_EnsureRemainingCapacity(s, 12 + 10 + 12))
+		return FALSE;
+
+	if (!progressive->SyncSent)
+	{
+		Stream_Write_UINT16(s, PROGRESSIVE_WBT_SYNC); /* blockType (2 bytes) */
+		Stream_Write_UINT32(s, 12); /* blockLen (4 bytes) */
+		Stream_Write_UINT32(s, 0xCACCACCA); /* magic (4 bytes) */
+		Stream_Write_UINT16(s, 0x0100); /* version (2 bytes) */
+
+		Stream_Write_UINT16(s, PROGRESSIVE_WBT_CONTEXT); /* blockType (2 bytes) */
+		Stream_Write_UINT32(s, 10); /* blockLen (4 bytes) */
+		Stream_Write_UINT8(s, 0); /* ctxId (1 byte) */
+		Stream_Write_UINT16(s, 64); /* tileSize (2 bytes) */
+		Stream_Write_UINT8(s, 0); /* flags (1 byte) */
+
+		progressive->SyncSent = TRUE;
+	}
+
+	Stream_Write_UINT16(s, PROGRESSIVE_WBT_FRAME_BEGIN); /* blockType (2 bytes) */
+	Stream_Write_UINT32(s, 12); /* blockLen (4 bytes) */
+	Stream_Write_UINT32(s, progressive->FrameIndex++); /* frameIndex (4 bytes) */
+	Stream_Write_UINT16(s, 1); /* regionCount (2 bytes) */
+
+	return TRUE;
+}
+
+static BOOL progressive_write_region_begin(wStream* s, const RFX_RECT* rects, int numRects)
+{
+	int index;
+
+	if (!Stream_EnsureRemainingCapacity(s, 18 + (numRects * 8) + 5 + (PROGRESSIVE_NUM_PROG_QUANT * 16)))
+		return FALSE;
+
+	Stream_Write_UINT16(s, PROGRESSIVE_WBT_REGION); /* blockType (2 bytes) */
+	Stream_Write_UINT32(s, 0); /* blockLen (4 bytes), written at the end */
+	Stream_Write_UINT8(s, 64); /* tileSize (1 byte) */
+	Stream_Write_UINT16(s, numRects); /* numRects (2 bytes) */
+	Stream_Write_UINT8(s, 1); /* numQuant (1 byte) */
+	Stream_Write_UINT8(s, PROGRESSIVE_NUM_PROG_QUANT); /* numProgQuant (1 byte) */
+	Stream_Write_UINT8(s, RFX_DWT_REDUCE_EXTRAPOLATE); /* flags (1 byte) */
+	Stream_Write_UINT16(s, 0); /* numTiles (2 bytes), written at the end */
+	Stream_Write_UINT32(s, 0); /* tileDataSize (4 bytes), written at the end */
+
+	for (index = 0; index < numRects; index++)
+	{
+		Stream_Write_UINT16(s, rects[index].x);
+		Stream_Write_UINT16(s, rects[index].y);
+		Stream_Write_UINT16(s, rects[index].width);
+		Stream_Write_UINT16(s, rects[index].height);
+	}
+
+	progressive_component_codec_quant_write(s, &progressive_default_quant);
+
+	for (index = 0; index < PROGRESSIVE_NUM_PROG_QUANT; index++)
+	{
+		Stream_Write_UINT8(s, progressive_default_prog_quant[index].quality);
+		progressive_component_codec_quant_write(s, &(progressive_default_prog_quant[index].yQuantValues));
+		progressive_component_codec_quant_write(s, &(progressive_default_prog_quant[index].cbQuantValues));
+		progressive_component_codec_quant_write(s, &(progressive_default_prog_quant[index].crQuantValues));
+	}
+
+	return TRUE;
+}
+
+static BOOL progressive_write_region_end(wStream* s, size_t regionStart, size_t tilesStart, int numTiles)
+{
+	size_t end = Stream_GetPosition(s);
+
+	Stream_SetPosition(s, regionStart + 2);
+	Stream_Write_UINT32(s, (UINT32) (end - regionStart)); /* blockLen (4 bytes) */
+	Stream_Seek(s, 6);
+	Stream_Write_UINT16(s, numTiles); /* numTiles (2 bytes) */
+	Stream_Write_UINT32(s, (UINT32) (end - tilesStart)); /* tileDataSize (4 bytes) */
+	Stream_SetPosition(s, end);
+
+	if (!Stream_EnsureRemainingCapacity(s, 6))
+		return FALSE;
+
+	Stream_Write_UINT16(s, PROGRESSIVE_WBT_FRAME_END); /* blockType (2 bytes) */
+	Stream_Write_UINT32(s, 6); /* blockLen (4 bytes) */
+
+	return TRUE;
+}
+
+/**
+ * Encodes the tiles of a surface covered by the given rectangles as a low
+ * quality first pass. pSrcData holds the whole 32bpp surface. Later calls to
+ * progressive_compress_upgrade refine these tiles while they stay unchanged.
+ */
+
+int progressive_compress(PROGRESSIVE_CONTEXT* progressive, BYTE* pSrcData, DWORD SrcFormat, int nSrcStep,
+		UINT16 surfaceId, const RFX_RECT* rects, int numRects, BYTE** ppDstData, UINT32* pDstSize)
+{
+	int index;
+	int status = -1;
+	int numTiles = 0;
+	UINT32 xIdx, yIdx;
+	UINT32 gridWidth;
+	UINT32 gridHeight;
+	UINT32 xStart, xEnd;
+	UINT32 yStart, yEnd;
+	size_t regionStart;
+	size_t tilesStart;
+	BYTE* dirty = NULL;
+	RFX_RECT* clipped = NULL;
+	wStream* s = NULL;
+	RFX_PROGRESSIVE_TILE* tile;
+	PROGRESSIVE_SURFACE_CONTEXT* surface;
+
+	if (!progressive->Compressor || !pSrcData || !rects || (numRects < 1) || !ppDstData || !pDstSize)
+		return -1;
+
+	if (FREERDP_PIXEL_FORMAT_BPP(SrcFormat) != 32)
+		return -1;
+
+	surface = (PROGRESSIVE_SURFACE_CONTEXT*) progressive_get_surface_data(progressive, surfaceId);
+
+	if (!surface)
+		return -1;
+
+	gridWidth = (surface->width + 63) / 64;
+	gridHeight = (surface->height + 63) / 64;
+
+	dirty = (BYTE*) calloc(surface->gridSize, sizeof(BYTE));
+	clipped = (RFX_RECT*) calloc(numRects, sizeof(RFX_RECT));
+
+	if (!dirty || !clipped)
+		goto fail;
+
+	for (index = 0; index < numRects; index++)
+	{
+		xStart = MIN(rects[index].x, surface->width);
+		yStart = MIN(rects[index].y, surface->height);
+		xEnd = MIN((UINT32) rects[index].x + rects[index].width, surface->width);
+		yEnd = MIN((UINT32) rects[index].y + rects[index].height, surface->height);
+
+		clipped[index].x = (UINT16) xStart;
+		clipped[index].y = (UINT16) yStart;
+		clipped[index].width = (UINT16) (xEnd - xStart);
+		clipped[index].height = (UINT16) (yEnd - yStart);
+
+		if ((xEnd <= xStart) || (yEnd <= yStart))
+			continue;
+
+		for (yIdx = yStart / 64; yIdx <= (yEnd - 1) / 64; yIdx++)
+		{
+			for (xIdx = xStart / 64; xIdx <= (xEnd - 1) / 64; xIdx++)
+				dirty[(yIdx * surface->gridWidth) + xIdx] = 1;
+		}
+	}
+
+	if (!(s = Stream_New(NULL, 4096)))
+		goto fail;
+
+	if (!progressive_write_frame_begin(progressive, s))
+		goto fail;
+
+	regionStart = Stream_GetPosition(s);
+
+	if (!progressive_write_region_begin(s, clipped, numRects))
+		goto fail;
+
+	tilesStart = Stream_GetPosition(s);
+
+	for (yIdx = 0; yIdx < gridHeight; yIdx++)
+	{
+		for (xIdx = 0; xIdx < gridWidth; xIdx++)
+		{
+			if (!dirty[(yIdx * surface->gridWidth) + xIdx])
+				continue;
+
+			tile = &(surface->tiles[(yIdx * surface->gridWidth) + xIdx]);
+			tile->xIdx = (UINT16) xIdx;
+			tile->yIdx = (UINT16) yIdx;
+
+			if (progressive_encode_tile_first(progressive, tile, pSrcData, SrcFormat, nSrcStep, surface, s) < 0)
+				goto fail;
+
+			numTiles++;
+		}
+	}
+
+	if (!progressive_write_region_end(s, regionStart, tilesStart, numTiles))
+		goto fail;
+
+	*ppDstData = Stream_Buffer(s);
+	*pDstSize = (UINT32) Stream_GetPosition(s);
+	Stream_Free(s, FALSE);
+	s = NULL;
+	status = 1;
+
+fail:
+	Stream_Free(s, TRUE);
+	free(dirty);
+	free(clipped);
+
+	return status;
+}
+
+/**
+ * Encodes one quality upgrade for up to maxTiles tiles (all if 0), lowest
+ * quality first. Returns the number of upgraded tiles, 0 when every tile has
+ * reached full quality, in which case no data is returned.
+ */
+
+int progressive_compress_upgrade(PROGRESSIVE_CONTEXT* progressive, UINT16 surfaceId, int maxTiles,
+		BYTE** ppDstData, UINT32* pDstSize)
+{
+	int index;
+	int status = -1;
+	int numTiles = 0;
+	UINT32 zIdx;
+	BYTE quality;
+	size_t regionStart;
+	size_t tilesStart;
+	RFX_RECT* rects = NULL;
+	RFX_PROGRESSIVE_TILE** tiles = NULL;
+	wStream* s = NULL;
+	RFX_PROGRESSIVE_TILE* tile;
+	PROGRESSIVE_SURFACE_CONTEXT* surface;
+
+	if (!progressive->Compressor || !ppDstData || !pDstSize)
+		return -1;
+
+	*ppDstData = NULL;
+	*pDstSize = 0;
+
+	surface = (PROGRESSIVE_SURFACE_CONTEXT*) progressive_get_surface_data(progressive, surfaceId);
+
+	if (!surface)
+		return -1;
+
+	if ((maxTiles <= 0) || ((UINT32) maxTiles > surface->gridSize))
+		maxTiles = surface->gridSize;
+
+	if (!(tiles = (RFX_PROGRESSIVE_TILE**) calloc(maxTiles, sizeof(RFX_PROGRESSIVE_TILE*))))
+		return -1;
+
+	for (quality = 0; (quality < PROGRESSIVE_NUM_PROG_QUANT) && (numTiles < maxTiles); quality++)
+	{
+		for (zIdx = 0; (zIdx < surface->gridSize) && (numTiles < maxTiles); zIdx++)
+		{
+			tile = &(surface->tiles[zIdx]);
+
+			if ((tile->pass > 0) && (tile->quality == quality))
+				tiles[numTiles++] = tile;
+		}
+	}
+
+	if (!numTiles)
+	{
+		free(tiles);
+		return 0;
+	}
+
+	if (!(rects = (RFX_RECT*) calloc(numTiles, sizeof(RFX_RECT))))
+		goto fail;
+
+	for (index = 0; index < numTiles; index++)
+	{
+		rects[index].x = tiles[index]->x;
+		rects[index].y = tiles[index]->y;
+		rects[index].width = tiles[index]->width;
+		rects[index].height = tiles[index]->height;
+	}
+
+	if (!(s = Stream_New(NULL, 4096)))
+		goto fail;
+
+	if (!progressive_write_frame_begin(progressive, s))
+		goto fail;
+
+	regionStart = Stream_GetPosition(s);
+
+	if (!progressive_write_region_begin(s, rects, numTiles))
+		goto fail;
+
+	tilesStart = Stream_GetPosition(s);
+
+	for (index = 0; index < numTiles; index++)
+	{
+		if (progressive_encode_tile_upgrade(progressive, tiles[index], s) < 0)
+			goto fail;
+	}
+
+	if (!progressive_write_region_end(s, regionStart, tilesStart, numTiles))
+		goto fail;
+
+	*ppDstData = Stream_Buffer(s);
+	*pDstSize = (UINT32) Stream_GetPosition(s);
+	Stream_Free(s, FALSE);
+	s = NULL;
+	status = numTiles;
+
+fail:
+	Stream_Free(s, TRUE);
+	free(rects);
+	free(tiles);
+
+	return status;
 }
 
 int progressive_context_reset(PROGRESSIVE_CONTEXT* progressive)
 {
+	progressive->SyncSent = FALSE;
+	progressive->FrameIndex = 0;
+
 	return 1;
 }
 
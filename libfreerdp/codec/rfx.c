@@ -52,6 +52,7 @@
 #include "rfx_dwt.h"
 #include "rfx_rlgr.h"
 
+#include "rfx_avx2.h"
 #include "rfx_sse2.h"
 #include "rfx_neon.h"
 
@@ -0,0 +1,597 @@
+/**
+ * FreeRDP: A Remote Desktop Protocol Implementation
+ * RemoteFX Codec Library - AVX2 Optimizations
+ *
+ * Copyright 2026 agent <agent@local>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#if defined(__GNUC__) || (defined(_MSC_VER) && (_MSC_VER >= 1700))
+#define WITH_RFX_AVX2
+/* must come before winpr/crt.h, which emulates some of its intrinsics */
+#include <immintrin.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <winpr/sysinfo.h>
+
+#include "rfx_types.h"
+#include "rfx_avx2.h"
+
+#ifdef WITH_RFX_AVX2
+
+/**
+ * This file is built with the same flags as the SSE2 code, every function
+ * carries the AVX2 target attribute and is only used once rfx_init_avx2
+ * found AVX2 support at runtime.
+ */
+
+#ifdef _MSC_VER
+#define	__attribute__(...)
+#endif
+
+#ifndef __clang__
+#define ATTRIBUTES  __gnu_inline__, __always_inline__, __artificial__, __target__("avx2")
+#else
+#define ATTRIBUTES __gnu_inline__, __always_inline__, __target__("avx2")
+#endif
+
+#define TARGET_AVX2 __target__("avx2")
+
+/**
+ * Quantization
+ *
+ * Buffers are only guaranteed to be 16 byte aligned, hence the unaligned
+ * loads and stores. The sub-band sizes are multiples of 16 coefficients.
+ */
+
+static __inline void __attribute__((ATTRIBUTES))
+rfx_quantization_decode_block_avx2(INT16* buffer, const int buffer_size, const UINT32 factor)
+{
+	__m256i a;
+	__m256i* ptr = (__m256i*) buffer;
+	__m256i* buf_end = (__m256i*) (buffer + buffer_size);
+
+	if (factor == 0)
+		return;
+
+	do
+	{
+		a = _mm256_loadu_si256(ptr);
+		a = _mm256_slli_epi16(a, factor);
+		_mm256_storeu_si256(ptr, a);
+
+		ptr++;
+	} while (ptr < buf_end);
+}
+
+static void __attribute__((TARGET_AVX2)) rfx_quantization_decode_avx2(INT16* buffer, const UINT32* quantVals)
+{
+	rfx_quantization_decode_block_avx2(&buffer[0], 1024, quantVals[8] - 1); /* HL1 */
+	rfx_quantization_decode_block_avx2(&buffer[1024], 1024, quantVals[7] - 1); /* LH1 */
+	rfx_quantization_decode_block_avx2(&buffer[2048], 1024, quantVals[9] - 1); /* HH1 */
+	rfx_quantization_decode_block_avx2(&buffer[3072], 256, quantVals[5] - 1); /* HL2 */
+	rfx_quantization_decode_block_avx2(&buffer[3328], 256, quantVals[4] - 1); /* LH2 */
+	rfx_quantization_decode_block_avx2(&buffer[3584], 256, quantVals[6] - 1); /* HH2 */
+	rfx_quantization_decode_block_avx2(&buffer[3840], 64, quantVals[2] - 1); /* HL3 */
+	rfx_quantization_decode_block_avx2(&buffer[3904], 64, quantVals[1] - 1); /* LH3 */
+	rfx_quantization_decode_block_avx2(&buffer[3968], 64, quantVals[3] - 1); /* HH3 */
+	rfx_quantization_decode_block_avx2(&buffer[4032], 64, quantVals[0] - 1); /* LL3 */
+}
+
+/**
+ * The band quantization and the final rounding of the << 5 scaling from the
+ * RGB->YCbCr phase are done in a single pass over the buffer, with the same
+ * 16-bit results as two separate passes.
+ */
+
+static __inline void __attribute__((ATTRIBUTES))
+rfx_quantization_encode_block_avx2(INT16* buffer, const int buffer_size, const UINT32 factor)
+{
+	__m256i a;
+	__m256i* ptr = (__m256i*) buffer;
+	__m256i* buf_end = (__m256i*) (buffer + buffer_size);
+	__m256i half;
+	__m256i half5;
+
+	half5 = _mm256_set1_epi16(1 << 4);
+
+	if (factor == 0)
+	{
+		do
+		{
+			a = _mm256_loadu_si256(ptr);
+			a = _mm256_srai_epi16(_mm256_add_epi16(a, half5), 5);
+			_mm256_storeu_si256(ptr, a);
+
+			ptr++;
+		} while (ptr < buf_end);
+
+		return;
+	}
+
+	half = _mm256_set1_epi16(1 << (factor - 1));
+
+	do
+	{
+		a = _mm256_loadu_si256(ptr);
+		a = _mm256_srai_epi16(_mm256_add_epi16(a, half), factor);
+		a = _mm256_srai_epi16(_mm256_add_epi16(a, half5), 5);
+		_mm256_storeu_si256(ptr, a);
+
+		ptr++;
+	} while (ptr < buf_end);
+}
+
+static void __attribute__((TARGET_AVX2)) rfx_quantization_encode_avx2(INT16* buffer, const UINT32* quantization_values)
+{
+	rfx_quantization_encode_block_avx2(buffer, 1024, quantization_values[8] - 6); /* HL1 */
+	rfx_quantization_encode_block_avx2(buffer + 1024, 1024, quantization_values[7] - 6); /* LH1 */
+	rfx_quantization_encode_block_avx2(buffer + 2048, 1024, quantization_values[9] - 6); /* HH1 */
+	rfx_quantization_encode_block_avx2(buffer + 3072, 256, quantization_values[5] - 6); /* HL2 */
+	rfx_quantization_encode_block_avx2(buffer + 3328, 256, quantization_values[4] - 6); /* LH2 */
+	rfx_quantization_encode_block_avx2(buffer + 3584, 256, quantization_values[6] - 6); /* HH2 */
+	rfx_quantization_encode_block_avx2(buffer + 3840, 64, quantization_values[2] - 6); /* HL3 */
+	rfx_quantization_encode_block_avx2(buffer + 3904, 64, quantization_values[1] - 6); /* LH3 */
+	rfx_quantization_encode_block_avx2(buffer + 3968, 64, quantization_values[3] - 6); /* HH3 */
+	rfx_quantization_encode_block_avx2(buffer + 4032, 64, quantization_values[0] - 6); /* LL3 */
+}
+
+/**
+ * Lane helpers for the horizontal transforms, which work on 16 coefficients
+ * per vector: the previous element (first one taken from prev) and the next
+ * element (last one taken from next).
+ */
+
+static __inline __m256i __attribute__((ATTRIBUTES))
+_mm256_shift_in_first_epi16(__m256i v, INT16 prev)
+{
+	__m256i t = _mm256_permute2x128_si256(_mm256_set1_epi16(prev), v, 0x20);
+	return _mm256_alignr_epi8(v, t, 14);
+}
+
+static __inline __m256i __attribute__((ATTRIBUTES))
+_mm256_shift_in_last_epi16(__m256i v, INT16 next)
+{
+	__m256i t = _mm256_permute2x128_si256(v, _mm256_set1_epi16(next), 0x21);
+	return _mm256_alignr_epi8(t, v, 2);
+}
+
+/**
+ * DWT decode
+ */
+
+static __inline void __attribute__((ATTRIBUTES))
+rfx_dwt_2d_decode_block_horiz_8_avx2(INT16* l, INT16* h, INT16* dst)
+{
+	int y;
+	__m128i l_n;
+	__m128i h_n;
+	__m128i h_n_m;
+	__m128i dst_n;
+	__m128i dst_n_p;
+	__m128i tmp_n;
+
+	for (y = 0; y < 8; y++)
+	{
+		/* dst[2n] = l[n] - ((h[n-1] + h[n] + 1) >> 1); */
+
+		l_n = _mm_load_si128((__m128i*) l);
+		h_n = _mm_load_si128((__m128i*) h);
+		h_n_m = _mm_insert_epi16(_mm_slli_si128(h_n, 2), h[0], 0);
+
+		tmp_n = _mm_add_epi16(_mm_add_epi16(h_n, h_n_m), _mm_set1_epi16(1));
+		dst_n = _mm_sub_epi16(l_n, _mm_srai_epi16(tmp_n, 1));
+
+		/* dst[2n + 1] = (h[n] << 1) + ((dst[2n] + dst[2n + 2]) >> 1); */
+
+		dst_n_p = _mm_insert_epi16(_mm_srli_si128(dst_n, 2), _mm_extract_epi16(dst_n, 7), 7);
+		tmp_n = _mm_srai_epi16(_mm_add_epi16(dst_n, dst_n_p), 1);
+		tmp_n = _mm_add_epi16(tmp_n, _mm_slli_epi16(h_n, 1));
+
+		_mm_store_si128((__m128i*) dst, _mm_unpacklo_epi16(dst_n, tmp_n));
+		_mm_store_si128((__m128i*) (dst + 8), _mm_unpackhi_epi16(dst_n, tmp_n));
+
+		l += 8;
+		h += 8;
+		dst += 16;
+	}
+}
+
+static __inline void __attribute__((ATTRIBUTES))
+rfx_dwt_2d_decode_block_horiz_avx2(INT16* l, INT16* h, INT16* dst, int subband_width)
+{
+	int y, n;
+	INT16 prev;
+	INT16 next;
+	__m256i l_n;
+	__m256i h_n;
+	__m256i h_n_m;
+	__m256i dst_n;
+	__m256i dst_n_p;
+	__m256i tmp_n;
+	__m256i dst1;
+	__m256i dst2;
+
+	for (y = 0; y < subband_width; y++)
+	{
+		/* Even coefficients, stored in place of l */
+		for (n = 0; n < subband_width; n += 16)
+		{
+			/* dst[2n] = l[n] - ((h[n-1] + h[n] + 1) >> 1); */
+
+			l_n = _mm256_loadu_si256((__m256i*) &l[n]);
+			h_n = _mm256_loadu_si256((__m256i*) &h[n]);
+			prev = (n == 0) ? h[0] : h[n - 1];
+			h_n_m = _mm256_shift_in_first_epi16(h_n, prev);
+
+			tmp_n = _mm256_add_epi16(_mm256_add_epi16(h_n, h_n_m), _mm256_set1_epi16(1));
+			dst_n = _mm256_sub_epi16(l_n, _mm256_srai_epi16(tmp_n, 1));
+
+			_mm256_storeu_si256((__m256i*) &l[n], dst_n);
+		}
+
+		/* Odd coefficients */
+		for (n = 0; n < subband_width; n += 16)
+		{
+			/* dst[2n + 1] = (h[n] << 1) + ((dst[2n] + dst[2n + 2]) >> 1); */
+
+			h_n = _mm256_loadu_si256((__m256i*) &h[n]);
+			dst_n = _mm256_loadu_si256((__m256i*) &l[n]);
+			next = (n == subband_width - 16) ? l[n + 15] : l[n + 16];
+			dst_n_p = _mm256_shift_in_last_epi16(dst_n, next);
+
+			tmp_n = _mm256_srai_epi16(_mm256_add_epi16(dst_n, dst_n_p), 1);
+			tmp_n = _mm256_add_epi16(tmp_n, _mm256_slli_epi16(h_n, 1));
+
+			dst1 = _mm256_unpacklo_epi16(dst_n, tmp_n);
+			dst2 = _mm256_unpackhi_epi16(dst_n, tmp_n);
+
+			_mm256_storeu_si256((__m256i*) &dst[2 * n], _mm256_permute2x128_si256(dst1, dst2, 0x20));
+			_mm256_storeu_si256((__m256i*) &dst[2 * n + 16], _mm256_permute2x128_si256(dst1, dst2, 0x31));
+		}
+
+		l += subband_width;
+		h += subband_width;
+		dst += 2 * subband_width;
+	}
+}
+
+static __inline void __attribute__((ATTRIBUTES))
+rfx_dwt_2d_decode_block_vert_avx2(INT16* l, INT16* h, INT16* dst, int subband_width)
+{
+	int x, n;
+	INT16* l_ptr = l;
+	INT16* h_ptr = h;
+	INT16* dst_ptr = dst;
+	__m256i l_n;
+	__m256i h_n;
+	__m256i tmp_n;
+	__m256i h_n_m;
+	__m256i dst_n;
+	__m256i dst_n_m;
+	__m256i dst_n_p;
+	int total_width = subband_width + subband_width;
+
+	/* Even coefficients */
+	for (n = 0; n < subband_width; n++)
+	{
+		for (x = 0; x < total_width; x += 16)
+		{
+			/* dst[2n] = l[n] - ((h[n-1] + h[n] + 1) >> 1); */
+
+			l_n = _mm256_loadu_si256((__m256i*) l_ptr);
+			h_n = _mm256_loadu_si256((__m256i*) h_ptr);
+			h_n_m = (n == 0) ? h_n : _mm256_loadu_si256((__m256i*) (h_ptr - total_width));
+
+			tmp_n = _mm256_add_epi16(_mm256_add_epi16(h_n, h_n_m), _mm256_set1_epi16(1));
+			dst_n = _mm256_sub_epi16(l_n, _mm256_srai_epi16(tmp_n, 1));
+			_mm256_storeu_si256((__m256i*) dst_ptr, dst_n);
+
+			l_ptr += 16;
+			h_ptr += 16;
+			dst_ptr += 16;
+		}
+		dst_ptr += total_width;
+	}
+
+	h_ptr = h;
+	dst_ptr = dst + total_width;
+
+	/* Odd coefficients */
+	for (n = 0; n < subband_width; n++)
+	{
+		for (x = 0; x < total_width; x += 16)
+		{
+			/* dst[2n + 1] = (h[n] << 1) + ((dst[2n] + dst[2n + 2]) >> 1); */
+
+			h_n = _mm256_loadu_si256((__m256i*) h_ptr);
+			dst_n_m = _mm256_loadu_si256((__m256i*) (dst_ptr - total_width));
+			dst_n_p = (n == subband_width - 1) ? dst_n_m :
+					_mm256_loadu_si256((__m256i*) (dst_ptr + total_width));
+
+			tmp_n = _mm256_srai_epi16(_mm256_add_epi16(dst_n_m, dst_n_p), 1);
+			dst_n = _mm256_add_epi16(tmp_n, _mm256_slli_epi16(h_n, 1));
+			_mm256_storeu_si256((__m256i*) dst_ptr, dst_n);
+
+			h_ptr += 16;
+			dst_ptr += 16;
+		}
+		dst_ptr += total_width;
+	}
+}
+
+static __inline void __attribute__((ATTRIBUTES))
+rfx_dwt_2d_decode_block_avx2(INT16* buffer, INT16* idwt, int subband_width)
+{
+	INT16 *hl, *lh, *hh, *ll;
+	INT16 *l_dst, *h_dst;
+
+	/* Inverse DWT in horizontal direction, results in 2 sub-bands in L, H order in tmp buffer idwt. */
+	/* The 4 sub-bands are stored in HL(0), LH(1), HH(2), LL(3) order. */
+
+	ll = buffer + subband_width * subband_width * 3;
+	hl = buffer;
+	l_dst = idwt;
+
+	lh = buffer + subband_width * subband_width;
+	hh = buffer + subband_width * subband_width * 2;
+	h_dst = idwt + subband_width * subband_width * 2;
+
+	if (subband_width == 8)
+	{
+		rfx_dwt_2d_decode_block_horiz_8_avx2(ll, hl, l_dst);
+		rfx_dwt_2d_decode_block_horiz_8_avx2(lh, hh, h_dst);
+	}
+	else
+	{
+		rfx_dwt_2d_decode_block_horiz_avx2(ll, hl, l_dst, subband_width);
+		rfx_dwt_2d_decode_block_horiz_avx2(lh, hh, h_dst, subband_width);
+	}
+
+	/* Inverse DWT in vertical direction, results are stored in original buffer. */
+	rfx_dwt_2d_decode_block_vert_avx2(l_dst, h_dst, buffer, subband_width);
+}
+
+static void __attribute__((TARGET_AVX2)) rfx_dwt_2d_decode_avx2(INT16* buffer, INT16* dwt_buffer)
+{
+	rfx_dwt_2d_decode_block_avx2(&buffer[3840], dwt_buffer, 8);
+	rfx_dwt_2d_decode_block_avx2(&buffer[3072], dwt_buffer, 16);
+	rfx_dwt_2d_decode_block_avx2(&buffer[0], dwt_buffer, 32);
+}
+
+/**
+ * DWT encode
+ *
+ * Like the SSE2 version, the lifting steps add neighbours in 16 bits. This
+ * matches the generic code as long as these sums fit in an INT16, which is
+ * the case for the << 5 scaled YCbCr input of the encoder but not for any
+ * INT16 input. TestFreeRDPCodecRemoteFX compares both on encoder input.
+ */
+
+static __inline void __attribute__((ATTRIBUTES))
+rfx_dwt_2d_encode_block_vert_avx2(INT16* src, INT16* l, INT16* h, int subband_width)
+{
+	int total_width;
+	int x;
+	int n;
+	__m256i src_2n;
+	__m256i src_2n_1;
+	__m256i src_2n_2;
+	__m256i h_n;
+	__m256i h_n_m;
+	__m256i l_n;
+
+	total_width = subband_width << 1;
+
+	for (n = 0; n < subband_width; n++)
+	{
+		for (x = 0; x < total_width; x += 16)
+		{
+			src_2n = _mm256_loadu_si256((__m256i*) src);
+			src_2n_1 = _mm256_loadu_si256((__m256i*) (src + total_width));
+			src_2n_2 = (n < subband_width - 1) ?
+					_mm256_loadu_si256((__m256i*) (src + 2 * total_width)) : src_2n;
+
+			/* h[n] = (src[2n + 1] - ((src[2n] + src[2n + 2]) >> 1)) >> 1 */
+
+			h_n = _mm256_srai_epi16(_mm256_add_epi16(src_2n, src_2n_2), 1);
+			h_n = _mm256_srai_epi16(_mm256_sub_epi16(src_2n_1, h_n), 1);
+			_mm256_storeu_si256((__m256i*) h, h_n);
+
+			/* l[n] = src[2n] + ((h[n - 1] + h[n]) >> 1) */
+
+			h_n_m = (n == 0) ? h_n : _mm256_loadu_si256((__m256i*) (h - total_width));
+			l_n = _mm256_srai_epi16(_mm256_add_epi16(h_n_m, h_n), 1);
+			l_n = _mm256_add_epi16(l_n, src_2n);
+			_mm256_storeu_si256((__m256i*) l, l_n);
+
+			src += 16;
+			l += 16;
+			h += 16;
+		}
+		src += total_width;
+	}
+}
+
+static __inline void __attribute__((ATTRIBUTES))
+rfx_dwt_2d_encode_block_horiz_8_avx2(INT16* src, INT16* l, INT16* h)
+{
+	int y;
+	__m128i deinterleave;
+	__m128i a;
+	__m128i b;
+	__m128i src_2n;
+	__m128i src_2n_1;
+	__m128i src_2n_2;
+	__m128i h_n;
+	__m128i h_n_m;
+	__m128i l_n;
+
+	/* gather the even words into the low half, the odd ones into the high half */
+	deinterleave = _mm_setr_epi8(0, 1, 4, 5, 8, 9, 12, 13, 2, 3, 6, 7, 10, 11, 14, 15);
+
+	for (y = 0; y < 8; y++)
+	{
+		a = _mm_shuffle_epi8(_mm_load_si128((__m128i*) src), deinterleave);
+		b = _mm_shuffle_epi8(_mm_load_si128((__m128i*) (src + 8)), deinterleave);
+		src_2n = _mm_unpacklo_epi64(a, b);
+		src_2n_1 = _mm_unpackhi_epi64(a, b);
+		src_2n_2 = _mm_insert_epi16(_mm_srli_si128(src_2n, 2), src[14], 7);
+
+		/* h[n] = (src[2n + 1] - ((src[2n] + src[2n + 2]) >> 1)) >> 1 */
+
+		h_n = _mm_srai_epi16(_mm_add_epi16(src_2n, src_2n_2), 1);
+		h_n = _mm_srai_epi16(_mm_sub_epi16(src_2n_1, h_n), 1);
+		_mm_store_si128((__m128i*) h, h_n);
+
+		/* l[n] = src[2n] + ((h[n - 1] + h[n]) >> 1) */
+
+		h_n_m = _mm_insert_epi16(_mm_slli_si128(h_n, 2), _mm_extract_epi16(h_n, 0), 0);
+		l_n = _mm_srai_epi16(_mm_add_epi16(h_n_m, h_n), 1);
+		l_n = _mm_add_epi16(l_n, src_2n);
+		_mm_store_si128((__m128i*) l, l_n);
+
+		src += 16;
+		l += 8;
+		h += 8;
+	}
+}
+
+static __inline void __attribute__((ATTRIBUTES))
+rfx_dwt_2d_encode_block_horiz_avx2(INT16* src, INT16* l, INT16* h, int subband_width)
+{
+	int y;
+	int n;
+	INT16 prev;
+	INT16 next;
+	__m256i deinterleave;
+	__m256i a;
+	__m256i b;
+	__m256i src_2n;
+	__m256i src_2n_1;
+	__m256i src_2n_2;
+	__m256i h_n;
+	__m256i h_n_m;
+	__m256i l_n;
+
+	/**
+	 * The set operations of the SSE2 version are replaced by a shuffle per
+	 * 128-bit lane, gathering the even words of each lane into its low
+	 * quadword and the odd words into its high one, and a quadword permute.
+	 */
+	deinterleave = _mm256_setr_epi8(0, 1, 4, 5, 8, 9, 12, 13, 2, 3, 6, 7, 10, 11, 14, 15,
+			0, 1, 4, 5, 8, 9, 12, 13, 2, 3, 6, 7, 10, 11, 14, 15);
+
+	for (y = 0; y < subband_width; y++)
+	{
+		for (n = 0; n < subband_width; n += 16)
+		{
+			/* a, b: [even | odd] words of src[0..15] and src[16..31] */
+			a = _mm256_shuffle_epi8(_mm256_loadu_si256((__m256i*) src), deinterleave);
+			a = _mm256_permute4x64_epi64(a, 0xD8);
+			b = _mm256_shuffle_epi8(_mm256_loadu_si256((__m256i*) (src + 16)), deinterleave);
+			b = _mm256_permute4x64_epi64(b, 0xD8);
+
+			src_2n = _mm256_permute2x128_si256(a, b, 0x20);
+			src_2n_1 = _mm256_permute2x128_si256(a, b, 0x31);
+			next = (n == subband_width - 16) ? src[30] : src[32];
+			src_2n_2 = _mm256_shift_in_last_epi16(src_2n, next);
+
+			/* h[n] = (src[2n + 1] - ((src[2n] + src[2n + 2]) >> 1)) >> 1 */
+
+			h_n = _mm256_srai_epi16(_mm256_add_epi16(src_2n, src_2n_2), 1);
+			h_n = _mm256_srai_epi16(_mm256_sub_epi16(src_2n_1, h_n), 1);
+			_mm256_storeu_si256((__m256i*) h, h_n);
+
+			/* l[n] = src[2n] + ((h[n - 1] + h[n]) >> 1) */
+
+			prev = (n == 0) ? h[0] : h[-1];
+			h_n_m = _mm256_shift_in_first_epi16(h_n, prev);
+			l_n = _mm256_srai_epi16(_mm256_add_epi16(h_n_m, h_n), 1);
+			l_n = _mm256_add_epi16(l_n, src_2n);
+			_mm256_storeu_si256((__m256i*) l, l_n);
+
+			src += 32;
+			l += 16;
+			h += 16;
+		}
+	}
+}
+
+static __inline void __attribute__((ATTRIBUTES))
+rfx_dwt_2d_encode_block_avx2(INT16* buffer, INT16* dwt, int subband_width)
+{
+	INT16 *hl, *lh, *hh, *ll;
+	INT16 *l_src, *h_src;
+
+	/* DWT in vertical direction, results in 2 sub-bands in L, H order in tmp buffer dwt. */
+
+	l_src = dwt;
+	h_src = dwt + subband_width * subband_width * 2;
+
+	rfx_dwt_2d_encode_block_vert_avx2(buffer, l_src, h_src, subband_width);
+
+	/* DWT in horizontal direction, results in 4 sub-bands in HL(0), LH(1), HH(2), LL(3) order, stored in original buffer. */
+
+	ll = buffer + subband_width * subband_width * 3;
+	hl = buffer;
+
+	lh = buffer + subband_width * subband_width;
+	hh = buffer + subband_width * subband_width * 2;
+
+	if (subband_width == 8)
+	{
+		rfx_dwt_2d_encode_block_horiz_8_avx2(l_src, ll, hl);
+		rfx_dwt_2d_encode_block_horiz_8_avx2(h_src, lh, hh);
+	}
+	else
+	{
+		rfx_dwt_2d_encode_block_horiz_avx2(l_src, ll, hl, subband_width);
+		rfx_dwt_2d_encode_block_horiz_avx2(h_src, lh, hh, subband_width);
+	}
+}
+
+static void __attribute__((TARGET_AVX2)) rfx_dwt_2d_encode_avx2(INT16* buffer, INT16* dwt_buffer)
+{
+	rfx_dwt_2d_encode_block_avx2(buffer, dwt_buffer, 32);
+	rfx_dwt_2d_encode_block_avx2(buffer + 3072, dwt_buffer, 16);
+	rfx_dwt_2d_encode_block_avx2(buffer + 3840, dwt_buffer, 8);
+}
+
+#endif /* WITH_RFX_AVX2 */
+
+void rfx_init_avx2(RFX_CONTEXT* context)
+{
+#ifdef WITH_RFX_AVX2
+	if (!IsProcessorFeaturePresentEx(PF_EX_AVX2))
+		return;
+
+	IF_PROFILER(context->priv->prof_rfx_quantization_decode->name = "rfx_quantization_decode_avx2");
+	IF_PROFILER(context->priv->prof_rfx_quantization_encode->name = "rfx_quantization_encode_avx2");
+	IF_PROFILER(context->priv->prof_rfx_dwt_2d_decode->name = "rfx_dwt_2d_decode_avx2");
+	IF_PROFILER(context->priv->prof_rfx_dwt_2d_encode->name = "rfx_dwt_2d_encode_avx2");
+
+	context->quantization_decode = rfx_quantization_decode_avx2;
+	context->quantization_encode = rfx_quantization_encode_avx2;
+	context->dwt_2d_decode = rfx_dwt_2d_decode_avx2;
+	context->dwt_2d_encode = rfx_dwt_2d_encode_avx2;
+#endif
+}
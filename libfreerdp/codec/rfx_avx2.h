@@ -0,0 +1,36 @@
+/**
+ * FreeRDP: A Remote Desktop Protocol Implementation
+ * RemoteFX Codec Library - AVX2 Optimizations
+ *
+ * Copyright 2026 agent <agent@local>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __RFX_AVX2_H
+#define __RFX_AVX2_H
+
+#include <freerdp/codec/rfx.h>
+
+void rfx_init_avx2(RFX_CONTEXT* context);
+
+/* AVX2 routines replace the SSE2 ones when the CPU supports them */
+#ifdef WITH_SSE2
+ #ifndef RFX_INIT_SIMD
+  #define RFX_INIT_SIMD(_rfx_context) do { \
+	rfx_init_sse2(_rfx_context); \
+	rfx_init_avx2(_rfx_context); } while (0)
+ #endif
+#endif
+
+#endif /* __RFX_AVX2_H */
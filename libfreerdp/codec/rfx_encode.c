@@ -250,15 +250,6 @@ void rfx_encode_rgb(RFX_CONTEXT* context, RFX_TILE* tile)
 			pSrcDst, 64 * sizeof(INT16), &roi_64x64);
 	PROFILER_EXIT(context->priv->prof_rfx_rgb_to_ycbcr);
 
-	/**
-	 * We need to clear the buffers as the RLGR encoder expects it to be initialized to zero.
-	 * This allows simplifying and improving the performance of the encoding process.
-	 */
-
-	ZeroMemory(tile->YData, 4096);
-	ZeroMemory(tile->CbData, 4096);
-	ZeroMemory(tile->CrData, 4096);
-
 	rfx_encode_component(context, YQuant, pSrcDst[0], tile->YData, 4096, &YLen);
 	rfx_encode_component(context, CbQuant, pSrcDst[1], tile->CbData, 4096, &CbLen);
 	rfx_encode_component(context, CrQuant, pSrcDst[2], tile->CrData, 4096, &CrLen);
@@ -32,11 +32,10 @@
 
 #include <winpr/crt.h>
 #include <winpr/print.h>
+#include <winpr/synch.h>
 #include <winpr/sysinfo.h>
 #include <winpr/bitstream.h>
 
-#include "rfx_bitstream.h"
-
 #include "rfx_rlgr.h"
 
 /* Constants used in RLGR1/RLGR3 algorithm */
@@ -47,18 +46,6 @@
 #define UQ_GR	(3)	/* increase in kp after nonzero symbol in GR mode */
 #define DQ_GR	(3)	/* decrease in kp after zero symbol in GR mode */
 
-/* Returns the least number of bits required to represent a given value */
-#define GetMinBits(_val, _nbits) \
-{ \
-	UINT32 _v = _val; \
-	_nbits = 0; \
-	while (_v) \
-	{ \
-		_v >>= 1; \
-		_nbits++; \
-	} \
-}
-
 /*
  * Update the passed parameter and clamp it to the range [0, KPMAX]
  * Return the value of parameter right-shifted by LSGR
@@ -74,6 +61,13 @@
 }
 
 static BOOL g_LZCNT = FALSE;
+static INIT_ONCE g_LZCNTOnce = INIT_ONCE_STATIC_INIT;
+
+static BOOL CALLBACK rfx_rlgr_init_lzcnt(PINIT_ONCE once, PVOID param, PVOID* context)
+{
+	g_LZCNT = IsProcessorFeaturePresentEx(PF_EX_LZCNT);
+	return TRUE;
+}
 
 static INLINE UINT32 lzcnt_s(UINT32 x)
 {
@@ -115,7 +109,8 @@ int rfx_rlgr_decode(const BYTE* pSrcData, UINT32 SrcSize, INT16* pDstData, UINT3
 	wBitStream* bs;
 	wBitStream s_bs;
 
-	g_LZCNT = IsProcessorFeaturePresentEx(PF_EX_LZCNT);
+	/* querying cpuid for every call is expensive, virtualized hosts trap it */
+	InitOnceExecuteOnce(&g_LZCNTOnce, rfx_rlgr_init_lzcnt, NULL, NULL);
 
 	k = 1;
 	kp = k << LSGR;
@@ -289,10 +284,7 @@ int rfx_rlgr_decode(const BYTE* pSrcData, UINT32 SrcSize, INT16* pDstData, UINT3
 
 			/* compute magnitude from code */
 
-			if (sign)
-				mag = ((INT16) (code + 1)) * -1;
-			else
-				mag = (INT16) (code + 1);
+			mag = (INT16) (((code + 1) ^ -((INT32) sign)) + sign);
 
 			/* write to output stream */
 
@@ -527,39 +519,75 @@ int rfx_rlgr_decode(const BYTE* pSrcData, UINT32 SrcSize, INT16* pDstData, UINT3
 	} \
 }
 
-/* Emit bitPattern to the output bitstream */
-#define OutputBits(numBits, bitPattern) rfx_bitstream_put_bits(bs, bitPattern, numBits)
-
-/* Emit a bit (0 or 1), count number of times, to the output bitstream */
-#define OutputBit(count, bit) \
-{	\
-	UINT16 _b = (bit ? 0xFFFF : 0); \
-	int _c = (count); \
-	for (; _c > 0; _c -= 16) \
-		rfx_bitstream_put_bits(bs, _b, (_c > 16 ? 16 : _c)); \
+/**
+ * The encoder writes through a 64-bit accumulator instead of the bit by bit
+ * rfx_bitstream_put_bits loop. Whole bytes are stored, so the output buffer
+ * no longer has to be zeroed by the caller. Bits beyond the end of the buffer
+ * are dropped, as before.
+ */
+
+struct _RLGR_BITWRITER
+{
+	BYTE* pointer;
+	BYTE* end;
+	UINT64 accumulator;
+	int pending;
+};
+typedef struct _RLGR_BITWRITER RLGR_BITWRITER;
+
+static INLINE void rlgr_put_bits(RLGR_BITWRITER* bw, UINT32 bits, int nbits)
+{
+	bw->accumulator = (bw->accumulator << nbits) | (bits & ((1 << nbits) - 1));
+	bw->pending += nbits;
+
+	while (bw->pending >= 8)
+	{
+		bw->pending -= 8;
+
+		if (bw->pointer < bw->end)
+			*bw->pointer++ = (BYTE) (bw->accumulator >> bw->pending);
+	}
+}
+
+static INLINE void rlgr_put_ones(RLGR_BITWRITER* bw, UINT32 count)
+{
+	for (; count > 16; count -= 16)
+		rlgr_put_bits(bw, 0xFFFF, 16);
+
+	rlgr_put_bits(bw, 0xFFFF, count);
+}
+
+static INLINE BYTE* rlgr_flush_bits(RLGR_BITWRITER* bw)
+{
+	if (bw->pending > 0)
+		rlgr_put_bits(bw, 0, 8 - bw->pending);
+
+	return bw->pointer;
 }
 
+/* Emit bitPattern to the output bitstream */
+#define OutputBits(numBits, bitPattern) rlgr_put_bits(bw, bitPattern, numBits)
+
+/* Emit a bit (0 or 1) to the output bitstream */
+#define OutputBit(bit) rlgr_put_bits(bw, bit, 1)
+
 /* Converts the input value to (2 * abs(input) - sign(input)), where sign(input) = (input < 0 ? 1 : 0) and returns it */
 #define Get2MagSign(input) ((input) >= 0 ? 2 * (input) : -2 * (input) - 1)
 
 /* Outputs the Golomb/Rice encoding of a non-negative integer */
-#define CodeGR(krp, val) rfx_rlgr_code_gr(bs, krp, val)
+#define CodeGR(krp, val) rfx_rlgr_code_gr(bw, krp, val)
 
-static void rfx_rlgr_code_gr(RFX_BITSTREAM* bs, int* krp, UINT32 val)
+static INLINE void rfx_rlgr_code_gr(RLGR_BITWRITER* bw, int* krp, UINT32 val)
 {
 	int kr = *krp >> LSGR;
 
 	/* unary part of GR code */
 
 	UINT32 vk = (val) >> kr;
-	OutputBit(vk, 1);
-	OutputBit(1, 0);
+	rlgr_put_ones(bw, vk);
 
-	/* remainder part of GR code, if needed */
-	if (kr)
-	{
-		OutputBits(kr, val & ((1 << kr) - 1));
-	}
+	/* the terminating zero and the remainder part of GR code, if needed */
+	OutputBits(kr + 1, val & ((1 << kr) - 1));
 
 	/* update krp, only if it is not equal to 1 */
 	if (vk == 0)
@@ -577,13 +605,15 @@ int rfx_rlgr_encode(RLGR_MODE mode, const INT16* data, int data_size, BYTE* buff
 	int k;
 	int kp;
 	int krp;
-	RFX_BITSTREAM* bs;
-	int processed_size;
+	RLGR_BITWRITER s_bw;
+	RLGR_BITWRITER* bw = &s_bw;
 
-	if (!(bs = (RFX_BITSTREAM*) calloc(1, sizeof(RFX_BITSTREAM))))
-		return 0;
+	bw->pointer = buffer;
+	bw->end = buffer + buffer_size;
+	bw->accumulator = 0;
+	bw->pending = 0;
 
-	rfx_bitstream_attach(bs, buffer, buffer_size);
+	InitOnceExecuteOnce(&g_LZCNTOnce, rfx_rlgr_init_lzcnt, NULL, NULL);
 
 	/* initialize the parameters */
 	k = 1;
@@ -617,17 +647,14 @@ int rfx_rlgr_encode(RLGR_MODE mode, const INT16* data, int data_size, BYTE* buff
 			runmax = 1 << k;
 			while (numZeros >= runmax)
 			{
-				OutputBit(1, 0); /* output a zero bit */
+				OutputBit(0); /* output a zero bit */
 				numZeros -= runmax;
 				UpdateParam(kp, UP_GR, k); /* update kp, k */
 				runmax = 1 << k;
 			}
 
-			/* output a 1 to terminate runs */
-			OutputBit(1, 1);
-
-			/* output the remaining run length using k bits */
-			OutputBits(k, numZeros);
+			/* output a 1 to terminate runs, then the remaining run length using k bits */
+			OutputBits(k + 1, (1 << k) | numZeros);
 
 			/* note: when we reach here and the last byte being encoded is 0, we still
 			   need to output the last two bits, otherwise mstsc will crash */
@@ -636,7 +663,7 @@ int rfx_rlgr_encode(RLGR_MODE mode, const INT16* data, int data_size, BYTE* buff
 			mag = (input < 0 ? -input : input); /* absolute value of input coefficient */
 			sign = (input < 0 ? 1 : 0);  /* sign of input coefficient */
 
-			OutputBit(1, sign); /* output the sign bit */
+			OutputBit(sign); /* output the sign bit */
 			CodeGR(&krp, mag ? mag - 1 : 0); /* output GR code for (mag - 1) */
 
 			UpdateParam(kp, -DN_GR, k);
@@ -689,7 +716,7 @@ int rfx_rlgr_encode(RLGR_MODE mode, const INT16* data, int data_size, BYTE* buff
 				CodeGR(&krp, sum2Ms);
 
 				/* encode binary representation of the first input (twoMs1). */
-				GetMinBits(sum2Ms, nIdx);
+				nIdx = 32 - lzcnt_s(sum2Ms);
 				OutputBits(nIdx, twoMs1);
 
 				/* update k,kp for the two input values */
@@ -706,8 +733,5 @@ int rfx_rlgr_encode(RLGR_MODE mode, const INT16* data, int data_size, BYTE* buff
 		}
 	}
 
-	processed_size = rfx_bitstream_get_processed_bytes(bs);
-	free(bs);
-
-	return processed_size;
+	return (int) (rlgr_flush_bits(bw) - buffer);
 }
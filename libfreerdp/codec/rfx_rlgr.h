@@ -22,6 +22,4 @@
 
 #include <freerdp/codec/rfx.h>
 
-int rfx_rlgr_encode(RLGR_MODE mode, const INT16* data, int data_size, BYTE* buffer, int buffer_size);
-
 #endif /* __RFX_RLGR_H */
@@ -125,6 +125,109 @@ int test_ClearDecompressExample4()
 	return 1;
 }
 
+static void test_clear_fill_image(BYTE* pData, int nWidth, int nHeight, int pattern)
+{
+	int x, y;
+	UINT32* pixel;
+
+	for (y = 0; y < nHeight; y++)
+	{
+		pixel = (UINT32*) &pData[y * nWidth * 4];
+
+		for (x = 0; x < nWidth; x++)
+		{
+			if (pattern == 0)
+				*pixel = ((x / 8) % 2) ? 0xFF336699 : 0xFFFFFFFF; /* stripes */
+			else if (pattern == 1)
+				*pixel = (((x + y) % 13) == 0) ? 0xFF000000 : 0xFFF0F0F0; /* text-like */
+			else
+				*pixel = 0xFF000000 | ((x * 5) << 16) | ((y * 7) << 8) | ((x * y) & 0xFF); /* gradient */
+
+			pixel++;
+		}
+	}
+}
+
+int test_ClearCompressRoundTrip(int nWidth, int nHeight, int pattern, int frames, BOOL lossless)
+{
+	int index;
+	int status;
+	int x, y;
+	int diff;
+	UINT32 DstSize;
+	BYTE* pSrcData;
+	BYTE* pDstData;
+	BYTE* pEncData = NULL;
+	CLEAR_CONTEXT* encoder;
+	CLEAR_CONTEXT* decoder;
+	int result = -1;
+
+	encoder = clear_context_new(TRUE);
+	decoder = clear_context_new(FALSE);
+	pSrcData = (BYTE*) malloc(nWidth * nHeight * 4);
+	pDstData = (BYTE*) calloc(1, nWidth * nHeight * 4);
+
+	if (!encoder || !decoder || !pSrcData || !pDstData)
+		goto fail;
+
+	test_clear_fill_image(pSrcData, nWidth, nHeight, pattern);
+
+	for (index = 0; index < frames; index++)
+	{
+		status = clear_compress(encoder, pSrcData, PIXEL_FORMAT_XRGB32, nWidth * 4,
+				nWidth, nHeight, &pEncData, &DstSize);
+
+		if (status < 0)
+		{
+			printf("clear_compress failure: %d\n", status);
+			goto fail;
+		}
+
+		ZeroMemory(pDstData, nWidth * nHeight * 4);
+
+		status = clear_decompress(decoder, pEncData, DstSize, &pDstData,
+				PIXEL_FORMAT_XRGB32, nWidth * 4, 0, 0, nWidth, nHeight);
+
+		free(pEncData);
+		pEncData = NULL;
+
+		if (status < 0)
+		{
+			printf("clear_decompress failure: %d (%dx%d pattern %d frame %d)\n",
+					status, nWidth, nHeight, pattern, index);
+			goto fail;
+		}
+
+		for (y = 0; y < nHeight; y++)
+		{
+			for (x = 0; x < nWidth * 4; x++)
+			{
+				if ((x % 4) == 3)
+					continue; /* alpha */
+
+				diff = abs(pSrcData[(y * nWidth * 4) + x] - pDstData[(y * nWidth * 4) + x]);
+
+				if ((lossless && diff) || (diff > 8))
+				{
+					printf("clear round trip mismatch at %d,%d (%dx%d pattern %d frame %d)\n",
+							x / 4, y, nWidth, nHeight, pattern, index);
+					goto fail;
+				}
+			}
+		}
+	}
+
+	result = 1;
+
+fail:
+	free(pSrcData);
+	free(pDstData);
+	clear_context_free(encoder);
+	clear_context_free(decoder);
+
+	return result;
+}
+
 int TestFreeRDPCodecClear(int argc, char* argv[])
 {
 	//test_ClearDecompressExample1();
@@ -135,6 +238,17 @@ int TestFreeRDPCodecClear(int argc, char* argv[])
 
 	test_ClearDecompressExample4();
 
+	if (test_ClearCompressRoundTrip(16, 16, 1, 3, TRUE) < 0) /* glyph hit */
+		return -1;
+
+	if (test_ClearCompressRoundTrip(200, 75, 0, 3, TRUE) < 0)
+		return -1;
+
+	if (test_ClearCompressRoundTrip(131, 97, 1, 2, TRUE) < 0)
+		return -1;
+
+	if (test_ClearCompressRoundTrip(64, 64, 2, 2, FALSE) < 0)
+		return -1;
+
 	return 0;
 }
-
@@ -1005,10 +1005,181 @@ int test_progressive_ms_sample(char* ms_sample_path)
 	return 0;
 }
 
+static int test_progressive_roundtrip_update(PROGRESSIVE_CONTEXT* decoder, BYTE* pSrcData, UINT32 SrcSize,
+		BYTE* pDstData, int nDstStep, int nWidth, int nHeight)
+{
+	int index;
+	int status;
+	int nXDst, nYDst;
+	int nCopyWidth, nCopyHeight;
+	RFX_PROGRESSIVE_TILE* tile;
+	PROGRESSIVE_BLOCK_REGION* region;
+
+	status = progressive_decompress(decoder, pSrcData, SrcSize, &pDstData,
+			PIXEL_FORMAT_XRGB32, nDstStep, 0, 0, nWidth, nHeight, 0);
+
+	if (status < 0)
+		return -1;
+
+	region = &(decoder->region);
+
+	for (index = 0; index < region->numTiles; index++)
+	{
+		tile = region->tiles[index];
+
+		nXDst = tile->x;
+		nYDst = tile->y;
+		nCopyWidth = MIN(64, nWidth - nXDst);
+		nCopyHeight = MIN(64, nHeight - nYDst);
+
+		freerdp_image_copy(pDstData, PIXEL_FORMAT_XRGB32, nDstStep,
+				nXDst, nYDst, nCopyWidth, nCopyHeight, tile->data,
+				PIXEL_FORMAT_XRGB32, 64 * 4, 0, 0, NULL);
+	}
+
+	return 1;
+}
+
+static double test_progressive_roundtrip_error(const BYTE* pSrcData, const BYTE* pDstData, int size)
+{
+	int index;
+	int delta;
+	double sum = 0.0;
+
+	for (index = 0; index < size; index++)
+	{
+		if ((index % 4) == 3)
+			continue; /* alpha */
+
+		delta = pSrcData[index] - pDstData[index];
+		sum += (delta < 0) ? -delta : delta;
+	}
+
+	return sum / ((size / 4) * 3);
+}
+
+static int test_progressive_roundtrip(void)
+{
+	int x, y;
+	int pass;
+	int status;
+	int rc = -1;
+	BYTE* pSrcData = NULL;
+	BYTE* pDstData = NULL;
+	BYTE* pEncData = NULL;
+	UINT32 EncSize = 0;
+	double error;
+	double lastError;
+	RFX_RECT rect;
+	PROGRESSIVE_CONTEXT* encoder = NULL;
+	PROGRESSIVE_CONTEXT* decoder = NULL;
+	const int nWidth = 160;
+	const int nHeight = 96;
+	const int nStep = nWidth * 4;
+
+	pSrcData = (BYTE*) calloc(nHeight, nStep);
+	pDstData = (BYTE*) calloc(nHeight, nStep);
+	encoder = progressive_context_new(TRUE);
+	decoder = progressive_context_new(FALSE);
+
+	if (!pSrcData || !pDstData || !encoder || !decoder)
+		goto fail;
+
+	/* smooth gradients with a few sharp edges */
+
+	for (y = 0; y < nHeight; y++)
+	{
+		for (x = 0; x < nWidth; x++)
+		{
+			BYTE* pixel = &pSrcData[(y * nStep) + (x * 4)];
+
+			pixel[0] = (BYTE) (x + y);
+			pixel[1] = (BYTE) ((y * 255) / nHeight);
+			pixel[2] = ((x / 8) % 2) ? 0xE0 : 0x20;
+			pixel[3] = 0xFF;
+
+			if ((x > 40) && (x < 120) && (y > 30) && (y < 50))
+				pixel[0] = pixel[1] = pixel[2] = 0x00;
+		}
+	}
+
+	if (progressive_create_surface_context(encoder, 0, nWidth, nHeight) < 0)
+		goto fail;
+
+	if (progressive_create_surface_context(decoder, 0, nWidth, nHeight) < 0)
+		goto fail;
+
+	rect.x = 0;
+	rect.y = 0;
+	rect.width = nWidth;
+	rect.height = nHeight;
+
+	status = progressive_compress(encoder, pSrcData, PIXEL_FORMAT_XRGB32, nStep, 0, &rect, 1, &pEncData, &EncSize);
+
+	if (status < 0)
+		goto fail;
+
+	if (test_progressive_roundtrip_update(decoder, pEncData, EncSize, pDstData, nStep, nWidth, nHeight) < 0)
+		goto fail;
+
+	free(pEncData);
+	pEncData = NULL;
+
+	lastError = test_progressive_roundtrip_error(pSrcData, pDstData, nHeight * nStep);
+	printf("ProgressiveCompress: first pass: %d bytes, error %.3f\n", EncSize, lastError);
+
+	for (pass = 0; pass < 8; pass++)
+	{
+		status = progressive_compress_upgrade(encoder, 0, 0, &pEncData, &EncSize);
+
+		if (status < 0)
+			goto fail;
+
+		if (status == 0)
+			break;
+
+		if (test_progressive_roundtrip_update(decoder, pEncData, EncSize, pDstData, nStep, nWidth, nHeight) < 0)
+			goto fail;
+
+		free(pEncData);
+		pEncData = NULL;
+
+		error = test_progressive_roundtrip_error(pSrcData, pDstData, nHeight * nStep);
+		printf("ProgressiveCompress: upgrade %d: %d tiles, %d bytes, error %.3f\n", pass + 1, status, EncSize, error);
+
+		if (error > lastError + 0.01)
+			goto fail;
+
+		lastError = error;
+	}
+
+	/* 3 upgrades reach full quality */
+
+	if ((pass != 3) || (lastError > 3.0))
+		goto fail;
+
+	rc = 0;
+
+fail:
+	if (rc)
+		printf("Progressive RemoteFX round trip failure\n");
+
+	free(pEncData);
+	free(pSrcData);
+	free(pDstData);
+	progressive_context_free(encoder);
+	progressive_context_free(decoder);
+
+	return rc;
+}
+
 int TestFreeRDPCodecProgressive(int argc, char* argv[])
 {
 	char* ms_sample_path;
 
+	if (test_progressive_roundtrip() < 0)
+		return -1;
+
 	ms_sample_path = _strdup("/tmp/EGFX_PROGRESSIVE_MS_SAMPLE");
 
 	if (PathFileExistsA(ms_sample_path))
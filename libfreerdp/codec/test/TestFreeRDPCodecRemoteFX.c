@@ -4,6 +4,8 @@
 #include <freerdp/freerdp.h>
 #include <freerdp/codec/rfx.h>
 
+#include <winpr/sysinfo.h>
+
 /**
  * The following is an annotated dump of a TS_RFX_TILESET message containing a single encoded 64x64 tile.
  *
@@ -756,7 +758,307 @@ const UINT32 TEST_RFX_XRGB_IMAGE[4096] =
 	0x00169ff8, 0x00159ef7, 0x00149df7, 0x00139cf6, 0x00129bf5, 0x00129bf5, 0x00129bf5, 0x00129bf5
 };
 
+static UINT32 test_rfx_rand(UINT32* seed)
+{
+	*seed = (*seed * 1103515245) + 12345;
+	return (*seed >> 16) & 0x7FFF;
+}
+
+/**
+ * Encoder input: YCbCr coefficients scaled by << 5, within [-4096, 4095].
+ * Half of the tiles are noise, the other half smooth gradients with a little
+ * noise, which is closer to screen content.
+ */
+
+static void test_rfx_fill_tile(INT16* tile, int index, UINT32* seed)
+{
+	int x, y;
+	int value;
+
+	for (y = 0; y < 64; y++)
+	{
+		for (x = 0; x < 64; x++)
+		{
+			if (index & 1)
+				value = (int) (test_rfx_rand(seed) & 0x1FFF) - 4096;
+			else
+				value = ((x + y) * 64) - 4096 + (int) (test_rfx_rand(seed) & 0x3F);
+
+			tile[(y * 64) + x] = (INT16) value;
+		}
+	}
+}
+
+/**
+ * Reference transforms, as in rfx_dwt.c and rfx_quantization.c.
+ */
+
+static void test_rfx_dwt_encode_block(INT16* buffer, INT16* dwt, int subband_width)
+{
+	INT16 *src, *l, *h;
+	INT16 *l_src, *h_src;
+	INT16 *hl, *lh, *hh, *ll;
+	int total_width;
+	int x, y;
+	int n;
+
+	total_width = subband_width << 1;
+
+	for (x = 0; x < total_width; x++)
+	{
+		for (n = 0; n < subband_width; n++)
+		{
+			y = n << 1;
+			l = dwt + n * total_width + x;
+			h = l + subband_width * total_width;
+			src = buffer + y * total_width + x;
+
+			*h = (src[total_width] - ((src[0] + src[n < subband_width - 1 ? 2 * total_width : 0]) >> 1)) >> 1;
+			*l = src[0] + (n == 0 ? *h : (*(h - total_width) + *h) >> 1);
+		}
+	}
+
+	ll = buffer + subband_width * subband_width * 3;
+	hl = buffer;
+	l_src = dwt;
+
+	lh = buffer + subband_width * subband_width;
+	hh = buffer + subband_width * subband_width * 2;
+	h_src = dwt + subband_width * subband_width * 2;
+
+	for (y = 0; y < subband_width; y++)
+	{
+		for (n = 0; n < subband_width; n++)
+		{
+			x = n << 1;
+			hl[n] = (l_src[x + 1] - ((l_src[x] + l_src[n < subband_width - 1 ? x + 2 : x]) >> 1)) >> 1;
+			ll[n] = l_src[x] + (n == 0 ? hl[n] : (hl[n - 1] + hl[n]) >> 1);
+		}
+
+		for (n = 0; n < subband_width; n++)
+		{
+			x = n << 1;
+			hh[n] = (h_src[x + 1] - ((h_src[x] + h_src[n < subband_width - 1 ? x + 2 : x]) >> 1)) >> 1;
+			lh[n] = h_src[x] + (n == 0 ? hh[n] : (hh[n - 1] + hh[n]) >> 1);
+		}
+
+		ll += subband_width;
+		hl += subband_width;
+		l_src += total_width;
+
+		lh += subband_width;
+		hh += subband_width;
+		h_src += total_width;
+	}
+}
+
+static void test_rfx_dwt_encode(INT16* buffer, INT16* dwt)
+{
+	test_rfx_dwt_encode_block(&buffer[0], dwt, 32);
+	test_rfx_dwt_encode_block(&buffer[3072], dwt, 16);
+	test_rfx_dwt_encode_block(&buffer[3840], dwt, 8);
+}
+
+static void test_rfx_quantization_encode_block(INT16* buffer, int buffer_size, UINT32 factor)
+{
+	INT16 half;
+
+	if (factor == 0)
+		return;
+
+	half = (1 << (factor - 1));
+
+	for (; buffer_size > 0; buffer++, buffer_size--)
+		*buffer = (*buffer + half) >> factor;
+}
+
+static void test_rfx_quantization_encode(INT16* buffer, const UINT32* quantization_values)
+{
+	test_rfx_quantization_encode_block(buffer, 1024, quantization_values[8] - 6); /* HL1 */
+	test_rfx_quantization_encode_block(buffer + 1024, 1024, quantization_values[7] - 6); /* LH1 */
+	test_rfx_quantization_encode_block(buffer + 2048, 1024, quantization_values[9] - 6); /* HH1 */
+	test_rfx_quantization_encode_block(buffer + 3072, 256, quantization_values[5] - 6); /* HL2 */
+	test_rfx_quantization_encode_block(buffer + 3328, 256, quantization_values[4] - 6); /* LH2 */
+	test_rfx_quantization_encode_block(buffer + 3584, 256, quantization_values[6] - 6); /* HH2 */
+	test_rfx_quantization_encode_block(buffer + 3840, 64, quantization_values[2] - 6); /* HL3 */
+	test_rfx_quantization_encode_block(buffer + 3904, 64, quantization_values[1] - 6); /* LH3 */
+	test_rfx_quantization_encode_block(buffer + 3968, 64, quantization_values[3] - 6); /* HH3 */
+	test_rfx_quantization_encode_block(buffer + 4032, 64, quantization_values[0] - 6); /* LL3 */
+	test_rfx_quantization_encode_block(buffer, 4096, 5);
+}
+
+/**
+ * The context routines (SSE2 or AVX2, depending on the CPU) must give the
+ * same coefficients as the reference code on encoder input. Both SIMD
+ * versions use 16-bit intermediate sums, they are not meant for arbitrary
+ * INT16 input where these sums overflow.
+ */
+
+int test_RemoteFxEncodeTransform()
+{
+	int index;
+	int band;
+	int status = -1;
+	UINT32 seed = 0x5246;
+	UINT32 quants[10];
+	INT16* tile = NULL;
+	INT16* reference = NULL;
+	INT16* dwt = NULL;
+	RFX_CONTEXT* context;
+
+	context = rfx_context_new(TRUE);
+
+	if (!context)
+		return -1;
+
+	tile = (INT16*) _aligned_malloc(4096 * sizeof(INT16), 32);
+	reference = (INT16*) _aligned_malloc(4096 * sizeof(INT16), 32);
+	dwt = (INT16*) _aligned_malloc(4096 * sizeof(INT16), 32);
+
+	if (!tile || !reference || !dwt)
+		goto out;
+
+	for (index = 0; index < 256; index++)
+	{
+		test_rfx_fill_tile(tile, index, &seed);
+		CopyMemory(reference, tile, 4096 * sizeof(INT16));
+
+		context->dwt_2d_encode(tile, dwt);
+		test_rfx_dwt_encode(reference, dwt);
+
+		if (memcmp(tile, reference, 4096 * sizeof(INT16)) != 0)
+		{
+			printf("RemoteFX DWT mismatch on tile %d\n", index);
+			goto out;
+		}
+
+		for (band = 0; band < 10; band++)
+			quants[band] = 6 + (test_rfx_rand(&seed) % 10);
+
+		context->quantization_encode(tile, quants);
+		test_rfx_quantization_encode(reference, quants);
+
+		if (memcmp(tile, reference, 4096 * sizeof(INT16)) != 0)
+		{
+			printf("RemoteFX quantization mismatch on tile %d\n", index);
+			goto out;
+		}
+	}
+
+	printf("RemoteFX transforms match the reference (%s)\n",
+			IsProcessorFeaturePresentEx(PF_EX_AVX2) ? "AVX2" :
+			IsProcessorFeaturePresent(PF_XMMI64_INSTRUCTIONS_AVAILABLE) ? "SSE2" : "generic");
+
+	status = 0;
+
+out:
+	_aligned_free(tile);
+	_aligned_free(reference);
+	_aligned_free(dwt);
+	rfx_context_free(context);
+
+	return status;
+}
+
+/**
+ * Encodes quantized tiles with RLGR1 and RLGR3 and decodes them back.
+ */
+
+int test_RemoteFxRlgrRoundTrip()
+{
+	int index;
+	int band;
+	int mode;
+	int size;
+	int status = -1;
+	UINT32 seed = 0x524C;
+	UINT32 quants[10];
+	BYTE* buffer = NULL;
+	INT16* tile = NULL;
+	INT16* decoded = NULL;
+	INT16* dwt = NULL;
+	RFX_CONTEXT* context;
+
+	context = rfx_context_new(TRUE);
+
+	if (!context)
+		return -1;
+
+	buffer = (BYTE*) malloc(4096 * sizeof(INT16) * 2);
+	tile = (INT16*) _aligned_malloc(4096 * sizeof(INT16), 32);
+	decoded = (INT16*) _aligned_malloc(4096 * sizeof(INT16), 32);
+	dwt = (INT16*) _aligned_malloc(4096 * sizeof(INT16), 32);
+
+	if (!buffer || !tile || !decoded || !dwt)
+		goto out;
+
+	for (index = 0; index < 128; index++)
+	{
+		test_rfx_fill_tile(tile, index, &seed);
+
+		for (band = 0; band < 10; band++)
+			quants[band] = 6 + (test_rfx_rand(&seed) % 10);
+
+		context->dwt_2d_encode(tile, dwt);
+		context->quantization_encode(tile, quants);
+
+		/* every fourth tile is left mostly empty to exercise long zero runs */
+		if ((index % 4) == 3)
+			ZeroMemory(tile, 3072 * sizeof(INT16));
+
+		for (mode = 0; mode < 2; mode++)
+		{
+			size = rfx_rlgr_encode(mode ? RLGR3 : RLGR1, tile, 4096, buffer, 4096 * sizeof(INT16) * 2);
+
+			if (size <= 0)
+			{
+				printf("RLGR%d encode failed on tile %d\n", mode ? 3 : 1, index);
+				goto out;
+			}
+
+			ZeroMemory(decoded, 4096 * sizeof(INT16));
+
+			if (rfx_rlgr_decode(buffer, (UINT32) size, decoded, 4096, mode ? 3 : 1) < 0)
+			{
+				printf("RLGR%d decode failed on tile %d\n", mode ? 3 : 1, index);
+				goto out;
+			}
+
+			/**
+			 * A zero run reaching the end of the tile is terminated with a
+			 * magnitude 1 value (see rfx_rlgr_encode), so a trailing zero
+			 * may come back as 1.
+			 */
+			if ((tile[4095] == 0) && (decoded[4095] == 1))
+				decoded[4095] = 0;
+
+			if (memcmp(tile, decoded, 4096 * sizeof(INT16)) != 0)
+			{
+				printf("RLGR%d round trip mismatch on tile %d\n", mode ? 3 : 1, index);
+				goto out;
+			}
+		}
+	}
+
+	status = 0;
+
+out:
+	free(buffer);
+	_aligned_free(tile);
+	_aligned_free(decoded);
+	_aligned_free(dwt);
+	rfx_context_free(context);
+
+	return status;
+}
+
 int TestFreeRDPCodecRemoteFX(int argc, char* argv[])
 {
+	if (test_RemoteFxEncodeTransform() < 0)
+		return -1;
+
+	if (test_RemoteFxRlgrRoundTrip() < 0)
+		return -1;
+
 	return 0;
 }
@@ -1,5 +1,6 @@
 #include <winpr/crt.h>
 #include <winpr/print.h>
+#include <winpr/sysinfo.h>
 
 #include <freerdp/codec/xcrush.h>
 
@@ -133,6 +134,201 @@ int test_XCrushCompressIsland()
 	return 1;
 }
 
+static UINT32 test_xcrush_rand(UINT32* seed)
+{
+	*seed = (*seed * 1103515245) + 12345;
+	return (*seed >> 16) & 0x7FFF;
+}
+
+/**
+ * Screen-like data: runs of text interleaved with incompressible bytes, so
+ * that packets taken from it find long matches in the history.
+ */
+
+static void test_xcrush_fill(BYTE* data, UINT32 size, UINT32* seed)
+{
+	UINT32 index;
+	const char* text = "the quick brown fox jumps over the lazy dog 0123456789";
+
+	for (index = 0; index < size; index++)
+	{
+		if ((index % 97) < 60)
+			data[index] = (BYTE) text[index % 53];
+		else
+			data[index] = (BYTE) test_xcrush_rand(seed);
+	}
+}
+
+int test_XCrushChunkBoundaries()
+{
+	int status;
+	UINT32 index;
+	UINT32 Flags;
+	UINT32 DstSize;
+	BYTE* pDstData;
+	UINT32 offset = 0;
+	UINT32 count = 0;
+	UINT32 seed = 1;
+	UINT32 accumulator = 0;
+	UINT32 SrcSize = 16000;
+	BYTE* pSrcData;
+	BYTE* OutputBuffer;
+	XCRUSH_CONTEXT* xcrush;
+
+	pSrcData = (BYTE*) malloc(SrcSize);
+	OutputBuffer = (BYTE*) malloc(65536);
+	xcrush = xcrush_context_new(TRUE);
+
+	if (!pSrcData || !OutputBuffer || !xcrush)
+		return -1;
+
+	test_xcrush_fill(pSrcData, SrcSize, &seed);
+
+	pDstData = OutputBuffer;
+	DstSize = 65536;
+	status = xcrush_compress(xcrush, pSrcData, SrcSize, &pDstData, &DstSize, &Flags);
+
+	if (status < 0)
+		return -1;
+
+	/* reference chunking: rolling hash over 32 bytes, boundary when its low 7 bits are zero */
+
+	for (index = 0; index < 32; index++)
+		accumulator = pSrcData[index] ^ _rotl(accumulator, 1);
+
+	for (index = 0; index < ((SrcSize - 64 + 3) & ~3); index++)
+	{
+		accumulator = pSrcData[index + 32] ^ pSrcData[index] ^ _rotl(accumulator, 1);
+
+		if (!(accumulator & 0x7F) && ((index + 32 - offset) >= 15))
+		{
+			if ((count >= xcrush->SignatureIndex) || (xcrush->Signatures[count].size != (index + 32 - offset)))
+			{
+				printf("XCrushChunkBoundaries: chunk %d mismatch\n", count);
+				return -1;
+			}
+
+			offset = index + 32;
+			count++;
+		}
+	}
+
+	if ((offset < SrcSize) && (SrcSize - offset >= 15))
+		count++;
+
+	if (count != xcrush->SignatureIndex)
+	{
+		printf("XCrushChunkBoundaries: chunk count mismatch: Actual: %d, Expected: %d\n",
+				xcrush->SignatureIndex, count);
+		return -1;
+	}
+
+	xcrush_context_free(xcrush);
+	free(OutputBuffer);
+	free(pSrcData);
+	return 1;
+}
+
+int test_XCrushCompressStream()
+{
+	int status;
+	UINT32 index;
+	UINT32 packet;
+	UINT32 Flags;
+	UINT32 SrcSize;
+	UINT32 DstSize;
+	BYTE* pDstData;
+	UINT32 OutSize;
+	BYTE* pOutData;
+	UINT32 seed = 1;
+	UINT64 TotalSrcSize = 0;
+	UINT64 TotalDstSize = 0;
+	UINT64 StartTime;
+	UINT64 EndTime;
+	UINT32 ScreenSize = 1024 * 1024;
+	BYTE* pScreenData;
+	BYTE* pSrcData;
+	BYTE* OutputBuffer;
+	XCRUSH_CONTEXT* encoder;
+	XCRUSH_CONTEXT* decoder;
+
+	pScreenData = (BYTE*) malloc(ScreenSize);
+	pSrcData = (BYTE*) malloc(16384);
+	OutputBuffer = (BYTE*) malloc(65536);
+	encoder = xcrush_context_new(TRUE);
+	decoder = xcrush_context_new(FALSE);
+
+	if (!pScreenData || !pSrcData || !OutputBuffer || !encoder || !decoder)
+		return -1;
+
+	test_xcrush_fill(pScreenData, ScreenSize, &seed);
+
+	StartTime = GetTickCount64();
+
+	for (packet = 0; packet < 1024; packet++)
+	{
+		/* a screen area with a few changed bytes, some packets are noise */
+
+		SrcSize = 1000 + (test_xcrush_rand(&seed) % 15000);
+
+		if ((packet % 64) == 63)
+		{
+			for (index = 0; index < SrcSize; index++)
+				pSrcData[index] = (BYTE) test_xcrush_rand(&seed);
+		}
+		else
+		{
+			CopyMemory(pSrcData, &pScreenData[(test_xcrush_rand(&seed) << 5) % (ScreenSize - 16384)], SrcSize);
+
+			for (index = 0; index < SrcSize / 200; index++)
+				pSrcData[test_xcrush_rand(&seed) % SrcSize] = (BYTE) test_xcrush_rand(&seed);
+		}
+
+		pDstData = OutputBuffer;
+		DstSize = 65536;
+		status = xcrush_compress(encoder, pSrcData, SrcSize, &pDstData, &DstSize, &Flags);
+
+		if (status < 0)
+		{
+			printf("XCrushCompressStream: compression failure: %d\n", status);
+			return -1;
+		}
+
+		TotalSrcSize += SrcSize;
+		TotalDstSize += DstSize;
+
+		if (Flags & PACKET_COMPRESSED)
+		{
+			status = xcrush_decompress(decoder, pDstData, DstSize, &pOutData, &OutSize, Flags);
+		}
+		else
+		{
+			/* the encoder was flushed and sent the packet as is */
+			pOutData = pDstData;
+			OutSize = DstSize;
+		}
+
+		if ((status < 0) || (OutSize != SrcSize) || (memcmp(pOutData, pSrcData, SrcSize) != 0))
+		{
+			printf("XCrushCompressStream: round trip mismatch in packet %d\n", packet);
+			return -1;
+		}
+	}
+
+	EndTime = GetTickCount64();
+
+	printf("XCrushCompressStream: %d -> %d bytes, ratio: %f, %d ms (with decompression)\n",
+			(UINT32) TotalSrcSize, (UINT32) TotalDstSize,
+			(double) TotalSrcSize / (double) TotalDstSize, (UINT32) (EndTime - StartTime));
+
+	xcrush_context_free(encoder);
+	xcrush_context_free(decoder);
+	free(OutputBuffer);
+	free(pSrcData);
+	free(pScreenData);
+	return 1;
+}
+
 int TestFreeRDPCodecXCrush(int argc, char* argv[])
 {
 	//if (test_XCrushCompressBells() < 0)
@@ -140,6 +336,12 @@ int TestFreeRDPCodecXCrush(int argc, char* argv[])
 	if (test_XCrushCompressIsland() < 0)
 		return -1;
 
+	if (test_XCrushChunkBoundaries() < 0)
+		return -1;
+
+	if (test_XCrushCompressStream() < 0)
+		return -1;
+
 	return 0;
 }
 
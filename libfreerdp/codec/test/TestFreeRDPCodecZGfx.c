@@ -3,8 +3,107 @@
 
 #include <freerdp/codec/zgfx.h>
 
+static const char* test_text =
+	"for.whom.the.bell.tolls,.the.bell.tolls.for.thee!\n"
+	"No man is an island, entire of itself; every man is a piece of the continent.";
+
+static BOOL test_ZGfxRoundTrip(ZGFX_CONTEXT* compressor, ZGFX_CONTEXT* decompressor, BYTE* pSrcData, UINT32 SrcSize)
+{
+	int status;
+	UINT32 Flags = 0;
+	UINT32 DstSize = 0;
+	UINT32 OutSize = 0;
+	BYTE* pDstData = NULL;
+	BYTE* pOutData = NULL;
+	BOOL result = FALSE;
+
+	status = zgfx_compress(compressor, pSrcData, SrcSize, &pDstData, &DstSize, &Flags);
+
+	if (status < 0)
+	{
+		printf("zgfx_compress failure: %d\n", status);
+		return FALSE;
+	}
+
+	status = zgfx_decompress(decompressor, pDstData, DstSize, &pOutData, &OutSize, 0);
+
+	if (status < 0)
+	{
+		printf("zgfx_decompress failure: %d\n", status);
+		goto out;
+	}
+
+	if ((OutSize != SrcSize) || (memcmp(pOutData, pSrcData, SrcSize) != 0))
+	{
+		printf("zgfx round trip mismatch: SrcSize: %d OutSize: %d\n", (int) SrcSize, (int) OutSize);
+		goto out;
+	}
+
+	result = TRUE;
+
+out:
+	free(pDstData);
+	free(pOutData);
+	return result;
+}
+
 int TestFreeRDPCodecZGfx(int argc, char* argv[])
 {
+	int pass;
+	UINT32 index;
+	UINT32 level;
+	UINT32 SrcSize;
+	BYTE* pSrcData;
+	UINT32 seed = 0x12345678;
+	ZGFX_CONTEXT* compressor;
+	ZGFX_CONTEXT* decompressor;
+
+	SrcSize = 3 * 65536 + 1000;
+
+	if (!(pSrcData = (BYTE*) malloc(SrcSize)))
+		return -1;
+
+	/* mix of repetitive text, runs and noise to exercise literals, matches and raw segments */
+	for (index = 0; index < SrcSize; index++)
+	{
+		seed = seed * 1103515245 + 12345;
+
+		if ((index / 4096) % 3 == 0)
+			pSrcData[index] = test_text[index % strlen(test_text)];
+		else if ((index / 4096) % 3 == 1)
+			pSrcData[index] = (BYTE) (index / 64);
+		else
+			pSrcData[index] = (BYTE) (seed >> 16);
+	}
+
+	for (level = ZGFX_COMPRESSION_LEVEL_FAST; level <= ZGFX_COMPRESSION_LEVEL_BEST; level++)
+	{
+		compressor = zgfx_context_new(TRUE);
+		decompressor = zgfx_context_new(FALSE);
+
+		if (!compressor || !decompressor)
+			return -1;
+
+		zgfx_set_compression_level(compressor, level);
+
+		/* several PDUs in a row to exercise matches across the shared history */
+		for (pass = 0; pass < 3; pass++)
+		{
+			if (!test_ZGfxRoundTrip(compressor, decompressor, (BYTE*) test_text, strlen(test_text)))
+				return -1;
+
+			if (!test_ZGfxRoundTrip(compressor, decompressor, pSrcData, 1024))
+				return -1;
+
+			if (!test_ZGfxRoundTrip(compressor, decompressor, pSrcData, SrcSize))
+				return -1;
+		}
+
+		zgfx_context_free(compressor);
+		zgfx_context_free(decompressor);
+	}
+
+	free(pSrcData);
+
 	return 0;
 }
-
@@ -71,6 +71,16 @@ static int test_basic() {
 	if (!rects || nbRects != 2 || !compareRectangles(rects, r1_r2, nbRects))
 		goto out;
 
+	/* r2 + r1, r1 lies entirely above the region */
+	region16_clear(&region);
+	if (!region16_union_rect(&region, &region, &r2))
+		goto out;
+	if (!region16_union_rect(&region, &region, &r1))
+		goto out;
+	rects = region16_rects(&region, &nbRects);
+	if (!rects || nbRects != 2 || !compareRectangles(rects, r1_r2, nbRects))
+		goto out;
+
 
 	/* clear region */
 	region16_clear(&region);
@@ -28,8 +28,40 @@
 #include <freerdp/log.h>
 #include <freerdp/codec/xcrush.h>
 
+#ifdef WITH_SSE2
+#include <emmintrin.h>
+#endif
+
 #define TAG FREERDP_TAG("codec")
 
+/**
+ * Matches are extended a block at a time before falling back to single bytes.
+ */
+
+#ifdef WITH_SSE2
+#define XCRUSH_BLOCK_SIZE	16
+
+static INLINE BOOL xcrush_equal_block(const BYTE* a, const BYTE* b)
+{
+	__m128i va = _mm_loadu_si128((const __m128i*) a);
+	__m128i vb = _mm_loadu_si128((const __m128i*) b);
+
+	return (_mm_movemask_epi8(_mm_cmpeq_epi8(va, vb)) == 0xFFFF) ? TRUE : FALSE;
+}
+#else
+#define XCRUSH_BLOCK_SIZE	8
+
+static INLINE BOOL xcrush_equal_block(const BYTE* a, const BYTE* b)
+{
+	UINT64 va, vb;
+
+	CopyMemory(&va, a, sizeof(UINT64));
+	CopyMemory(&vb, b, sizeof(UINT64));
+
+	return (va == vb) ? TRUE : FALSE;
+}
+#endif
+
 const char* xcrush_get_level_2_compression_flags_string(UINT32 flags)
 {
 	flags &= 0xE0;
@@ -141,19 +173,116 @@ int xcrush_append_chunk(XCRUSH_CONTEXT* xcrush, BYTE* data, UINT32* beg, UINT32
 	return 1;
 }
 
-int xcrush_compute_chunks(XCRUSH_CONTEXT* xcrush, BYTE* data, UINT32 size, UINT32* pIndex)
+/**
+ * The rolling hash at position i covers data[i + 1] to data[i + 32], each
+ * byte rotated left by its distance to data[i + 32]. Only the low 7 bits
+ * decide on a chunk boundary, and a byte only reaches them when rotated by
+ * less than 7 or by more than 24 bits, so they only depend on the first and
+ * last 7 bytes of the window. This allows evaluating 16 positions at once
+ * instead of rolling the hash one byte after the other.
+ */
+
+#ifdef WITH_SSE2
+/* data[i + 32 - n] << n and data[i + n] >> n, the 16-bit shifts must not carry across bytes */
+#define XCRUSH_HASH_TAIL_SSE2(_hash, _data, _n) \
+	_hash = _mm_xor_si128(_hash, _mm_and_si128(_mm_slli_epi16( \
+		_mm_loadu_si128((const __m128i*) &(_data)[32 - (_n)]), _n), _mm_set1_epi8((char) (0xFF << (_n)))))
+
+#define XCRUSH_HASH_HEAD_SSE2(_hash, _data, _n) \
+	_hash = _mm_xor_si128(_hash, _mm_and_si128(_mm_srli_epi16( \
+		_mm_loadu_si128((const __m128i*) &(_data)[_n]), _n), _mm_set1_epi8((char) (0xFF >> (_n)))))
+
+static INLINE UINT32 xcrush_chunk_boundary_mask_sse2(const BYTE* data)
+{
+	__m128i hash;
+
+	hash = _mm_loadu_si128((const __m128i*) &data[32]);
+
+	XCRUSH_HASH_TAIL_SSE2(hash, data, 1);
+	XCRUSH_HASH_TAIL_SSE2(hash, data, 2);
+	XCRUSH_HASH_TAIL_SSE2(hash, data, 3);
+	XCRUSH_HASH_TAIL_SSE2(hash, data, 4);
+	XCRUSH_HASH_TAIL_SSE2(hash, data, 5);
+	XCRUSH_HASH_TAIL_SSE2(hash, data, 6);
+
+	XCRUSH_HASH_HEAD_SSE2(hash, data, 1);
+	XCRUSH_HASH_HEAD_SSE2(hash, data, 2);
+	XCRUSH_HASH_HEAD_SSE2(hash, data, 3);
+	XCRUSH_HASH_HEAD_SSE2(hash, data, 4);
+	XCRUSH_HASH_HEAD_SSE2(hash, data, 5);
+	XCRUSH_HASH_HEAD_SSE2(hash, data, 6);
+	XCRUSH_HASH_HEAD_SSE2(hash, data, 7);
+
+	hash = _mm_and_si128(hash, _mm_set1_epi8(0x7F));
+
+	return (UINT32) _mm_movemask_epi8(_mm_cmpeq_epi8(hash, _mm_setzero_si128()));
+}
+
+static INLINE BOOL xcrush_chunk_boundary(const BYTE* data)
+{
+	int shift;
+	UINT32 hash = data[32];
+
+	for (shift = 1; shift < 7; shift++)
+		hash ^= data[32 - shift] << shift;
+
+	for (shift = 1; shift < 8; shift++)
+		hash ^= data[shift] >> shift;
+
+	return (hash & 0x7F) ? FALSE : TRUE;
+}
+
+static int xcrush_compute_chunks_sse2(XCRUSH_CONTEXT* xcrush, BYTE* data, UINT32 size, UINT32* pIndex)
+{
+	UINT32 i;
+	UINT32 bit;
+	UINT32 mask;
+	UINT32 count;
+	UINT32 offset = 0;
+
+	/* the rolling hash was evaluated in groups of four positions */
+	count = (size - 64 + 3) & ~3;
+
+	for (i = 0; i < count; i += 16)
+	{
+		if ((count - i) >= 16)
+		{
+			mask = xcrush_chunk_boundary_mask_sse2(&data[i]);
+		}
+		else
+		{
+			mask = 0;
+
+			for (bit = 0; bit < (count - i); bit++)
+			{
+				if (xcrush_chunk_boundary(&data[i + bit]))
+					mask |= (1 << bit);
+			}
+		}
+
+		for (bit = 0; mask; bit++, mask >>= 1)
+		{
+			if ((mask & 1) && !xcrush_append_chunk(xcrush, data, &offset, i + bit + 32))
+				return 0;
+		}
+	}
+
+	if ((size == offset) || xcrush_append_chunk(xcrush, data, &offset, size))
+	{
+		*pIndex = xcrush->SignatureIndex;
+		return 1;
+	}
+
+	return 0;
+}
+#else
+static int xcrush_compute_chunks_generic(XCRUSH_CONTEXT* xcrush, BYTE* data, UINT32 size, UINT32* pIndex)
 {
 	UINT32 i = 0;
 	UINT32 offset = 0;
 	UINT32 rotation = 0;
 	UINT32 accumulator = 0;
 
-	*pIndex = 0;
-	xcrush->SignatureIndex = 0;
-
-	if (size < 128)
-		return 0;
-
 	for (i = 0; i < 32; i++)
 	{
 		rotation = _rotl(accumulator, 1);
@@ -210,6 +339,22 @@ int xcrush_compute_chunks(XCRUSH_CONTEXT* xcrush, BYTE* data, UINT32 size, UINT3
 
 	return 0;
 }
+#endif
+
+int xcrush_compute_chunks(XCRUSH_CONTEXT* xcrush, BYTE* data, UINT32 size, UINT32* pIndex)
+{
+	*pIndex = 0;
+	xcrush->SignatureIndex = 0;
+
+	if (size < 128)
+		return 0;
+
+#ifdef WITH_SSE2
+	return xcrush_compute_chunks_sse2(xcrush, data, size, pIndex);
+#else
+	return xcrush_compute_chunks_generic(xcrush, data, size, pIndex);
+#endif
+}
 
 UINT32 xcrush_compute_signatures(XCRUSH_CONTEXT* xcrush, BYTE* data, UINT32 size)
 {
@@ -286,11 +431,15 @@ int xcrush_insert_chunk(XCRUSH_CONTEXT* xcrush, XCRUSH_SIGNATURE* signature, UIN
 	{
 		xcrush->ChunkHead = 1;
 		xcrush->ChunkTail = 1;
+		xcrush->ChunkWrapped = TRUE;
 	}
 
 	if (xcrush->ChunkHead >= xcrush->ChunkTail)
 	{
-		xcrush_clear_hash_table_range(xcrush, xcrush->ChunkTail, xcrush->ChunkTail + 10000);
+		/* until the chunk indices wrap around, nothing links beyond ChunkHead */
+		if (xcrush->ChunkWrapped)
+			xcrush_clear_hash_table_range(xcrush, xcrush->ChunkTail, xcrush->ChunkTail + 10000);
+
 		xcrush->ChunkTail += 10000;
 	}
 
@@ -306,6 +455,12 @@ int xcrush_insert_chunk(XCRUSH_CONTEXT* xcrush, XCRUSH_SIGNATURE* signature, UIN
 	if (seed >= 65536)
 		return -3002; /* error */
 
+	if (xcrush->NextChunksEpoch[seed] != xcrush->ChunkEpoch)
+	{
+		xcrush->NextChunksEpoch[seed] = xcrush->ChunkEpoch;
+		xcrush->NextChunks[seed] = 0;
+	}
+
 	if (xcrush->NextChunks[seed])
 	{
 		if (xcrush->NextChunks[seed] >= 65534)
@@ -373,6 +528,14 @@ int xcrush_find_match_length(XCRUSH_CONTEXT* xcrush, UINT32 MatchOffset, UINT32
 		return 0;
 	}
 
+	while (((HistoryBufferEnd - ForwardMatchPtr) >= XCRUSH_BLOCK_SIZE)
+		&& xcrush_equal_block(ForwardMatchPtr, ForwardChunkPtr))
+	{
+		ForwardMatchLength += XCRUSH_BLOCK_SIZE;
+		ForwardMatchPtr += XCRUSH_BLOCK_SIZE;
+		ForwardChunkPtr += XCRUSH_BLOCK_SIZE;
+	}
+
 	while (1)
 	{
 		MatchSymbol = *ForwardMatchPtr++;
@@ -390,6 +553,15 @@ int xcrush_find_match_length(XCRUSH_CONTEXT* xcrush, UINT32 MatchOffset, UINT32
 	ReverseMatchPtr = MatchBuffer - 1;
 	ReverseChunkPtr = ChunkBuffer - 1;
 
+	while (((ReverseMatchPtr - &HistoryBuffer[HistoryOffset]) > XCRUSH_BLOCK_SIZE)
+		&& ((ReverseChunkPtr - HistoryBuffer) > XCRUSH_BLOCK_SIZE)
+		&& xcrush_equal_block(ReverseMatchPtr - (XCRUSH_BLOCK_SIZE - 1), ReverseChunkPtr - (XCRUSH_BLOCK_SIZE - 1)))
+	{
+		ReverseMatchLength += XCRUSH_BLOCK_SIZE;
+		ReverseMatchPtr -= XCRUSH_BLOCK_SIZE;
+		ReverseChunkPtr -= XCRUSH_BLOCK_SIZE;
+	}
+
 	while((ReverseMatchPtr > &HistoryBuffer[HistoryOffset])
 		&& (ReverseChunkPtr > HistoryBuffer)
 		&& (*ReverseMatchPtr == *ReverseChunkPtr))
@@ -1016,11 +1188,20 @@ void xcrush_context_reset(XCRUSH_CONTEXT* xcrush, BOOL flush)
 	xcrush->CompressionFlags = 0;
 
 	xcrush->ChunkHead = xcrush->ChunkTail = 1;
-	ZeroMemory(&(xcrush->Chunks), sizeof(xcrush->Chunks));
-	ZeroMemory(&(xcrush->NextChunks), sizeof(xcrush->NextChunks));
+	xcrush->ChunkWrapped = FALSE;
+
+	/**
+	 * Chunks are only reached through NextChunks, so instead of clearing both
+	 * tables (which happens for every incompressible packet) the hash table
+	 * entries of older epochs are treated as empty.
+	 */
+	xcrush->ChunkEpoch++;
 
-	ZeroMemory(&(xcrush->OriginalMatches), sizeof(xcrush->OriginalMatches));
-	ZeroMemory(&(xcrush->OptimizedMatches), sizeof(xcrush->OptimizedMatches));
+	if (!xcrush->ChunkEpoch)
+	{
+		ZeroMemory(&(xcrush->NextChunksEpoch), sizeof(xcrush->NextChunksEpoch));
+		xcrush->ChunkEpoch = 1;
+	}
 
 	if (flush)
 		xcrush->HistoryOffset = xcrush->HistoryBufferSize + 1;
@@ -23,7 +23,9 @@
 
 #include <winpr/crt.h>
 #include <winpr/print.h>
+#include <winpr/synch.h>
 #include <winpr/bitstream.h>
+#include <winpr/endian.h>
 
 #include <freerdp/codec/zgfx.h>
 
@@ -379,14 +381,439 @@ int zgfx_decompress(ZGFX_CONTEXT* zgfx, BYTE* pSrcData, UINT32 SrcSize, BYTE** p
 	return 1;
 }
 
+#define ZGFX_MATCH_HASH_SIZE		65536
+#define ZGFX_MATCH_HASH(_p) \
+	((((UINT32) (_p)[0] << 8) ^ ((UINT32) (_p)[1] << 4) ^ ((UINT32) (_p)[2])) * 0x9E3779B1 >> 16)
+
+struct _ZGFX_LEVEL
+{
+	UINT32 maxChain;
+	UINT32 niceLength;
+	BOOL lazyMatch;
+	BOOL insertAll;
+};
+typedef struct _ZGFX_LEVEL ZGFX_LEVEL;
+
+static const ZGFX_LEVEL ZGFX_LEVEL_TABLE[] =
+{
+	{   1,   32, FALSE, FALSE }, /* ZGFX_COMPRESSION_LEVEL_FAST */
+	{  16,  256, FALSE, TRUE  }, /* ZGFX_COMPRESSION_LEVEL_DEFAULT */
+	{ 256, 4096, TRUE,  TRUE  }  /* ZGFX_COMPRESSION_LEVEL_BEST */
+};
+
+static BYTE ZGFX_LITERAL_LENGTH[256];
+static UINT16 ZGFX_LITERAL_CODE[256];
+
+static INIT_ONCE g_LiteralsOnce = INIT_ONCE_STATIC_INIT;
+
+static BOOL CALLBACK zgfx_compress_init_literals(PINIT_ONCE once, PVOID param, PVOID* context)
+{
+	int index;
+	const ZGFX_TOKEN* token;
+
+	for (index = 0; index < 256; index++)
+	{
+		/* prefix 0 followed by the 8-bit literal value */
+		ZGFX_LITERAL_CODE[index] = (UINT16) index;
+		ZGFX_LITERAL_LENGTH[index] = 9;
+	}
+
+	for (token = ZGFX_TOKEN_TABLE; token->prefixLength != 0; token++)
+	{
+		if ((token->tokenType == 0) && (token->valueBits == 0))
+		{
+			ZGFX_LITERAL_CODE[token->valueBase] = (UINT16) token->prefixCode;
+			ZGFX_LITERAL_LENGTH[token->valueBase] = (BYTE) token->prefixLength;
+		}
+	}
+
+	return TRUE;
+}
+
+static const ZGFX_TOKEN* zgfx_distance_token(UINT32 distance)
+{
+	const ZGFX_TOKEN* token;
+
+	for (token = ZGFX_TOKEN_TABLE; token->prefixLength != 0; token++)
+	{
+		if (token->tokenType != 1)
+			continue;
+
+		if ((distance >= token->valueBase) && ((distance - token->valueBase) < ((UINT32) 1 << token->valueBits)))
+			return token;
+	}
+
+	return NULL;
+}
+
+static UINT32 zgfx_length_bits(UINT32 count)
+{
+	UINT32 extra = 2;
+
+	if (count == 3)
+		return 1;
+
+	while ((count >> (extra + 1)) != 0)
+		extra++;
+
+	/* leading 1, (extra - 2) continuation ones, terminating 0, then extra bits */
+	return extra + extra;
+}
+
+static UINT32 zgfx_match_cost(UINT32 distance, UINT32 count)
+{
+	const ZGFX_TOKEN* token = zgfx_distance_token(distance);
+
+	if (!token)
+		return 0xFFFFFFFF;
+
+	return token->prefixLength + token->valueBits + zgfx_length_bits(count);
+}
+
+static void zgfx_write_literal(wBitStream* bs, BYTE c)
+{
+	UINT32 bits = ZGFX_LITERAL_CODE[c];
+	UINT32 nbits = ZGFX_LITERAL_LENGTH[c];
+
+	BitStream_Write_Bits(bs, bits, nbits);
+}
+
+static void zgfx_write_match(wBitStream* bs, UINT32 distance, UINT32 count)
+{
+	UINT32 bits;
+	UINT32 extra;
+	UINT32 ones;
+	const ZGFX_TOKEN* token = zgfx_distance_token(distance);
+
+	bits = (UINT32) token->prefixCode;
+	BitStream_Write_Bits(bs, bits, token->prefixLength);
+	bits = distance - token->valueBase;
+	BitStream_Write_Bits(bs, bits, token->valueBits);
+
+	if (count == 3)
+	{
+		BitStream_Write_Bits(bs, 0, 1);
+		return;
+	}
+
+	extra = 2;
+
+	while ((count >> (extra + 1)) != 0)
+		extra++;
+
+	/* 1, then one 1 bit per doubling above 4, then a terminating 0 */
+	BitStream_Write_Bits(bs, 1, 1);
+
+	for (ones = extra - 2; ones > 0; ones--)
+		BitStream_Write_Bits(bs, 1, 1);
+
+	BitStream_Write_Bits(bs, 0, 1);
+	bits = count - ((UINT32) 1 << extra);
+	BitStream_Write_Bits(bs, bits, extra);
+}
+
+static void zgfx_match_insert(ZGFX_CONTEXT* zgfx, BYTE* pSrc, UINT32 position)
+{
+	UINT32 hash = ZGFX_MATCH_HASH(pSrc);
+
+	zgfx->MatchChainTable[position % zgfx->HistoryBufferSize] = zgfx->MatchHashTable[hash];
+	zgfx->MatchHashTable[hash] = position + 1;
+}
+
+/**
+ * Finds the longest match for pSrc in the history ring. The current segment
+ * has already been written to the ring, which makes overlapping matches
+ * (distance < length) resolve exactly like the decoder's ring read does.
+ */
+
+static UINT32 zgfx_match_find(ZGFX_CONTEXT* zgfx, const ZGFX_LEVEL* level, BYTE* pSrc, UINT32 SrcLeft,
+		UINT32 position, UINT32 ringIndex, UINT32 maxDistance, UINT32* pDistance)
+{
+	UINT32 k;
+	UINT32 chain;
+	UINT32 count;
+	UINT32 distance;
+	UINT32 candidate;
+	UINT32 index;
+	UINT32 bestCount = 0;
+	UINT32 lastDistance = 0;
+	const BYTE* history = zgfx->HistoryBuffer;
+	const UINT32 size = zgfx->HistoryBufferSize;
+
+	candidate = zgfx->MatchHashTable[ZGFX_MATCH_HASH(pSrc)];
+
+	for (chain = 0; (chain < level->maxChain) && candidate; chain++)
+	{
+		distance = position - (candidate - 1);
+
+		/* stale chain entries point forward: stop as soon as the distance stops growing */
+		if ((distance <= lastDistance) || (distance > maxDistance))
+			break;
+
+		lastDistance = distance;
+		index = (ringIndex + size - distance) % size;
+
+		if ((bestCount < SrcLeft) && (history[(index + bestCount) % size] == pSrc[bestCount]))
+		{
+			count = 0;
+
+			if ((index + SrcLeft) <= size)
+			{
+				while ((count < SrcLeft) && (history[index + count] == pSrc[count]))
+					count++;
+			}
+			else
+			{
+				for (k = index; (count < SrcLeft) && (history[k] == pSrc[count]); count++)
+				{
+					if (++k == size)
+						k = 0;
+				}
+			}
+
+			if (count > bestCount)
+			{
+				bestCount = count;
+				*pDistance = distance;
+
+				if (count >= level->niceLength)
+					break;
+			}
+		}
+
+		candidate = zgfx->MatchChainTable[(candidate - 1) % size];
+	}
+
+	return (bestCount >= 3) ? bestCount : 0;
+}
+
+static BOOL zgfx_match_worth(UINT32 distance, UINT32 count, BYTE* pSrc)
+{
+	UINT32 index;
+	UINT32 literalCost = 0;
+
+	if (count >= 8)
+		return TRUE;
+
+	for (index = 0; index < count; index++)
+		literalCost += ZGFX_LITERAL_LENGTH[pSrc[index]];
+
+	return (zgfx_match_cost(distance, count) < literalCost);
+}
+
+/**
+ * Compresses a single segment (at most ZGFX_SEGMENTED_MAXSIZE bytes) into
+ * pDstData, which must hold SrcSize + 1 bytes. Falls back to an uncompressed
+ * segment when compression does not shrink the data.
+ */
+
+static int zgfx_compress_segment(ZGFX_CONTEXT* zgfx, BYTE* pSrcData, UINT32 SrcSize, BYTE* pDstData, UINT32* pDstSize)
+{
+	UINT32 count;
+	UINT32 index;
+	UINT32 distance;
+	UINT32 position;
+	UINT32 ringIndex;
+	UINT32 historyFill;
+	UINT32 maxDistance;
+	UINT32 nextCount;
+	UINT32 nextDistance;
+	UINT32 compressedSize;
+	BOOL compressed = TRUE;
+	wBitStream* bs = zgfx->bs;
+	const ZGFX_LEVEL* level = &ZGFX_LEVEL_TABLE[zgfx->CompressionLevel];
+
+	if (SrcSize > ZGFX_SEGMENTED_MAXSIZE)
+		return -1;
+
+	position = zgfx->HistoryPosition;
+	ringIndex = zgfx->HistoryIndex;
+	historyFill = zgfx->HistoryFill;
+	maxDistance = zgfx->HistoryBufferSize - SrcSize;
+
+	zgfx_history_buffer_ring_write(zgfx, pSrcData, SrcSize);
+
+	BitStream_Attach(bs, zgfx->OutputBuffer, sizeof(zgfx->OutputBuffer));
+
+	index = 0;
+
+	while (index < SrcSize)
+	{
+		/* worst case token is 63 bits, stop once the output can no longer win */
+		if (((bs->position / 8) + 8) >= SrcSize)
+		{
+			compressed = FALSE;
+			break;
+		}
+
+		count = 0;
+
+		if ((index + 3) <= SrcSize)
+		{
+			count = zgfx_match_find(zgfx, level, &pSrcData[index], SrcSize - index, position + index,
+					(ringIndex + index) % zgfx->HistoryBufferSize, MIN(maxDistance, historyFill + index), &distance);
+
+			if (count && !zgfx_match_worth(distance, count, &pSrcData[index]))
+				count = 0;
+
+			zgfx_match_insert(zgfx, &pSrcData[index], position + index);
+
+			/* lazy evaluation: defer to a literal if the next position matches longer */
+			if (count && level->lazyMatch && (count < level->niceLength) && ((index + 4) <= SrcSize))
+			{
+				nextCount = zgfx_match_find(zgfx, level, &pSrcData[index + 1], SrcSize - index - 1, position + index + 1,
+						(ringIndex + index + 1) % zgfx->HistoryBufferSize, MIN(maxDistance, historyFill + index + 1), &nextDistance);
+
+				if (nextCount > (count + 1))
+					count = 0;
+			}
+		}
+
+		if (!count)
+		{
+			zgfx_write_literal(bs, pSrcData[index]);
+			index++;
+			continue;
+		}
+
+		zgfx_write_match(bs, distance, count);
+
+		if (level->insertAll)
+		{
+			for (count--, index++; count > 0; count--, index++)
+			{
+				if ((index + 3) <= SrcSize)
+					zgfx_match_insert(zgfx, &pSrcData[index], position + index);
+			}
+		}
+		else
+		{
+			index += count;
+		}
+	}
+
+	if (compressed)
+	{
+		BitStream_Flush(bs);
+		compressedSize = (bs->position + 7) / 8;
+
+		if ((compressedSize + 1) >= SrcSize)
+			compressed = FALSE;
+	}
+
+	if (compressed)
+	{
+		pDstData[0] = ZGFX_PACKET_COMPR_TYPE_RDP8 | PACKET_COMPRESSED;
+		CopyMemory(&pDstData[1], zgfx->OutputBuffer, compressedSize);
+		/* the last byte holds the number of unused bits in the preceding byte */
+		pDstData[compressedSize + 1] = (BYTE) ((compressedSize * 8) - bs->position);
+		*pDstSize = compressedSize + 2;
+	}
+	else
+	{
+		pDstData[0] = ZGFX_PACKET_COMPR_TYPE_RDP8;
+		CopyMemory(&pDstData[1], pSrcData, SrcSize);
+		*pDstSize = SrcSize + 1;
+	}
+
+	zgfx->HistoryPosition += SrcSize;
+	zgfx->HistoryFill = MIN(zgfx->HistoryFill + SrcSize, zgfx->HistoryBufferSize);
+
+	return 1;
+}
+
+/**
+ * Produces an RDP_SEGMENTED_DATA structure in a newly allocated buffer,
+ * returned through ppDstData and owned by the caller (as in zgfx_decompress).
+ */
+
 int zgfx_compress(ZGFX_CONTEXT* zgfx, BYTE* pSrcData, UINT32 SrcSize, BYTE** ppDstData, UINT32* pDstSize, UINT32* pFlags)
 {
+	int status;
+	BYTE* pDstData;
+	UINT32 DstSize;
+	UINT32 segmentSize;
+	UINT32 segmentCount;
+	UINT32 segmentNumber;
+	UINT32 segmentOffset;
+	UINT32 uncompressedSize;
+
+	if (!zgfx->Compressor || !zgfx->MatchHashTable)
+		return -1;
+
+	*pFlags = 0;
+	segmentCount = (SrcSize + ZGFX_SEGMENTED_MAXSIZE - 1) / ZGFX_SEGMENTED_MAXSIZE;
+
+	if (segmentCount > 0xFFFF)
+		return -1;
+
+	if (SrcSize <= ZGFX_SEGMENTED_MAXSIZE)
+	{
+		if (!(pDstData = (BYTE*) malloc(SrcSize + 2)))
+			return -1;
+
+		pDstData[0] = ZGFX_SEGMENTED_SINGLE; /* descriptor (1 byte) */
+
+		if ((status = zgfx_compress_segment(zgfx, pSrcData, SrcSize, &pDstData[1], &DstSize)) < 0)
+		{
+			free(pDstData);
+			return status;
+		}
+
+		DstSize += 1;
+	}
+	else
+	{
+		if (!(pDstData = (BYTE*) malloc(7 + segmentCount * (4 + ZGFX_SEGMENTED_MAXSIZE + 1))))
+			return -1;
+
+		pDstData[0] = ZGFX_SEGMENTED_MULTIPART; /* descriptor (1 byte) */
+		Data_Write_UINT16(&pDstData[1], segmentCount); /* segmentCount (2 bytes) */
+		Data_Write_UINT32(&pDstData[3], SrcSize); /* uncompressedSize (4 bytes) */
+
+		DstSize = 7;
+		segmentOffset = 0;
+
+		for (segmentNumber = 0; segmentNumber < segmentCount; segmentNumber++)
+		{
+			uncompressedSize = MIN(SrcSize - segmentOffset, ZGFX_SEGMENTED_MAXSIZE);
+
+			if ((status = zgfx_compress_segment(zgfx, &pSrcData[segmentOffset], uncompressedSize,
+					&pDstData[DstSize + 4], &segmentSize)) < 0)
+			{
+				free(pDstData);
+				return status;
+			}
+
+			Data_Write_UINT32(&pDstData[DstSize], segmentSize); /* segmentSize (4 bytes) */
+
+			DstSize += 4 + segmentSize;
+			segmentOffset += uncompressedSize;
+		}
+	}
+
+	*pFlags |= PACKET_COMPRESSED;
+	*ppDstData = pDstData;
+	*pDstSize = DstSize;
+
 	return 1;
 }
 
+void zgfx_set_compression_level(ZGFX_CONTEXT* zgfx, DWORD CompressionLevel)
+{
+	if (CompressionLevel > ZGFX_COMPRESSION_LEVEL_BEST)
+		CompressionLevel = ZGFX_COMPRESSION_LEVEL_BEST;
+
+	zgfx->CompressionLevel = CompressionLevel;
+}
+
 void zgfx_context_reset(ZGFX_CONTEXT* zgfx, BOOL flush)
 {
 	zgfx->HistoryIndex = 0;
+	zgfx->HistoryFill = 0;
+
+	if (zgfx->MatchHashTable)
+		ZeroMemory(zgfx->MatchHashTable, ZGFX_MATCH_HASH_SIZE * sizeof(UINT32));
 }
 
 ZGFX_CONTEXT* zgfx_context_new(BOOL Compressor)
@@ -401,6 +828,22 @@ ZGFX_CONTEXT* zgfx_context_new(BOOL Compressor)
 
 		zgfx->HistoryBufferSize = sizeof(zgfx->HistoryBuffer);
 
+		if (Compressor)
+		{
+			InitOnceExecuteOnce(&g_LiteralsOnce, zgfx_compress_init_literals, NULL, NULL);
+
+			zgfx->CompressionLevel = ZGFX_COMPRESSION_LEVEL_DEFAULT;
+			zgfx->bs = BitStream_New();
+			zgfx->MatchHashTable = (UINT32*) calloc(ZGFX_MATCH_HASH_SIZE, sizeof(UINT32));
+			zgfx->MatchChainTable = (UINT32*) calloc(zgfx->HistoryBufferSize, sizeof(UINT32));
+
+			if (!zgfx->bs || !zgfx->MatchHashTable || !zgfx->MatchChainTable)
+			{
+				zgfx_context_free(zgfx);
+				return NULL;
+			}
+		}
+
 		zgfx_context_reset(zgfx, FALSE);
 	}
 
@@ -409,6 +852,12 @@ ZGFX_CONTEXT* zgfx_context_new(BOOL Compressor)
 
 void zgfx_context_free(ZGFX_CONTEXT* zgfx)
 {
-	free(zgfx);
-}
+	if (zgfx)
+	{
+		BitStream_Free(zgfx->bs);
+		free(zgfx->MatchHashTable);
+		free(zgfx->MatchChainTable);
 
+		free(zgfx);
+	}
+}
@@ -191,8 +191,10 @@ int bulk_compress(rdpBulk* bulk, BYTE* pSrcData, UINT32 SrcSize, BYTE** ppDstDat
 		return 0;
 	}
 
-	*ppDstData = bulk->OutputBuffer;
-	*pDstSize = sizeof(bulk->OutputBuffer);
+	/* alternate buffers, the previous output may still be in flight */
+	bulk->OutputIndex = !bulk->OutputIndex;
+	*ppDstData = bulk->OutputBuffer[bulk->OutputIndex];
+	*pDstSize = sizeof(bulk->OutputBuffer[0]);
 	bulk_compression_level(bulk);
 	bulk_compression_max_size(bulk);
 
@@ -240,6 +242,62 @@ int bulk_compress(rdpBulk* bulk, BYTE* pSrcData, UINT32 SrcSize, BYTE** ppDstDat
 	return status;
 }
 
+static void CALLBACK bulk_compress_work_callback(PTP_CALLBACK_INSTANCE instance, void* context, PTP_WORK work)
+{
+	rdpBulk* bulk = (rdpBulk*) context;
+	rdpBulkJob* job = &bulk->CompressJob;
+
+	job->Flags = 0;
+	job->status = bulk_compress(bulk, job->pSrcData, job->SrcSize, &job->pDstData, &job->DstSize, &job->Flags);
+}
+
+/**
+ * Starts compressing the next fragment in the background. The source data
+ * must stay untouched until bulk_compress_end(), and the output of the last
+ * bulk_compress() or bulk_compress_end() call stays valid meanwhile.
+ */
+
+BOOL bulk_compress_begin(rdpBulk* bulk, BYTE* pSrcData, UINT32 SrcSize)
+{
+	rdpBulkJob* job = &bulk->CompressJob;
+
+	if (job->pending)
+		return FALSE;
+
+	job->pSrcData = pSrcData;
+	job->SrcSize = SrcSize;
+	job->pending = TRUE;
+
+	if (!bulk->CompressWork)
+		bulk->CompressWork = CreateThreadpoolWork(bulk_compress_work_callback, (void*) bulk, NULL);
+
+	if (bulk->CompressWork)
+		SubmitThreadpoolWork(bulk->CompressWork);
+	else
+		bulk_compress_work_callback(NULL, (void*) bulk, NULL);
+
+	return TRUE;
+}
+
+int bulk_compress_end(rdpBulk* bulk, BYTE** ppDstData, UINT32* pDstSize, UINT32* pFlags)
+{
+	rdpBulkJob* job = &bulk->CompressJob;
+
+	if (!job->pending)
+		return -1;
+
+	if (bulk->CompressWork)
+		WaitForThreadpoolWorkCallbacks(bulk->CompressWork, FALSE);
+
+	job->pending = FALSE;
+
+	*ppDstData = job->pDstData;
+	*pDstSize = job->DstSize;
+	*pFlags = job->Flags;
+
+	return job->status;
+}
+
 void bulk_reset(rdpBulk* bulk)
 {
 	mppc_context_reset(bulk->mppcSend, FALSE);
@@ -275,6 +333,12 @@ void bulk_free(rdpBulk* bulk)
 	if (!bulk)
 		return;
 
+	if (bulk->CompressWork)
+	{
+		WaitForThreadpoolWorkCallbacks(bulk->CompressWork, FALSE);
+		CloseThreadpoolWork(bulk->CompressWork);
+	}
+
 	mppc_context_free(bulk->mppcSend);
 	mppc_context_free(bulk->mppcRecv);
 	ncrush_context_free(bulk->ncrushRecv);
@@ -28,6 +28,28 @@ typedef struct rdp_bulk rdpBulk;
 #include <freerdp/codec/ncrush.h>
 #include <freerdp/codec/xcrush.h>
 
+#include <winpr/pool.h>
+
+/**
+ * Compression runs on the send path, one fragment at a time since every
+ * fragment extends the shared history. bulk_compress_begin() hands the
+ * next fragment to a pool thread so that it is compressed while the caller
+ * encrypts and writes the previous one; outputs alternate between two
+ * buffers so that the previous result stays valid meanwhile.
+ */
+
+struct rdp_bulk_job
+{
+	BYTE* pSrcData;
+	UINT32 SrcSize;
+	BYTE* pDstData;
+	UINT32 DstSize;
+	UINT32 Flags;
+	int status;
+	BOOL pending;
+};
+typedef struct rdp_bulk_job rdpBulkJob;
+
 struct rdp_bulk
 {
 	rdpContext* context;
@@ -39,7 +61,10 @@ struct rdp_bulk
 	NCRUSH_CONTEXT* ncrushSend;
 	XCRUSH_CONTEXT* xcrushRecv;
 	XCRUSH_CONTEXT* xcrushSend;
-	BYTE OutputBuffer[65536];
+	int OutputIndex;
+	BYTE OutputBuffer[2][65536];
+	PTP_WORK CompressWork;
+	rdpBulkJob CompressJob;
 };
 
 #define BULK_COMPRESSION_FLAGS_MASK	0xE0
@@ -51,6 +76,9 @@ UINT32 bulk_compression_max_size(rdpBulk* bulk);
 int bulk_decompress(rdpBulk* bulk, BYTE* pSrcData, UINT32 SrcSize, BYTE** ppDstData, UINT32* pDstSize, UINT32 flags);
 int bulk_compress(rdpBulk* bulk, BYTE* pSrcData, UINT32 SrcSize, BYTE** ppDstData, UINT32* pDstSize, UINT32* pFlags);
 
+BOOL bulk_compress_begin(rdpBulk* bulk, BYTE* pSrcData, UINT32 SrcSize);
+int bulk_compress_end(rdpBulk* bulk, BYTE** ppDstData, UINT32* pDstSize, UINT32* pFlags);
+
 void bulk_reset(rdpBulk* bulk);
 
 rdpBulk* bulk_new(rdpContext* context);
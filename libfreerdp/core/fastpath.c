@@ -407,7 +407,9 @@ static int fastpath_recv_update_data(rdpFastPath* fastpath, wStream* s)
 		}
 
 		totalSize = size;
+		rdp->update->pdu = cs;
 		status = fastpath_recv_update(fastpath, updateCode, totalSize, cs);
+		rdp->update->pdu = NULL;
 
 		if (status < 0)
 			goto out_fail;
@@ -499,7 +501,9 @@ static int fastpath_recv_update_data(rdpFastPath* fastpath, wStream* s)
 			Stream_SealLength(fastpath->updateData);
 			Stream_SetPosition(fastpath->updateData, 0);
 
+			rdp->update->pdu = fastpath->updateData;
 			status = fastpath_recv_update(fastpath, updateCode, totalSize, fastpath->updateData);
+			rdp->update->pdu = NULL;
 
 			Stream_Release(fastpath->updateData);
 
@@ -904,6 +908,7 @@ BOOL fastpath_send_update_pdu(rdpFastPath* fastpath, BYTE updateCode, wStream* s
 	UINT32 fpUpdatePduHeaderSize;
 	UINT32 fpUpdateHeaderSize;
 	UINT32 CompressionMaxSize;
+	BOOL compress = FALSE;
 	FASTPATH_UPDATE_PDU_HEADER fpUpdatePduHeader = { 0 };
 	FASTPATH_UPDATE_HEADER fpUpdateHeader = { 0 };
 
@@ -914,6 +919,7 @@ BOOL fastpath_send_update_pdu(rdpFastPath* fastpath, BYTE updateCode, wStream* s
 
 	if (settings->CompressionEnabled && !skipCompression)
 	{
+		compress = TRUE;
 		CompressionMaxSize = bulk_compression_max_size(rdp->bulk);
 		maxLength = (maxLength < CompressionMaxSize) ? maxLength : CompressionMaxSize;
 		maxLength -= 20;
@@ -954,6 +960,7 @@ BOOL fastpath_send_update_pdu(rdpFastPath* fastpath, BYTE updateCode, wStream* s
 		UINT32 compressionFlags = 0;
 		BYTE pad = 0;
 		BYTE* pSignature = NULL;
+		DataChunk chunks[2];
 
 		fpUpdatePduHeader.action = 0;
 		fpUpdatePduHeader.secFlags = 0;
@@ -971,16 +978,26 @@ BOOL fastpath_send_update_pdu(rdpFastPath* fastpath, BYTE updateCode, wStream* s
 		if (rdp->sec_flags & SEC_SECURE_CHECKSUM)
 			fpUpdatePduHeader.secFlags |= FASTPATH_OUTPUT_SECURE_CHECKSUM;
 
-		if (settings->CompressionEnabled && !skipCompression)
+		if (compress)
 		{
-			if (bulk_compress(rdp->bulk, pSrcData, SrcSize, &pDstData, &DstSize, &compressionFlags) >= 0)
+			int compressStatus;
+			UINT32 nextSize = totalLength - SrcSize;
+
+			/* the first fragment was not started in the background */
+			if (fragment == 0)
+				compressStatus = bulk_compress(rdp->bulk, pSrcData, SrcSize, &pDstData, &DstSize, &compressionFlags);
+			else
+				compressStatus = bulk_compress_end(rdp->bulk, &pDstData, &DstSize, &compressionFlags);
+
+			if ((compressStatus >= 0) && compressionFlags)
 			{
-				if (compressionFlags)
-				{
-					fpUpdateHeader.compressionFlags = compressionFlags;
-					fpUpdateHeader.compression = FASTPATH_OUTPUT_COMPRESSION_USED;
-				}
+				fpUpdateHeader.compressionFlags = compressionFlags;
+				fpUpdateHeader.compression = FASTPATH_OUTPUT_COMPRESSION_USED;
 			}
+
+			/* compress the next fragment while this one is encrypted and written */
+			if (nextSize > 0)
+				bulk_compress_begin(rdp->bulk, &pSrcData[SrcSize], (nextSize > maxLength) ? maxLength : nextSize);
 		}
 
 		if (!fpUpdateHeader.compression)
@@ -1024,6 +1041,26 @@ BOOL fastpath_send_update_pdu(rdpFastPath* fastpath, BYTE updateCode, wStream* s
 		Stream_SetPosition(fs, 0);
 		fastpath_write_update_pdu_header(fs, &fpUpdatePduHeader, rdp);
 		fastpath_write_update_header(fs, &fpUpdateHeader);
+
+		if (!(rdp->sec_flags & SEC_ENCRYPT))
+		{
+			/* the payload is sent from where it is, only the headers are written to fs */
+
+			chunks[0].data = Stream_Buffer(fs);
+			chunks[0].size = Stream_GetPosition(fs);
+			chunks[1].data = pDstData;
+			chunks[1].size = DstSize;
+
+			if (transport_write_vector(rdp->transport, chunks, 2) < 0)
+			{
+				status = FALSE;
+				break;
+			}
+
+			Stream_Seek(s, SrcSize);
+			continue;
+		}
+
 		Stream_Write(fs, pDstData, DstSize);
 
 		if (pad)
@@ -1037,7 +1074,11 @@ BOOL fastpath_send_update_pdu(rdpFastPath* fastpath, BYTE updateCode, wStream* s
 			if (rdp->settings->EncryptionMethods == ENCRYPTION_METHOD_FIPS)
 			{
 				if (!security_hmac_signature(data, dataSize - pad, pSignature, rdp))
-					return FALSE;
+				{
+					status = FALSE;
+					break;
+				}
+
 				security_fips_encrypt(data, dataSize, rdp);
 			}
 			else
@@ -1048,7 +1089,10 @@ BOOL fastpath_send_update_pdu(rdpFastPath* fastpath, BYTE updateCode, wStream* s
 					status = security_mac_signature(rdp, data, dataSize, pSignature);
 
 				if (!status || !security_encrypt(data, dataSize, rdp))
-					return FALSE;
+				{
+					status = FALSE;
+					break;
+				}
 			}
 		}
 
@@ -1063,6 +1107,16 @@ BOOL fastpath_send_update_pdu(rdpFastPath* fastpath, BYTE updateCode, wStream* s
 		Stream_Seek(s, SrcSize);
 	}
 
+	if (compress && rdp->bulk->CompressJob.pending)
+	{
+		BYTE* pDstData;
+		UINT32 DstSize;
+		UINT32 compressionFlags;
+
+		/* a write failed while the next fragment was being compressed */
+		bulk_compress_end(rdp->bulk, &pDstData, &DstSize, &compressionFlags);
+	}
+
 	rdp->sec_flags = 0;
 
 	return status;
@@ -35,22 +35,396 @@
 #include <winpr/collections.h>
 
 #define TAG FREERDP_TAG("core.message")
-#define WITH_STREAM_POOL	1
+
+/**
+ * Bitmap data of queued updates is not copied when it lies within the
+ * received PDU (update->pdu): the message holds a reference on the PDU
+ * stream in lParam instead, and releases it once the update was processed.
+ */
+
+static BOOL update_message_in_pdu(wStream* pdu, const BYTE* data, UINT32 length)
+{
+	if (!pdu || !pdu->pool || !data)
+		return FALSE;
+
+	if ((data < Stream_Buffer(pdu)) || ((data + length) > (Stream_Buffer(pdu) + Stream_Capacity(pdu))))
+		return FALSE;
+
+	return TRUE;
+}
+
+static wStream* update_message_ref_pdu(rdpContext* context, const BYTE* data, UINT32 length)
+{
+	wStream* pdu = context->update->pdu;
+
+	if (!update_message_in_pdu(pdu, data, length))
+		return NULL;
+
+	Stream_AddRef(pdu);
+
+	return pdu;
+}
+
+/**
+ * Queued updates are batched per received PDU: everything posted between
+ * BeginPaint and EndPaint by the receiving thread goes to proxy->batch and
+ * reaches the queue as one Update_Batch message. Updates made obsolete by a
+ * later one of the same batch are dropped while appending.
+ */
+
+static int update_message_free_class(wMessage* msg, int msgClass, int msgType);
+static int update_message_process_class(rdpUpdateProxy* proxy, wMessage* msg, int msgClass, int msgType);
+
+static UPDATE_MESSAGE_ARENA_BLOCK* update_message_arena_block_new(size_t size)
+{
+	UPDATE_MESSAGE_ARENA_BLOCK* block;
+
+	block = (UPDATE_MESSAGE_ARENA_BLOCK*) malloc(sizeof(UPDATE_MESSAGE_ARENA_BLOCK) + size);
+
+	if (!block)
+		return NULL;
+
+	block->next = NULL;
+	block->size = size;
+	block->used = 0;
+	block->data = (BYTE*) &block[1];
+
+	return block;
+}
+
+static UPDATE_MESSAGE_BATCH* update_message_batch_new(void)
+{
+	UPDATE_MESSAGE_BATCH* batch;
+
+	batch = (UPDATE_MESSAGE_BATCH*) calloc(1, sizeof(UPDATE_MESSAGE_BATCH));
+
+	if (!batch)
+		return NULL;
+
+	batch->blocks = update_message_arena_block_new(UPDATE_MESSAGE_ARENA_BLOCK_SIZE);
+
+	if (!batch->blocks)
+	{
+		free(batch);
+		return NULL;
+	}
+
+	return batch;
+}
+
+static void* update_message_batch_alloc(UPDATE_MESSAGE_BATCH* batch, size_t size)
+{
+	BYTE* ptr;
+	UPDATE_MESSAGE_ARENA_BLOCK* block = batch->blocks;
+
+	size = (size + 7) & ~((size_t) 7);
+
+	if ((block->size - block->used) < size)
+	{
+		block = update_message_arena_block_new((size > UPDATE_MESSAGE_ARENA_BLOCK_SIZE) ?
+				size : UPDATE_MESSAGE_ARENA_BLOCK_SIZE);
+
+		if (!block)
+			return NULL;
+
+		block->next = batch->blocks;
+		batch->blocks = block;
+	}
+
+	ptr = &block->data[block->used];
+	block->used += size;
+
+	return ptr;
+}
+
+static BOOL update_message_batch_owns(UPDATE_MESSAGE_BATCH* batch, const void* ptr)
+{
+	UPDATE_MESSAGE_ARENA_BLOCK* block;
+
+	for (block = batch->blocks; block; block = block->next)
+	{
+		if (((const BYTE*) ptr >= block->data) && ((const BYTE*) ptr < &block->data[block->used]))
+			return TRUE;
+	}
+
+	return FALSE;
+}
+
+static void update_message_batch_free_message(UPDATE_MESSAGE_BATCH* batch, wMessage* msg)
+{
+	/* arena parameters are flat and released with the arena */
+	if (update_message_batch_owns(batch, msg->wParam))
+		return;
+
+	update_message_free_class(msg, GetMessageClass(msg->id), GetMessageType(msg->id));
+}
+
+static void update_message_batch_reset(UPDATE_MESSAGE_BATCH* batch)
+{
+	UPDATE_MESSAGE_ARENA_BLOCK* block;
+
+	/* keep the first block, later ones only served a burst */
+	while (batch->blocks->next)
+	{
+		block = batch->blocks;
+		batch->blocks = block->next;
+		free(block);
+	}
+
+	batch->blocks->used = 0;
+	batch->count = 0;
+}
+
+static void update_message_batch_free(UPDATE_MESSAGE_BATCH* batch)
+{
+	UINT32 index;
+	UPDATE_MESSAGE_ARENA_BLOCK* block;
+
+	if (!batch)
+		return;
+
+	for (index = 0; index < batch->count; index++)
+	{
+		if (batch->messages[index].id)
+			update_message_batch_free_message(batch, &batch->messages[index]);
+	}
+
+	while (batch->blocks)
+	{
+		block = batch->blocks;
+		batch->blocks = block->next;
+		free(block);
+	}
+
+	free(batch->messages);
+	free(batch);
+}
+
+static void update_message_batch_drop(UPDATE_MESSAGE_BATCH* batch, wMessage* msg)
+{
+	update_message_batch_free_message(batch, msg);
+	msg->id = 0;
+}
+
+static BOOL update_message_is_pointer_set(UINT32 id)
+{
+	return (id == MakeMessageId(PointerUpdate, PointerSystem)) ||
+		(id == MakeMessageId(PointerUpdate, PointerCached)) ||
+		(id == MakeMessageId(PointerUpdate, PointerColor)) ||
+		(id == MakeMessageId(PointerUpdate, PointerNew));
+}
+
+/**
+ * Drops the messages of the batch that a new message overrides: opaque
+ * rectangles it covers within the current run of opaque rectangles (a
+ * SetBounds in between may clip it), the previous pointer position, and
+ * the previous system or cached pointer selection. Pointer color and new
+ * pointer updates also fill the pointer cache and are always kept.
+ */
+
+static void update_message_batch_compact(UPDATE_MESSAGE_BATCH* batch, UINT32 id, void* wParam)
+{
+	int index;
+	wMessage* msg;
+
+	if (id == MakeMessageId(PrimaryUpdate, OpaqueRect))
+	{
+		OPAQUE_RECT_ORDER* prev;
+		OPAQUE_RECT_ORDER* rect = (OPAQUE_RECT_ORDER*) wParam;
+
+		if ((rect->nWidth <= 0) || (rect->nHeight <= 0))
+			return;
+
+		for (index = ((int) batch->count) - 1; index >= 0; index--)
+		{
+			msg = &batch->messages[index];
+
+			if (!msg->id)
+				continue;
+
+			if (msg->id != id)
+				break;
+
+			prev = (OPAQUE_RECT_ORDER*) msg->wParam;
+
+			if ((prev->nLeftRect >= rect->nLeftRect) && (prev->nTopRect >= rect->nTopRect) &&
+				((prev->nLeftRect + prev->nWidth) <= (rect->nLeftRect + rect->nWidth)) &&
+				((prev->nTopRect + prev->nHeight) <= (rect->nTopRect + rect->nHeight)))
+			{
+				update_message_batch_drop(batch, msg);
+			}
+		}
+	}
+	else if (id == MakeMessageId(PointerUpdate, PointerPosition))
+	{
+		for (index = ((int) batch->count) - 1; index >= 0; index--)
+		{
+			msg = &batch->messages[index];
+
+			if (msg->id == id)
+			{
+				update_message_batch_drop(batch, msg);
+				break;
+			}
+		}
+	}
+	else if (update_message_is_pointer_set(id))
+	{
+		for (index = ((int) batch->count) - 1; index >= 0; index--)
+		{
+			msg = &batch->messages[index];
+
+			if (!update_message_is_pointer_set(msg->id))
+				continue;
+
+			if ((msg->id == MakeMessageId(PointerUpdate, PointerSystem)) ||
+				(msg->id == MakeMessageId(PointerUpdate, PointerCached)))
+			{
+				update_message_batch_drop(batch, msg);
+			}
+
+			break;
+		}
+	}
+}
+
+static UPDATE_MESSAGE_BATCH* update_message_current_batch(rdpContext* context)
+{
+	rdpUpdateProxy* proxy = context->update->proxy;
+
+	if (!proxy || (proxy->batchThreadId != GetCurrentThreadId()))
+		return NULL;
+
+	return proxy->batch;
+}
+
+static void* update_message_alloc(rdpContext* context, size_t size)
+{
+	UPDATE_MESSAGE_BATCH* batch = update_message_current_batch(context);
+
+	if (!batch)
+		return malloc(size);
+
+	return update_message_batch_alloc(batch, size);
+}
+
+static BOOL update_message_post(rdpContext* context, UINT32 id, void* wParam, void* lParam)
+{
+	wMessage* msg;
+	UPDATE_MESSAGE_BATCH* batch = update_message_current_batch(context);
+
+	if (!batch)
+	{
+		MessageQueue_Post(context->update->queue, (void*) context, id, wParam, lParam);
+		return TRUE;
+	}
+
+	if (batch->count >= batch->capacity)
+	{
+		UINT32 capacity = batch->capacity ? (batch->capacity * 2) : 64;
+
+		msg = (wMessage*) realloc(batch->messages, capacity * sizeof(wMessage));
+
+		if (!msg)
+		{
+			wMessage dropped;
+
+			ZeroMemory(&dropped, sizeof(wMessage));
+			dropped.id = id;
+			dropped.context = (void*) context;
+			dropped.wParam = wParam;
+			dropped.lParam = lParam;
+
+			WLog_ERR(TAG, "failed to grow update batch, dropping message 0x%08X", id);
+			update_message_batch_free_message(batch, &dropped);
+			return FALSE;
+		}
+
+		batch->messages = msg;
+		batch->capacity = capacity;
+	}
+
+	update_message_batch_compact(batch, id, wParam);
+
+	msg = &batch->messages[batch->count++];
+	ZeroMemory(msg, sizeof(wMessage));
+	msg->id = id;
+	msg->context = (void*) context;
+	msg->wParam = wParam;
+	msg->lParam = lParam;
+
+	return TRUE;
+}
+
+static int update_message_process_batch(rdpUpdateProxy* proxy, UPDATE_MESSAGE_BATCH* batch)
+{
+	UINT32 index;
+	wMessage* msg;
+
+	for (index = 0; index < batch->count; index++)
+	{
+		msg = &batch->messages[index];
+
+		if (!msg->id)
+			continue;
+
+		update_message_process_class(proxy, msg, GetMessageClass(msg->id), GetMessageType(msg->id));
+		update_message_batch_free_message(batch, msg);
+	}
+
+	update_message_batch_reset(batch);
+
+	/* hand the batch back to the receiving thread, keeping its arena */
+	if (InterlockedCompareExchangePointer((PVOID volatile*) &proxy->spareBatch, batch, NULL))
+		update_message_batch_free(batch);
+
+	return 1;
+}
 
 /* Update */
 
+static BOOL update_message_EndPaint(rdpContext* context);
+
 static BOOL update_message_BeginPaint(rdpContext* context)
 {
-	MessageQueue_Post(context->update->queue, (void*) context,
-			MakeMessageId(Update, BeginPaint), NULL, NULL);
+	UPDATE_MESSAGE_BATCH* batch;
+	rdpUpdateProxy* proxy = context->update->proxy;
 
-	return TRUE;
+	if (proxy->batch)
+	{
+		/* the previous paint was not ended (e.g. a malformed PDU), close its batch */
+		proxy->batchThreadId = GetCurrentThreadId();
+		update_message_EndPaint(context);
+	}
+
+	batch = proxy->spareBatch;
+
+	if (batch && (InterlockedCompareExchangePointer((PVOID volatile*) &proxy->spareBatch, NULL, batch) != batch))
+		batch = NULL;
+
+	if (!batch)
+		batch = update_message_batch_new();
+
+	proxy->batchThreadId = GetCurrentThreadId();
+	proxy->batch = batch;
+
+	return update_message_post(context, MakeMessageId(Update, BeginPaint), NULL, NULL);
 }
 
 static BOOL update_message_EndPaint(rdpContext* context)
 {
-	MessageQueue_Post(context->update->queue, (void*) context,
-			MakeMessageId(Update, EndPaint), NULL, NULL);
+	rdpUpdateProxy* proxy = context->update->proxy;
+	UPDATE_MESSAGE_BATCH* batch = update_message_current_batch(context);
+
+	update_message_post(context, MakeMessageId(Update, EndPaint), NULL, NULL);
+
+	if (batch)
+	{
+		proxy->batch = NULL;
+		MessageQueue_Post(context->update->queue, (void*) context,
+				MakeMessageId(Update, Batch), (void*) batch, NULL);
+	}
+
 	return TRUE;
 }
 
@@ -60,27 +434,27 @@ static BOOL update_message_SetBounds(rdpContext* context, rdpBounds* bounds)
 
 	if (bounds)
 	{
-		wParam = (rdpBounds*) malloc(sizeof(rdpBounds));
+		wParam = (rdpBounds*) update_message_alloc(context, sizeof(rdpBounds));
 		if (!wParam)
 			return FALSE;
 		CopyMemory(wParam, bounds, sizeof(rdpBounds));
 	}
 
-	MessageQueue_Post(context->update->queue, (void*) context,
+	update_message_post(context,
 			MakeMessageId(Update, SetBounds), (void*) wParam, NULL);
 	return TRUE;
 }
 
 static BOOL update_message_Synchronize(rdpContext* context)
 {
-	MessageQueue_Post(context->update->queue, (void*) context,
+	update_message_post(context,
 			MakeMessageId(Update, Synchronize), NULL, NULL);
 	return TRUE;
 }
 
 static BOOL update_message_DesktopResize(rdpContext* context)
 {
-	MessageQueue_Post(context->update->queue, (void*) context,
+	update_message_post(context,
 			MakeMessageId(Update, DesktopResize), NULL, NULL);
 	return TRUE;
 }
@@ -88,6 +462,7 @@ static BOOL update_message_DesktopResize(rdpContext* context)
 static BOOL update_message_BitmapUpdate(rdpContext* context, BITMAP_UPDATE* bitmap)
 {
 	UINT32 index;
+	wStream* pdu;
 	BITMAP_UPDATE* wParam;
 
 	wParam = (BITMAP_UPDATE*) malloc(sizeof(BITMAP_UPDATE));
@@ -105,28 +480,45 @@ static BOOL update_message_BitmapUpdate(rdpContext* context, BITMAP_UPDATE* bitm
 	}
 	CopyMemory(wParam->rectangles, bitmap->rectangles, sizeof(BITMAP_DATA) * wParam->number);
 
+	pdu = context->update->pdu;
+
 	for (index = 0; index < wParam->number; index++)
 	{
-#ifdef WITH_STREAM_POOL
-		StreamPool_AddRef(context->rdp->transport->ReceivePool, bitmap->rectangles[index].bitmapDataStream);
-#else
-		wParam->rectangles[index].bitmapDataStream = (BYTE*) malloc(wParam->rectangles[index].bitmapLength);
-		if (!wParam->rectangles[index].bitmapDataStream)
+		if (!update_message_in_pdu(pdu, bitmap->rectangles[index].bitmapDataStream,
+				bitmap->rectangles[index].bitmapLength))
 		{
-			for (index -= 1; index >= 0; --index)
+			pdu = NULL;
+			break;
+		}
+	}
+
+	if (pdu)
+	{
+		Stream_AddRef(pdu);
+	}
+	else
+	{
+		for (index = 0; index < wParam->number; index++)
+		{
+			wParam->rectangles[index].bitmapDataStream = (BYTE*) malloc(wParam->rectangles[index].bitmapLength);
+
+			if (!wParam->rectangles[index].bitmapDataStream)
 			{
-				free(wParam->rectangles[index].bitmapDataStream);
+				while (index > 0)
+					free(wParam->rectangles[--index].bitmapDataStream);
+
+				free(wParam->rectangles);
+				free(wParam);
+				return FALSE;
 			}
-			free(wParam->rectangles);
-			free(wParam);
-			return FALSE;
+
+			CopyMemory(wParam->rectangles[index].bitmapDataStream, bitmap->rectangles[index].bitmapDataStream,
+					wParam->rectangles[index].bitmapLength);
 		}
-		CopyMemory(wParam->rectangles[index].bitmapDataStream, bitmap->rectangles[index].bitmapDataStream,
-				wParam->rectangles[index].bitmapLength);
-#endif
 	}
-	MessageQueue_Post(context->update->queue, (void*) context,
-			MakeMessageId(Update, BitmapUpdate), (void*) wParam, NULL);
+
+	update_message_post(context,
+			MakeMessageId(Update, BitmapUpdate), (void*) wParam, (void*) pdu);
 
 	return TRUE;
 }
@@ -140,7 +532,7 @@ static BOOL update_message_Palette(rdpContext* context, PALETTE_UPDATE* palette)
 		return FALSE;
 	CopyMemory(wParam, palette, sizeof(PALETTE_UPDATE));
 
-	MessageQueue_Post(context->update->queue, (void*) context,
+	update_message_post(context,
 			MakeMessageId(Update, Palette), (void*) wParam, NULL);
 	return TRUE;
 }
@@ -154,14 +546,14 @@ static BOOL update_message_PlaySound(rdpContext* context, PLAY_SOUND_UPDATE* pla
 		return FALSE;
 	CopyMemory(wParam, playSound, sizeof(PLAY_SOUND_UPDATE));
 
-	MessageQueue_Post(context->update->queue, (void*) context,
+	update_message_post(context,
 			MakeMessageId(Update, PlaySound), (void*) wParam, NULL);
 	return TRUE;
 }
 
 static BOOL update_message_SetKeyboardIndicators(rdpContext* context, UINT16 led_flags)
 {
-	MessageQueue_Post(context->update->queue, (void*) context,
+	update_message_post(context,
 			MakeMessageId(Update, SetKeyboardIndicators), (void*)(size_t)led_flags, NULL);
 	return TRUE;
 }
@@ -175,7 +567,7 @@ static BOOL update_message_RefreshRect(rdpContext* context, BYTE count, RECTANGL
 		return FALSE;
 	CopyMemory(lParam, areas, sizeof(RECTANGLE_16) * count);
 
-	MessageQueue_Post(context->update->queue, (void*) context,
+	update_message_post(context,
 			MakeMessageId(Update, RefreshRect), (void*) (size_t) count, (void*) lParam);
 	return TRUE;
 }
@@ -192,7 +584,7 @@ static BOOL update_message_SuppressOutput(rdpContext* context, BYTE allow, RECTA
 		CopyMemory(lParam, area, sizeof(RECTANGLE_16));
 	}
 
-	MessageQueue_Post(context->update->queue, (void*) context,
+	update_message_post(context,
 			MakeMessageId(Update, SuppressOutput), (void*) (size_t) allow, (void*) lParam);
 	return TRUE;
 }
@@ -215,13 +607,14 @@ static BOOL update_message_SurfaceCommand(rdpContext* context, wStream* s)
 
 	wParam->pointer = wParam->buffer;
 
-	MessageQueue_Post(context->update->queue, (void*) context,
+	update_message_post(context,
 			MakeMessageId(Update, SurfaceCommand), (void*) wParam, NULL);
 	return TRUE;
 }
 
 static BOOL update_message_SurfaceBits(rdpContext* context, SURFACE_BITS_COMMAND* surfaceBitsCommand)
 {
+	wStream* pdu;
 	SURFACE_BITS_COMMAND* wParam;
 
 	wParam = (SURFACE_BITS_COMMAND*) malloc(sizeof(SURFACE_BITS_COMMAND));
@@ -229,20 +622,21 @@ static BOOL update_message_SurfaceBits(rdpContext* context, SURFACE_BITS_COMMAND
 		return FALSE;
 	CopyMemory(wParam, surfaceBitsCommand, sizeof(SURFACE_BITS_COMMAND));
 
-#ifdef WITH_STREAM_POOL
-	StreamPool_AddRef(context->rdp->transport->ReceivePool, surfaceBitsCommand->bitmapData);
-#else
-	wParam->bitmapData = (BYTE*) malloc(wParam->bitmapDataLength);
-	if (!wParam->bitmapData)
+	pdu = update_message_ref_pdu(context, surfaceBitsCommand->bitmapData, surfaceBitsCommand->bitmapDataLength);
+
+	if (!pdu)
 	{
-		free(wParam);
-		return FALSE;
+		wParam->bitmapData = (BYTE*) malloc(wParam->bitmapDataLength);
+		if (!wParam->bitmapData)
+		{
+			free(wParam);
+			return FALSE;
+		}
+		CopyMemory(wParam->bitmapData, surfaceBitsCommand->bitmapData, wParam->bitmapDataLength);
 	}
-	CopyMemory(wParam->bitmapData, surfaceBitsCommand->bitmapData, wParam->bitmapDataLength);
-#endif
 
-	MessageQueue_Post(context->update->queue, (void*) context,
-			MakeMessageId(Update, SurfaceBits), (void*) wParam, NULL);
+	update_message_post(context,
+			MakeMessageId(Update, SurfaceBits), (void*) wParam, (void*) pdu);
 	return TRUE;
 }
 
@@ -250,12 +644,12 @@ static BOOL update_message_SurfaceFrameMarker(rdpContext* context, SURFACE_FRAME
 {
 	SURFACE_FRAME_MARKER* wParam;
 
-	wParam = (SURFACE_FRAME_MARKER*) malloc(sizeof(SURFACE_FRAME_MARKER));
+	wParam = (SURFACE_FRAME_MARKER*) update_message_alloc(context, sizeof(SURFACE_FRAME_MARKER));
 	if (!wParam)
 		return FALSE;
 	CopyMemory(wParam, surfaceFrameMarker, sizeof(SURFACE_FRAME_MARKER));
 
-	MessageQueue_Post(context->update->queue, (void*) context,
+	update_message_post(context,
 			MakeMessageId(Update, SurfaceFrameMarker), (void*) wParam, NULL);
 
 	return TRUE;
@@ -263,7 +657,7 @@ static BOOL update_message_SurfaceFrameMarker(rdpContext* context, SURFACE_FRAME
 
 static BOOL update_message_SurfaceFrameAcknowledge(rdpContext* context, UINT32 frameId)
 {
-	MessageQueue_Post(context->update->queue, (void*) context,
+	update_message_post(context,
 			MakeMessageId(Update, SurfaceFrameAcknowledge), (void*) (size_t) frameId, NULL);
 
 	return TRUE;
@@ -275,12 +669,12 @@ static BOOL update_message_DstBlt(rdpContext* context, DSTBLT_ORDER* dstBlt)
 {
 	DSTBLT_ORDER* wParam;
 
-	wParam = (DSTBLT_ORDER*) malloc(sizeof(DSTBLT_ORDER));
+	wParam = (DSTBLT_ORDER*) update_message_alloc(context, sizeof(DSTBLT_ORDER));
 	if (!wParam)
 		return FALSE;
 	CopyMemory(wParam, dstBlt, sizeof(DSTBLT_ORDER));
 
-	MessageQueue_Post(context->update->queue, (void*) context,
+	update_message_post(context,
 			MakeMessageId(PrimaryUpdate, DstBlt), (void*) wParam, NULL);
 	return TRUE;
 }
@@ -289,14 +683,14 @@ static BOOL update_message_PatBlt(rdpContext* context, PATBLT_ORDER* patBlt)
 {
 	PATBLT_ORDER* wParam;
 
-	wParam = (PATBLT_ORDER*) malloc(sizeof(PATBLT_ORDER));
+	wParam = (PATBLT_ORDER*) update_message_alloc(context, sizeof(PATBLT_ORDER));
 	if (!wParam)
 		return FALSE;
 	CopyMemory(wParam, patBlt, sizeof(PATBLT_ORDER));
 
 	wParam->brush.data = (BYTE*) wParam->brush.p8x8;
 
-	MessageQueue_Post(context->update->queue, (void*) context,
+	update_message_post(context,
 			MakeMessageId(PrimaryUpdate, PatBlt), (void*) wParam, NULL);
 	return TRUE;
 }
@@ -305,12 +699,12 @@ static BOOL update_message_ScrBlt(rdpContext* context, SCRBLT_ORDER* scrBlt)
 {
 	SCRBLT_ORDER* wParam;
 
-	wParam = (SCRBLT_ORDER*) malloc(sizeof(SCRBLT_ORDER));
+	wParam = (SCRBLT_ORDER*) update_message_alloc(context, sizeof(SCRBLT_ORDER));
 	if (!wParam)
 		return FALSE;
 	CopyMemory(wParam, scrBlt, sizeof(SCRBLT_ORDER));
 
-	MessageQueue_Post(context->update->queue, (void*) context,
+	update_message_post(context,
 			MakeMessageId(PrimaryUpdate, ScrBlt), (void*) wParam, NULL);
 
 	return TRUE;
@@ -320,12 +714,12 @@ static BOOL update_message_OpaqueRect(rdpContext* context, OPAQUE_RECT_ORDER* op
 {
 	OPAQUE_RECT_ORDER* wParam;
 
-	wParam = (OPAQUE_RECT_ORDER*) malloc(sizeof(OPAQUE_RECT_ORDER));
+	wParam = (OPAQUE_RECT_ORDER*) update_message_alloc(context, sizeof(OPAQUE_RECT_ORDER));
 	if (!wParam)
 		return FALSE;
 	CopyMemory(wParam, opaqueRect, sizeof(OPAQUE_RECT_ORDER));
 
-	MessageQueue_Post(context->update->queue, (void*) context,
+	update_message_post(context,
 			MakeMessageId(PrimaryUpdate, OpaqueRect), (void*) wParam, NULL);
 	return TRUE;
 }
@@ -334,12 +728,12 @@ static BOOL update_message_DrawNineGrid(rdpContext* context, DRAW_NINE_GRID_ORDE
 {
 	DRAW_NINE_GRID_ORDER* wParam;
 
-	wParam = (DRAW_NINE_GRID_ORDER*) malloc(sizeof(DRAW_NINE_GRID_ORDER));
+	wParam = (DRAW_NINE_GRID_ORDER*) update_message_alloc(context, sizeof(DRAW_NINE_GRID_ORDER));
 	if (!wParam)
 		return FALSE;
 	CopyMemory(wParam, drawNineGrid, sizeof(DRAW_NINE_GRID_ORDER));
 
-	MessageQueue_Post(context->update->queue, (void*) context,
+	update_message_post(context,
 			MakeMessageId(PrimaryUpdate, DrawNineGrid), (void*) wParam, NULL);
 	return TRUE;
 }
@@ -348,12 +742,12 @@ static BOOL update_message_MultiDstBlt(rdpContext* context, MULTI_DSTBLT_ORDER*
 {
 	MULTI_DSTBLT_ORDER* wParam;
 
-	wParam = (MULTI_DSTBLT_ORDER*) malloc(sizeof(MULTI_DSTBLT_ORDER));
+	wParam = (MULTI_DSTBLT_ORDER*) update_message_alloc(context, sizeof(MULTI_DSTBLT_ORDER));
 	if (!wParam)
 		return FALSE;
 	CopyMemory(wParam, multiDstBlt, sizeof(MULTI_DSTBLT_ORDER));
 
-	MessageQueue_Post(context->update->queue, (void*) context,
+	update_message_post(context,
 			MakeMessageId(PrimaryUpdate, MultiDstBlt), (void*) wParam, NULL);
 	return TRUE;
 }
@@ -362,14 +756,14 @@ static BOOL update_message_MultiPatBlt(rdpContext* context, MULTI_PATBLT_ORDER*
 {
 	MULTI_PATBLT_ORDER* wParam;
 
-	wParam = (MULTI_PATBLT_ORDER*) malloc(sizeof(MULTI_PATBLT_ORDER));
+	wParam = (MULTI_PATBLT_ORDER*) update_message_alloc(context, sizeof(MULTI_PATBLT_ORDER));
 	if (!wParam)
 		return FALSE;
 	CopyMemory(wParam, multiPatBlt, sizeof(MULTI_PATBLT_ORDER));
 
 	wParam->brush.data = (BYTE*) wParam->brush.p8x8;
 
-	MessageQueue_Post(context->update->queue, (void*) context,
+	update_message_post(context,
 			MakeMessageId(PrimaryUpdate, MultiPatBlt), (void*) wParam, NULL);
 	return TRUE;
 }
@@ -378,12 +772,12 @@ static BOOL update_message_MultiScrBlt(rdpContext* context, MULTI_SCRBLT_ORDER*
 {
 	MULTI_SCRBLT_ORDER* wParam;
 
-	wParam = (MULTI_SCRBLT_ORDER*) malloc(sizeof(MULTI_SCRBLT_ORDER));
+	wParam = (MULTI_SCRBLT_ORDER*) update_message_alloc(context, sizeof(MULTI_SCRBLT_ORDER));
 	if (!wParam)
 		return FALSE;
 	CopyMemory(wParam, multiScrBlt, sizeof(MULTI_SCRBLT_ORDER));
 
-	MessageQueue_Post(context->update->queue, (void*) context,
+	update_message_post(context,
 			MakeMessageId(PrimaryUpdate, MultiScrBlt), (void*) wParam, NULL);
 	return TRUE;
 }
@@ -392,12 +786,12 @@ static BOOL update_message_MultiOpaqueRect(rdpContext* context, MULTI_OPAQUE_REC
 {
 	MULTI_OPAQUE_RECT_ORDER* wParam;
 
-	wParam = (MULTI_OPAQUE_RECT_ORDER*) malloc(sizeof(MULTI_OPAQUE_RECT_ORDER));
+	wParam = (MULTI_OPAQUE_RECT_ORDER*) update_message_alloc(context, sizeof(MULTI_OPAQUE_RECT_ORDER));
 	if (!wParam)
 		return FALSE;
 	CopyMemory(wParam, multiOpaqueRect, sizeof(MULTI_OPAQUE_RECT_ORDER));
 
-	MessageQueue_Post(context->update->queue, (void*) context,
+	update_message_post(context,
 			MakeMessageId(PrimaryUpdate, MultiOpaqueRect), (void*) wParam, NULL);
 	return TRUE;
 }
@@ -406,14 +800,14 @@ static BOOL update_message_MultiDrawNineGrid(rdpContext* context, MULTI_DRAW_NIN
 {
 	MULTI_DRAW_NINE_GRID_ORDER* wParam;
 
-	wParam = (MULTI_DRAW_NINE_GRID_ORDER*) malloc(sizeof(MULTI_DRAW_NINE_GRID_ORDER));
+	wParam = (MULTI_DRAW_NINE_GRID_ORDER*) update_message_alloc(context, sizeof(MULTI_DRAW_NINE_GRID_ORDER));
 	if (!wParam)
 		return FALSE;
 	CopyMemory(wParam, multiDrawNineGrid, sizeof(MULTI_DRAW_NINE_GRID_ORDER));
 
 	/* TODO: complete copy */
 
-	MessageQueue_Post(context->update->queue, (void*) context,
+	update_message_post(context,
 			MakeMessageId(PrimaryUpdate, MultiDrawNineGrid), (void*) wParam, NULL);
 	return TRUE;
 }
@@ -422,12 +816,12 @@ static BOOL update_message_LineTo(rdpContext* context, LINE_TO_ORDER* lineTo)
 {
 	LINE_TO_ORDER* wParam;
 
-	wParam = (LINE_TO_ORDER*) malloc(sizeof(LINE_TO_ORDER));
+	wParam = (LINE_TO_ORDER*) update_message_alloc(context, sizeof(LINE_TO_ORDER));
 	if (!wParam)
 		return FALSE;
 	CopyMemory(wParam, lineTo, sizeof(LINE_TO_ORDER));
 
-	MessageQueue_Post(context->update->queue, (void*) context,
+	update_message_post(context,
 			MakeMessageId(PrimaryUpdate, LineTo), (void*) wParam, NULL);
 	return TRUE;
 }
@@ -449,7 +843,7 @@ static BOOL update_message_Polyline(rdpContext* context, POLYLINE_ORDER* polylin
 	}
 	CopyMemory(wParam->points, polyline->points, sizeof(DELTA_POINT) * wParam->numDeltaEntries);
 
-	MessageQueue_Post(context->update->queue, (void*) context,
+	update_message_post(context,
 			MakeMessageId(PrimaryUpdate, Polyline), (void*) wParam, NULL);
 	return TRUE;
 }
@@ -458,12 +852,12 @@ static BOOL update_message_MemBlt(rdpContext* context, MEMBLT_ORDER* memBlt)
 {
 	MEMBLT_ORDER* wParam;
 
-	wParam = (MEMBLT_ORDER*) malloc(sizeof(MEMBLT_ORDER));
+	wParam = (MEMBLT_ORDER*) update_message_alloc(context, sizeof(MEMBLT_ORDER));
 	if (!wParam)
 		return FALSE;
 	CopyMemory(wParam, memBlt, sizeof(MEMBLT_ORDER));
 
-	MessageQueue_Post(context->update->queue, (void*) context,
+	update_message_post(context,
 			MakeMessageId(PrimaryUpdate, MemBlt), (void*) wParam, NULL);
 
 	return TRUE;
@@ -473,14 +867,14 @@ static BOOL update_message_Mem3Blt(rdpContext* context, MEM3BLT_ORDER* mem3Blt)
 {
 	MEM3BLT_ORDER* wParam;
 
-	wParam = (MEM3BLT_ORDER*) malloc(sizeof(MEM3BLT_ORDER));
+	wParam = (MEM3BLT_ORDER*) update_message_alloc(context, sizeof(MEM3BLT_ORDER));
 	if (!wParam)
 		return FALSE;
 	CopyMemory(wParam, mem3Blt, sizeof(MEM3BLT_ORDER));
 
 	wParam->brush.data = (BYTE*) wParam->brush.p8x8;
 
-	MessageQueue_Post(context->update->queue, (void*) context,
+	update_message_post(context,
 			MakeMessageId(PrimaryUpdate, Mem3Blt), (void*) wParam, NULL);
 	return TRUE;
 }
@@ -489,12 +883,12 @@ static BOOL update_message_SaveBitmap(rdpContext* context, SAVE_BITMAP_ORDER* sa
 {
 	SAVE_BITMAP_ORDER* wParam;
 
-	wParam = (SAVE_BITMAP_ORDER*) malloc(sizeof(SAVE_BITMAP_ORDER));
+	wParam = (SAVE_BITMAP_ORDER*) update_message_alloc(context, sizeof(SAVE_BITMAP_ORDER));
 	if (!wParam)
 		return FALSE;
 	CopyMemory(wParam, saveBitmap, sizeof(SAVE_BITMAP_ORDER));
 
-	MessageQueue_Post(context->update->queue, (void*) context,
+	update_message_post(context,
 			MakeMessageId(PrimaryUpdate, SaveBitmap), (void*) wParam, NULL);
 	return TRUE;
 }
@@ -503,14 +897,14 @@ static BOOL update_message_GlyphIndex(rdpContext* context, GLYPH_INDEX_ORDER* gl
 {
 	GLYPH_INDEX_ORDER* wParam;
 
-	wParam = (GLYPH_INDEX_ORDER*) malloc(sizeof(GLYPH_INDEX_ORDER));
+	wParam = (GLYPH_INDEX_ORDER*) update_message_alloc(context, sizeof(GLYPH_INDEX_ORDER));
 	if (!wParam)
 		return FALSE;
 	CopyMemory(wParam, glyphIndex, sizeof(GLYPH_INDEX_ORDER));
 
 	wParam->brush.data = (BYTE*) wParam->brush.p8x8;
 
-	MessageQueue_Post(context->update->queue, (void*) context,
+	update_message_post(context,
 			MakeMessageId(PrimaryUpdate, GlyphIndex), (void*) wParam, NULL);
 	return TRUE;
 }
@@ -519,12 +913,12 @@ static BOOL update_message_FastIndex(rdpContext* context, FAST_INDEX_ORDER* fast
 {
 	FAST_INDEX_ORDER* wParam;
 
-	wParam = (FAST_INDEX_ORDER*) malloc(sizeof(FAST_INDEX_ORDER));
+	wParam = (FAST_INDEX_ORDER*) update_message_alloc(context, sizeof(FAST_INDEX_ORDER));
 	if (!wParam)
 		return FALSE;
 	CopyMemory(wParam, fastIndex, sizeof(FAST_INDEX_ORDER));
 
-	MessageQueue_Post(context->update->queue, (void*) context,
+	update_message_post(context,
 			MakeMessageId(PrimaryUpdate, FastIndex), (void*) wParam, NULL);
 	return TRUE;
 }
@@ -553,7 +947,7 @@ static BOOL update_message_FastGlyph(rdpContext* context, FAST_GLYPH_ORDER* fast
 		wParam->glyphData.aj = NULL;
 	}
 
-	MessageQueue_Post(context->update->queue, (void*) context,
+	update_message_post(context,
 			MakeMessageId(PrimaryUpdate, FastGlyph), (void*) wParam, NULL);
 	return TRUE;
 }
@@ -575,7 +969,7 @@ static BOOL update_message_PolygonSC(rdpContext* context, POLYGON_SC_ORDER* poly
 	}
 	CopyMemory(wParam->points, polygonSC, sizeof(DELTA_POINT) * wParam->numPoints);
 
-	MessageQueue_Post(context->update->queue, (void*) context,
+	update_message_post(context,
 			MakeMessageId(PrimaryUpdate, PolygonSC), (void*) wParam, NULL);
 	return TRUE;
 }
@@ -599,7 +993,7 @@ static BOOL update_message_PolygonCB(rdpContext* context, POLYGON_CB_ORDER* poly
 
 	wParam->brush.data = (BYTE*) wParam->brush.p8x8;
 
-	MessageQueue_Post(context->update->queue, (void*) context,
+	update_message_post(context,
 			MakeMessageId(PrimaryUpdate, PolygonCB), (void*) wParam, NULL);
 	return TRUE;
 }
@@ -608,12 +1002,12 @@ static BOOL update_message_EllipseSC(rdpContext* context, ELLIPSE_SC_ORDER* elli
 {
 	ELLIPSE_SC_ORDER* wParam;
 
-	wParam = (ELLIPSE_SC_ORDER*) malloc(sizeof(ELLIPSE_SC_ORDER));
+	wParam = (ELLIPSE_SC_ORDER*) update_message_alloc(context, sizeof(ELLIPSE_SC_ORDER));
 	if (!wParam)
 		return FALSE;
 	CopyMemory(wParam, ellipseSC, sizeof(ELLIPSE_SC_ORDER));
 
-	MessageQueue_Post(context->update->queue, (void*) context,
+	update_message_post(context,
 			MakeMessageId(PrimaryUpdate, EllipseSC), (void*) wParam, NULL);
 	return TRUE;
 }
@@ -622,14 +1016,14 @@ static BOOL update_message_EllipseCB(rdpContext* context, ELLIPSE_CB_ORDER* elli
 {
 	ELLIPSE_CB_ORDER* wParam;
 
-	wParam = (ELLIPSE_CB_ORDER*) malloc(sizeof(ELLIPSE_CB_ORDER));
+	wParam = (ELLIPSE_CB_ORDER*) update_message_alloc(context, sizeof(ELLIPSE_CB_ORDER));
 	if (!wParam)
 		return FALSE;
 	CopyMemory(wParam, ellipseCB, sizeof(ELLIPSE_CB_ORDER));
 
 	wParam->brush.data = (BYTE*) wParam->brush.p8x8;
 
-	MessageQueue_Post(context->update->queue, (void*) context,
+	update_message_post(context,
 			MakeMessageId(PrimaryUpdate, EllipseCB), (void*) wParam, NULL);
 	return TRUE;
 }
@@ -638,6 +1032,7 @@ static BOOL update_message_EllipseCB(rdpContext* context, ELLIPSE_CB_ORDER* elli
 
 static BOOL update_message_CacheBitmap(rdpContext* context, CACHE_BITMAP_ORDER* cacheBitmapOrder)
 {
+	wStream* pdu;
 	CACHE_BITMAP_ORDER* wParam;
 
 	wParam = (CACHE_BITMAP_ORDER*) malloc(sizeof(CACHE_BITMAP_ORDER));
@@ -645,21 +1040,27 @@ static BOOL update_message_CacheBitmap(rdpContext* context, CACHE_BITMAP_ORDER*
 		return FALSE;
 	CopyMemory(wParam, cacheBitmapOrder, sizeof(CACHE_BITMAP_ORDER));
 
-	wParam->bitmapDataStream = (BYTE*) malloc(wParam->bitmapLength);
-	if (!wParam->bitmapDataStream)
+	pdu = update_message_ref_pdu(context, cacheBitmapOrder->bitmapDataStream, cacheBitmapOrder->bitmapLength);
+
+	if (!pdu)
 	{
-		free(wParam);
-		return FALSE;
+		wParam->bitmapDataStream = (BYTE*) malloc(wParam->bitmapLength);
+		if (!wParam->bitmapDataStream)
+		{
+			free(wParam);
+			return FALSE;
+		}
+		CopyMemory(wParam->bitmapDataStream, cacheBitmapOrder->bitmapDataStream, wParam->bitmapLength);
 	}
-	CopyMemory(wParam->bitmapDataStream, cacheBitmapOrder, wParam->bitmapLength);
 
-	MessageQueue_Post(context->update->queue, (void*) context,
-			MakeMessageId(SecondaryUpdate, CacheBitmap), (void*) wParam, NULL);
+	update_message_post(context,
+			MakeMessageId(SecondaryUpdate, CacheBitmap), (void*) wParam, (void*) pdu);
 	return TRUE;
 }
 
 static BOOL update_message_CacheBitmapV2(rdpContext* context, CACHE_BITMAP_V2_ORDER* cacheBitmapV2Order)
 {
+	wStream* pdu;
 	CACHE_BITMAP_V2_ORDER* wParam;
 
 	wParam = (CACHE_BITMAP_V2_ORDER*) malloc(sizeof(CACHE_BITMAP_V2_ORDER));
@@ -667,21 +1068,27 @@ static BOOL update_message_CacheBitmapV2(rdpContext* context, CACHE_BITMAP_V2_OR
 		return FALSE;
 	CopyMemory(wParam, cacheBitmapV2Order, sizeof(CACHE_BITMAP_V2_ORDER));
 
-	wParam->bitmapDataStream = (BYTE*) malloc(wParam->bitmapLength);
-	if (!wParam->bitmapDataStream)
+	pdu = update_message_ref_pdu(context, cacheBitmapV2Order->bitmapDataStream, cacheBitmapV2Order->bitmapLength);
+
+	if (!pdu)
 	{
-		free(wParam);
-		return FALSE;
+		wParam->bitmapDataStream = (BYTE*) malloc(wParam->bitmapLength);
+		if (!wParam->bitmapDataStream)
+		{
+			free(wParam);
+			return FALSE;
+		}
+		CopyMemory(wParam->bitmapDataStream, cacheBitmapV2Order->bitmapDataStream, wParam->bitmapLength);
 	}
-	CopyMemory(wParam->bitmapDataStream, cacheBitmapV2Order->bitmapDataStream, wParam->bitmapLength);
 
-	MessageQueue_Post(context->update->queue, (void*) context,
-			MakeMessageId(SecondaryUpdate, CacheBitmapV2), (void*) wParam, NULL);
+	update_message_post(context,
+			MakeMessageId(SecondaryUpdate, CacheBitmapV2), (void*) wParam, (void*) pdu);
 	return TRUE;
 }
 
 static BOOL update_message_CacheBitmapV3(rdpContext* context, CACHE_BITMAP_V3_ORDER* cacheBitmapV3Order)
 {
+	wStream* pdu;
 	CACHE_BITMAP_V3_ORDER* wParam;
 
 	wParam = (CACHE_BITMAP_V3_ORDER*) malloc(sizeof(CACHE_BITMAP_V3_ORDER));
@@ -689,16 +1096,21 @@ static BOOL update_message_CacheBitmapV3(rdpContext* context, CACHE_BITMAP_V3_OR
 		return FALSE;
 	CopyMemory(wParam, cacheBitmapV3Order, sizeof(CACHE_BITMAP_V3_ORDER));
 
-	wParam->bitmapData.data = (BYTE*) malloc(wParam->bitmapData.length);
-	if (!wParam->bitmapData.data)
+	pdu = update_message_ref_pdu(context, cacheBitmapV3Order->bitmapData.data, cacheBitmapV3Order->bitmapData.length);
+
+	if (!pdu)
 	{
-		free(wParam);
-		return FALSE;
+		wParam->bitmapData.data = (BYTE*) malloc(wParam->bitmapData.length);
+		if (!wParam->bitmapData.data)
+		{
+			free(wParam);
+			return FALSE;
+		}
+		CopyMemory(wParam->bitmapData.data, cacheBitmapV3Order->bitmapData.data, wParam->bitmapData.length);
 	}
-	CopyMemory(wParam->bitmapData.data, cacheBitmapV3Order->bitmapData.data, wParam->bitmapData.length);
 
-	MessageQueue_Post(context->update->queue, (void*) context,
-			MakeMessageId(SecondaryUpdate, CacheBitmapV3), (void*) wParam, NULL);
+	update_message_post(context,
+			MakeMessageId(SecondaryUpdate, CacheBitmapV3), (void*) wParam, (void*) pdu);
 	return TRUE;
 }
 
@@ -711,7 +1123,7 @@ static BOOL update_message_CacheColorTable(rdpContext* context, CACHE_COLOR_TABL
 		return FALSE;
 	CopyMemory(wParam, cacheColorTableOrder, sizeof(CACHE_COLOR_TABLE_ORDER));
 
-	MessageQueue_Post(context->update->queue, (void*) context,
+	update_message_post(context,
 			MakeMessageId(SecondaryUpdate, CacheColorTable), (void*) wParam, NULL);
 	return TRUE;
 }
@@ -725,7 +1137,7 @@ static BOOL update_message_CacheGlyph(rdpContext* context, CACHE_GLYPH_ORDER* ca
 		return FALSE;
 	CopyMemory(wParam, cacheGlyphOrder, sizeof(CACHE_GLYPH_ORDER));
 
-	MessageQueue_Post(context->update->queue, (void*) context,
+	update_message_post(context,
 			MakeMessageId(SecondaryUpdate, CacheGlyph), (void*) wParam, NULL);
 	return TRUE;
 }
@@ -739,7 +1151,7 @@ static BOOL update_message_CacheGlyphV2(rdpContext* context, CACHE_GLYPH_V2_ORDE
 		return FALSE;
 	CopyMemory(wParam, cacheGlyphV2Order, sizeof(CACHE_GLYPH_V2_ORDER));
 
-	MessageQueue_Post(context->update->queue, (void*) context,
+	update_message_post(context,
 			MakeMessageId(SecondaryUpdate, CacheGlyphV2), (void*) wParam, NULL);
 	return TRUE;
 }
@@ -753,7 +1165,7 @@ static BOOL update_message_CacheBrush(rdpContext* context, CACHE_BRUSH_ORDER* ca
 		return FALSE;
 	CopyMemory(wParam, cacheBrushOrder, sizeof(CACHE_BRUSH_ORDER));
 
-	MessageQueue_Post(context->update->queue, (void*) context,
+	update_message_post(context,
 			MakeMessageId(SecondaryUpdate, CacheBrush), (void*) wParam, NULL);
 	return TRUE;
 }
@@ -779,7 +1191,7 @@ static BOOL update_message_CreateOffscreenBitmap(rdpContext* context, CREATE_OFF
 	}
 	CopyMemory(wParam->deleteList.indices, createOffscreenBitmap->deleteList.indices, wParam->deleteList.cIndices);
 
-	MessageQueue_Post(context->update->queue, (void*) context,
+	update_message_post(context,
 			MakeMessageId(AltSecUpdate, CreateOffscreenBitmap), (void*) wParam, NULL);
 	return TRUE;
 }
@@ -793,7 +1205,7 @@ static BOOL update_message_SwitchSurface(rdpContext* context, SWITCH_SURFACE_ORD
 		return FALSE;
 	CopyMemory(wParam, switchSurface, sizeof(SWITCH_SURFACE_ORDER));
 
-	MessageQueue_Post(context->update->queue, (void*) context,
+	update_message_post(context,
 			MakeMessageId(AltSecUpdate, SwitchSurface), (void*) wParam, NULL);
 	return TRUE;
 }
@@ -807,7 +1219,7 @@ static BOOL update_message_CreateNineGridBitmap(rdpContext* context, CREATE_NINE
 		return FALSE;
 	CopyMemory(wParam, createNineGridBitmap, sizeof(CREATE_NINE_GRID_BITMAP_ORDER));
 
-	MessageQueue_Post(context->update->queue, (void*) context,
+	update_message_post(context,
 			MakeMessageId(AltSecUpdate, CreateNineGridBitmap), (void*) wParam, NULL);
 	return TRUE;
 }
@@ -821,7 +1233,7 @@ static BOOL update_message_FrameMarker(rdpContext* context, FRAME_MARKER_ORDER*
 		return FALSE;
 	CopyMemory(wParam, frameMarker, sizeof(FRAME_MARKER_ORDER));
 
-	MessageQueue_Post(context->update->queue, (void*) context,
+	update_message_post(context,
 			MakeMessageId(AltSecUpdate, FrameMarker), (void*) wParam, NULL);
 	return TRUE;
 }
@@ -837,7 +1249,7 @@ static BOOL update_message_StreamBitmapFirst(rdpContext* context, STREAM_BITMAP_
 
 	/* TODO: complete copy */
 
-	MessageQueue_Post(context->update->queue, (void*) context,
+	update_message_post(context,
 			MakeMessageId(AltSecUpdate, StreamBitmapFirst), (void*) wParam, NULL);
 	return TRUE;
 }
@@ -853,7 +1265,7 @@ static BOOL update_message_StreamBitmapNext(rdpContext* context, STREAM_BITMAP_N
 
 	/* TODO: complete copy */
 
-	MessageQueue_Post(context->update->queue, (void*) context,
+	update_message_post(context,
 			MakeMessageId(AltSecUpdate, StreamBitmapNext), (void*) wParam, NULL);
 	return TRUE;
 }
@@ -869,7 +1281,7 @@ static BOOL update_message_DrawGdiPlusFirst(rdpContext* context, DRAW_GDIPLUS_FI
 
 	/* TODO: complete copy */
 
-	MessageQueue_Post(context->update->queue, (void*) context,
+	update_message_post(context,
 			MakeMessageId(AltSecUpdate, DrawGdiPlusFirst), (void*) wParam, NULL);
 	return TRUE;
 }
@@ -885,7 +1297,7 @@ static BOOL update_message_DrawGdiPlusNext(rdpContext* context, DRAW_GDIPLUS_NEX
 
 	/* TODO: complete copy */
 
-	MessageQueue_Post(context->update->queue, (void*) context,
+	update_message_post(context,
 			MakeMessageId(AltSecUpdate, DrawGdiPlusNext), (void*) wParam, NULL);
 	return TRUE;
 }
@@ -901,7 +1313,7 @@ static BOOL update_message_DrawGdiPlusEnd(rdpContext* context, DRAW_GDIPLUS_END_
 
 	/* TODO: complete copy */
 
-	MessageQueue_Post(context->update->queue, (void*) context,
+	update_message_post(context,
 			MakeMessageId(AltSecUpdate, DrawGdiPlusEnd), (void*) wParam, NULL);
 	return TRUE;
 }
@@ -917,7 +1329,7 @@ static BOOL update_message_DrawGdiPlusCacheFirst(rdpContext* context, DRAW_GDIPL
 
 	/* TODO: complete copy */
 
-	MessageQueue_Post(context->update->queue, (void*) context,
+	update_message_post(context,
 			MakeMessageId(AltSecUpdate, DrawGdiPlusCacheFirst), (void*) wParam, NULL);
 	return TRUE;
 }
@@ -933,7 +1345,7 @@ static BOOL update_message_DrawGdiPlusCacheNext(rdpContext* context, DRAW_GDIPLU
 
 	/* TODO: complete copy */
 
-	MessageQueue_Post(context->update->queue, (void*) context,
+	update_message_post(context,
 			MakeMessageId(AltSecUpdate, DrawGdiPlusCacheNext), (void*) wParam, NULL);
 	return TRUE;
 }
@@ -949,7 +1361,7 @@ static BOOL update_message_DrawGdiPlusCacheEnd(rdpContext* context, DRAW_GDIPLUS
 
 	/* TODO: complete copy */
 
-	MessageQueue_Post(context->update->queue, (void*) context,
+	update_message_post(context,
 			MakeMessageId(AltSecUpdate, DrawGdiPlusCacheEnd), (void*) wParam, NULL);
 	return TRUE;
 }
@@ -974,7 +1386,7 @@ static BOOL update_message_WindowCreate(rdpContext* context, WINDOW_ORDER_INFO*
 	}
 	CopyMemory(lParam, windowState, sizeof(WINDOW_STATE_ORDER));
 
-	MessageQueue_Post(context->update->queue, (void*) context,
+	update_message_post(context,
 			MakeMessageId(WindowUpdate, WindowCreate), (void*) wParam, (void*) lParam);
 	return TRUE;
 }
@@ -997,7 +1409,7 @@ static BOOL	update_message_WindowUpdate(rdpContext* context, WINDOW_ORDER_INFO*
 	}
 	CopyMemory(lParam, windowState, sizeof(WINDOW_STATE_ORDER));
 
-	MessageQueue_Post(context->update->queue, (void*) context,
+	update_message_post(context,
 			MakeMessageId(WindowUpdate, WindowUpdate), (void*) wParam, (void*) lParam);
 	return TRUE;
 }
@@ -1046,7 +1458,7 @@ static BOOL update_message_WindowIcon(rdpContext* context, WINDOW_ORDER_INFO* or
 		CopyMemory(lParam->iconInfo->colorTable, windowIcon->iconInfo->colorTable, windowIcon->iconInfo->cbColorTable);
 	}
 
-	MessageQueue_Post(context->update->queue, (void*) context,
+	update_message_post(context,
 			MakeMessageId(WindowUpdate, WindowIcon), (void*) wParam, (void*) lParam);
 	return TRUE;
 
@@ -1078,7 +1490,7 @@ static BOOL update_message_WindowCachedIcon(rdpContext* context, WINDOW_ORDER_IN
 	}
 	CopyMemory(lParam, windowCachedIcon, sizeof(WINDOW_CACHED_ICON_ORDER));
 
-	MessageQueue_Post(context->update->queue, (void*) context,
+	update_message_post(context,
 			MakeMessageId(WindowUpdate, WindowCachedIcon), (void*) wParam, (void*) lParam);
 	return TRUE;
 }
@@ -1092,7 +1504,7 @@ static BOOL update_message_WindowDelete(rdpContext* context, WINDOW_ORDER_INFO*
 		return FALSE;
 	CopyMemory(wParam, orderInfo, sizeof(WINDOW_ORDER_INFO));
 
-	MessageQueue_Post(context->update->queue, (void*) context,
+	update_message_post(context,
 			MakeMessageId(WindowUpdate, WindowDelete), (void*) wParam, NULL);
 	return TRUE;
 }
@@ -1115,7 +1527,7 @@ static BOOL update_message_NotifyIconCreate(rdpContext* context, WINDOW_ORDER_IN
 	}
 	CopyMemory(lParam, notifyIconState, sizeof(NOTIFY_ICON_STATE_ORDER));
 
-	MessageQueue_Post(context->update->queue, (void*) context,
+	update_message_post(context,
 			MakeMessageId(WindowUpdate, NotifyIconCreate), (void*) wParam, (void*) lParam);
 	return TRUE;
 }
@@ -1138,7 +1550,7 @@ static BOOL update_message_NotifyIconUpdate(rdpContext* context, WINDOW_ORDER_IN
 	}
 	CopyMemory(lParam, notifyIconState, sizeof(NOTIFY_ICON_STATE_ORDER));
 
-	MessageQueue_Post(context->update->queue, (void*) context,
+	update_message_post(context,
 			MakeMessageId(WindowUpdate, NotifyIconUpdate), (void*) wParam, (void*) lParam);
 	return TRUE;
 }
@@ -1152,7 +1564,7 @@ static BOOL update_message_NotifyIconDelete(rdpContext* context, WINDOW_ORDER_IN
 		return FALSE;
 	CopyMemory(wParam, orderInfo, sizeof(WINDOW_ORDER_INFO));
 
-	MessageQueue_Post(context->update->queue, (void*) context,
+	update_message_post(context,
 			MakeMessageId(WindowUpdate, NotifyIconDelete), (void*) wParam, NULL);
 	return TRUE;
 }
@@ -1183,7 +1595,7 @@ static BOOL update_message_MonitoredDesktop(rdpContext* context, WINDOW_ORDER_IN
 		CopyMemory(lParam->windowIds, monitoredDesktop->windowIds, lParam->numWindowIds);
 	}
 
-	MessageQueue_Post(context->update->queue, (void*) context,
+	update_message_post(context,
 			MakeMessageId(WindowUpdate, MonitoredDesktop), (void*) wParam, (void*) lParam);
 	return TRUE;
 }
@@ -1197,7 +1609,7 @@ static BOOL update_message_NonMonitoredDesktop(rdpContext* context, WINDOW_ORDER
 		return FALSE;
 	CopyMemory(wParam, orderInfo, sizeof(WINDOW_ORDER_INFO));
 
-	MessageQueue_Post(context->update->queue, (void*) context,
+	update_message_post(context,
 			MakeMessageId(WindowUpdate, NonMonitoredDesktop), (void*) wParam, NULL);
 	return TRUE;
 }
@@ -1208,12 +1620,12 @@ static BOOL update_message_PointerPosition(rdpContext* context, POINTER_POSITION
 {
 	POINTER_POSITION_UPDATE* wParam;
 
-	wParam = (POINTER_POSITION_UPDATE*) malloc(sizeof(POINTER_POSITION_UPDATE));
+	wParam = (POINTER_POSITION_UPDATE*) update_message_alloc(context, sizeof(POINTER_POSITION_UPDATE));
 	if (!wParam)
 		return FALSE;
 	CopyMemory(wParam, pointerPosition, sizeof(POINTER_POSITION_UPDATE));
 
-	MessageQueue_Post(context->update->queue, (void*) context,
+	update_message_post(context,
 			MakeMessageId(PointerUpdate, PointerPosition), (void*) wParam, NULL);
 	return TRUE;
 }
@@ -1222,12 +1634,12 @@ static BOOL update_message_PointerSystem(rdpContext* context, POINTER_SYSTEM_UPD
 {
 	POINTER_SYSTEM_UPDATE* wParam;
 
-	wParam = (POINTER_SYSTEM_UPDATE*) malloc(sizeof(POINTER_SYSTEM_UPDATE));
+	wParam = (POINTER_SYSTEM_UPDATE*) update_message_alloc(context, sizeof(POINTER_SYSTEM_UPDATE));
 	if (!wParam)
 		return FALSE;
 	CopyMemory(wParam, pointerSystem, sizeof(POINTER_SYSTEM_UPDATE));
 
-	MessageQueue_Post(context->update->queue, (void*) context,
+	update_message_post(context,
 			MakeMessageId(PointerUpdate, PointerSystem), (void*) wParam, NULL);
 	return TRUE;
 }
@@ -1259,7 +1671,7 @@ static BOOL update_message_PointerColor(rdpContext* context, POINTER_COLOR_UPDAT
 		CopyMemory(wParam->xorMaskData, pointerColor->xorMaskData, wParam->lengthXorMask);
 	}
 
-	MessageQueue_Post(context->update->queue, (void*) context,
+	update_message_post(context,
 			MakeMessageId(PointerUpdate, PointerColor), (void*) wParam, NULL);
 	return TRUE;
 
@@ -1297,7 +1709,7 @@ static BOOL update_message_PointerNew(rdpContext* context, POINTER_NEW_UPDATE* p
 		CopyMemory(wParam->colorPtrAttr.xorMaskData, pointerNew->colorPtrAttr.xorMaskData, wParam->colorPtrAttr.lengthXorMask);
 	}
 
-	MessageQueue_Post(context->update->queue, (void*) context,
+	update_message_post(context,
 			MakeMessageId(PointerUpdate, PointerNew), (void*) wParam, NULL);
 	return TRUE;
 
@@ -1312,12 +1724,12 @@ static BOOL update_message_PointerCached(rdpContext* context, POINTER_CACHED_UPD
 {
 	POINTER_CACHED_UPDATE* wParam;
 
-	wParam = (POINTER_CACHED_UPDATE*) malloc(sizeof(POINTER_CACHED_UPDATE));
+	wParam = (POINTER_CACHED_UPDATE*) update_message_alloc(context, sizeof(POINTER_CACHED_UPDATE));
 	if (!wParam)
 		return FALSE;
 	CopyMemory(wParam, pointerCached, sizeof(POINTER_CACHED_UPDATE));
 
-	MessageQueue_Post(context->update->queue, (void*) context,
+	update_message_post(context,
 			MakeMessageId(PointerUpdate, PointerCached), (void*) wParam, NULL);
 	return TRUE;
 }
@@ -1350,14 +1762,14 @@ static int update_message_free_update_class(wMessage* msg, int type)
 				UINT32 index;
 				BITMAP_UPDATE* wParam = (BITMAP_UPDATE*) msg->wParam;
 
-				for (index = 0; index < wParam->number; index++)
+				if (msg->lParam)
 				{
-#ifdef WITH_STREAM_POOL
-					rdpContext* context = (rdpContext*) msg->context;
-					StreamPool_Release(context->rdp->transport->ReceivePool, wParam->rectangles[index].bitmapDataStream);
-#else
-					free(wParam->rectangles[index].bitmapDataStream);
-#endif
+					Stream_Release((wStream*) msg->lParam);
+				}
+				else
+				{
+					for (index = 0; index < wParam->number; index++)
+						free(wParam->rectangles[index].bitmapDataStream);
 				}
 
 				free(wParam->rectangles);
@@ -1390,15 +1802,14 @@ static int update_message_free_update_class(wMessage* msg, int type)
 
 		case Update_SurfaceBits:
 			{
-#ifdef WITH_STREAM_POOL
-				rdpContext* context = (rdpContext*) msg->context;
 				SURFACE_BITS_COMMAND* wParam = (SURFACE_BITS_COMMAND*) msg->wParam;
-				StreamPool_Release(context->rdp->transport->ReceivePool, wParam->bitmapData);
-#else
-				SURFACE_BITS_COMMAND* wParam = (SURFACE_BITS_COMMAND*) msg->wParam;
-				free(wParam->bitmapData);
+
+				if (msg->lParam)
+					Stream_Release((wStream*) msg->lParam);
+				else
+					free(wParam->bitmapData);
+
 				free(wParam);
-#endif
 			}
 			break;
 
@@ -1410,6 +1821,10 @@ static int update_message_free_update_class(wMessage* msg, int type)
 		case Update_SetKeyboardIndicators:
 			break;
 
+		case Update_Batch:
+			update_message_batch_free((UPDATE_MESSAGE_BATCH*) msg->wParam);
+			break;
+
 		default:
 			status = -1;
 			break;
@@ -1487,6 +1902,11 @@ static int update_message_process_update_class(rdpUpdateProxy* proxy, wMessage*
 			IFCALL(proxy->SetKeyboardIndicators, msg->context, (UINT16) (size_t) msg->wParam);
 			break;
 
+		case Update_Batch:
+			update_message_process_batch(proxy, (UPDATE_MESSAGE_BATCH*) msg->wParam);
+			msg->wParam = NULL;
+			break;
+
 		default:
 			status = -1;
 			break;
@@ -1729,7 +2149,11 @@ static int update_message_free_secondary_update_class(wMessage* msg, int type)
 			{
 				CACHE_BITMAP_ORDER* wParam = (CACHE_BITMAP_ORDER*) msg->wParam;
 
-				free(wParam->bitmapDataStream);
+				if (msg->lParam)
+					Stream_Release((wStream*) msg->lParam);
+				else
+					free(wParam->bitmapDataStream);
+
 				free(wParam);
 			}
 			break;
@@ -1738,7 +2162,11 @@ static int update_message_free_secondary_update_class(wMessage* msg, int type)
 			{
 				CACHE_BITMAP_V2_ORDER* wParam = (CACHE_BITMAP_V2_ORDER*) msg->wParam;
 
-				free(wParam->bitmapDataStream);
+				if (msg->lParam)
+					Stream_Release((wStream*) msg->lParam);
+				else
+					free(wParam->bitmapDataStream);
+
 				free(wParam);
 			}
 			break;
@@ -1747,7 +2175,11 @@ static int update_message_free_secondary_update_class(wMessage* msg, int type)
 			{
 				CACHE_BITMAP_V3_ORDER* wParam = (CACHE_BITMAP_V3_ORDER*) msg->wParam;
 
-				free(wParam->bitmapData.data);
+				if (msg->lParam)
+					Stream_Release((wStream*) msg->lParam);
+				else
+					free(wParam->bitmapData.data);
+
 				free(wParam);
 			}
 			break;
@@ -2566,6 +2998,8 @@ void update_message_proxy_free(rdpUpdateProxy* message)
 		MessageQueue_PostQuit(message->update->queue, 0);
 		WaitForSingleObject(message->thread, INFINITE);
 		CloseHandle(message->thread);
+		update_message_batch_free(message->batch);
+		update_message_batch_free(message->spareBatch);
 		free(message);
 	}
 }
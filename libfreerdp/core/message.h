@@ -27,6 +27,33 @@
  * Update Message Queue
  */
 
+/**
+ * Updates received between BeginPaint and EndPaint are collected in a batch
+ * and posted as a single Update_Batch message. Fixed-size update parameters
+ * are allocated from the batch arena, which is kept across batches.
+ */
+
+#define UPDATE_MESSAGE_ARENA_BLOCK_SIZE		65536
+
+typedef struct update_message_arena_block UPDATE_MESSAGE_ARENA_BLOCK;
+
+struct update_message_arena_block
+{
+	UPDATE_MESSAGE_ARENA_BLOCK* next;
+	size_t size;
+	size_t used;
+	BYTE* data;
+};
+
+struct update_message_batch
+{
+	UINT32 count;
+	UINT32 capacity;
+	wMessage* messages;
+	UPDATE_MESSAGE_ARENA_BLOCK* blocks;
+};
+typedef struct update_message_batch UPDATE_MESSAGE_BATCH;
+
 /* Update Proxy Interface */
 
 struct rdp_update_proxy
@@ -123,6 +150,11 @@ struct rdp_update_proxy
 	pPointerCached PointerCached;
 
 	HANDLE thread;
+
+	/* open batch, only used by the thread that called BeginPaint */
+	DWORD batchThreadId;
+	UPDATE_MESSAGE_BATCH* batch;
+	UPDATE_MESSAGE_BATCH* spareBatch;
 };
 
 int update_message_queue_process_message(rdpUpdate* update, wMessage* message);
@@ -130,8 +162,8 @@ int update_message_queue_free_message(wMessage* message);
 
 int update_message_queue_process_pending_messages(rdpUpdate* update);
 
-rdpUpdateProxy* update_message_proxy_new(rdpUpdate* update);
-void update_message_proxy_free(rdpUpdateProxy* message);
+FREERDP_TEST_API rdpUpdateProxy* update_message_proxy_new(rdpUpdate* update);
+FREERDP_TEST_API void update_message_proxy_free(rdpUpdateProxy* message);
 
 /**
  * Input Message Queue
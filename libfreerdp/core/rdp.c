@@ -814,8 +814,15 @@ int rdp_recv_data_pdu(rdpRdp* rdp, wStream* s)
 	switch (type)
 	{
 		case DATA_PDU_TYPE_UPDATE:
+			rdp->update->pdu = cs;
+
 			if (!update_recv(rdp->update, cs))
+			{
+				rdp->update->pdu = NULL;
 				goto out_fail;
+			}
+
+			rdp->update->pdu = NULL;
 			break;
 
 		case DATA_PDU_TYPE_CONTROL:
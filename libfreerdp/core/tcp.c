@@ -35,6 +35,7 @@
 #include <unistd.h>
 #include <sys/ioctl.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
 #include <net/if.h>
@@ -88,6 +89,8 @@
 
 /* Simple Socket BIO */
 
+#define TRANSPORT_BIO_MAX_SEGMENTS	16
+
 struct _WINPR_BIO_SIMPLE_SOCKET
 {
 	SOCKET socket;
@@ -134,6 +137,70 @@ static int transport_bio_simple_write(BIO* bio, const char* buf, int size)
 	return status;
 }
 
+/**
+ * Gathers up to TRANSPORT_BIO_MAX_SEGMENTS segments into a single send call,
+ * a short count means the socket send buffer is full.
+ */
+
+static int transport_bio_simple_write_vector(BIO* bio, const DataChunk* chunks, int count)
+{
+	int index;
+	int error;
+	int status = 0;
+	WINPR_BIO_SIMPLE_SOCKET* ptr = (WINPR_BIO_SIMPLE_SOCKET*) bio->ptr;
+#ifdef _WIN32
+	DWORD bytesSent = 0;
+	WSABUF buffers[TRANSPORT_BIO_MAX_SEGMENTS];
+#else
+	struct iovec buffers[TRANSPORT_BIO_MAX_SEGMENTS];
+#endif
+
+	if (!chunks || (count < 1))
+		return 0;
+
+	if (count > TRANSPORT_BIO_MAX_SEGMENTS)
+		count = TRANSPORT_BIO_MAX_SEGMENTS;
+
+	BIO_clear_flags(bio, BIO_FLAGS_WRITE);
+
+	for (index = 0; index < count; index++)
+	{
+#ifdef _WIN32
+		buffers[index].buf = (CHAR*) chunks[index].data;
+		buffers[index].len = (ULONG) chunks[index].size;
+#else
+		buffers[index].iov_base = (void*) chunks[index].data;
+		buffers[index].iov_len = chunks[index].size;
+#endif
+	}
+
+#ifdef _WIN32
+	if (WSASend(ptr->socket, buffers, count, &bytesSent, 0, NULL, NULL) == 0)
+		status = (int) bytesSent;
+	else
+		status = -1;
+#else
+	status = (int) writev((int) ptr->socket, buffers, count);
+#endif
+
+	if (status <= 0)
+	{
+		error = WSAGetLastError();
+
+		if ((error == WSAEWOULDBLOCK) || (error == WSAEINTR) ||
+			(error == WSAEINPROGRESS) || (error == WSAEALREADY))
+		{
+			BIO_set_flags(bio, (BIO_FLAGS_WRITE | BIO_FLAGS_SHOULD_RETRY));
+		}
+		else
+		{
+			BIO_clear_flags(bio, BIO_FLAGS_SHOULD_RETRY);
+		}
+	}
+
+	return status;
+}
+
 static int transport_bio_simple_read(BIO* bio, char* buf, int size)
 {
 	int error;
@@ -212,6 +279,13 @@ static long transport_bio_simple_ctrl(BIO* bio, int cmd, long arg1, void* arg2)
 
 		return 1;
 	}
+	else if (cmd == BIO_C_WRITE_VECTOR)
+	{
+		if (!bio->init)
+			return -1;
+
+		return transport_bio_simple_write_vector(bio, (const DataChunk*) arg2, (int) arg1);
+	}
 	else if (cmd == BIO_C_SET_NONBLOCK)
 	{
 #ifndef _WIN32
@@ -472,6 +546,8 @@ long transport_bio_buffered_callback(BIO* bio, int mode, const char* argp, int a
 	return 1;
 }
 
+static int transport_bio_buffered_write_vector(BIO* bio, const DataChunk* chunks, int count);
+
 static int transport_bio_buffered_write(BIO* bio, const char* buf, int num)
 {
 	int i, ret;
@@ -481,13 +557,18 @@ static int transport_bio_buffered_write(BIO* bio, const char* buf, int num)
 	DataChunk chunks[2];
 	WINPR_BIO_BUFFERED_SOCKET* ptr = (WINPR_BIO_BUFFERED_SOCKET*) bio->ptr;
 
+	/* nothing queued: hand the data to the socket without copying it first */
+	if (buf && num && !ringbuffer_used(&ptr->xmitBuffer))
+	{
+		chunks[0].data = (const BYTE*) buf;
+		chunks[0].size = num;
+		return transport_bio_buffered_write_vector(bio, chunks, 1);
+	}
+
 	ret = num;
 	ptr->writeBlocked = FALSE;
 	BIO_clear_flags(bio, BIO_FLAGS_WRITE);
 
-	/* we directly append extra bytes in the xmit buffer, this could be prevented
-	 * but for now it makes the code more simple.
-	 */
 	if (buf && num && !ringbuffer_write(&ptr->xmitBuffer, (const BYTE*) buf, num))
 	{
 		WLog_ERR(TAG, "an error occured when writing (num: %d)", num);
@@ -532,6 +613,89 @@ out:
 	return ret;
 }
 
+/**
+ * Segments are written to the socket in place when nothing is queued, only
+ * the part the socket did not take is copied into the xmit buffer. Like
+ * BIO_write on this BIO, all bytes are always accepted.
+ */
+
+static int transport_bio_buffered_write_vector(BIO* bio, const DataChunk* chunks, int count)
+{
+	int index;
+	int status;
+	size_t offset;
+	size_t total = 0;
+	WINPR_BIO_BUFFERED_SOCKET* ptr = (WINPR_BIO_BUFFERED_SOCKET*) bio->ptr;
+
+	if (!chunks || (count < 1))
+		return 0;
+
+	for (index = 0; index < count; index++)
+		total += chunks[index].size;
+
+	if (ringbuffer_used(&ptr->xmitBuffer))
+	{
+		/* queued bytes go first, append behind them */
+
+		for (index = 0; index < count; index++)
+		{
+			if (chunks[index].size && !ringbuffer_write(&ptr->xmitBuffer, chunks[index].data, chunks[index].size))
+			{
+				WLog_ERR(TAG, "an error occured when writing (num: %d)", (int) chunks[index].size);
+				return -1;
+			}
+		}
+
+		if (transport_bio_buffered_write(bio, NULL, 0) < 0)
+			return -1;
+
+		return (int) total;
+	}
+
+	ptr->writeBlocked = FALSE;
+	BIO_clear_flags(bio, BIO_FLAGS_WRITE);
+
+	status = BIO_write_vector(bio->next_bio, chunks, count);
+
+	if (status <= 0)
+	{
+		if (!BIO_should_retry(bio->next_bio))
+		{
+			BIO_clear_flags(bio, BIO_FLAGS_SHOULD_RETRY);
+			return -1; /* fatal error */
+		}
+
+		status = 0;
+	}
+
+	offset = (size_t) status;
+
+	for (index = 0; index < count; index++)
+	{
+		if (offset >= chunks[index].size)
+		{
+			offset -= chunks[index].size;
+			continue;
+		}
+
+		if (!ringbuffer_write(&ptr->xmitBuffer, &chunks[index].data[offset], chunks[index].size - offset))
+		{
+			WLog_ERR(TAG, "an error occured when writing (num: %d)", (int) (chunks[index].size - offset));
+			return -1;
+		}
+
+		offset = 0;
+	}
+
+	if (ringbuffer_used(&ptr->xmitBuffer))
+	{
+		BIO_set_flags(bio, BIO_FLAGS_WRITE);
+		ptr->writeBlocked = TRUE;
+	}
+
+	return (int) total;
+}
+
 static int transport_bio_buffered_read(BIO* bio, char* buf, int size)
 {
 	int status;
@@ -604,6 +768,10 @@ static long transport_bio_buffered_ctrl(BIO* bio, int cmd, long arg1, void* arg2
 			status = (int) ptr->writeBlocked;
 			break;
 
+		case BIO_C_WRITE_VECTOR:
+			status = transport_bio_buffered_write_vector(bio, (const DataChunk*) arg2, (int) arg1);
+			break;
+
 		default:
 			status = BIO_ctrl(bio->next_bio, cmd, arg1, arg2);
 			break;
@@ -47,6 +47,7 @@
 #define BIO_C_WRITE_BLOCKED		1106
 #define BIO_C_WAIT_READ			1107
 #define BIO_C_WAIT_WRITE		1108
+#define BIO_C_WRITE_VECTOR		1109
 
 #define BIO_set_socket(b, s, c)		BIO_ctrl(b, BIO_C_SET_SOCKET, c, s);
 #define BIO_get_socket(b, c)		BIO_ctrl(b, BIO_C_GET_SOCKET, 0, (char*) c)
@@ -57,6 +58,13 @@
 #define BIO_wait_read(b, c)		BIO_ctrl(b, BIO_C_WAIT_READ, c, NULL)
 #define BIO_wait_write(b, c)		BIO_ctrl(b, BIO_C_WAIT_WRITE, c, NULL)
 
+/**
+ * Writes an array of DataChunk segments as if they were one buffer, returns
+ * the number of bytes written or <= 0 with the same retry semantics as
+ * BIO_write. Supported by the simple socket, buffered socket and TLS BIOs.
+ */
+#define BIO_write_vector(b, v, c)	BIO_ctrl(b, BIO_C_WRITE_VECTOR, c, (void*) v)
+
 BIO_METHOD* BIO_s_simple_socket(void);
 BIO_METHOD* BIO_s_buffered_socket(void);
 
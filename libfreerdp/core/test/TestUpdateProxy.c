@@ -0,0 +1,311 @@
+/**
+ * FreeRDP: A Remote Desktop Protocol Implementation
+ * Update Message Proxy Tests
+ *
+ * Copyright 2026 agent <agent@local>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <winpr/crt.h>
+#include <winpr/print.h>
+#include <winpr/synch.h>
+#include <winpr/interlocked.h>
+
+#include <freerdp/freerdp.h>
+
+#include "message.h"
+
+#define TEST_PROXY_MAX_CALLS	32
+
+/**
+ * The original update callbacks, called by the proxy thread, record what
+ * reaches them: the update type and one value identifying the update.
+ */
+
+struct test_proxy_call
+{
+	UINT32 type;
+	UINT32 value;
+};
+typedef struct test_proxy_call TEST_PROXY_CALL;
+
+struct test_proxy_context
+{
+	rdpContext context;
+
+	int count;
+	TEST_PROXY_CALL calls[TEST_PROXY_MAX_CALLS];
+};
+typedef struct test_proxy_context TEST_PROXY_CONTEXT;
+
+static void test_proxy_record(rdpContext* context, UINT32 type, UINT32 value)
+{
+	TEST_PROXY_CONTEXT* test = (TEST_PROXY_CONTEXT*) context;
+
+	if (test->count < TEST_PROXY_MAX_CALLS)
+	{
+		test->calls[test->count].type = type;
+		test->calls[test->count].value = value;
+	}
+
+	test->count++;
+}
+
+static BOOL test_proxy_BeginPaint(rdpContext* context)
+{
+	test_proxy_record(context, MakeMessageId(Update, BeginPaint), 0);
+	return TRUE;
+}
+
+static BOOL test_proxy_EndPaint(rdpContext* context)
+{
+	test_proxy_record(context, MakeMessageId(Update, EndPaint), 0);
+	return TRUE;
+}
+
+static BOOL test_proxy_OpaqueRect(rdpContext* context, OPAQUE_RECT_ORDER* opaque_rect)
+{
+	test_proxy_record(context, MakeMessageId(PrimaryUpdate, OpaqueRect), opaque_rect->color);
+	return TRUE;
+}
+
+static BOOL test_proxy_PointerPosition(rdpContext* context, POINTER_POSITION_UPDATE* pointer_position)
+{
+	test_proxy_record(context, MakeMessageId(PointerUpdate, PointerPosition), pointer_position->xPos);
+	return TRUE;
+}
+
+static BOOL test_proxy_PointerSystem(rdpContext* context, POINTER_SYSTEM_UPDATE* pointer_system)
+{
+	test_proxy_record(context, MakeMessageId(PointerUpdate, PointerSystem), pointer_system->type);
+	return TRUE;
+}
+
+static BOOL test_proxy_PointerCached(rdpContext* context, POINTER_CACHED_UPDATE* pointer_cached)
+{
+	test_proxy_record(context, MakeMessageId(PointerUpdate, PointerCached), pointer_cached->cacheIndex);
+	return TRUE;
+}
+
+static void test_proxy_opaque_rect(rdpUpdate* update, INT32 left, INT32 top, INT32 width, INT32 height, UINT32 color)
+{
+	OPAQUE_RECT_ORDER opaque_rect;
+
+	ZeroMemory(&opaque_rect, sizeof(OPAQUE_RECT_ORDER));
+	opaque_rect.nLeftRect = left;
+	opaque_rect.nTopRect = top;
+	opaque_rect.nWidth = width;
+	opaque_rect.nHeight = height;
+	opaque_rect.color = color;
+
+	update->primary->OpaqueRect(update->context, &opaque_rect);
+}
+
+static void test_proxy_pointer_position(rdpUpdate* update, UINT32 x, UINT32 y)
+{
+	POINTER_POSITION_UPDATE pointer_position;
+
+	pointer_position.xPos = x;
+	pointer_position.yPos = y;
+
+	update->pointer->PointerPosition(update->context, &pointer_position);
+}
+
+static BOOL test_proxy_check(TEST_PROXY_CONTEXT* test, const char* name, const TEST_PROXY_CALL* expected, int count)
+{
+	int index;
+
+	if (test->count != count)
+	{
+		printf("%s: %d updates instead of %d\n", name, test->count, count);
+		return FALSE;
+	}
+
+	for (index = 0; index < count; index++)
+	{
+		if ((test->calls[index].type != expected[index].type) || (test->calls[index].value != expected[index].value))
+		{
+			printf("%s: update %d is 0x%08X/%u instead of 0x%08X/%u\n", name, index,
+					test->calls[index].type, test->calls[index].value, expected[index].type, expected[index].value);
+			return FALSE;
+		}
+	}
+
+	return TRUE;
+}
+
+/**
+ * Waits for the proxy thread to hand the processed batch back.
+ */
+
+static UPDATE_MESSAGE_BATCH* test_proxy_wait_spare(rdpUpdateProxy* proxy)
+{
+	int retry;
+	UPDATE_MESSAGE_BATCH* batch;
+
+	for (retry = 0; retry < 500; retry++)
+	{
+		batch = (UPDATE_MESSAGE_BATCH*) InterlockedCompareExchangePointer((PVOID volatile*) &proxy->spareBatch, NULL, NULL);
+
+		if (batch)
+			return batch;
+
+		Sleep(10);
+	}
+
+	return NULL;
+}
+
+int TestUpdateProxy(int argc, char* argv[])
+{
+	int result = -1;
+	rdpUpdate* update = NULL;
+	rdpUpdateProxy* proxy = NULL;
+	TEST_PROXY_CONTEXT* test = NULL;
+	UPDATE_MESSAGE_BATCH* spare;
+	POINTER_SYSTEM_UPDATE pointer_system;
+	POINTER_CACHED_UPDATE pointer_cached;
+
+	/* overdrawn opaque rectangles and superseded pointer updates are dropped */
+	const TEST_PROXY_CALL compacted[] =
+	{
+		{ MakeMessageId(Update, BeginPaint), 0 },
+		{ MakeMessageId(PrimaryUpdate, OpaqueRect), 2 },
+		{ MakeMessageId(PrimaryUpdate, OpaqueRect), 3 },
+		{ MakeMessageId(PointerUpdate, PointerPosition), 20 },
+		{ MakeMessageId(PointerUpdate, PointerCached), 5 },
+		{ MakeMessageId(Update, EndPaint), 0 }
+	};
+
+	/* a paint that was never ended is closed by the next one */
+	const TEST_PROXY_CALL unended[] =
+	{
+		{ MakeMessageId(Update, BeginPaint), 0 },
+		{ MakeMessageId(PrimaryUpdate, OpaqueRect), 4 },
+		{ MakeMessageId(Update, EndPaint), 0 },
+		{ MakeMessageId(Update, BeginPaint), 0 },
+		{ MakeMessageId(PrimaryUpdate, OpaqueRect), 5 },
+		{ MakeMessageId(Update, EndPaint), 0 }
+	};
+
+	test = (TEST_PROXY_CONTEXT*) calloc(1, sizeof(TEST_PROXY_CONTEXT));
+	update = (rdpUpdate*) calloc(1, sizeof(rdpUpdate));
+
+	if (!test || !update)
+		goto out;
+
+	update->context = &test->context;
+	test->context.update = update;
+
+	update->pointer = (rdpPointerUpdate*) calloc(1, sizeof(rdpPointerUpdate));
+	update->primary = (rdpPrimaryUpdate*) calloc(1, sizeof(rdpPrimaryUpdate));
+	update->secondary = (rdpSecondaryUpdate*) calloc(1, sizeof(rdpSecondaryUpdate));
+	update->altsec = (rdpAltSecUpdate*) calloc(1, sizeof(rdpAltSecUpdate));
+	update->window = (rdpWindowUpdate*) calloc(1, sizeof(rdpWindowUpdate));
+	update->queue = MessageQueue_New(NULL);
+
+	if (!update->pointer || !update->primary || !update->secondary ||
+			!update->altsec || !update->window || !update->queue)
+		goto out;
+
+	update->BeginPaint = test_proxy_BeginPaint;
+	update->EndPaint = test_proxy_EndPaint;
+	update->primary->OpaqueRect = test_proxy_OpaqueRect;
+	update->pointer->PointerPosition = test_proxy_PointerPosition;
+	update->pointer->PointerSystem = test_proxy_PointerSystem;
+	update->pointer->PointerCached = test_proxy_PointerCached;
+
+	proxy = update->proxy = update_message_proxy_new(update);
+
+	if (!proxy)
+		goto out;
+
+	update->BeginPaint(update->context);
+
+	/* the second rectangle covers the first one, the third one does not */
+	test_proxy_opaque_rect(update, 10, 10, 20, 20, 1);
+	test_proxy_opaque_rect(update, 0, 0, 100, 100, 2);
+	test_proxy_opaque_rect(update, 50, 50, 100, 100, 3);
+
+	test_proxy_pointer_position(update, 10, 10);
+	test_proxy_pointer_position(update, 20, 20);
+
+	pointer_system.type = SYSPTR_NULL;
+	update->pointer->PointerSystem(update->context, &pointer_system);
+
+	pointer_cached.cacheIndex = 5;
+	update->pointer->PointerCached(update->context, &pointer_cached);
+
+	update->EndPaint(update->context);
+
+	/* the processed batch is kept for the next paint */
+
+	spare = test_proxy_wait_spare(proxy);
+
+	if (!spare)
+	{
+		printf("processed batch not recycled\n");
+		goto out;
+	}
+
+	if (!test_proxy_check(test, "compacted", compacted, sizeof(compacted) / sizeof(compacted[0])))
+		goto out;
+
+	test->count = 0;
+
+	update->BeginPaint(update->context);
+
+	if ((proxy->batch != spare) || proxy->spareBatch)
+	{
+		printf("spare batch not reused\n");
+		goto out;
+	}
+
+	test_proxy_opaque_rect(update, 0, 0, 10, 10, 4);
+
+	update->BeginPaint(update->context);
+	test_proxy_opaque_rect(update, 0, 0, 100, 100, 5);
+	update->EndPaint(update->context);
+
+	/* freeing the proxy processes the queued batches first */
+
+	update_message_proxy_free(proxy);
+	proxy = update->proxy = NULL;
+
+	if (!test_proxy_check(test, "unended", unended, sizeof(unended) / sizeof(unended[0])))
+		goto out;
+
+	result = 0;
+
+out:
+	if (proxy)
+		update_message_proxy_free(proxy);
+
+	if (update)
+	{
+		if (update->queue)
+			MessageQueue_Free(update->queue);
+
+		free(update->pointer);
+		free(update->primary);
+		free(update->secondary);
+		free(update->altsec);
+		free(update->window);
+		free(update);
+	}
+
+	free(test);
+
+	return result;
+}
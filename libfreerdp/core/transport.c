@@ -566,7 +566,8 @@ int transport_read_pdu(rdpTransport* transport, wStream* s)
 		}
 	}
 
-	if (!Stream_EnsureCapacity(s, Stream_GetPosition(s) + pduLength))
+	/* pduLength includes the header bytes already read */
+	if (!Stream_EnsureCapacity(s, pduLength))
 		return -1;
 	status = transport_read_layer_bytes(transport, s, pduLength - Stream_GetPosition(s));
 
@@ -581,6 +582,34 @@ int transport_read_pdu(rdpTransport* transport, wStream* s)
 	return Stream_Length(s);
 }
 
+/**
+ * In blocking mode, or when asked to wait for the output buffer to be flushed,
+ * waits until the buffered BIO has handed everything to the socket.
+ */
+
+static int transport_write_flush_blocked(rdpTransport* transport)
+{
+	if (!transport->blocking && !transport->settings->WaitForOutputBufferFlush)
+		return 1;
+
+	while (BIO_write_blocked(transport->frontBio))
+	{
+		if (BIO_wait_write(transport->frontBio, 100) < 0)
+		{
+			WLog_ERR(TAG, "error when selecting for write");
+			return -1;
+		}
+
+		if (BIO_flush(transport->frontBio) < 1)
+		{
+			WLog_ERR(TAG, "error when flushing outputBuffer");
+			return -1;
+		}
+	}
+
+	return 1;
+}
+
 int transport_write(rdpTransport* transport, wStream* s)
 {
 	int length;
@@ -625,24 +654,10 @@ int transport_write(rdpTransport* transport, wStream* s)
 			continue;
 		}
 
-		if (transport->blocking || transport->settings->WaitForOutputBufferFlush)
+		if (transport_write_flush_blocked(transport) < 0)
 		{
-			while (BIO_write_blocked(transport->frontBio))
-			{
-				if (BIO_wait_write(transport->frontBio, 100) < 0)
-				{
-					WLog_ERR(TAG, "error when selecting for write");
-					status = -1;
-					goto out_cleanup;
-				}
-
-				if (BIO_flush(transport->frontBio) < 1)
-				{
-					WLog_ERR(TAG, "error when flushing outputBuffer");
-					status = -1;
-					goto out_cleanup;
-				}
-			}
+			status = -1;
+			goto out_cleanup;
 		}
 
 		length -= status;
@@ -665,6 +680,106 @@ out_cleanup:
 	return status;
 }
 
+/**
+ * Writes the segments as one PDU without assembling them first: they are
+ * gathered into a single socket write, or coalesced into TLS records. Gateway
+ * transports get the segments one after the other. The chunks array is
+ * consumed: sizes and data pointers are advanced as bytes are written.
+ */
+
+int transport_write_vector(rdpTransport* transport, DataChunk* chunks, int count)
+{
+	int index;
+	int status = -1;
+	int length = 0;
+	BOOL vectored;
+
+	EnterCriticalSection(&(transport->WriteLock));
+
+	vectored = ((transport->layer == TRANSPORT_LAYER_TCP) ||
+			(transport->layer == TRANSPORT_LAYER_TLS)) ? TRUE : FALSE;
+
+	for (index = 0; index < count; index++)
+	{
+		if (chunks[index].size > 0)
+		{
+			WLog_Packet(WLog_Get(TAG), WLOG_TRACE, (BYTE*) chunks[index].data,
+					chunks[index].size, WLOG_PACKET_OUTBOUND);
+		}
+
+		length += (int) chunks[index].size;
+	}
+
+	index = 0;
+
+	while (index < count)
+	{
+		if (!chunks[index].size)
+		{
+			index++;
+			continue;
+		}
+
+		if (vectored)
+			status = BIO_write_vector(transport->frontBio, &chunks[index], count - index);
+		else
+			status = BIO_write(transport->frontBio, chunks[index].data, (int) chunks[index].size);
+
+		if (status <= 0)
+		{
+			if (!BIO_should_retry(transport->frontBio))
+				goto out_cleanup;
+
+			/* non-blocking can live with blocked IOs */
+			if (!transport->blocking)
+				goto out_cleanup;
+
+			if (BIO_wait_write(transport->frontBio, 100) < 0)
+			{
+				WLog_ERR(TAG, "error when selecting for write");
+				status = -1;
+				goto out_cleanup;
+			}
+
+			continue;
+		}
+
+		if (transport_write_flush_blocked(transport) < 0)
+		{
+			status = -1;
+			goto out_cleanup;
+		}
+
+		while ((status > 0) && (index < count))
+		{
+			if ((size_t) status < chunks[index].size)
+			{
+				chunks[index].data += status;
+				chunks[index].size -= status;
+				break;
+			}
+
+			status -= (int) chunks[index].size;
+			chunks[index].size = 0;
+			index++;
+		}
+	}
+
+	transport->written += length;
+	status = length;
+
+out_cleanup:
+
+	if (status < 0)
+	{
+		/* A write error indicates that the peer has dropped the connection */
+		transport->layer = TRANSPORT_LAYER_CLOSED;
+	}
+
+	LeaveCriticalSection(&(transport->WriteLock));
+	return status;
+}
+
 DWORD transport_get_event_handles(rdpTransport* transport, HANDLE* events, DWORD count)
 {
 	DWORD nCount = 0;
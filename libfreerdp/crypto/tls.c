@@ -45,9 +45,12 @@
 
 #define TAG FREERDP_TAG("crypto")
 
+#define BIO_RDP_TLS_RECORD_SIZE		16384
+
 struct _BIO_RDP_TLS
 {
 	SSL* ssl;
+	BYTE* record;
 };
 typedef struct _BIO_RDP_TLS BIO_RDP_TLS;
 
@@ -107,6 +110,92 @@ static int bio_rdp_tls_write(BIO* bio, const char* buf, int size)
 	return status;
 }
 
+/**
+ * Small segments (PDU headers, trailers) are coalesced with the data around
+ * them into full size TLS records instead of each going out as a record of
+ * its own. Data spanning whole records is encrypted straight from the segment.
+ */
+
+static int bio_rdp_tls_write_vector(BIO* bio, const DataChunk* chunks, int count)
+{
+	int index;
+	int status = 0;
+	int written = 0;
+	size_t used = 0;
+	size_t offset;
+	size_t length;
+	BIO_RDP_TLS* tls = (BIO_RDP_TLS*) bio->ptr;
+
+	if (!chunks || (count < 1))
+		return 0;
+
+	if (!tls->record)
+	{
+		tls->record = (BYTE*) malloc(BIO_RDP_TLS_RECORD_SIZE);
+
+		if (!tls->record)
+			return -1;
+	}
+
+	for (index = 0; index < count; index++)
+	{
+		offset = 0;
+
+		while (offset < chunks[index].size)
+		{
+			length = chunks[index].size - offset;
+
+			if (!used && (length >= BIO_RDP_TLS_RECORD_SIZE))
+			{
+				length -= (length % BIO_RDP_TLS_RECORD_SIZE);
+				status = bio_rdp_tls_write(bio, (const char*) &chunks[index].data[offset], (int) length);
+
+				if (status <= 0)
+					goto out;
+
+				written += status;
+
+				if ((size_t) status < length)
+					goto out;
+
+				offset += length;
+				continue;
+			}
+
+			length = MIN(length, BIO_RDP_TLS_RECORD_SIZE - used);
+			CopyMemory(&tls->record[used], &chunks[index].data[offset], length);
+			used += length;
+			offset += length;
+
+			if (used == BIO_RDP_TLS_RECORD_SIZE)
+			{
+				status = bio_rdp_tls_write(bio, (const char*) tls->record, (int) used);
+
+				if (status <= 0)
+					goto out;
+
+				written += status;
+
+				if ((size_t) status < used)
+					goto out;
+
+				used = 0;
+			}
+		}
+	}
+
+	if (used > 0)
+	{
+		status = bio_rdp_tls_write(bio, (const char*) tls->record, (int) used);
+
+		if (status > 0)
+			written += status;
+	}
+
+out:
+	return (written > 0) ? written : status;
+}
+
 static int bio_rdp_tls_read(BIO* bio, char* buf, int size)
 {
 	int status;
@@ -299,6 +388,10 @@ static long bio_rdp_tls_ctrl(BIO* bio, int cmd, long num, void* ptr)
 			status = 1;
 			break;
 
+		case BIO_C_WRITE_VECTOR:
+			status = bio_rdp_tls_write_vector(bio, (const DataChunk*) ptr, (int) num);
+			break;
+
 		case BIO_C_GET_SSL:
 			if (ptr)
 			{
@@ -409,6 +502,7 @@ static int bio_rdp_tls_free(BIO* bio)
 		bio->flags = 0;
 	}
 
+	free(tls->record);
 	free(tls);
 
 	return 1;
@@ -365,6 +365,65 @@ pstatus_t general_RGBToYUV420_8u_P3AC4R(const BYTE* pSrc, INT32 srcStep,
 	return PRIMITIVES_SUCCESS;
 }
 
+/**
+ * Convert what a vectorized version left over: the columns from nWidth on
+ * and the rows from nHeight on, nWidth and nHeight being even.
+ */
+
+void general_RGBToYUV420_8u_P3AC4R_borders(const BYTE* pSrc, INT32 srcStep,
+		BYTE* pDst[3], INT32 dstStep[3], const prim_size_t* roi, int nWidth, int nHeight)
+{
+	BYTE* pBorder[3];
+	prim_size_t size;
+
+	if (nWidth < roi->width)
+	{
+		pBorder[0] = pDst[0] + nWidth;
+		pBorder[1] = pDst[1] + (nWidth / 2);
+		pBorder[2] = pDst[2] + (nWidth / 2);
+		size.width = roi->width - nWidth;
+		size.height = roi->height;
+		general_RGBToYUV420_8u_P3AC4R(pSrc + (nWidth * 4), srcStep, pBorder, dstStep, &size);
+	}
+
+	if ((nHeight < roi->height) && (nWidth > 0))
+	{
+		pBorder[0] = pDst[0] + (nHeight * dstStep[0]);
+		pBorder[1] = pDst[1] + ((nHeight / 2) * dstStep[1]);
+		pBorder[2] = pDst[2] + ((nHeight / 2) * dstStep[2]);
+		size.width = nWidth;
+		size.height = roi->height - nHeight;
+		general_RGBToYUV420_8u_P3AC4R(pSrc + (nHeight * srcStep), srcStep, pBorder, dstStep, &size);
+	}
+}
+
+void general_YUV420ToRGB_8u_P3AC4R_borders(const BYTE* pSrc[3], int srcStep[3],
+		BYTE* pDst, int dstStep, const prim_size_t* roi, int nWidth, int nHeight)
+{
+	const BYTE* pBorder[3];
+	prim_size_t size;
+
+	if (nWidth < roi->width)
+	{
+		pBorder[0] = pSrc[0] + nWidth;
+		pBorder[1] = pSrc[1] + (nWidth / 2);
+		pBorder[2] = pSrc[2] + (nWidth / 2);
+		size.width = roi->width - nWidth;
+		size.height = roi->height;
+		general_YUV420ToRGB_8u_P3AC4R(pBorder, srcStep, pDst + (nWidth * 4), dstStep, &size);
+	}
+
+	if ((nHeight < roi->height) && (nWidth > 0))
+	{
+		pBorder[0] = pSrc[0] + (nHeight * srcStep[0]);
+		pBorder[1] = pSrc[1] + ((nHeight / 2) * srcStep[1]);
+		pBorder[2] = pSrc[2] + ((nHeight / 2) * srcStep[2]);
+		size.width = nWidth;
+		size.height = roi->height - nHeight;
+		general_YUV420ToRGB_8u_P3AC4R(pBorder, srcStep, pDst + (nHeight * dstStep), dstStep, &size);
+	}
+}
+
 void primitives_init_YUV(primitives_t* prims)
 {
 	prims->YUV420ToRGB_8u_P3AC4R = general_YUV420ToRGB_8u_P3AC4R;
@@ -21,6 +21,16 @@
 
 pstatus_t general_yCbCrToRGB_16s8u_P3AC4R(const INT16* pSrc[3], int srcStep, BYTE* pDst, int dstStep, const prim_size_t* roi);
 
+pstatus_t general_YUV420ToRGB_8u_P3AC4R(const BYTE* pSrc[3], int srcStep[3],
+		BYTE* pDst, int dstStep, const prim_size_t* roi);
+pstatus_t general_RGBToYUV420_8u_P3AC4R(const BYTE* pSrc, INT32 srcStep,
+		BYTE* pDst[3], INT32 dstStep[3], const prim_size_t* roi);
+
+void general_RGBToYUV420_8u_P3AC4R_borders(const BYTE* pSrc, INT32 srcStep,
+		BYTE* pDst[3], INT32 dstStep[3], const prim_size_t* roi, int nWidth, int nHeight);
+void general_YUV420ToRGB_8u_P3AC4R_borders(const BYTE* pSrc[3], int srcStep[3],
+		BYTE* pDst, int dstStep, const prim_size_t* roi, int nWidth, int nHeight);
+
 void primitives_init_YUV(primitives_t* prims);
 void primitives_init_YUV_opt(primitives_t* prims);
 void primitives_deinit_YUV(primitives_t* prims);
@@ -11,17 +11,36 @@
 #include "config.h"
 #endif
 
+#ifdef WITH_SSE2
+/* must come before winpr/crt.h, which emulates some of its intrinsics */
+#include <immintrin.h>
+#endif
+
 #include <winpr/sysinfo.h>
 #include <winpr/crt.h>
 #include <freerdp/types.h>
 #include <freerdp/primitives.h>
 
+#include "prim_YUV.h"
+
 
 #ifdef WITH_SSE2
 
 #include <emmintrin.h>
 #include <tmmintrin.h>
 
+/**
+ * The AVX2 versions are built for the AVX2 target through a function
+ * attribute, the rest of this file keeps the SSSE3 baseline.
+ */
+#if defined(__GNUC__)
+#define PRIM_TARGET_AVX2 __attribute__((target("avx2")))
+#define WITH_AVX2_YUV 1
+#elif defined(_MSC_VER) && (_MSC_VER >= 1700)
+#define PRIM_TARGET_AVX2
+#define WITH_AVX2_YUV 1
+#endif
+
 pstatus_t ssse3_YUV420ToRGB_8u_P3AC4R(const BYTE **pSrc, int *srcStep,
 		BYTE *pDst, int dstStep, const prim_size_t *roi)
 {
@@ -357,6 +376,332 @@ pstatus_t ssse3_YUV420ToRGB_8u_P3AC4R(const BYTE **pSrc, int *srcStep,
 	
 	return PRIMITIVES_SUCCESS;
 }
+
+/**
+ * The vectorized RGB to YUV420 conversions below produce exactly the same
+ * output as general_RGBToYUV420_8u_P3AC4R:
+ *
+ * Y = (54 * R + 183 * G + 18 * B) >> 8, computed with 32-bit multiply-adds
+ * U, V are computed on the 2x2 averages, every term fits into 16 bits.
+ *
+ * Only complete 2x2 blocks are vectorized, the right column strip and an odd
+ * last row are handed to the generic code, which handles the borders.
+ */
+
+pstatus_t ssse3_RGBToYUV420_8u_P3AC4R(const BYTE* pSrc, INT32 srcStep,
+		BYTE* pDst[3], INT32 dstStep[3], const prim_size_t* roi)
+{
+	int x, y;
+	int nWidth, nHeight;
+	const BYTE* pRGB0;
+	const BYTE* pRGB1;
+	BYTE* pY0;
+	BYTE* pY1;
+	BYTE* pU;
+	BYTE* pV;
+	__m128i zero, c128;
+	__m128i yCoeffs, uCoeffs, vCoeffs;
+	__m128i p0, p1, q0, q1;
+	__m128i a, b, c, d;
+	__m128i t0, t1, y0, y1, u, v;
+
+	/* 8 pixels (4 complete 2x2 blocks) per iteration */
+	nWidth = roi->width & ~7;
+	nHeight = roi->height & ~1;
+
+	zero = _mm_setzero_si128();
+	c128 = _mm_set1_epi32(128);
+	yCoeffs = _mm_set_epi16(0, 54, 183, 18, 0, 54, 183, 18);
+	uCoeffs = _mm_set_epi16(0, -29, -99, 128, 0, -29, -99, 128);
+	vCoeffs = _mm_set_epi16(0, 128, -116, -12, 0, 128, -116, -12);
+
+	for (y = 0; y < nHeight; y += 2)
+	{
+		pRGB0 = pSrc + (y * srcStep);
+		pRGB1 = pRGB0 + srcStep;
+		pY0 = pDst[0] + (y * dstStep[0]);
+		pY1 = pY0 + dstStep[0];
+		pU = pDst[1] + ((y / 2) * dstStep[1]);
+		pV = pDst[2] + ((y / 2) * dstStep[2]);
+
+		for (x = 0; x < nWidth; x += 8)
+		{
+			p0 = _mm_loadu_si128((const __m128i*) &pRGB0[x * 4]);
+			p1 = _mm_loadu_si128((const __m128i*) &pRGB0[(x + 4) * 4]);
+			q0 = _mm_loadu_si128((const __m128i*) &pRGB1[x * 4]);
+			q1 = _mm_loadu_si128((const __m128i*) &pRGB1[(x + 4) * 4]);
+
+			/* Y, first row */
+			a = _mm_unpacklo_epi8(p0, zero);
+			b = _mm_unpackhi_epi8(p0, zero);
+			y0 = _mm_hadd_epi32(_mm_madd_epi16(a, yCoeffs), _mm_madd_epi16(b, yCoeffs));
+			c = _mm_unpacklo_epi8(p1, zero);
+			d = _mm_unpackhi_epi8(p1, zero);
+			y1 = _mm_hadd_epi32(_mm_madd_epi16(c, yCoeffs), _mm_madd_epi16(d, yCoeffs));
+			y0 = _mm_packs_epi32(_mm_srli_epi32(y0, 8), _mm_srli_epi32(y1, 8));
+			_mm_storel_epi64((__m128i*) &pY0[x], _mm_packus_epi16(y0, y0));
+
+			/* 2x2 block sums, first 4 pixels */
+			t0 = _mm_add_epi16(a, _mm_unpacklo_epi8(q0, zero));
+			t1 = _mm_add_epi16(b, _mm_unpackhi_epi8(q0, zero));
+			t0 = _mm_add_epi16(_mm_unpacklo_epi64(t0, t1), _mm_unpackhi_epi64(t0, t1));
+
+			/* 2x2 block sums, last 4 pixels */
+			a = _mm_add_epi16(c, _mm_unpacklo_epi8(q1, zero));
+			b = _mm_add_epi16(d, _mm_unpackhi_epi8(q1, zero));
+			t1 = _mm_add_epi16(_mm_unpacklo_epi64(a, b), _mm_unpackhi_epi64(a, b));
+
+			/* Y, second row */
+			a = _mm_unpacklo_epi8(q0, zero);
+			b = _mm_unpackhi_epi8(q0, zero);
+			y0 = _mm_hadd_epi32(_mm_madd_epi16(a, yCoeffs), _mm_madd_epi16(b, yCoeffs));
+			c = _mm_unpacklo_epi8(q1, zero);
+			d = _mm_unpackhi_epi8(q1, zero);
+			y1 = _mm_hadd_epi32(_mm_madd_epi16(c, yCoeffs), _mm_madd_epi16(d, yCoeffs));
+			y0 = _mm_packs_epi32(_mm_srli_epi32(y0, 8), _mm_srli_epi32(y1, 8));
+			_mm_storel_epi64((__m128i*) &pY1[x], _mm_packus_epi16(y0, y0));
+
+			/* U and V from the 2x2 averages */
+			t0 = _mm_srli_epi16(t0, 2);
+			t1 = _mm_srli_epi16(t1, 2);
+
+			u = _mm_hadd_epi32(_mm_madd_epi16(t0, uCoeffs), _mm_madd_epi16(t1, uCoeffs));
+			u = _mm_add_epi32(_mm_srai_epi32(u, 8), c128);
+			v = _mm_hadd_epi32(_mm_madd_epi16(t0, vCoeffs), _mm_madd_epi16(t1, vCoeffs));
+			v = _mm_add_epi32(_mm_srai_epi32(v, 8), c128);
+
+			u = _mm_packus_epi16(_mm_packs_epi32(u, v), zero);
+			*((UINT32*) &pU[x / 2]) = (UINT32) _mm_cvtsi128_si32(u);
+			*((UINT32*) &pV[x / 2]) = (UINT32) _mm_cvtsi128_si32(_mm_srli_si128(u, 4));
+		}
+	}
+
+	general_RGBToYUV420_8u_P3AC4R_borders(pSrc, srcStep, pDst, dstStep, roi, nWidth, nHeight);
+
+	return PRIMITIVES_SUCCESS;
+}
+
+#ifdef WITH_AVX2_YUV
+
+PRIM_TARGET_AVX2
+pstatus_t avx2_RGBToYUV420_8u_P3AC4R(const BYTE* pSrc, INT32 srcStep,
+		BYTE* pDst[3], INT32 dstStep[3], const prim_size_t* roi)
+{
+	int x, y;
+	int nWidth, nHeight;
+	const BYTE* pRGB0;
+	const BYTE* pRGB1;
+	BYTE* pY0;
+	BYTE* pY1;
+	BYTE* pU;
+	BYTE* pV;
+	__m256i zero, c128;
+	__m256i yCoeffs, uCoeffs, vCoeffs;
+	__m256i p0, p1, q0, q1;
+	__m256i a, b, c, d;
+	__m256i t0, t1, y0, y1, u, v;
+	__m128i lo, hi;
+
+	/* 16 pixels (8 complete 2x2 blocks) per iteration */
+	nWidth = roi->width & ~15;
+	nHeight = roi->height & ~1;
+
+	zero = _mm256_setzero_si256();
+	c128 = _mm256_set1_epi32(128);
+	yCoeffs = _mm256_set_epi16(0, 54, 183, 18, 0, 54, 183, 18, 0, 54, 183, 18, 0, 54, 183, 18);
+	uCoeffs = _mm256_set_epi16(0, -29, -99, 128, 0, -29, -99, 128, 0, -29, -99, 128, 0, -29, -99, 128);
+	vCoeffs = _mm256_set_epi16(0, 128, -116, -12, 0, 128, -116, -12, 0, 128, -116, -12, 0, 128, -116, -12);
+
+	for (y = 0; y < nHeight; y += 2)
+	{
+		pRGB0 = pSrc + (y * srcStep);
+		pRGB1 = pRGB0 + srcStep;
+		pY0 = pDst[0] + (y * dstStep[0]);
+		pY1 = pY0 + dstStep[0];
+		pU = pDst[1] + ((y / 2) * dstStep[1]);
+		pV = pDst[2] + ((y / 2) * dstStep[2]);
+
+		for (x = 0; x < nWidth; x += 16)
+		{
+			p0 = _mm256_loadu_si256((const __m256i*) &pRGB0[x * 4]);
+			p1 = _mm256_loadu_si256((const __m256i*) &pRGB0[(x + 8) * 4]);
+			q0 = _mm256_loadu_si256((const __m256i*) &pRGB1[x * 4]);
+			q1 = _mm256_loadu_si256((const __m256i*) &pRGB1[(x + 8) * 4]);
+
+			/**
+			 * The unpacks and horizontal adds work within 128-bit lanes, so
+			 * results come out as [0..3, 8..11 | 4..7, 12..15] and are put back
+			 * in order when narrowing to 128 bits.
+			 */
+
+			/* Y, first row */
+			a = _mm256_unpacklo_epi8(p0, zero);
+			b = _mm256_unpackhi_epi8(p0, zero);
+			y0 = _mm256_hadd_epi32(_mm256_madd_epi16(a, yCoeffs), _mm256_madd_epi16(b, yCoeffs));
+			c = _mm256_unpacklo_epi8(p1, zero);
+			d = _mm256_unpackhi_epi8(p1, zero);
+			y1 = _mm256_hadd_epi32(_mm256_madd_epi16(c, yCoeffs), _mm256_madd_epi16(d, yCoeffs));
+			y0 = _mm256_packs_epi32(_mm256_srli_epi32(y0, 8), _mm256_srli_epi32(y1, 8));
+			lo = _mm256_castsi256_si128(y0);
+			hi = _mm256_extracti128_si256(y0, 1);
+			_mm_storeu_si128((__m128i*) &pY0[x],
+					_mm_packus_epi16(_mm_unpacklo_epi64(lo, hi), _mm_unpackhi_epi64(lo, hi)));
+
+			/* 2x2 block sums */
+			t0 = _mm256_add_epi16(a, _mm256_unpacklo_epi8(q0, zero));
+			t1 = _mm256_add_epi16(b, _mm256_unpackhi_epi8(q0, zero));
+			t0 = _mm256_add_epi16(_mm256_unpacklo_epi64(t0, t1), _mm256_unpackhi_epi64(t0, t1));
+
+			a = _mm256_add_epi16(c, _mm256_unpacklo_epi8(q1, zero));
+			b = _mm256_add_epi16(d, _mm256_unpackhi_epi8(q1, zero));
+			t1 = _mm256_add_epi16(_mm256_unpacklo_epi64(a, b), _mm256_unpackhi_epi64(a, b));
+
+			/* Y, second row */
+			a = _mm256_unpacklo_epi8(q0, zero);
+			b = _mm256_unpackhi_epi8(q0, zero);
+			y0 = _mm256_hadd_epi32(_mm256_madd_epi16(a, yCoeffs), _mm256_madd_epi16(b, yCoeffs));
+			c = _mm256_unpacklo_epi8(q1, zero);
+			d = _mm256_unpackhi_epi8(q1, zero);
+			y1 = _mm256_hadd_epi32(_mm256_madd_epi16(c, yCoeffs), _mm256_madd_epi16(d, yCoeffs));
+			y0 = _mm256_packs_epi32(_mm256_srli_epi32(y0, 8), _mm256_srli_epi32(y1, 8));
+			lo = _mm256_castsi256_si128(y0);
+			hi = _mm256_extracti128_si256(y0, 1);
+			_mm_storeu_si128((__m128i*) &pY1[x],
+					_mm_packus_epi16(_mm_unpacklo_epi64(lo, hi), _mm_unpackhi_epi64(lo, hi)));
+
+			/* U and V from the 2x2 averages, blocks come out as [0, 1, 4, 5 | 2, 3, 6, 7] */
+			t0 = _mm256_srli_epi16(t0, 2);
+			t1 = _mm256_srli_epi16(t1, 2);
+
+			u = _mm256_hadd_epi32(_mm256_madd_epi16(t0, uCoeffs), _mm256_madd_epi16(t1, uCoeffs));
+			u = _mm256_add_epi32(_mm256_srai_epi32(u, 8), c128);
+			v = _mm256_hadd_epi32(_mm256_madd_epi16(t0, vCoeffs), _mm256_madd_epi16(t1, vCoeffs));
+			v = _mm256_add_epi32(_mm256_srai_epi32(v, 8), c128);
+
+			u = _mm256_packus_epi16(_mm256_packs_epi32(u, v), zero);
+			lo = _mm_unpacklo_epi16(_mm256_castsi256_si128(u), _mm256_extracti128_si256(u, 1));
+			_mm_storel_epi64((__m128i*) &pU[x / 2], lo);
+			_mm_storel_epi64((__m128i*) &pV[x / 2], _mm_srli_si128(lo, 8));
+		}
+	}
+
+	general_RGBToYUV420_8u_P3AC4R_borders(pSrc, srcStep, pDst, dstStep, roi, nWidth, nHeight);
+
+	return PRIMITIVES_SUCCESS;
+}
+
+/**
+ * YUV420 to RGB with the same results as general_YUV420ToRGB_8u_P3AC4R.
+ * The 8.8 fixed point coefficients are split so that every term fits into
+ * 16 bits: 403 = 256 + 147 and 475 = 256 + 219, for instance
+ * R = (256 * Y + 403 * V') >> 8 = Y + V' + ((147 * V') >> 8)
+ */
+
+PRIM_TARGET_AVX2
+static INLINE void avx2_yuv_store_bgrx(BYTE* pDst, __m256i R, __m256i G, __m256i B)
+{
+	__m256i BG, RX, px0, px1;
+	__m256i alpha = _mm256_set1_epi8((char) 0xFF);
+
+	/* lanes hold pixels [0..7, 16..23 | 8..15, 24..31] */
+	BG = _mm256_unpacklo_epi8(B, G);
+	RX = _mm256_unpacklo_epi8(R, alpha);
+	px0 = _mm256_unpacklo_epi16(BG, RX);
+	px1 = _mm256_unpackhi_epi16(BG, RX);
+	_mm256_storeu_si256((__m256i*) pDst, _mm256_permute2x128_si256(px0, px1, 0x20));
+	_mm256_storeu_si256((__m256i*) &pDst[32], _mm256_permute2x128_si256(px0, px1, 0x31));
+
+	BG = _mm256_unpackhi_epi8(B, G);
+	RX = _mm256_unpackhi_epi8(R, alpha);
+	px0 = _mm256_unpacklo_epi16(BG, RX);
+	px1 = _mm256_unpackhi_epi16(BG, RX);
+	_mm256_storeu_si256((__m256i*) &pDst[64], _mm256_permute2x128_si256(px0, px1, 0x20));
+	_mm256_storeu_si256((__m256i*) &pDst[96], _mm256_permute2x128_si256(px0, px1, 0x31));
+}
+
+PRIM_TARGET_AVX2
+pstatus_t avx2_YUV420ToRGB_8u_P3AC4R(const BYTE** pSrc, int* srcStep,
+		BYTE* pDst, int dstStep, const prim_size_t* roi)
+{
+	int x, y, row;
+	int nWidth, nHeight;
+	const BYTE* pY;
+	const BYTE* pU;
+	const BYTE* pV;
+	BYTE* pRGB;
+	__m256i c128, c147, c219, c48, c120;
+	__m256i U, V, Ylo, Yhi, R, G, B;
+	__m256i rc, gc, bc, rlo, rhi, glo, ghi, blo, bhi;
+
+	/* 32 pixels (16 chroma samples) per iteration */
+	nWidth = roi->width & ~31;
+	nHeight = roi->height & ~1;
+
+	c128 = _mm256_set1_epi16(128);
+	c147 = _mm256_set1_epi16(147);
+	c219 = _mm256_set1_epi16(219);
+	c48 = _mm256_set1_epi16(48);
+	c120 = _mm256_set1_epi16(120);
+
+	for (y = 0; y < nHeight; y += 2)
+	{
+		pU = pSrc[1] + ((y / 2) * srcStep[1]);
+		pV = pSrc[2] + ((y / 2) * srcStep[2]);
+
+		for (x = 0; x < nWidth; x += 32)
+		{
+			U = _mm256_sub_epi16(_mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*) &pU[x / 2])), c128);
+			V = _mm256_sub_epi16(_mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*) &pV[x / 2])), c128);
+
+			/* chroma terms for 16 samples */
+			rc = _mm256_add_epi16(V, _mm256_srai_epi16(_mm256_mullo_epi16(V, c147), 8));
+			bc = _mm256_add_epi16(U, _mm256_srai_epi16(_mm256_mullo_epi16(U, c219), 8));
+			gc = _mm256_srai_epi16(_mm256_sub_epi16(_mm256_setzero_si256(),
+					_mm256_add_epi16(_mm256_mullo_epi16(U, c48), _mm256_mullo_epi16(V, c120))), 8);
+
+			/* duplicate each sample for two pixels: [0..7 | 8..15] and [16..23 | 24..31] */
+			rlo = _mm256_unpacklo_epi16(rc, rc);
+			rhi = _mm256_unpackhi_epi16(rc, rc);
+			R = rlo;
+			rlo = _mm256_permute2x128_si256(R, rhi, 0x20);
+			rhi = _mm256_permute2x128_si256(R, rhi, 0x31);
+
+			glo = _mm256_unpacklo_epi16(gc, gc);
+			ghi = _mm256_unpackhi_epi16(gc, gc);
+			G = glo;
+			glo = _mm256_permute2x128_si256(G, ghi, 0x20);
+			ghi = _mm256_permute2x128_si256(G, ghi, 0x31);
+
+			blo = _mm256_unpacklo_epi16(bc, bc);
+			bhi = _mm256_unpackhi_epi16(bc, bc);
+			B = blo;
+			blo = _mm256_permute2x128_si256(B, bhi, 0x20);
+			bhi = _mm256_permute2x128_si256(B, bhi, 0x31);
+
+			for (row = 0; row < 2; row++)
+			{
+				pY = pSrc[0] + ((y + row) * srcStep[0]) + x;
+				pRGB = pDst + ((y + row) * dstStep) + (x * 4);
+
+				Ylo = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*) pY));
+				Yhi = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*) &pY[16]));
+
+				R = _mm256_packus_epi16(_mm256_add_epi16(Ylo, rlo), _mm256_add_epi16(Yhi, rhi));
+				G = _mm256_packus_epi16(_mm256_add_epi16(Ylo, glo), _mm256_add_epi16(Yhi, ghi));
+				B = _mm256_packus_epi16(_mm256_add_epi16(Ylo, blo), _mm256_add_epi16(Yhi, bhi));
+
+				avx2_yuv_store_bgrx(pRGB, R, G, B);
+			}
+		}
+	}
+
+	general_YUV420ToRGB_8u_P3AC4R_borders(pSrc, srcStep, pDst, dstStep, roi, nWidth, nHeight);
+
+	return PRIMITIVES_SUCCESS;
+}
+
+#endif /* WITH_AVX2_YUV */
+
 #endif
 
 void primitives_init_YUV_opt(primitives_t *prims)
@@ -365,6 +710,15 @@ void primitives_init_YUV_opt(primitives_t *prims)
 	if (IsProcessorFeaturePresentEx(PF_EX_SSSE3) && IsProcessorFeaturePresent(PF_SSE3_INSTRUCTIONS_AVAILABLE))
 	{
 		prims->YUV420ToRGB_8u_P3AC4R = ssse3_YUV420ToRGB_8u_P3AC4R;
+		prims->RGBToYUV420_8u_P3AC4R = ssse3_RGBToYUV420_8u_P3AC4R;
 	}
+
+#ifdef WITH_AVX2_YUV
+	if (IsProcessorFeaturePresentEx(PF_EX_AVX2))
+	{
+		prims->YUV420ToRGB_8u_P3AC4R = avx2_YUV420ToRGB_8u_P3AC4R;
+		prims->RGBToYUV420_8u_P3AC4R = avx2_RGBToYUV420_8u_P3AC4R;
+	}
+#endif
 #endif
 }
@@ -0,0 +1,309 @@
+/**
+ * FreeRDP: A Remote Desktop Protocol Implementation
+ * YUV Primitives Tests
+ *
+ * Copyright 2026 agent <agent@local>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <winpr/sysinfo.h>
+#include "prim_test.h"
+
+static const int YUV_TRIAL_ITERATIONS = 2000000;
+static const float TEST_TIME = 4.0;
+
+#define YUV_MAX_WIDTH	128
+#define YUV_MAX_HEIGHT	64
+
+extern BOOL g_TestPrimitivesPerformance;
+
+extern pstatus_t general_YUV420ToRGB_8u_P3AC4R(const BYTE* pSrc[3], int srcStep[3],
+	BYTE* pDst, int dstStep, const prim_size_t* roi);
+extern pstatus_t general_RGBToYUV420_8u_P3AC4R(const BYTE* pSrc, INT32 srcStep,
+	BYTE* pDst[3], INT32 dstStep[3], const prim_size_t* roi);
+extern pstatus_t ssse3_YUV420ToRGB_8u_P3AC4R(const BYTE** pSrc, int* srcStep,
+	BYTE* pDst, int dstStep, const prim_size_t* roi);
+extern pstatus_t ssse3_RGBToYUV420_8u_P3AC4R(const BYTE* pSrc, INT32 srcStep,
+	BYTE* pDst[3], INT32 dstStep[3], const prim_size_t* roi);
+#if defined(WITH_SSE2) && (defined(__GNUC__) || (defined(_MSC_VER) && (_MSC_VER >= 1700)))
+#define TEST_AVX2_YUV	1
+extern pstatus_t avx2_YUV420ToRGB_8u_P3AC4R(const BYTE** pSrc, int* srcStep,
+	BYTE* pDst, int dstStep, const prim_size_t* roi);
+extern pstatus_t avx2_RGBToYUV420_8u_P3AC4R(const BYTE* pSrc, INT32 srcStep,
+	BYTE* pDst[3], INT32 dstStep[3], const prim_size_t* roi);
+#endif
+
+static BYTE ALIGN(yuv_rgb[YUV_MAX_WIDTH * YUV_MAX_HEIGHT * 4]);
+static BYTE ALIGN(yuv_rgb_c[YUV_MAX_WIDTH * YUV_MAX_HEIGHT * 4]);
+static BYTE ALIGN(yuv_planes[3][YUV_MAX_WIDTH * YUV_MAX_HEIGHT]);
+static BYTE ALIGN(yuv_planes_c[3][YUV_MAX_WIDTH * YUV_MAX_HEIGHT]);
+
+static const int yuv_test_sizes[][2] = {
+	{ 64, 64 }, { 128, 64 }, { 67, 45 }, { 33, 1 }, { 1, 7 }, { 97, 63 }, { 16, 2 }
+};
+#define NUM_YUV_TEST_SIZES (sizeof(yuv_test_sizes) / sizeof(yuv_test_sizes[0]))
+
+typedef pstatus_t (*fnRGBToYUV420)(const BYTE* pSrc, INT32 srcStep,
+	BYTE* pDst[3], INT32 dstStep[3], const prim_size_t* roi);
+typedef pstatus_t (*fnYUV420ToRGB)(const BYTE** pSrc, int* srcStep,
+	BYTE* pDst, int dstStep, const prim_size_t* roi);
+
+/* ------------------------------------------------------------------------- */
+static BOOL test_RGBToYUV420_compare(const char* name, fnRGBToYUV420 fkt)
+{
+	int i, x, y, w, h;
+	int halfWidth, halfHeight;
+	BYTE* pDst[3];
+	BYTE* pDstC[3];
+	INT32 dstStep[3];
+	prim_size_t roi;
+	BOOL failed = FALSE;
+
+	dstStep[0] = YUV_MAX_WIDTH;
+	dstStep[1] = dstStep[2] = YUV_MAX_WIDTH / 2;
+
+	for (i = 0; i < (int) NUM_YUV_TEST_SIZES; i++)
+	{
+		roi.width = w = yuv_test_sizes[i][0];
+		roi.height = h = yuv_test_sizes[i][1];
+		halfWidth = (w + 1) / 2;
+		halfHeight = (h + 1) / 2;
+
+		for (x = 0; x < 3; x++)
+		{
+			pDst[x] = yuv_planes[x];
+			pDstC[x] = yuv_planes_c[x];
+			memset(yuv_planes[x], 0, sizeof(yuv_planes[x]));
+			memset(yuv_planes_c[x], 0, sizeof(yuv_planes_c[x]));
+		}
+
+		general_RGBToYUV420_8u_P3AC4R(yuv_rgb, YUV_MAX_WIDTH * 4, pDstC, dstStep, &roi);
+		fkt(yuv_rgb, YUV_MAX_WIDTH * 4, pDst, dstStep, &roi);
+
+		for (y = 0; y < h; y++)
+		{
+			if (memcmp(&pDst[0][y * dstStep[0]], &pDstC[0][y * dstStep[0]], w) != 0)
+			{
+				printf("RGBToYUV420-%s FAIL: Y plane row %d (%dx%d)\n", name, y, w, h);
+				failed = TRUE;
+			}
+		}
+
+		for (y = 0; y < halfHeight; y++)
+		{
+			for (x = 1; x < 3; x++)
+			{
+				if (memcmp(&pDst[x][y * dstStep[x]], &pDstC[x][y * dstStep[x]], halfWidth) != 0)
+				{
+					printf("RGBToYUV420-%s FAIL: %s plane row %d (%dx%d)\n",
+						name, (x == 1) ? "U" : "V", y, w, h);
+					failed = TRUE;
+				}
+			}
+		}
+	}
+
+	return failed;
+}
+
+/* ------------------------------------------------------------------------- */
+/**
+ * tolerance is the largest difference allowed per channel, the SSSE3 code
+ * rounds its fixed point products differently than the generic code and
+ * leaves the (AC4R, ignored) alpha channel at 0, hence checkAlpha.
+ */
+static BOOL test_YUV420ToRGB_compare(const char* name, fnYUV420ToRGB fkt, int tolerance, BOOL checkAlpha)
+{
+	int i, x, y, w, h;
+	int diff;
+	const BYTE* pRow;
+	const BYTE* pRowC;
+	const BYTE* pSrc[3];
+	int srcStep[3];
+	prim_size_t roi;
+	BOOL failed = FALSE;
+
+	pSrc[0] = yuv_planes[0];
+	pSrc[1] = yuv_planes[1];
+	pSrc[2] = yuv_planes[2];
+	srcStep[0] = YUV_MAX_WIDTH;
+	srcStep[1] = srcStep[2] = YUV_MAX_WIDTH / 2;
+
+	for (i = 0; i < (int) NUM_YUV_TEST_SIZES; i++)
+	{
+		roi.width = w = yuv_test_sizes[i][0];
+		roi.height = h = yuv_test_sizes[i][1];
+
+		memset(yuv_rgb, 0, sizeof(yuv_rgb));
+		memset(yuv_rgb_c, 0, sizeof(yuv_rgb_c));
+
+		general_YUV420ToRGB_8u_P3AC4R(pSrc, srcStep, yuv_rgb_c, YUV_MAX_WIDTH * 4, &roi);
+		fkt(pSrc, srcStep, yuv_rgb, YUV_MAX_WIDTH * 4, &roi);
+
+		for (y = 0; y < h; y++)
+		{
+			pRow = &yuv_rgb[y * YUV_MAX_WIDTH * 4];
+			pRowC = &yuv_rgb_c[y * YUV_MAX_WIDTH * 4];
+
+			for (x = 0; x < w * 4; x++)
+			{
+				if (((x % 4) == 3) && !checkAlpha)
+					continue;
+
+				diff = (int) pRow[x] - (int) pRowC[x];
+
+				if ((diff > tolerance) || (diff < -tolerance))
+				{
+					printf("YUV420ToRGB-%s FAIL: row %d column %d %d != %d (%dx%d)\n",
+						name, y, x / 4, pRow[x], pRowC[x], w, h);
+					failed = TRUE;
+					break;
+				}
+			}
+		}
+	}
+
+	return failed;
+}
+
+/* ------------------------------------------------------------------------- */
+int test_RGBToYUV420_8u_P3AC4R_func(void)
+{
+	char testStr[256];
+	BOOL failed = FALSE;
+
+	testStr[0] = '\0';
+	get_random_data(yuv_rgb, sizeof(yuv_rgb));
+
+#ifdef WITH_SSE2
+	if (IsProcessorFeaturePresentEx(PF_EX_SSSE3))
+	{
+		strcat(testStr, " SSSE3");
+		failed |= test_RGBToYUV420_compare("SSSE3", ssse3_RGBToYUV420_8u_P3AC4R);
+	}
+#ifdef TEST_AVX2_YUV
+	if (IsProcessorFeaturePresentEx(PF_EX_AVX2))
+	{
+		strcat(testStr, " AVX2");
+		failed |= test_RGBToYUV420_compare("AVX2", avx2_RGBToYUV420_8u_P3AC4R);
+	}
+#endif
+#endif /* i386 */
+	if (!failed) printf("All RGBToYUV420_8u_P3AC4R tests passed (%s).\n", testStr);
+	return (failed > 0) ? FAILURE : SUCCESS;
+}
+
+/* ------------------------------------------------------------------------- */
+int test_YUV420ToRGB_8u_P3AC4R_func(void)
+{
+	char testStr[256];
+	BOOL failed = FALSE;
+
+	testStr[0] = '\0';
+	get_random_data(yuv_planes, sizeof(yuv_planes));
+
+#ifdef WITH_SSE2
+	if (IsProcessorFeaturePresentEx(PF_EX_SSSE3))
+	{
+		strcat(testStr, " SSSE3");
+		failed |= test_YUV420ToRGB_compare("SSSE3", ssse3_YUV420ToRGB_8u_P3AC4R, 1, FALSE);
+	}
+#ifdef TEST_AVX2_YUV
+	if (IsProcessorFeaturePresentEx(PF_EX_AVX2))
+	{
+		strcat(testStr, " AVX2");
+		failed |= test_YUV420ToRGB_compare("AVX2", avx2_YUV420ToRGB_8u_P3AC4R, 0, TRUE);
+	}
+#endif
+#endif /* i386 */
+	if (!failed) printf("All YUV420ToRGB_8u_P3AC4R tests passed (%s).\n", testStr);
+	return (failed > 0) ? FAILURE : SUCCESS;
+}
+
+/* ------------------------------------------------------------------------- */
+static INT32 yuv_dst_step[3] = { YUV_MAX_WIDTH, YUV_MAX_WIDTH / 2, YUV_MAX_WIDTH / 2 };
+static BYTE* yuv_dst_planes[3] = { yuv_planes[0], yuv_planes[1], yuv_planes[2] };
+static const BYTE* yuv_src_planes[3] = { yuv_planes[0], yuv_planes[1], yuv_planes[2] };
+static prim_size_t yuv_speed_roi = { YUV_MAX_WIDTH, YUV_MAX_HEIGHT };
+
+STD_SPEED_TEST(
+	rgb_to_yuv420_speed, BYTE, BYTE, PRIM_NOP,
+	TRUE, general_RGBToYUV420_8u_P3AC4R(src1, YUV_MAX_WIDTH * 4,
+		yuv_dst_planes, yuv_dst_step, &yuv_speed_roi),
+#ifdef WITH_SSE2
+	TRUE, ssse3_RGBToYUV420_8u_P3AC4R(src1, YUV_MAX_WIDTH * 4,
+		yuv_dst_planes, yuv_dst_step, &yuv_speed_roi),
+		PF_EX_SSSE3, TRUE,
+#else
+	FALSE, PRIM_NOP, 0, FALSE,
+#endif
+	FALSE, PRIM_NOP);
+
+#ifdef TEST_AVX2_YUV
+STD_SPEED_TEST(
+	yuv420_to_rgb_speed, BYTE, BYTE, PRIM_NOP,
+	TRUE, general_YUV420ToRGB_8u_P3AC4R(yuv_src_planes, yuv_dst_step,
+		dst, YUV_MAX_WIDTH * 4, &yuv_speed_roi),
+	TRUE, avx2_YUV420ToRGB_8u_P3AC4R(yuv_src_planes, yuv_dst_step,
+		dst, YUV_MAX_WIDTH * 4, &yuv_speed_roi),
+		PF_EX_AVX2, TRUE,
+	FALSE, PRIM_NOP);
+#endif
+
+int test_YUV420_8u_P3AC4R_speed(void)
+{
+	int size_array[] = { YUV_MAX_WIDTH * YUV_MAX_HEIGHT };
+
+	get_random_data(yuv_rgb, sizeof(yuv_rgb));
+	get_random_data(yuv_planes, sizeof(yuv_planes));
+
+	rgb_to_yuv420_speed("RGBToYUV420", "aligned", yuv_rgb,
+		0, 0, yuv_rgb_c,
+		size_array, 1, YUV_TRIAL_ITERATIONS, TEST_TIME);
+#ifdef TEST_AVX2_YUV
+	yuv420_to_rgb_speed("YUV420ToRGB", "aligned", yuv_rgb,
+		0, 0, yuv_rgb_c,
+		size_array, 1, YUV_TRIAL_ITERATIONS, TEST_TIME);
+#endif
+	return SUCCESS;
+}
+
+int TestPrimitivesYUV(int argc, char* argv[])
+{
+	int status;
+
+	status = test_RGBToYUV420_8u_P3AC4R_func();
+
+	if (status != SUCCESS)
+		return 1;
+
+	status = test_YUV420ToRGB_8u_P3AC4R_func();
+
+	if (status != SUCCESS)
+		return 1;
+
+	if (g_TestPrimitivesPerformance)
+	{
+		status = test_YUV420_8u_P3AC4R_speed();
+
+		if (status != SUCCESS)
+			return 1;
+	}
+
+	return 0;
+}
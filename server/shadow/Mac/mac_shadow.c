@@ -29,6 +29,7 @@
 #include "../shadow_client.h"
 #include "../shadow_surface.h"
 #include "../shadow_capture.h"
+#include "../shadow_encode_cache.h"
 #include "../shadow_encoder.h"
 #include "../shadow_subsystem.h"
 #include "../shadow_mcevent.h"
@@ -313,6 +314,7 @@ void (^mac_capture_stream_handler)(CGDisplayStreamFrameStatus, uint64_t, IOSurfa
 	int height;
 	int nSrcStep;
 	BYTE* pSrcData;
+	BYTE* pDstData;
 	RECTANGLE_16 surfaceRect;
 	const RECTANGLE_16* extents;
 	macShadowSubsystem* subsystem = g_Subsystem;
@@ -344,6 +346,11 @@ void (^mac_capture_stream_handler)(CGDisplayStreamFrameStatus, uint64_t, IOSurfa
 		y = extents->top;
 		width = extents->right - extents->left;
 		height = extents->bottom - extents->top;
+
+		pDstData = shadow_surface_begin_frame(surface);
+
+		if (!pDstData)
+			return;
 			
 		IOSurfaceLock(frameSurface, kIOSurfaceLockReadOnly, NULL);
 		
@@ -352,12 +359,12 @@ void (^mac_capture_stream_handler)(CGDisplayStreamFrameStatus, uint64_t, IOSurfa
 
 		if (subsystem->retina)
 		{
-			freerdp_image_copy_from_retina(surface->data, PIXEL_FORMAT_XRGB32, surface->scanline,
+			freerdp_image_copy_from_retina(pDstData, PIXEL_FORMAT_XRGB32, surface->scanline,
 					       x, y, width, height, pSrcData, nSrcStep, x, y);
 		}
 		else
 		{
-			freerdp_image_copy(surface->data, PIXEL_FORMAT_XRGB32, surface->scanline,
+			freerdp_image_copy(pDstData, PIXEL_FORMAT_XRGB32, surface->scanline,
 						x, y, width, height, pSrcData, PIXEL_FORMAT_XRGB32, nSrcStep, x, y, NULL);
 		}
 		
@@ -367,7 +374,7 @@ void (^mac_capture_stream_handler)(CGDisplayStreamFrameStatus, uint64_t, IOSurfa
 			
 		count = ArrayList_Count(server->clients);
 			
-		shadow_multiclient_publish_and_wait(subsystem->updateEvent);
+		shadow_surface_publish(surface, &(subsystem->invalidRegion), NULL);
 		
 		if (count == 1)
 		{
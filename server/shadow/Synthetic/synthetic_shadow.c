@@ -0,0 +1,765 @@
+/**
+ * FreeRDP: A Remote Desktop Protocol Implementation
+ * Synthetic Shadow Subsystem
+ *
+ * Copyright 2026 agent <agent@local>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <winpr/crt.h>
+#include <winpr/synch.h>
+#include <winpr/sysinfo.h>
+
+#include <freerdp/log.h>
+#include <freerdp/codec/color.h>
+#include <freerdp/codec/region.h>
+
+#include "../shadow_screen.h"
+#include "../shadow_client.h"
+#include "../shadow_capture.h"
+#include "../shadow_encode_cache.h"
+#include "../shadow_surface.h"
+#include "../shadow_subsystem.h"
+#include "../shadow_mcevent.h"
+
+#include "synthetic_shadow.h"
+
+#define TAG SERVER_TAG("shadow.synthetic")
+
+#define SYNTHETIC_SHADOW_GLYPH_WIDTH		8
+#define SYNTHETIC_SHADOW_GLYPH_HEIGHT		16
+#define SYNTHETIC_SHADOW_NOISE_BLOCK		4
+#define SYNTHETIC_SHADOW_TITLE_HEIGHT		24
+#define SYNTHETIC_SHADOW_STATS_INTERVAL		5000
+
+#define SYNTHETIC_SHADOW_TEXT_BACKGROUND	0xFF1E1E1E
+#define SYNTHETIC_SHADOW_TEXT_FOREGROUND	0xFFD4D4D4
+#define SYNTHETIC_SHADOW_WINDOW_TITLE		0xFF2B579A
+#define SYNTHETIC_SHADOW_WINDOW_BODY		0xFFF0F0F0
+#define SYNTHETIC_SHADOW_WINDOW_BORDER		0xFF404040
+#define SYNTHETIC_SHADOW_WINDOW_TEXT		0xFFA0A0A0
+
+static UINT32 synthetic_shadow_random(syntheticShadowSubsystem* subsystem)
+{
+	subsystem->seed = (subsystem->seed * 1103515245) + 12345;
+	return subsystem->seed >> 8;
+}
+
+static UINT32 synthetic_shadow_background_pixel(syntheticShadowSubsystem* subsystem, int x, int y)
+{
+	UINT32 r, g, b;
+
+	r = 32 + ((x * 96) / subsystem->width);
+	g = 64 + ((y * 96) / subsystem->height);
+	b = 160 + (((x ^ y) >> 5) & 0x0F);
+
+	return 0xFF000000 | (r << 16) | (g << 8) | b;
+}
+
+static UINT32 synthetic_shadow_window_pixel(syntheticShadowSubsystem* subsystem, int x, int y)
+{
+	int width = subsystem->window.right - subsystem->window.left;
+	int height = subsystem->window.bottom - subsystem->window.top;
+
+	if ((x == 0) || (y == 0) || (x == width - 1) || (y == height - 1))
+		return SYNTHETIC_SHADOW_WINDOW_BORDER;
+
+	if (y < SYNTHETIC_SHADOW_TITLE_HEIGHT)
+		return SYNTHETIC_SHADOW_WINDOW_TITLE;
+
+	/* a few lines of grey "text" in the client area */
+	if ((x >= 16) && (x < width - 16 - ((y / 20) % 4) * 24) && (((y - SYNTHETIC_SHADOW_TITLE_HEIGHT) % 20) >= 8)
+			&& (((y - SYNTHETIC_SHADOW_TITLE_HEIGHT) % 20) < 14))
+		return SYNTHETIC_SHADOW_WINDOW_TEXT;
+
+	return SYNTHETIC_SHADOW_WINDOW_BODY;
+}
+
+static void synthetic_shadow_fill_rect(syntheticShadowSubsystem* subsystem, const RECTANGLE_16* rect, UINT32 color)
+{
+	int x, y;
+	UINT32* pDst;
+
+	for (y = rect->top; y < rect->bottom; y++)
+	{
+		pDst = (UINT32*) &subsystem->data[(y * subsystem->scanline) + (rect->left * 4)];
+
+		for (x = rect->left; x < rect->right; x++)
+			*pDst++ = color;
+	}
+}
+
+static void synthetic_shadow_draw_background(syntheticShadowSubsystem* subsystem, const RECTANGLE_16* rect)
+{
+	int x, y;
+	UINT32* pDst;
+
+	for (y = rect->top; y < rect->bottom; y++)
+	{
+		pDst = (UINT32*) &subsystem->data[(y * subsystem->scanline) + (rect->left * 4)];
+
+		for (x = rect->left; x < rect->right; x++)
+			*pDst++ = synthetic_shadow_background_pixel(subsystem, x, y);
+	}
+}
+
+/**
+ * Scrolling text: the area moves up by one line of glyphs and a new line of
+ * pseudo-random glyphs is drawn at the bottom, like a busy terminal.
+ */
+
+static void synthetic_shadow_render_scroll(syntheticShadowSubsystem* subsystem)
+{
+	int x, y;
+	int cx, gy;
+	int cols;
+	int length;
+	UINT32 bits;
+	UINT32* pDst;
+	RECTANGLE_16 line;
+	RECTANGLE_16* rect = &(subsystem->scrollRect);
+	int width = rect->right - rect->left;
+	int height = rect->bottom - rect->top;
+	int lineHeight = SYNTHETIC_SHADOW_GLYPH_HEIGHT;
+
+	if ((width < SYNTHETIC_SHADOW_GLYPH_WIDTH) || (height < lineHeight))
+		return;
+
+	for (y = rect->top; y < rect->bottom - lineHeight; y++)
+	{
+		MoveMemory(&subsystem->data[(y * subsystem->scanline) + (rect->left * 4)],
+				&subsystem->data[((y + lineHeight) * subsystem->scanline) + (rect->left * 4)], width * 4);
+	}
+
+	line.left = rect->left;
+	line.top = rect->bottom - lineHeight;
+	line.right = rect->right;
+	line.bottom = rect->bottom;
+
+	synthetic_shadow_fill_rect(subsystem, &line, SYNTHETIC_SHADOW_TEXT_BACKGROUND);
+
+	cols = width / SYNTHETIC_SHADOW_GLYPH_WIDTH;
+	length = synthetic_shadow_random(subsystem) % (cols + 1);
+
+	for (cx = 0; cx < length; cx++)
+	{
+		bits = synthetic_shadow_random(subsystem);
+
+		/* roughly one cell in six is a space */
+		if ((bits % 6) == 0)
+			continue;
+
+		for (gy = 3; gy < 13; gy++)
+		{
+			y = line.top + gy;
+			pDst = (UINT32*) &subsystem->data[(y * subsystem->scanline) +
+					((rect->left + (cx * SYNTHETIC_SHADOW_GLYPH_WIDTH)) * 4)];
+
+			for (x = 1; x < 7; x++)
+			{
+				if (bits & (1 << (((gy * 6) + x) % 24)))
+					pDst[x] = SYNTHETIC_SHADOW_TEXT_FOREGROUND;
+			}
+		}
+	}
+}
+
+/**
+ * Video-like content: blocks of pseudo-random colour, redrawn every frame.
+ */
+
+static void synthetic_shadow_render_noise(syntheticShadowSubsystem* subsystem)
+{
+	int x, y;
+	int bx, by;
+	UINT32 color;
+	UINT32* pDst;
+	RECTANGLE_16* rect = &(subsystem->noiseRect);
+	int block = SYNTHETIC_SHADOW_NOISE_BLOCK;
+
+	for (y = rect->top; y < rect->bottom; y += block)
+	{
+		for (x = rect->left; x < rect->right; x += block)
+		{
+			color = 0xFF000000 | (synthetic_shadow_random(subsystem) & 0xFFFFFF);
+
+			for (by = y; (by < y + block) && (by < rect->bottom); by++)
+			{
+				pDst = (UINT32*) &subsystem->data[(by * subsystem->scanline) + (x * 4)];
+
+				for (bx = x; (bx < x + block) && (bx < rect->right); bx++)
+					*pDst++ = color;
+			}
+		}
+	}
+}
+
+static void synthetic_shadow_draw_window(syntheticShadowSubsystem* subsystem)
+{
+	int x, y;
+	UINT32* pDst;
+	RECTANGLE_16* rect = &(subsystem->window);
+
+	for (y = rect->top; y < rect->bottom; y++)
+	{
+		pDst = (UINT32*) &subsystem->data[(y * subsystem->scanline) + (rect->left * 4)];
+
+		for (x = rect->left; x < rect->right; x++)
+			*pDst++ = synthetic_shadow_window_pixel(subsystem, x - rect->left, y - rect->top);
+	}
+}
+
+/**
+ * Window drag: a window bounces around its area, the desktop it uncovers
+ * is repainted.
+ */
+
+static void synthetic_shadow_render_drag(syntheticShadowSubsystem* subsystem)
+{
+	int dx, dy;
+	RECTANGLE_16* area = &(subsystem->dragArea);
+	RECTANGLE_16* window = &(subsystem->window);
+
+	synthetic_shadow_draw_background(subsystem, window);
+
+	dx = subsystem->windowDx;
+	dy = subsystem->windowDy;
+
+	if ((window->left + dx < area->left) || (window->right + dx > area->right))
+		subsystem->windowDx = dx = -dx;
+
+	if ((window->top + dy < area->top) || (window->bottom + dy > area->bottom))
+		subsystem->windowDy = dy = -dy;
+
+	window->left += dx;
+	window->right += dx;
+	window->top += dy;
+	window->bottom += dy;
+
+	synthetic_shadow_draw_window(subsystem);
+}
+
+static void synthetic_shadow_render(syntheticShadowSubsystem* subsystem)
+{
+	if (subsystem->scenes & SYNTHETIC_SHADOW_SCENE_SCROLL)
+		synthetic_shadow_render_scroll(subsystem);
+
+	if (subsystem->scenes & SYNTHETIC_SHADOW_SCENE_NOISE)
+		synthetic_shadow_render_noise(subsystem);
+
+	if (subsystem->scenes & SYNTHETIC_SHADOW_SCENE_DRAG)
+		synthetic_shadow_render_drag(subsystem);
+
+	subsystem->frameCount++;
+}
+
+/**
+ * Splits the screen between the scenes: scrolling text on the left, the
+ * noise area above the dragged window on the right. A single scene gets
+ * the whole screen.
+ */
+
+static void synthetic_shadow_layout(syntheticShadowSubsystem* subsystem)
+{
+	int width, height;
+	RECTANGLE_16 rest;
+	RECTANGLE_16* window = &(subsystem->window);
+	UINT32 others = subsystem->scenes & ~SYNTHETIC_SHADOW_SCENE_SCROLL;
+
+	rest.left = 0;
+	rest.top = 0;
+	rest.right = subsystem->width;
+	rest.bottom = subsystem->height;
+
+	if (subsystem->scenes & SYNTHETIC_SHADOW_SCENE_SCROLL)
+	{
+		CopyMemory(&(subsystem->scrollRect), &rest, sizeof(RECTANGLE_16));
+
+		if (others)
+		{
+			subsystem->scrollRect.right = rest.right / 2;
+			rest.left = subsystem->scrollRect.right;
+		}
+	}
+
+	CopyMemory(&(subsystem->noiseRect), &rest, sizeof(RECTANGLE_16));
+	CopyMemory(&(subsystem->dragArea), &rest, sizeof(RECTANGLE_16));
+
+	if ((others & SYNTHETIC_SHADOW_SCENE_NOISE) && (others & SYNTHETIC_SHADOW_SCENE_DRAG))
+	{
+		subsystem->noiseRect.bottom = rest.top + ((rest.bottom - rest.top) / 2);
+		subsystem->dragArea.top = subsystem->noiseRect.bottom;
+	}
+
+	width = MIN(480, (subsystem->dragArea.right - subsystem->dragArea.left) / 2);
+	height = MIN(320, (subsystem->dragArea.bottom - subsystem->dragArea.top) / 2);
+
+	window->left = subsystem->dragArea.left;
+	window->top = subsystem->dragArea.top;
+	window->right = window->left + width;
+	window->bottom = window->top + height;
+
+	subsystem->windowDx = 7;
+	subsystem->windowDy = 5;
+}
+
+static void synthetic_shadow_reset(syntheticShadowSubsystem* subsystem)
+{
+	RECTANGLE_16 screen;
+
+	screen.left = 0;
+	screen.top = 0;
+	screen.right = subsystem->width;
+	screen.bottom = subsystem->height;
+
+	subsystem->seed = 0x5EED;
+	subsystem->frameCount = 0;
+
+	synthetic_shadow_layout(subsystem);
+	synthetic_shadow_draw_background(subsystem, &screen);
+
+	if (subsystem->scenes & SYNTHETIC_SHADOW_SCENE_SCROLL)
+		synthetic_shadow_fill_rect(subsystem, &(subsystem->scrollRect), SYNTHETIC_SHADOW_TEXT_BACKGROUND);
+
+	if (subsystem->scenes & SYNTHETIC_SHADOW_SCENE_DRAG)
+		synthetic_shadow_draw_window(subsystem);
+}
+
+/**
+ * Options: <scene>[+<scene>...][,<width>x<height>[,<fps>]] where a scene is
+ * scroll, noise, drag, mixed (all three) or idle (a static screen).
+ */
+
+static int synthetic_shadow_parse_options(syntheticShadowSubsystem* subsystem, const char* options)
+{
+	char* p;
+	char* str;
+	char* tok;
+	char* next;
+	int status = 1;
+	int width, height, fps;
+
+	subsystem->scenes = SYNTHETIC_SHADOW_SCENE_SCROLL | SYNTHETIC_SHADOW_SCENE_NOISE | SYNTHETIC_SHADOW_SCENE_DRAG;
+	subsystem->width = SYNTHETIC_SHADOW_DEFAULT_WIDTH;
+	subsystem->height = SYNTHETIC_SHADOW_DEFAULT_HEIGHT;
+	subsystem->captureFrameRate = SYNTHETIC_SHADOW_DEFAULT_FRAME_RATE;
+
+	if (!options)
+		return 1;
+
+	if (!(str = _strdup(options)))
+		return -1;
+
+	p = strchr(str, ',');
+
+	if (p)
+		*p++ = '\0';
+
+	subsystem->scenes = 0;
+
+	for (tok = str; tok && (status > 0); tok = next)
+	{
+		next = strchr(tok, '+');
+
+		if (next)
+			*next++ = '\0';
+
+		if (_stricmp(tok, "scroll") == 0)
+			subsystem->scenes |= SYNTHETIC_SHADOW_SCENE_SCROLL;
+		else if (_stricmp(tok, "noise") == 0)
+			subsystem->scenes |= SYNTHETIC_SHADOW_SCENE_NOISE;
+		else if (_stricmp(tok, "drag") == 0)
+			subsystem->scenes |= SYNTHETIC_SHADOW_SCENE_DRAG;
+		else if (_stricmp(tok, "mixed") == 0)
+			subsystem->scenes |= SYNTHETIC_SHADOW_SCENE_SCROLL | SYNTHETIC_SHADOW_SCENE_NOISE | SYNTHETIC_SHADOW_SCENE_DRAG;
+		else if (_stricmp(tok, "idle") != 0)
+			status = -1;
+	}
+
+	if (p && (status > 0))
+	{
+		tok = p;
+		p = strchr(p, ',');
+
+		if (p)
+			*p++ = '\0';
+
+		if ((sscanf(tok, "%dx%d", &width, &height) != 2) ||
+				(width < 64) || (height < 64) || (width > 8192) || (height > 8192))
+		{
+			status = -1;
+		}
+		else
+		{
+			subsystem->width = width;
+			subsystem->height = height;
+		}
+	}
+
+	if (p && (status > 0))
+	{
+		fps = atoi(p);
+
+		if ((fps < 1) || (fps > 120))
+			status = -1;
+		else
+			subsystem->captureFrameRate = fps;
+	}
+
+	free(str);
+
+	if (status < 0)
+		WLog_ERR(TAG, "invalid synthetic screen options: %s", options);
+
+	return status;
+}
+
+static void synthetic_shadow_log_stats(syntheticShadowSubsystem* subsystem)
+{
+	UINT64 now = GetTickCount64();
+	UINT32 frames = subsystem->statsFrames;
+
+	if (now - subsystem->statsTime < SYNTHETIC_SHADOW_STATS_INTERVAL)
+		return;
+
+	if (frames > 0)
+	{
+		WLog_INFO(TAG, "%u frames in %u ms: %u changed pixels/frame, %u moves, render %u us/frame, grab %u us/frame",
+				frames, (UINT32) (now - subsystem->statsTime),
+				(UINT32) (subsystem->statsPixels / frames), subsystem->statsMoves,
+				(UINT32) ((subsystem->statsRenderTime * 1000) / frames),
+				(UINT32) ((subsystem->statsGrabTime * 1000) / frames));
+	}
+
+	subsystem->statsTime = now;
+	subsystem->statsFrames = 0;
+	subsystem->statsPixels = 0;
+	subsystem->statsMoves = 0;
+	subsystem->statsRenderTime = 0;
+	subsystem->statsGrabTime = 0;
+}
+
+int synthetic_shadow_screen_grab(syntheticShadowSubsystem* subsystem)
+{
+	int index;
+	int count;
+	int status;
+	int numRects;
+	BOOL hasMove;
+	rdpShadowMove move;
+	UINT64 start;
+	UINT64 rendered;
+	BYTE* pSrcData;
+	BYTE* pDstData;
+	rdpShadowServer* server;
+	rdpShadowSurface* surface;
+	RECTANGLE_16 surfaceRect;
+	const RECTANGLE_16* rects;
+
+	server = subsystem->server;
+	surface = server->surface;
+
+	count = ArrayList_Count(server->clients);
+
+	if ((count < 1) || ((count == 1) && subsystem->suppressOutput))
+		return 1;
+
+	start = GetTickCount64();
+
+	synthetic_shadow_render(subsystem);
+
+	rendered = GetTickCount64();
+
+	surfaceRect.left = 0;
+	surfaceRect.top = 0;
+	surfaceRect.right = surface->width;
+	surfaceRect.bottom = surface->height;
+
+	pSrcData = &subsystem->data[(surface->y * subsystem->scanline) + (surface->x * 4)];
+
+	status = shadow_capture_compare(server->capture, pSrcData, subsystem->scanline,
+			surface->width, surface->height, &(subsystem->invalidRegion));
+
+	if (status < 0)
+		region16_union_rect(&(subsystem->invalidRegion), &(subsystem->invalidRegion), &surfaceRect);
+
+	region16_intersect_rect(&(subsystem->invalidRegion), &(subsystem->invalidRegion), &surfaceRect);
+
+	if (!region16_is_empty(&(subsystem->invalidRegion)))
+	{
+		pDstData = shadow_surface_begin_frame(surface);
+
+		if (!pDstData)
+			return -1;
+
+		hasMove = (shadow_capture_detect_move(server->capture, surface->data, surface->scanline,
+				pSrcData, subsystem->scanline, &(subsystem->invalidRegion), &move) > 0) ? TRUE : FALSE;
+
+		shadow_capture_copy(server->capture, pDstData, surface->scanline,
+				pSrcData, subsystem->scanline, &(subsystem->invalidRegion));
+
+		if (hasMove)
+			subsystem->statsMoves++;
+
+		shadow_surface_publish(surface, &(subsystem->invalidRegion), hasMove ? &move : NULL);
+
+		rects = region16_rects(&(subsystem->invalidRegion), &numRects);
+
+		for (index = 0; index < numRects; index++)
+		{
+			subsystem->statsPixels += (rects[index].right - rects[index].left) *
+					(rects[index].bottom - rects[index].top);
+		}
+
+		region16_clear(&(subsystem->invalidRegion));
+	}
+
+	subsystem->statsFrames++;
+	subsystem->statsRenderTime += rendered - start;
+	subsystem->statsGrabTime += GetTickCount64() - rendered;
+
+	return 1;
+}
+
+int synthetic_shadow_subsystem_process_message(syntheticShadowSubsystem* subsystem, wMessage* message)
+{
+	if (message->id == SHADOW_MSG_IN_REFRESH_OUTPUT_ID)
+	{
+		UINT32 index;
+		SHADOW_MSG_IN_REFRESH_OUTPUT* msg = (SHADOW_MSG_IN_REFRESH_OUTPUT*) message->wParam;
+
+		if (msg->numRects)
+		{
+			for (index = 0; index < msg->numRects; index++)
+			{
+				region16_union_rect(&(subsystem->invalidRegion),
+						&(subsystem->invalidRegion), &msg->rects[index]);
+			}
+		}
+		else
+		{
+			RECTANGLE_16 refreshRect;
+
+			refreshRect.left = 0;
+			refreshRect.top = 0;
+			refreshRect.right = subsystem->width;
+			refreshRect.bottom = subsystem->height;
+
+			region16_union_rect(&(subsystem->invalidRegion),
+						&(subsystem->invalidRegion), &refreshRect);
+		}
+	}
+	else if (message->id == SHADOW_MSG_IN_SUPPRESS_OUTPUT_ID)
+	{
+		SHADOW_MSG_IN_SUPPRESS_OUTPUT* msg = (SHADOW_MSG_IN_SUPPRESS_OUTPUT*) message->wParam;
+
+		subsystem->suppressOutput = (msg->allow) ? FALSE : TRUE;
+
+		if (msg->allow)
+		{
+			region16_union_rect(&(subsystem->invalidRegion),
+						&(subsystem->invalidRegion), &(msg->rect));
+		}
+	}
+
+	if (message->Free)
+		message->Free(message);
+
+	return 1;
+}
+
+void* synthetic_shadow_subsystem_thread(syntheticShadowSubsystem* subsystem)
+{
+	DWORD status;
+	UINT64 cTime;
+	DWORD dwTimeout;
+	DWORD dwInterval;
+	UINT64 frameTime;
+	wMessage message;
+	wMessagePipe* MsgPipe;
+
+	MsgPipe = subsystem->MsgPipe;
+
+	dwInterval = 1000 / subsystem->captureFrameRate;
+	frameTime = GetTickCount64() + dwInterval;
+	subsystem->statsTime = GetTickCount64();
+
+	while (1)
+	{
+		cTime = GetTickCount64();
+		dwTimeout = (cTime > frameTime) ? 0 : frameTime - cTime;
+
+		status = WaitForSingleObject(MessageQueue_Event(MsgPipe->In), dwTimeout);
+
+		if (status == WAIT_OBJECT_0)
+		{
+			if (MessageQueue_Peek(MsgPipe->In, &message, TRUE))
+			{
+				if (message.id == WMQ_QUIT)
+					break;
+
+				synthetic_shadow_subsystem_process_message(subsystem, &message);
+			}
+		}
+
+		if ((status == WAIT_TIMEOUT) || (GetTickCount64() > frameTime))
+		{
+			synthetic_shadow_screen_grab(subsystem);
+			synthetic_shadow_log_stats(subsystem);
+
+			frameTime += dwInterval;
+		}
+	}
+
+	ExitThread(0);
+	return NULL;
+}
+
+int synthetic_shadow_enum_monitors(MONITOR_DEF* monitors, int maxMonitors)
+{
+	if (maxMonitors < 1)
+		return 0;
+
+	monitors[0].left = 0;
+	monitors[0].top = 0;
+	monitors[0].right = SYNTHETIC_SHADOW_DEFAULT_WIDTH;
+	monitors[0].bottom = SYNTHETIC_SHADOW_DEFAULT_HEIGHT;
+	monitors[0].flags = 1;
+
+	return 1;
+}
+
+int synthetic_shadow_subsystem_init(syntheticShadowSubsystem* subsystem)
+{
+	MONITOR_DEF* monitor;
+
+	if (synthetic_shadow_parse_options(subsystem, subsystem->server->syntheticOptions) < 0)
+		return -1;
+
+	subsystem->scanline = subsystem->width * 4;
+	subsystem->data = (BYTE*) _aligned_malloc(subsystem->scanline * subsystem->height, 16);
+
+	if (!subsystem->data)
+		return -1;
+
+	synthetic_shadow_reset(subsystem);
+
+	subsystem->numMonitors = 1;
+	monitor = &(subsystem->monitors[0]);
+
+	monitor->left = 0;
+	monitor->top = 0;
+	monitor->right = subsystem->width;
+	monitor->bottom = subsystem->height;
+	monitor->flags = 1;
+
+	CopyMemory(&(subsystem->virtualScreen), monitor, sizeof(MONITOR_DEF));
+
+	WLog_INFO(TAG, "synthetic screen %dx%d at %d fps, scenes: %s%s%s%s",
+			subsystem->width, subsystem->height, subsystem->captureFrameRate,
+			(subsystem->scenes & SYNTHETIC_SHADOW_SCENE_SCROLL) ? "scroll " : "",
+			(subsystem->scenes & SYNTHETIC_SHADOW_SCENE_NOISE) ? "noise " : "",
+			(subsystem->scenes & SYNTHETIC_SHADOW_SCENE_DRAG) ? "drag " : "",
+			subsystem->scenes ? "" : "idle");
+
+	return 1;
+}
+
+int synthetic_shadow_subsystem_uninit(syntheticShadowSubsystem* subsystem)
+{
+	if (!subsystem)
+		return -1;
+
+	if (subsystem->data)
+	{
+		_aligned_free(subsystem->data);
+		subsystem->data = NULL;
+	}
+
+	return 1;
+}
+
+int synthetic_shadow_subsystem_start(syntheticShadowSubsystem* subsystem)
+{
+	if (!subsystem)
+		return -1;
+
+	if (!(subsystem->thread = CreateThread(NULL, 0,
+			(LPTHREAD_START_ROUTINE) synthetic_shadow_subsystem_thread,
+			(void*) subsystem, 0, NULL)))
+	{
+		WLog_ERR(TAG, "Failed to create thread");
+		return -1;
+	}
+
+	return 1;
+}
+
+int synthetic_shadow_subsystem_stop(syntheticShadowSubsystem* subsystem)
+{
+	if (!subsystem)
+		return -1;
+
+	if (subsystem->thread)
+	{
+		MessageQueue_PostQuit(subsystem->MsgPipe->In, 0);
+		WaitForSingleObject(subsystem->thread, INFINITE);
+		CloseHandle(subsystem->thread);
+		subsystem->thread = NULL;
+	}
+
+	return 1;
+}
+
+syntheticShadowSubsystem* synthetic_shadow_subsystem_new()
+{
+	syntheticShadowSubsystem* subsystem;
+
+	subsystem = (syntheticShadowSubsystem*) calloc(1, sizeof(syntheticShadowSubsystem));
+
+	if (!subsystem)
+		return NULL;
+
+	return subsystem;
+}
+
+void synthetic_shadow_subsystem_free(syntheticShadowSubsystem* subsystem)
+{
+	if (!subsystem)
+		return;
+
+	synthetic_shadow_subsystem_uninit(subsystem);
+
+	free(subsystem);
+}
+
+int Synthetic_ShadowSubsystemEntry(RDP_SHADOW_ENTRY_POINTS* pEntryPoints)
+{
+	pEntryPoints->New = (pfnShadowSubsystemNew) synthetic_shadow_subsystem_new;
+	pEntryPoints->Free = (pfnShadowSubsystemFree) synthetic_shadow_subsystem_free;
+
+	pEntryPoints->Init = (pfnShadowSubsystemInit) synthetic_shadow_subsystem_init;
+	pEntryPoints->Uninit = (pfnShadowSubsystemInit) synthetic_shadow_subsystem_uninit;
+
+	pEntryPoints->Start = (pfnShadowSubsystemStart) synthetic_shadow_subsystem_start;
+	pEntryPoints->Stop = (pfnShadowSubsystemStop) synthetic_shadow_subsystem_stop;
+
+	pEntryPoints->EnumMonitors = (pfnShadowEnumMonitors) synthetic_shadow_enum_monitors;
+
+	return 1;
+}
@@ -0,0 +1,88 @@
+/**
+ * FreeRDP: A Remote Desktop Protocol Implementation
+ * Synthetic Shadow Subsystem
+ *
+ * Copyright 2026 agent <agent@local>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef FREERDP_SHADOW_SERVER_SYNTHETIC_H
+#define FREERDP_SHADOW_SERVER_SYNTHETIC_H
+
+#include <freerdp/server/shadow.h>
+
+typedef struct synthetic_shadow_subsystem syntheticShadowSubsystem;
+
+#include <winpr/crt.h>
+#include <winpr/synch.h>
+#include <winpr/thread.h>
+#include <winpr/collections.h>
+
+#define SYNTHETIC_SHADOW_SCENE_SCROLL		0x00000001
+#define SYNTHETIC_SHADOW_SCENE_NOISE		0x00000002
+#define SYNTHETIC_SHADOW_SCENE_DRAG		0x00000004
+
+#define SYNTHETIC_SHADOW_DEFAULT_WIDTH		1920
+#define SYNTHETIC_SHADOW_DEFAULT_HEIGHT		1080
+#define SYNTHETIC_SHADOW_DEFAULT_FRAME_RATE	30
+
+/**
+ * A headless screen drawn by the subsystem itself: scrolling text, a
+ * video-like noise area and a dragged window over a static desktop, or any
+ * subset of them. The content only depends on the frame number, so runs are
+ * reproducible. Frames go through the same diff, copy and encode path as a
+ * real screen.
+ */
+
+struct synthetic_shadow_subsystem
+{
+	RDP_SHADOW_SUBSYSTEM_COMMON();
+
+	HANDLE thread;
+
+	int width;
+	int height;
+	int scanline;
+	BYTE* data;
+
+	UINT32 scenes;
+	UINT32 frameCount;
+	UINT32 seed;
+
+	RECTANGLE_16 scrollRect;
+	RECTANGLE_16 noiseRect;
+	RECTANGLE_16 dragArea;
+	RECTANGLE_16 window;
+	int windowDx;
+	int windowDy;
+
+	UINT64 statsTime;
+	UINT32 statsFrames;
+	UINT64 statsPixels;
+	UINT32 statsMoves;
+	UINT64 statsRenderTime;
+	UINT64 statsGrabTime;
+};
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* FREERDP_SHADOW_SERVER_SYNTHETIC_H */
@@ -27,6 +27,7 @@
 #include "../shadow_screen.h"
 #include "../shadow_surface.h"
 #include "../shadow_capture.h"
+#include "../shadow_encode_cache.h"
 #include "../shadow_subsystem.h"
 #include "../shadow_mcevent.h"
 
@@ -214,6 +215,7 @@ int win_shadow_surface_copy(winShadowSubsystem* subsystem)
 	int status = 1;
 	int nDstStep = 0;
 	BYTE* pDstData = NULL;
+	BYTE* pSurfaceData;
 	rdpShadowServer* server;
 	rdpShadowSurface* surface;
 	RECTANGLE_16 surfaceRect;
@@ -280,7 +282,12 @@ int win_shadow_surface_copy(winShadowSubsystem* subsystem)
 	if (status <= 0)
 		return status;
 
-	freerdp_image_copy(surface->data, PIXEL_FORMAT_XRGB32,
+	pSurfaceData = shadow_surface_begin_frame(surface);
+
+	if (!pSurfaceData)
+		return -1;
+
+	freerdp_image_copy(pSurfaceData, PIXEL_FORMAT_XRGB32,
 			surface->scanline, x - surface->x, y - surface->y, width, height,
 			pDstData, PIXEL_FORMAT_XRGB32, nDstStep, 0, 0, NULL);
 
@@ -288,7 +295,7 @@ int win_shadow_surface_copy(winShadowSubsystem* subsystem)
 
 	count = ArrayList_Count(server->clients);
 
-	shadow_multiclient_publish_and_wait(subsystem->updateEvent);
+	shadow_surface_publish(surface, &(subsystem->invalidRegion), NULL);
 
 	ArrayList_Unlock(server->clients);
 
@@ -44,6 +44,7 @@
 #include "../shadow_client.h"
 #include "../shadow_encoder.h"
 #include "../shadow_capture.h"
+#include "../shadow_encode_cache.h"
 #include "../shadow_surface.h"
 #include "../shadow_subsystem.h"
 #include "../shadow_mcevent.h"
@@ -479,6 +480,47 @@ int x11_shadow_query_cursor(x11ShadowSubsystem* subsystem, BOOL getImage)
 	return 1;
 }
 
+#ifdef WITH_XDAMAGE
+static void x11_shadow_damage_notify(x11ShadowSubsystem* subsystem, XDamageNotifyEvent* notify)
+{
+	int x, y;
+	int right, bottom;
+	RECTANGLE_16 rect;
+
+	if (subsystem->damageOverflow)
+		return;
+
+	if (subsystem->damageCount >= X11_SHADOW_MAX_DAMAGE_RECTS)
+	{
+		subsystem->damageOverflow = TRUE;
+		region16_clear(&(subsystem->damageRegion));
+		return;
+	}
+
+	x = (notify->area.x < 0) ? 0 : notify->area.x;
+	y = (notify->area.y < 0) ? 0 : notify->area.y;
+	right = notify->area.x + notify->area.width;
+	bottom = notify->area.y + notify->area.height;
+
+	if (right > subsystem->width)
+		right = subsystem->width;
+
+	if (bottom > subsystem->height)
+		bottom = subsystem->height;
+
+	if ((right <= x) || (bottom <= y))
+		return;
+
+	rect.left = x;
+	rect.top = y;
+	rect.right = right;
+	rect.bottom = bottom;
+
+	region16_union_rect(&(subsystem->damageRegion), &(subsystem->damageRegion), &rect);
+	subsystem->damageCount++;
+}
+#endif
+
 int x11_shadow_handle_xevent(x11ShadowSubsystem* subsystem, XEvent* xevent)
 {
 	if (xevent->type == MotionNotify)
@@ -490,6 +532,12 @@ int x11_shadow_handle_xevent(x11ShadowSubsystem* subsystem, XEvent* xevent)
 	{
 		x11_shadow_query_cursor(subsystem, TRUE);
 	}
+#endif
+#ifdef WITH_XDAMAGE
+	else if (subsystem->use_xdamage && (xevent->type == subsystem->xdamage_notify_event))
+	{
+		x11_shadow_damage_notify(subsystem, (XDamageNotifyEvent*) xevent);
+	}
 #endif
 	else
 	{
@@ -511,7 +559,7 @@ void x11_shadow_validate_region(x11ShadowSubsystem* subsystem, int x, int y, int
 	region.width = width;
 	region.height = height;
 
-#ifdef WITH_XFIXES
+#if defined(WITH_XFIXES) && defined(WITH_XDAMAGE)
 	XFixesSetRegion(subsystem->display, subsystem->xdamage_region, &region, 1);
 	XDamageSubtract(subsystem->display, subsystem->xdamage, subsystem->xdamage_region, None);
 #endif
@@ -632,19 +680,122 @@ int x11_shadow_blend_cursor(x11ShadowSubsystem* subsystem)
 	return 1;
 }
 
+/**
+ * Copies the damaged rectangles of the root window into the surface back
+ * buffer and adds them to the invalid region: through the shared memory pixmap when XShm is
+ * available, with one XGetImage per rectangle otherwise. Called with the
+ * display locked, returns with the display unlocked.
+ * Block moves are only looked for when the damage is a single rectangle
+ * captured through shared memory, the rest of the pixmap may be stale.
+ */
+
+static int x11_shadow_damage_grab(x11ShadowSubsystem* subsystem, BYTE* pDstData, rdpShadowMove* move, BOOL* hasMove)
+{
+	int index;
+	int numRects;
+	XImage* image;
+	RECTANGLE_16 rect;
+	RECTANGLE_16 surfaceRect;
+	const RECTANGLE_16* rects;
+	rdpShadowSurface* surface;
+	REGION16 region;
+
+	surface = subsystem->server->surface;
+
+	surfaceRect.left = surface->x;
+	surfaceRect.top = surface->y;
+	surfaceRect.right = surface->x + surface->width;
+	surfaceRect.bottom = surface->y + surface->height;
+
+	region16_init(&region);
+
+	rects = region16_rects(&(subsystem->damageRegion), &numRects);
+
+	for (index = 0; index < numRects; index++)
+	{
+		if (!rectangles_intersection(&rects[index], &surfaceRect, &rect))
+			continue;
+
+		rect.left -= surface->x;
+		rect.top -= surface->y;
+		rect.right -= surface->x;
+		rect.bottom -= surface->y;
+
+		region16_union_rect(&region, &region, &rect);
+	}
+
+	rects = region16_rects(&region, &numRects);
+
+	for (index = 0; index < numRects; index++)
+	{
+		if (subsystem->use_xshm)
+		{
+			XCopyArea(subsystem->display, subsystem->root_window, subsystem->fb_pixmap,
+					subsystem->xshm_gc, surface->x + rects[index].left, surface->y + rects[index].top,
+					rects[index].right - rects[index].left, rects[index].bottom - rects[index].top,
+					rects[index].left, rects[index].top);
+			continue;
+		}
+
+		image = XGetImage(subsystem->display, subsystem->root_window,
+				surface->x + rects[index].left, surface->y + rects[index].top,
+				rects[index].right - rects[index].left, rects[index].bottom - rects[index].top,
+				AllPlanes, ZPixmap);
+
+		if (!image)
+			continue;
+
+		freerdp_image_copy(pDstData, PIXEL_FORMAT_XRGB32,
+				surface->scanline, rects[index].left, rects[index].top,
+				rects[index].right - rects[index].left, rects[index].bottom - rects[index].top,
+				(BYTE*) image->data, PIXEL_FORMAT_XRGB32, image->bytes_per_line, 0, 0, NULL);
+
+		XDestroyImage(image);
+	}
+
+	if (subsystem->use_xshm)
+		XSync(subsystem->display, False);
+
+	XUnlockDisplay(subsystem->display);
+
+	if (subsystem->use_xshm)
+	{
+		image = subsystem->fb_image;
+
+		if (numRects == 1)
+		{
+			*hasMove = (shadow_capture_detect_move(subsystem->server->capture, surface->data, surface->scanline,
+					(BYTE*) image->data, image->bytes_per_line, &region, move) > 0) ? TRUE : FALSE;
+		}
+
+		shadow_capture_copy(subsystem->server->capture, pDstData, surface->scanline,
+				(BYTE*) image->data, image->bytes_per_line, &region);
+	}
+
+	for (index = 0; index < numRects; index++)
+		region16_union_rect(&(subsystem->invalidRegion), &(subsystem->invalidRegion), &rects[index]);
+
+	/* keep the tile hashes in step with the surface for the next full frame compare */
+	shadow_capture_update(subsystem->server->capture, pDstData, surface->scanline, &region);
+
+	region16_uninit(&region);
+
+	return 1;
+}
+
 int x11_shadow_screen_grab(x11ShadowSubsystem* subsystem)
 {
 	int count;
 	int status;
-	int x, y;
-	int width, height;
-	XImage* image;
+	BOOL fullFrame = TRUE;
+	BOOL hasMove = FALSE;
+	rdpShadowMove move;
+	XImage* image = NULL;
+	BYTE* pDstData;
 	rdpShadowScreen* screen;
 	rdpShadowServer* server;
 	rdpShadowSurface* surface;
-	RECTANGLE_16 invalidRect;
 	RECTANGLE_16 surfaceRect;
-	const RECTANGLE_16 *extents;
 
 	server = subsystem->server;
 	surface = server->surface;
@@ -652,11 +803,18 @@ int x11_shadow_screen_grab(x11ShadowSubsystem* subsystem)
 
 	count = ArrayList_Count(server->clients);
 
-	if (count < 1)
+	if ((count < 1) || ((count == 1) && subsystem->suppressOutput))
+	{
+		/* nobody looks at the surface, it is refreshed from a full frame later */
+		subsystem->damageOverflow = TRUE;
 		return 1;
+	}
 
-	if ((count == 1) && subsystem->suppressOutput)
-		return 1;
+	/* the clients keep encoding from the last published frame meanwhile */
+	pDstData = shadow_surface_begin_frame(surface);
+
+	if (!pDstData)
+		return -1;
 
 	surfaceRect.left = 0;
 	surfaceRect.top = 0;
@@ -665,51 +823,85 @@ int x11_shadow_screen_grab(x11ShadowSubsystem* subsystem)
 
 	XLockDisplay(subsystem->display);
 
-	if (subsystem->use_xshm)
+#ifdef WITH_XDAMAGE
+	if (subsystem->use_xdamage)
 	{
-		image = subsystem->fb_image;
+		XEvent xevent;
+
+		/**
+		 * Repair the damage first: anything drawn from now on is reported
+		 * again, so the damage events queued after the sync cover at least
+		 * everything that changed since the previous grab.
+		 */
 
-		XCopyArea(subsystem->display, subsystem->root_window, subsystem->fb_pixmap,
-				subsystem->xshm_gc, 0, 0, subsystem->width, subsystem->height, 0, 0);
+		XDamageSubtract(subsystem->display, subsystem->xdamage, None, None);
+		XSync(subsystem->display, False);
+
+		while (XPending(subsystem->display) > 0)
+		{
+			XNextEvent(subsystem->display, &xevent);
+			x11_shadow_handle_xevent(subsystem, &xevent);
+		}
 
-		status = shadow_capture_compare(surface->data, surface->scanline, surface->width, surface->height,
-				(BYTE*) &(image->data[surface->width * 4]), image->bytes_per_line, &invalidRect);
+		fullFrame = subsystem->damageOverflow;
 	}
-	else
+#endif
+
+	if (fullFrame)
 	{
-		image = XGetImage(subsystem->display, subsystem->root_window,
-					surface->x, surface->y, surface->width, surface->height, AllPlanes, ZPixmap);
+		if (subsystem->use_xshm)
+		{
+			image = subsystem->fb_image;
 
-		status = shadow_capture_compare(surface->data, surface->scanline, surface->width, surface->height,
-				(BYTE*) image->data, image->bytes_per_line, &invalidRect);
-	}
+			XCopyArea(subsystem->display, subsystem->root_window, subsystem->fb_pixmap,
+					subsystem->xshm_gc, surface->x, surface->y, surface->width, surface->height, 0, 0);
+		}
+		else
+		{
+			image = XGetImage(subsystem->display, subsystem->root_window,
+						surface->x, surface->y, surface->width, surface->height, AllPlanes, ZPixmap);
+		}
 
-	XSync(subsystem->display, False);
+		XSync(subsystem->display, False);
 
-	XUnlockDisplay(subsystem->display);
+		XUnlockDisplay(subsystem->display);
+
+		if (!image)
+			return -1;
+
+		status = shadow_capture_compare(server->capture, (BYTE*) image->data, image->bytes_per_line,
+				surface->width, surface->height, &(subsystem->invalidRegion));
+
+		if (status < 0)
+			region16_union_rect(&(subsystem->invalidRegion), &(subsystem->invalidRegion), &surfaceRect);
+	}
+	else
+	{
+		x11_shadow_damage_grab(subsystem, pDstData, &move, &hasMove);
+	}
+
+	region16_clear(&(subsystem->damageRegion));
+	subsystem->damageCount = 0;
+	subsystem->damageOverflow = FALSE;
 
-	region16_union_rect(&(subsystem->invalidRegion), &(subsystem->invalidRegion), &invalidRect);
 	region16_intersect_rect(&(subsystem->invalidRegion), &(subsystem->invalidRegion), &surfaceRect);
 
 	if (!region16_is_empty(&(subsystem->invalidRegion)))
 	{
-		extents = region16_extents(&(subsystem->invalidRegion));
-
-		x = extents->left;
-		y = extents->top;
-		width = extents->right - extents->left;
-		height = extents->bottom - extents->top;
+		if (fullFrame)
+		{
+			hasMove = (shadow_capture_detect_move(server->capture, surface->data, surface->scanline,
+					(BYTE*) image->data, image->bytes_per_line, &(subsystem->invalidRegion), &move) > 0) ? TRUE : FALSE;
 
-		freerdp_image_copy(surface->data, PIXEL_FORMAT_XRGB32,
-				surface->scanline, x, y, width, height,
-				(BYTE*) image->data, PIXEL_FORMAT_XRGB32,
-				image->bytes_per_line, x, y, NULL);
+			shadow_capture_copy(server->capture, pDstData, surface->scanline,
+					(BYTE*) image->data, image->bytes_per_line, &(subsystem->invalidRegion));
+		}
 
 		//x11_shadow_blend_cursor(subsystem);
 
 		count = ArrayList_Count(server->clients);
 
-		shadow_multiclient_publish_and_wait(subsystem->updateEvent);
+		shadow_surface_publish(surface, &(subsystem->invalidRegion), hasMove ? &move : NULL);
 
 		if (count == 1)
 		{
@@ -726,7 +918,7 @@ int x11_shadow_screen_grab(x11ShadowSubsystem* subsystem)
 		region16_clear(&(subsystem->invalidRegion));
 	}
 
-	if (!subsystem->use_xshm)
+	if (image && !subsystem->use_xshm)
 		XDestroyImage(image);
 
 	return 1;
@@ -822,7 +1014,7 @@ void* x11_shadow_subsystem_thread(x11ShadowSubsystem* subsystem)
 
 		if (WaitForSingleObject(subsystem->event, 0) == WAIT_OBJECT_0)
 		{
-			if (XEventsQueued(subsystem->display, QueuedAlready))
+			while (XEventsQueued(subsystem->display, QueuedAlready))
 			{
 				XNextEvent(subsystem->display, &xevent);
 				x11_shadow_handle_xevent(subsystem, &xevent);
@@ -906,6 +1098,12 @@ int x11_shadow_xinerama_init(x11ShadowSubsystem* subsystem)
 
 	x11_shadow_subsystem_base_init(subsystem);
 
+	if (subsystem->server->x11Damage)
+	{
+		subsystem->use_xshm = TRUE;
+		subsystem->use_xdamage = TRUE;
+	}
+
 	if (!XineramaQueryExtension(subsystem->display, &xinerama_event, &xinerama_error))
 		return -1;
 
@@ -1127,6 +1325,11 @@ int x11_shadow_subsystem_init(x11ShadowSubsystem* subsystem)
 
 	x11_shadow_subsystem_base_init(subsystem);
 
+	/* the first grab has no damage history and compares the full frame */
+	region16_init(&(subsystem->damageRegion));
+	subsystem->damageCount = 0;
+	subsystem->damageOverflow = TRUE;
+
 	if ((subsystem->depth != 24) && (subsystem->depth != 32))
 	{
 		WLog_ERR(TAG, "unsupported X11 server color depth: %d", subsystem->depth);
@@ -1269,6 +1472,8 @@ int x11_shadow_subsystem_uninit(x11ShadowSubsystem* subsystem)
 		subsystem->cursorPixels = NULL;
 	}
 
+	region16_uninit(&(subsystem->damageRegion));
+
 	return 1;
 }
 
@@ -1323,8 +1528,9 @@ x11ShadowSubsystem* x11_shadow_subsystem_new()
 	subsystem->MouseEvent = (pfnShadowMouseEvent) x11_shadow_input_mouse_event;
 	subsystem->ExtendedMouseEvent = (pfnShadowExtendedMouseEvent) x11_shadow_input_extended_mouse_event;
 
+	/* XShm and XDamage capture are experimental, see x11_shadow_subsystem_init */
 	subsystem->composite = FALSE;
-	subsystem->use_xshm = FALSE; /* temporarily disabled */
+	subsystem->use_xshm = FALSE;
 	subsystem->use_xfixes = TRUE;
 	subsystem->use_xdamage = FALSE;
 	subsystem->use_xinerama = TRUE;
@@ -23,6 +23,8 @@
 
 typedef struct x11_shadow_subsystem x11ShadowSubsystem;
 
+#define X11_SHADOW_MAX_DAMAGE_RECTS	256
+
 #include <winpr/crt.h>
 #include <winpr/synch.h>
 #include <winpr/thread.h>
@@ -79,6 +81,16 @@ struct x11_shadow_subsystem
 	Pixmap fb_pixmap;
 	Window root_window;
 	XShmSegmentInfo fb_shm_info;
+	GC xshm_gc;
+
+	/**
+	 * XDamage rectangles (root window coordinates) reported since the last
+	 * screen grab. Past X11_SHADOW_MAX_DAMAGE_RECTS, or before the first
+	 * grab, the damage overflows and the whole frame is diffed instead.
+	 */
+	REGION16 damageRegion;
+	int damageCount;
+	BOOL damageOverflow;
 
 	int cursorHotX;
 	int cursorHotY;
@@ -90,7 +102,6 @@ struct x11_shadow_subsystem
 	int cursorMaxHeight;
 
 #ifdef WITH_XDAMAGE
-	GC xshm_gc;
 	Damage xdamage;
 	int xdamage_notify_event;
 	XserverRegion xdamage_region;
@@ -20,10 +20,18 @@
 #include "config.h"
 #endif
 
+#if defined(WITH_SSE2) && (defined(__GNUC__) || (defined(_MSC_VER) && (_MSC_VER >= 1700)))
+#define WITH_CAPTURE_SIMD
+/* must come before winpr/crt.h, which emulates some of its intrinsics */
+#include <immintrin.h>
+#endif
+
 #include <winpr/crt.h>
 #include <winpr/print.h>
+#include <winpr/sysinfo.h>
 
 #include <freerdp/log.h>
+#include <freerdp/codec/color.h>
 
 #include "shadow_surface.h"
 
@@ -80,144 +88,1004 @@ int shadow_capture_align_clip_rect(RECTANGLE_16* rect, RECTANGLE_16* clip)
 	return 1;
 }
 
-int shadow_capture_compare(BYTE* pData1, int nStep1, int nWidth, int nHeight, BYTE* pData2, int nStep2, RECTANGLE_16* rect)
+/**
+ * Tile hashing
+ *
+ * Each 16x16 tile is hashed with an accumulator per 64-bit lane of a 64 byte
+ * tile row, in the spirit of XXH3: the lane is mixed with a key depending on
+ * its row and column, the two 32-bit halves of the result are multiplied and
+ * the data of the neighbouring lane is added. The SIMD versions compute the
+ * same hash, partial tiles at the right edge are padded with zeroes.
+ */
+
+#define SHADOW_CAPTURE_KEY_STEP		0x9E3779B97F4A7C15ULL
+
+static const UINT64 shadow_capture_keys[8] =
 {
-	BOOL equal;
-	BOOL allEqual;
-	int tw, th;
-	int tx, ty, k;
-	int nrow, ncol;
-	int l, t, r, b;
-	BYTE *p1, *p2;
-	BOOL rows[1024];
-	BOOL cols[1024];
-	BOOL grid[1024][1024];
+	0xBE4BA423396CFEB8ULL, 0x1CAD21F72C81017CULL,
+	0xDB979083E96DD4DEULL, 0x1F67B3B7A4A44072ULL,
+	0x78E5C0CC4EE679CBULL, 0x2172FFCC7DD05A82ULL,
+	0x8E2443F7744608B8ULL, 0x4C263A81E69035E0ULL
+};
+
+#define SHADOW_CAPTURE_MAX_SPANS	16
+#define SHADOW_CAPTURE_MIN_PARALLEL_TILES	4096
+#define SHADOW_CAPTURE_MIN_PARALLEL_PIXELS	(256 * 1024)
+
+static UINT64 shadow_capture_hash_finalize(const UINT64* acc, int nHeight)
+{
+	int index;
+	UINT64 h = (UINT64) nHeight * 0x9FB21C651E98DF25ULL;
+
+	for (index = 0; index < 8; index++)
+	{
+		h ^= acc[index] * 0xC2B2AE3D27D4EB4FULL;
+		h = ((h << 31) | (h >> 33)) * 0x9E3779B185EBCA87ULL;
+	}
+
+	h ^= h >> 33;
+	h *= 0xFF51AFD7ED558CCDULL;
+	h ^= h >> 33;
+	h *= 0xC4CEB9FE1A85EC53ULL;
+	h ^= h >> 33;
+
+	return h;
+}
+
+static void shadow_capture_hash_row(UINT64* acc, const BYTE* pRow, UINT64 step)
+{
+	int index;
+	UINT64 data[8];
+	UINT64 key;
+
+	CopyMemory(data, pRow, sizeof(data));
+
+	for (index = 0; index < 8; index++)
+	{
+		key = (shadow_capture_keys[index] + step) ^ data[index];
+		acc[index] += (key & 0xFFFFFFFF) * (key >> 32) + data[index ^ 1];
+	}
+}
+
+static UINT64 shadow_capture_hash_tile_c(const BYTE* pData, int nStep, int nHeight)
+{
+	int y;
+	UINT64 acc[8];
+
+	ZeroMemory(acc, sizeof(acc));
+
+	for (y = 0; y < nHeight; y++)
+	{
+		shadow_capture_hash_row(acc, pData, (y + 1) * SHADOW_CAPTURE_KEY_STEP);
+		pData += nStep;
+	}
+
+	return shadow_capture_hash_finalize(acc, nHeight);
+}
+
+static UINT64 shadow_capture_hash_partial_tile(const BYTE* pData, int nStep, int nWidth, int nHeight)
+{
+	int y;
+	UINT64 acc[8];
+	BYTE row[64];
+
+	ZeroMemory(acc, sizeof(acc));
+	ZeroMemory(row, sizeof(row));
+
+	for (y = 0; y < nHeight; y++)
+	{
+		CopyMemory(row, pData, nWidth * 4);
+		shadow_capture_hash_row(acc, row, (y + 1) * SHADOW_CAPTURE_KEY_STEP);
+		pData += nStep;
+	}
+
+	return shadow_capture_hash_finalize(acc, nHeight);
+}
+
+#ifdef WITH_CAPTURE_SIMD
+
+#ifdef _MSC_VER
+#define __attribute__(...)
+#endif
+
+#define SHADOW_CAPTURE_ACCUMULATE_SSE2(_acc, _data, _key) do { \
+	__m128i _dk = _mm_xor_si128(_data, _key); \
+	__m128i _prod = _mm_mul_epu32(_dk, _mm_shuffle_epi32(_dk, _MM_SHUFFLE(2, 3, 0, 1))); \
+	_acc = _mm_add_epi64(_acc, _mm_add_epi64(_prod, _mm_shuffle_epi32(_data, _MM_SHUFFLE(1, 0, 3, 2)))); \
+	} while (0)
+
+static UINT64 __attribute__((__target__("sse2")))
+shadow_capture_hash_tile_sse2(const BYTE* pData, int nStep, int nHeight)
+{
+	int y;
+	UINT64 acc[8];
+	__m128i a0, a1, a2, a3;
+	__m128i k0, k1, k2, k3;
+	__m128i step;
+
+	a0 = a1 = a2 = a3 = _mm_setzero_si128();
+	k0 = _mm_loadu_si128((const __m128i*) &shadow_capture_keys[0]);
+	k1 = _mm_loadu_si128((const __m128i*) &shadow_capture_keys[2]);
+	k2 = _mm_loadu_si128((const __m128i*) &shadow_capture_keys[4]);
+	k3 = _mm_loadu_si128((const __m128i*) &shadow_capture_keys[6]);
+	step = _mm_set1_epi64x(SHADOW_CAPTURE_KEY_STEP);
 
-	allEqual = TRUE;
-	ZeroMemory(rect, sizeof(RECTANGLE_16));
-	FillMemory(rows, sizeof(rows), 0xFF);
-	FillMemory(cols, sizeof(cols), 0xFF);
-	FillMemory(grid, sizeof(grid), 0xFF);
+	for (y = 0; y < nHeight; y++)
+	{
+		k0 = _mm_add_epi64(k0, step);
+		k1 = _mm_add_epi64(k1, step);
+		k2 = _mm_add_epi64(k2, step);
+		k3 = _mm_add_epi64(k3, step);
+
+		SHADOW_CAPTURE_ACCUMULATE_SSE2(a0, _mm_loadu_si128((const __m128i*) &pData[0]), k0);
+		SHADOW_CAPTURE_ACCUMULATE_SSE2(a1, _mm_loadu_si128((const __m128i*) &pData[16]), k1);
+		SHADOW_CAPTURE_ACCUMULATE_SSE2(a2, _mm_loadu_si128((const __m128i*) &pData[32]), k2);
+		SHADOW_CAPTURE_ACCUMULATE_SSE2(a3, _mm_loadu_si128((const __m128i*) &pData[48]), k3);
+
+		pData += nStep;
+	}
+
+	_mm_storeu_si128((__m128i*) &acc[0], a0);
+	_mm_storeu_si128((__m128i*) &acc[2], a1);
+	_mm_storeu_si128((__m128i*) &acc[4], a2);
+	_mm_storeu_si128((__m128i*) &acc[6], a3);
+
+	return shadow_capture_hash_finalize(acc, nHeight);
+}
+
+#define SHADOW_CAPTURE_ACCUMULATE_AVX2(_acc, _data, _key) do { \
+	__m256i _dk = _mm256_xor_si256(_data, _key); \
+	__m256i _prod = _mm256_mul_epu32(_dk, _mm256_shuffle_epi32(_dk, _MM_SHUFFLE(2, 3, 0, 1))); \
+	_acc = _mm256_add_epi64(_acc, _mm256_add_epi64(_prod, _mm256_shuffle_epi32(_data, _MM_SHUFFLE(1, 0, 3, 2)))); \
+	} while (0)
+
+static UINT64 __attribute__((__target__("avx2")))
+shadow_capture_hash_tile_avx2(const BYTE* pData, int nStep, int nHeight)
+{
+	int y;
+	UINT64 acc[8];
+	__m256i a0, a1;
+	__m256i k0, k1;
+	__m256i step;
+
+	a0 = a1 = _mm256_setzero_si256();
+	k0 = _mm256_loadu_si256((const __m256i*) &shadow_capture_keys[0]);
+	k1 = _mm256_loadu_si256((const __m256i*) &shadow_capture_keys[4]);
+	step = _mm256_set1_epi64x(SHADOW_CAPTURE_KEY_STEP);
+
+	for (y = 0; y < nHeight; y++)
+	{
+		k0 = _mm256_add_epi64(k0, step);
+		k1 = _mm256_add_epi64(k1, step);
+
+		SHADOW_CAPTURE_ACCUMULATE_AVX2(a0, _mm256_loadu_si256((const __m256i*) &pData[0]), k0);
+		SHADOW_CAPTURE_ACCUMULATE_AVX2(a1, _mm256_loadu_si256((const __m256i*) &pData[32]), k1);
+
+		pData += nStep;
+	}
+
+	_mm256_storeu_si256((__m256i*) &acc[0], a0);
+	_mm256_storeu_si256((__m256i*) &acc[4], a1);
+
+	return shadow_capture_hash_finalize(acc, nHeight);
+}
 
-	nrow = (nHeight + 15) / 16;
-	ncol = (nWidth + 15) / 16;
+#endif /* WITH_CAPTURE_SIMD */
 
-	l = ncol + 1;
-	r = -1;
+/**
+ * Hashes the tile rows of a band and flags the tiles whose hash changed.
+ */
 
-	t = nrow + 1;
-	b = -1;
+static void shadow_capture_compare_band(rdpShadowCapture* capture, int firstRow, int lastRow)
+{
+	int tx, ty;
+	int tw, th;
+	UINT64 hash;
+	UINT64* pHash;
+	BYTE* pDirty;
+	const BYTE* pTile;
 
-	for (ty = 0; ty < nrow; ty++)
+	for (ty = firstRow; ty < lastRow; ty++)
 	{
-		th = ((ty + 1) == nrow) ? (nHeight % 16) : 16;
+		th = capture->height - (ty * 16);
 
-		if (!th)
+		if (th > 16)
 			th = 16;
 
-		for (tx = 0; tx < ncol; tx++)
+		pTile = &capture->frameData[ty * 16 * capture->frameStep];
+		pHash = &capture->tileHashes[ty * capture->tileCols];
+		pDirty = &capture->tileDirty[ty * capture->tileCols];
+
+		for (tx = 0; tx < capture->tileCols; tx++)
 		{
-			equal = TRUE;
+			tw = capture->width - (tx * 16);
+
+			if (tw >= 16)
+				hash = capture->hashTile(pTile, capture->frameStep, th);
+			else
+				hash = shadow_capture_hash_partial_tile(pTile, capture->frameStep, tw, th);
+
+			pDirty[tx] = (!capture->tileHashesValid || (pHash[tx] != hash)) ? 1 : 0;
+			pHash[tx] = hash;
+			pTile += 16 * 4;
+		}
+	}
+}
+
+static void CALLBACK shadow_capture_band_work_callback(PTP_CALLBACK_INSTANCE instance, void* context, PTP_WORK work)
+{
+	rdpShadowCaptureBand* band = (rdpShadowCaptureBand*) context;
+
+	shadow_capture_compare_band(band->capture, band->firstRow, band->lastRow);
+}
+
+/**
+ * Copies the part of the copy rectangles between the top and bottom rows.
+ */
+
+static void shadow_capture_copy_band(rdpShadowCapture* capture, int top, int bottom)
+{
+	int index;
+	int y1, y2;
+	const RECTANGLE_16* rect;
+
+	for (index = 0; index < capture->copyNumRects; index++)
+	{
+		rect = &capture->copyRects[index];
+
+		y1 = MAX(rect->top, top);
+		y2 = MIN(rect->bottom, bottom);
+
+		if (y2 <= y1)
+			continue;
+
+		freerdp_image_copy(capture->copyData, PIXEL_FORMAT_XRGB32, capture->copyStep,
+				rect->left, y1, rect->right - rect->left, y2 - y1,
+				(BYTE*) capture->frameData, PIXEL_FORMAT_XRGB32, capture->frameStep,
+				rect->left, y1, NULL);
+	}
+}
+
+static void CALLBACK shadow_capture_copy_work_callback(PTP_CALLBACK_INSTANCE instance, void* context, PTP_WORK work)
+{
+	rdpShadowCaptureBand* band = (rdpShadowCaptureBand*) context;
 
-			tw = ((tx + 1) == ncol) ? (nWidth % 16) : 16;
+	shadow_capture_copy_band(band->capture, band->top, band->bottom);
+}
+
+static BOOL shadow_capture_resize(rdpShadowCapture* capture, int nWidth, int nHeight)
+{
+	int tileCols;
+	int tileRows;
+	UINT64* tileHashes;
+	BYTE* tileDirty;
+
+	tileCols = (nWidth + 15) / 16;
+	tileRows = (nHeight + 15) / 16;
+
+	tileHashes = (UINT64*) calloc(tileCols * tileRows, sizeof(UINT64));
+	tileDirty = (BYTE*) calloc(tileCols * tileRows, sizeof(BYTE));
+
+	if (!tileHashes || !tileDirty)
+	{
+		free(tileHashes);
+		free(tileDirty);
+		return FALSE;
+	}
+
+	free(capture->tileHashes);
+	free(capture->tileDirty);
+
+	capture->width = nWidth;
+	capture->height = nHeight;
+	capture->tileCols = tileCols;
+	capture->tileRows = tileRows;
+	capture->tileHashes = tileHashes;
+	capture->tileDirty = tileDirty;
+	capture->tileHashesValid = FALSE;
+
+	return TRUE;
+}
 
-			if (!tw)
-				tw = 16;
+/**
+ * Adds the dirty tiles to the region. Runs of dirty tiles in a tile row form
+ * a rectangle, and consecutive tile rows with the same runs are merged. A
+ * row with more than SHADOW_CAPTURE_MAX_SPANS runs is reduced to one.
+ */
+
+static void shadow_capture_flush_spans(REGION16* region, RECTANGLE_16* spans, int count)
+{
+	int index;
+
+	for (index = 0; index < count; index++)
+		region16_union_rect(region, region, &spans[index]);
+}
 
-			p1 = &pData1[(ty * 16 * nStep1) + (tx * 16 * 4)];
-			p2 = &pData2[(ty * 16 * nStep2) + (tx * 16 * 4)];
+static void shadow_capture_build_region(rdpShadowCapture* capture, REGION16* region)
+{
+	int tx, ty;
+	int count;
+	int pendingCount = 0;
+	BOOL merge;
+	BYTE* pDirty;
+	UINT16 top, bottom;
+	RECTANGLE_16 spans[SHADOW_CAPTURE_MAX_SPANS];
+	RECTANGLE_16 pending[SHADOW_CAPTURE_MAX_SPANS];
+
+	for (ty = 0; ty < capture->tileRows; ty++)
+	{
+		count = 0;
+		pDirty = &capture->tileDirty[ty * capture->tileCols];
+		top = (UINT16) (ty * 16);
+		bottom = (UINT16) MIN((ty + 1) * 16, capture->height);
 
-			for (k = 0; k < th; k++)
+		for (tx = 0; tx < capture->tileCols; tx++)
+		{
+			if (!pDirty[tx])
+				continue;
+
+			if ((count > 0) && (spans[count - 1].right == (tx * 16)))
 			{
-				if (memcmp(p1, p2, tw * 4) != 0)
-				{
-					equal = FALSE;
-					break;
-				}
-
-				p1 += nStep1;
-				p2 += nStep2;
+				spans[count - 1].right = (UINT16) MIN((tx + 1) * 16, capture->width);
+				continue;
 			}
 
-			if (!equal)
+			if (count == SHADOW_CAPTURE_MAX_SPANS)
 			{
-				grid[ty][tx] = FALSE;
-				rows[ty] = FALSE;
-				cols[tx] = FALSE;
+				spans[0].right = (UINT16) MIN((tx + 1) * 16, capture->width);
+				count = 1;
+				continue;
+			}
 
-				if (l > tx)
-					l = tx;
+			spans[count].left = (UINT16) (tx * 16);
+			spans[count].top = top;
+			spans[count].right = (UINT16) MIN((tx + 1) * 16, capture->width);
+			spans[count].bottom = bottom;
+			count++;
+		}
 
-				if (r < tx)
-					r = tx;
-			}
+		merge = (count > 0) && (count == pendingCount) && (pending[0].bottom == top);
+
+		for (tx = 0; merge && (tx < count); tx++)
+		{
+			if ((spans[tx].left != pending[tx].left) || (spans[tx].right != pending[tx].right))
+				merge = FALSE;
+		}
+
+		if (merge)
+		{
+			for (tx = 0; tx < count; tx++)
+				pending[tx].bottom = bottom;
+
+			continue;
 		}
 
-		if (!rows[ty])
+		shadow_capture_flush_spans(region, pending, pendingCount);
+		CopyMemory(pending, spans, count * sizeof(RECTANGLE_16));
+		pendingCount = count;
+	}
+
+	shadow_capture_flush_spans(region, pending, pendingCount);
+}
+
+/**
+ * Compares a frame with the previous one using the tile hashes and adds the
+ * 16x16 tiles that changed to region. The first frame, and any frame after a
+ * size change or shadow_capture_invalidate, is entirely dirty.
+ *
+ * Returns 1 when tiles changed, 0 when none did and -1 on error.
+ */
+
+int shadow_capture_compare(rdpShadowCapture* capture, BYTE* pData, int nStep, int nWidth, int nHeight, REGION16* region)
+{
+	int index;
+	int count;
+	int changed;
+	int rowsPerBand;
+
+	if (!capture || !pData || (nWidth < 1) || (nHeight < 1))
+		return -1;
+
+	if ((nWidth != capture->width) || (nHeight != capture->height) || !capture->tileHashes)
+	{
+		if (!shadow_capture_resize(capture, nWidth, nHeight))
+			return -1;
+	}
+
+	capture->frameData = pData;
+	capture->frameStep = nStep;
+
+	count = capture->tileCols * capture->tileRows;
+
+	if ((capture->bandCount > 1) && (count >= SHADOW_CAPTURE_MIN_PARALLEL_TILES))
+	{
+		rowsPerBand = (capture->tileRows + capture->bandCount - 1) / capture->bandCount;
+
+		for (index = 0; index < capture->bandCount; index++)
 		{
-			allEqual = FALSE;
+			capture->bands[index].firstRow = MIN(index * rowsPerBand, capture->tileRows);
+			capture->bands[index].lastRow = MIN((index + 1) * rowsPerBand, capture->tileRows);
+			SubmitThreadpoolWork(capture->bands[index].work);
+		}
+
+		for (index = 0; index < capture->bandCount; index++)
+			WaitForThreadpoolWorkCallbacks(capture->bands[index].work, FALSE);
+	}
+	else
+	{
+		shadow_capture_compare_band(capture, 0, capture->tileRows);
+	}
+
+	capture->tileHashesValid = TRUE;
+	capture->frameData = NULL;
 
-			if (t > ty)
-				t = ty;
+	changed = 0;
 
-			if (b < ty)
-				b = ty;
+	for (index = 0; index < count; index++)
+	{
+		if (capture->tileDirty[index])
+		{
+			changed = 1;
+			break;
 		}
 	}
 
-	if (allEqual)
+	if (changed)
+		shadow_capture_build_region(capture, region);
+
+	return changed;
+}
+
+/**
+ * Copies a region of a captured frame into a surface buffer at the same
+ * coordinates. Large regions are split in horizontal bands copied on the
+ * capture thread pool, like the tile hashing of shadow_capture_compare.
+ *
+ * Returns 1 when something was copied, 0 for an empty region and -1 on error.
+ */
+
+int shadow_capture_copy(rdpShadowCapture* capture, BYTE* pDstData, int nDstStep,
+		BYTE* pSrcData, int nSrcStep, REGION16* region)
+{
+	int index;
+	int height;
+	int numRects;
+	int rowsPerBand;
+	UINT32 pixels = 0;
+	const RECTANGLE_16* rects;
+	const RECTANGLE_16* extents;
+
+	if (!capture || !pDstData || !pSrcData || !region)
+		return -1;
+
+	rects = region16_rects(region, &numRects);
+
+	if (numRects < 1)
 		return 0;
 
-	rect->left = l * 16;
-	rect->top = t * 16;
-	rect->right = (r + 1) * 16;
-	rect->bottom = (b + 1) * 16;
+	extents = region16_extents(region);
 
-	if (rect->right > nWidth)
-		rect->right = nWidth;
+	for (index = 0; index < numRects; index++)
+		pixels += (rects[index].right - rects[index].left) * (rects[index].bottom - rects[index].top);
 
-	if (rect->bottom > nHeight)
-		rect->bottom = nHeight;
+	capture->frameData = pSrcData;
+	capture->frameStep = nSrcStep;
+	capture->copyData = pDstData;
+	capture->copyStep = nDstStep;
+	capture->copyRects = rects;
+	capture->copyNumRects = numRects;
 
-	if (0)
+	if ((capture->bandCount > 1) && (pixels >= SHADOW_CAPTURE_MIN_PARALLEL_PIXELS))
 	{
-		char *col_str = calloc(ncol + 1, sizeof(char));
-		if (!col_str)
+		height = extents->bottom - extents->top;
+		rowsPerBand = (height + capture->bandCount - 1) / capture->bandCount;
+
+		for (index = 0; index < capture->bandCount; index++)
 		{
-			WLog_ERR(TAG, "calloc failed!");
-			return 1;
+			capture->bands[index].top = extents->top + MIN(index * rowsPerBand, height);
+			capture->bands[index].bottom = extents->top + MIN((index + 1) * rowsPerBand, height);
+			SubmitThreadpoolWork(capture->bands[index].copyWork);
 		}
 
-		for (tx = 0; tx < ncol; tx++)
-			sprintf(&col_str[tx], "-");
-		WLog_INFO(TAG, "%s", col_str);
+		for (index = 0; index < capture->bandCount; index++)
+			WaitForThreadpoolWorkCallbacks(capture->bands[index].copyWork, FALSE);
+	}
+	else
+	{
+		shadow_capture_copy_band(capture, extents->top, extents->bottom);
+	}
+
+	capture->frameData = NULL;
+	capture->copyData = NULL;
+	capture->copyRects = NULL;
+	capture->copyNumRects = 0;
+
+	return 1;
+}
 
-		for (tx = 0; tx < ncol; tx++)
-			sprintf(&col_str[tx], "%c", cols[tx] ? 'O' : 'X');
-		WLog_INFO(TAG, "%s", col_str);
+/**
+ * Move detection
+ *
+ * Every row (or column) of the dirty extents is hashed in the previous and
+ * the new frame. Each window of a few new lines votes for the offset of the
+ * old window with the same hashes, windows that are not unique (blank space
+ * between text lines) do not vote. The longest run of matching lines at the most voted offset is
+ * then checked pixel by pixel: only a large block found entirely in the
+ * previous frame is reported.
+ */
 
-		for (tx = 0; tx < ncol; tx++)
-			sprintf(&col_str[tx], "-");
-		WLog_INFO(TAG, "%s", col_str);
+#define SHADOW_CAPTURE_MOVE_MIN_SIZE	64
+#define SHADOW_CAPTURE_MOVE_MIN_VOTES	8
+#define SHADOW_CAPTURE_MOVE_WINDOW	8
+#define SHADOW_CAPTURE_LINE_PRIME	0x9E3779B97F4A7C15ULL
 
-		for (ty = 0; ty < nrow; ty++)
+static UINT64 shadow_capture_hash_line(const BYTE* pData, int nWidth)
+{
+	int x;
+	UINT64 h0 = 0;
+	UINT64 h1 = 0;
+	UINT32 pixel;
+
+	for (x = 0; x + 1 < nWidth; x += 2)
+	{
+		h0 = (h0 ^ *((const UINT32*) &pData[x * 4])) * SHADOW_CAPTURE_LINE_PRIME;
+		h1 = (h1 ^ *((const UINT32*) &pData[(x + 1) * 4])) * SHADOW_CAPTURE_LINE_PRIME;
+	}
+
+	if (x < nWidth)
+	{
+		pixel = *((const UINT32*) &pData[x * 4]);
+		h0 = (h0 ^ pixel) * SHADOW_CAPTURE_LINE_PRIME;
+	}
+
+	h0 ^= (h1 << 29) | (h1 >> 35);
+	h0 ^= h0 >> 33;
+	h0 *= 0xFF51AFD7ED558CCDULL;
+	h0 ^= h0 >> 33;
+
+	return h0;
+}
+
+static void shadow_capture_hash_rows(UINT64* hashes, const BYTE* pData, int nStep,
+		const RECTANGLE_16* rect)
+{
+	int y;
+	int nWidth = rect->right - rect->left;
+
+	for (y = rect->top; y < rect->bottom; y++)
+		hashes[y - rect->top] = shadow_capture_hash_line(&pData[(y * nStep) + (rect->left * 4)], nWidth);
+}
+
+static void shadow_capture_hash_columns(UINT64* hashes, const BYTE* pData, int nStep,
+		const RECTANGLE_16* rect)
+{
+	int x, y;
+	const UINT32* pRow;
+	int nWidth = rect->right - rect->left;
+
+	ZeroMemory(hashes, nWidth * sizeof(UINT64));
+
+	for (y = rect->top; y < rect->bottom; y++)
+	{
+		pRow = (const UINT32*) &pData[(y * nStep) + (rect->left * 4)];
+
+		for (x = 0; x < nWidth; x++)
+			hashes[x] = (hashes[x] ^ pRow[x]) * SHADOW_CAPTURE_LINE_PRIME;
+	}
+
+	for (x = 0; x < nWidth; x++)
+	{
+		hashes[x] ^= hashes[x] >> 33;
+		hashes[x] *= 0xFF51AFD7ED558CCDULL;
+		hashes[x] ^= hashes[x] >> 33;
+	}
+}
+
+/**
+ * Finds the offset by which the new lines moved relative to the old ones and
+ * the longest run [first, last) of new lines matching the old lines at that
+ * offset. Returns FALSE if no run reaches minRun lines.
+ */
+
+static UINT64 shadow_capture_hash_window(const UINT64* lines)
+{
+	int index;
+	UINT64 h = 0;
+
+	for (index = 0; index < SHADOW_CAPTURE_MOVE_WINDOW; index++)
+		h = ((h << 23) | (h >> 41)) ^ (lines[index] * SHADOW_CAPTURE_LINE_PRIME);
+
+	return h;
+}
+
+static BOOL shadow_capture_match_lines(const UINT64* oldLines, const UINT64* newLines, int count,
+		int minRun, int* pShift, int* pFirst, int* pLast)
+{
+	int i, j;
+	int shift;
+	int first;
+	int windows;
+	int run = 0;
+	int bestRun = 0;
+	int bestVotes = 0;
+	int bestShift = 0;
+	UINT32 slot;
+	UINT32 tableSize = 64;
+	UINT64 key;
+	UINT64* keys;
+	int* lines;
+	int* votes;
+	BOOL status = FALSE;
+
+	while (tableSize < (UINT32) (count * 2))
+		tableSize <<= 1;
+
+	keys = (UINT64*) calloc(tableSize, sizeof(UINT64));
+	lines = (int*) calloc(tableSize, sizeof(int));
+	votes = (int*) calloc(count * 2, sizeof(int));
+
+	if (!keys || !lines || !votes)
+		goto out;
+
+	/* lines holds the first old line of a window + 1, or -1 for a window seen several times */
+
+	windows = count - SHADOW_CAPTURE_MOVE_WINDOW + 1;
+
+	for (i = 0; i < windows; i++)
+	{
+		key = shadow_capture_hash_window(&oldLines[i]);
+		slot = ((UINT32) key) & (tableSize - 1);
+
+		while (lines[slot] && (keys[slot] != key))
+			slot = (slot + 1) & (tableSize - 1);
+
+		keys[slot] = key;
+		lines[slot] = lines[slot] ? -1 : (i + 1);
+	}
+
+	for (j = 0; j < windows; j++)
+	{
+		key = shadow_capture_hash_window(&newLines[j]);
+		slot = ((UINT32) key) & (tableSize - 1);
+
+		while (lines[slot] && (keys[slot] != key))
+			slot = (slot + 1) & (tableSize - 1);
+
+		if (lines[slot] <= 0)
+			continue;
+
+		shift = j - (lines[slot] - 1);
+
+		if (shift == 0)
+			continue;
+
+		if (++votes[shift + count] > bestVotes)
+		{
+			bestVotes = votes[shift + count];
+			bestShift = shift;
+		}
+	}
+
+	if (bestVotes < SHADOW_CAPTURE_MOVE_MIN_VOTES)
+		goto out;
+
+	first = MAX(bestShift, 0);
+
+	for (j = first; j < MIN(count, count + bestShift); j++)
+	{
+		if (newLines[j] != oldLines[j - bestShift])
+		{
+			run = 0;
+			continue;
+		}
+
+		if (++run > bestRun)
 		{
-			for (tx = 0; tx < ncol; tx++)
-				sprintf(&col_str[tx], "%c", cols[tx] ? 'O' : 'X');
-			WLog_INFO(TAG, "%s", col_str);
-			WLog_INFO(TAG, "|%s|", rows[ty] ? "O" : "X");
+			bestRun = run;
+			*pLast = j + 1;
 		}
+	}
+
+	if (bestRun < minRun)
+		goto out;
+
+	*pShift = bestShift;
+	*pFirst = *pLast - bestRun;
+	status = TRUE;
+
+out:
+	free(keys);
+	free(lines);
+	free(votes);
+	return status;
+}
+
+/**
+ * Looks for a block of the dirty region that moved vertically or
+ * horizontally between the previous frame (pOldData, typically the surface
+ * before the copy) and the new one. The dirty extents are first trimmed of
+ * the unchanged columns and rows on their edges, left over by the tile
+ * alignment of the region. The region is left untouched, the move is
+ * published along with it.
+ *
+ * Returns 1 when a move was found, 0 when none was and -1 on error.
+ */
+
+int shadow_capture_detect_move(rdpShadowCapture* capture, const BYTE* pOldData, int nOldStep,
+		const BYTE* pNewData, int nNewStep, REGION16* region, rdpShadowMove* move)
+{
+	int y;
+	int shift = 0;
+	int first = 0;
+	int last = 0;
+	int status = 0;
+	int count;
+	UINT64* lines;
+	UINT64* oldLines;
+	UINT64* newLines;
+	RECTANGLE_16 rect;
+
+	if (!capture || !pOldData || !pNewData || !region || !move)
+		return -1;
+
+	if (region16_is_empty(region))
+		return 0;
+
+	rect = *region16_extents(region);
+
+	if ((rect.right - rect.left < SHADOW_CAPTURE_MOVE_MIN_SIZE) ||
+			(rect.bottom - rect.top < SHADOW_CAPTURE_MOVE_MIN_SIZE))
+		return 0;
+
+	count = MAX(rect.right - rect.left, rect.bottom - rect.top);
+	lines = (UINT64*) calloc(count * 2, sizeof(UINT64));
+
+	if (!lines)
+		return -1;
+
+	oldLines = lines;
+	newLines = &lines[count];
+
+	shadow_capture_hash_columns(oldLines, pOldData, nOldStep, &rect);
+	shadow_capture_hash_columns(newLines, pNewData, nNewStep, &rect);
+
+	for (first = 0; (rect.left + first < rect.right) && (oldLines[first] == newLines[first]); first++);
+	for (last = rect.right - rect.left; (last > first) && (oldLines[last - 1] == newLines[last - 1]); last--);
+
+	rect.right = rect.left + last;
+	rect.left = rect.left + first;
 
-		WLog_INFO(TAG, "left: %d top: %d right: %d bottom: %d ncol: %d nrow: %d",
-				l, t, r, b, ncol, nrow);
-		free(col_str);
+	if (rect.right - rect.left < SHADOW_CAPTURE_MOVE_MIN_SIZE)
+		goto out;
+
+	shadow_capture_hash_rows(oldLines, pOldData, nOldStep, &rect);
+	shadow_capture_hash_rows(newLines, pNewData, nNewStep, &rect);
+
+	for (first = 0; (rect.top + first < rect.bottom) && (oldLines[first] == newLines[first]); first++);
+	for (last = rect.bottom - rect.top; (last > first) && (oldLines[last - 1] == newLines[last - 1]); last--);
+
+	if (last - first < SHADOW_CAPTURE_MOVE_MIN_SIZE)
+		goto out;
+
+	rect.bottom = rect.top + last;
+	rect.top = rect.top + first;
+	oldLines = &oldLines[first];
+	newLines = &newLines[first];
+
+	if (shadow_capture_match_lines(oldLines, newLines, rect.bottom - rect.top,
+			SHADOW_CAPTURE_MOVE_MIN_SIZE, &shift, &first, &last))
+	{
+		move->dst.left = rect.left;
+		move->dst.top = rect.top + first;
+		move->dst.right = rect.right;
+		move->dst.bottom = rect.top + last;
+		move->dx = 0;
+		move->dy = (INT16) shift;
+		status = 1;
 	}
+	else
+	{
+		oldLines = lines;
+		newLines = &lines[count];
 
-	return 1;
+		shadow_capture_hash_columns(oldLines, pOldData, nOldStep, &rect);
+		shadow_capture_hash_columns(newLines, pNewData, nNewStep, &rect);
+
+		if (shadow_capture_match_lines(oldLines, newLines, rect.right - rect.left,
+				SHADOW_CAPTURE_MOVE_MIN_SIZE, &shift, &first, &last))
+		{
+			move->dst.left = rect.left + first;
+			move->dst.top = rect.top;
+			move->dst.right = rect.left + last;
+			move->dst.bottom = rect.bottom;
+			move->dx = (INT16) shift;
+			move->dy = 0;
+			status = 1;
+		}
+	}
+
+	/* rule out hash collisions */
+
+	for (y = move->dst.top; (status > 0) && (y < move->dst.bottom); y++)
+	{
+		if (memcmp(&pNewData[(y * nNewStep) + (move->dst.left * 4)],
+				&pOldData[((y - move->dy) * nOldStep) + ((move->dst.left - move->dx) * 4)],
+				(move->dst.right - move->dst.left) * 4) != 0)
+			status = 0;
+	}
+
+out:
+	free(lines);
+
+	return status;
+}
+
+/**
+ * Removes a rectangle from a region, region16 only knows unions and
+ * intersections with a rectangle.
+ */
+
+void shadow_capture_subtract_rect(REGION16* region, const RECTANGLE_16* rect)
+{
+	int index;
+	int numRects = 0;
+	REGION16 result;
+	RECTANGLE_16 piece;
+	const RECTANGLE_16* r;
+	const RECTANGLE_16* rects;
+
+	if (!region16_intersects_rect(region, rect))
+		return;
+
+	region16_init(&result);
+	rects = region16_rects(region, &numRects);
+
+	for (index = 0; index < numRects; index++)
+	{
+		r = &rects[index];
+
+		if ((r->right <= rect->left) || (r->left >= rect->right) ||
+				(r->bottom <= rect->top) || (r->top >= rect->bottom))
+		{
+			region16_union_rect(&result, &result, r);
+			continue;
+		}
+
+		piece = *r;
+
+		if (r->top < rect->top)
+		{
+			piece.bottom = rect->top;
+			region16_union_rect(&result, &result, &piece);
+		}
+
+		if (r->bottom > rect->bottom)
+		{
+			piece.top = rect->bottom;
+			piece.bottom = r->bottom;
+			region16_union_rect(&result, &result, &piece);
+		}
+
+		piece.top = MAX(r->top, rect->top);
+		piece.bottom = MIN(r->bottom, rect->bottom);
+
+		if (r->left < rect->left)
+		{
+			piece.left = r->left;
+			piece.right = rect->left;
+			region16_union_rect(&result, &result, &piece);
+		}
+
+		if (r->right > rect->right)
+		{
+			piece.left = rect->right;
+			piece.right = r->right;
+			region16_union_rect(&result, &result, &piece);
+		}
+	}
+
+	region16_copy(region, &result);
+	region16_uninit(&result);
+}
+
+/**
+ * Moves the part of a region lying in the move source along with it: after
+ * the move the destination is invalid wherever its source was.
+ */
+
+void shadow_capture_apply_move(REGION16* region, const rdpShadowMove* move)
+{
+	int index;
+	int numRects = 0;
+	REGION16 moved;
+	RECTANGLE_16 src;
+	RECTANGLE_16 rect;
+	const RECTANGLE_16* rects;
+
+	src.left = move->dst.left - move->dx;
+	src.top = move->dst.top - move->dy;
+	src.right = move->dst.right - move->dx;
+	src.bottom = move->dst.bottom - move->dy;
+
+	region16_init(&moved);
+	rects = region16_rects(region, &numRects);
+
+	for (index = 0; index < numRects; index++)
+	{
+		if (!rectangles_intersection(&rects[index], &src, &rect))
+			continue;
+
+		rect.left += move->dx;
+		rect.top += move->dy;
+		rect.right += move->dx;
+		rect.bottom += move->dy;
+		region16_union_rect(&moved, &moved, &rect);
+	}
+
+	shadow_capture_subtract_rect(region, &(move->dst));
+
+	rects = region16_rects(&moved, &numRects);
+
+	for (index = 0; index < numRects; index++)
+		region16_union_rect(region, region, &rects[index]);
+
+	region16_uninit(&moved);
+}
+
+/**
+ * Rehashes the tiles touching region from a frame that was updated without
+ * shadow_capture_compare, such as a damage driven capture, so that the next
+ * compared frame is only dirty where it differs from that frame.
+ */
+
+void shadow_capture_update(rdpShadowCapture* capture, const BYTE* pData, int nStep, REGION16* region)
+{
+	int index;
+	int numRects;
+	int tx, ty;
+	int tw, th;
+	const BYTE* pTile;
+	const RECTANGLE_16* rects;
+
+	if (!capture || !capture->tileHashesValid)
+		return;
+
+	rects = region16_rects(region, &numRects);
+
+	for (index = 0; index < numRects; index++)
+	{
+		for (ty = rects[index].top / 16; (ty < capture->tileRows) && ((ty * 16) < rects[index].bottom); ty++)
+		{
+			th = MIN(capture->height - (ty * 16), 16);
+
+			for (tx = rects[index].left / 16; (tx < capture->tileCols) && ((tx * 16) < rects[index].right); tx++)
+			{
+				tw = capture->width - (tx * 16);
+				pTile = &pData[(ty * 16 * nStep) + (tx * 16 * 4)];
+
+				if (tw >= 16)
+					capture->tileHashes[(ty * capture->tileCols) + tx] = capture->hashTile(pTile, nStep, th);
+				else
+					capture->tileHashes[(ty * capture->tileCols) + tx] = shadow_capture_hash_partial_tile(pTile, nStep, tw, th);
+			}
+		}
+	}
+}
+
+/**
+ * Forgets the tile hashes, the next compared frame is entirely dirty.
+ */
+
+void shadow_capture_invalidate(rdpShadowCapture* capture)
+{
+	if (capture)
+		capture->tileHashesValid = FALSE;
 }
 
 rdpShadowCapture* shadow_capture_new(rdpShadowServer* server)
 {
+	int index;
+	SYSTEM_INFO sysinfo;
 	rdpShadowCapture* capture;
 
 	capture = (rdpShadowCapture*) calloc(1, sizeof(rdpShadowCapture));
@@ -228,16 +1096,82 @@ rdpShadowCapture* shadow_capture_new(rdpShadowServer* server)
 	capture->server = server;
 
 	if (!InitializeCriticalSectionAndSpinCount(&(capture->lock), 4000))
+	{
+		free(capture);
 		return NULL;
+	}
+
+	capture->hashTile = shadow_capture_hash_tile_c;
+
+#ifdef WITH_CAPTURE_SIMD
+	if (IsProcessorFeaturePresent(PF_XMMI64_INSTRUCTIONS_AVAILABLE))
+		capture->hashTile = shadow_capture_hash_tile_sse2;
+
+	if (IsProcessorFeaturePresentEx(PF_EX_AVX2))
+		capture->hashTile = shadow_capture_hash_tile_avx2;
+#endif
+
+	GetNativeSystemInfo(&sysinfo);
+	capture->bandCount = MIN((int) sysinfo.dwNumberOfProcessors, SHADOW_CAPTURE_MAX_BANDS);
+
+	if (capture->bandCount > 1)
+	{
+		capture->ThreadPool = CreateThreadpool(NULL);
+
+		if (!capture->ThreadPool)
+			goto fail;
+
+		InitializeThreadpoolEnvironment(&capture->ThreadPoolEnv);
+		SetThreadpoolCallbackPool(&capture->ThreadPoolEnv, capture->ThreadPool);
+		SetThreadpoolThreadMaximum(capture->ThreadPool, capture->bandCount);
+
+		for (index = 0; index < capture->bandCount; index++)
+		{
+			capture->bands[index].capture = capture;
+			capture->bands[index].work = CreateThreadpoolWork((PTP_WORK_CALLBACK) shadow_capture_band_work_callback,
+					(void*) &capture->bands[index], &capture->ThreadPoolEnv);
+
+			capture->bands[index].copyWork = CreateThreadpoolWork((PTP_WORK_CALLBACK) shadow_capture_copy_work_callback,
+					(void*) &capture->bands[index], &capture->ThreadPoolEnv);
+
+			if (!capture->bands[index].work || !capture->bands[index].copyWork)
+				goto fail;
+		}
+	}
 
 	return capture;
+
+fail:
+	WLog_ERR(TAG, "failed to create the capture thread pool");
+	shadow_capture_free(capture);
+	return NULL;
 }
 
 void shadow_capture_free(rdpShadowCapture* capture)
 {
+	int index;
+
 	if (!capture)
 		return;
 
+	for (index = 0; index < capture->bandCount; index++)
+	{
+		if (capture->bands[index].work)
+			CloseThreadpoolWork(capture->bands[index].work);
+
+		if (capture->bands[index].copyWork)
+			CloseThreadpoolWork(capture->bands[index].copyWork);
+	}
+
+	if (capture->ThreadPool)
+	{
+		CloseThreadpool(capture->ThreadPool);
+		DestroyThreadpoolEnvironment(&capture->ThreadPoolEnv);
+	}
+
+	free(capture->tileHashes);
+	free(capture->tileDirty);
+
 	DeleteCriticalSection(&(capture->lock));
 
 	free(capture);
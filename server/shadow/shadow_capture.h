@@ -22,8 +22,26 @@
 #include <freerdp/server/shadow.h>
 
 #include <winpr/crt.h>
+#include <winpr/pool.h>
 #include <winpr/synch.h>
 
+#define SHADOW_CAPTURE_MAX_BANDS	16
+
+typedef UINT64 (*pfnShadowCaptureHashTile)(const BYTE* pData, int nStep, int nHeight);
+
+struct rdp_shadow_capture_band
+{
+	rdpShadowCapture* capture;
+	PTP_WORK work;
+	PTP_WORK copyWork;
+
+	int firstRow;
+	int lastRow;
+	int top;
+	int bottom;
+};
+typedef struct rdp_shadow_capture_band rdpShadowCaptureBand;
+
 struct rdp_shadow_capture
 {
 	rdpShadowServer* server;
@@ -31,6 +49,32 @@ struct rdp_shadow_capture
 	int width;
 	int height;
 
+	/**
+	 * One hash per 16x16 tile of the last compared frame, and whether the
+	 * tile changed in that frame. The hashes are only meaningful while
+	 * tileHashesValid is set.
+	 */
+	int tileCols;
+	int tileRows;
+	UINT64* tileHashes;
+	BYTE* tileDirty;
+	BOOL tileHashesValid;
+	pfnShadowCaptureHashTile hashTile;
+
+	const BYTE* frameData;
+	int frameStep;
+
+	/* destination and rectangles of shadow_capture_copy, in frame coordinates */
+	BYTE* copyData;
+	int copyStep;
+	const RECTANGLE_16* copyRects;
+	int copyNumRects;
+
+	int bandCount;
+	rdpShadowCaptureBand bands[SHADOW_CAPTURE_MAX_BANDS];
+	PTP_POOL ThreadPool;
+	TP_CALLBACK_ENVIRON ThreadPoolEnv;
+
 	CRITICAL_SECTION lock;
 };
 
@@ -39,7 +83,15 @@ extern "C" {
 #endif
 
 int shadow_capture_align_clip_rect(RECTANGLE_16* rect, RECTANGLE_16* clip);
-int shadow_capture_compare(BYTE* pData1, int nStep1, int nWidth, int nHeight, BYTE* pData2, int nStep2, RECTANGLE_16* rect);
+int shadow_capture_compare(rdpShadowCapture* capture, BYTE* pData, int nStep, int nWidth, int nHeight, REGION16* region);
+int shadow_capture_copy(rdpShadowCapture* capture, BYTE* pDstData, int nDstStep,
+		BYTE* pSrcData, int nSrcStep, REGION16* region);
+int shadow_capture_detect_move(rdpShadowCapture* capture, const BYTE* pOldData, int nOldStep,
+		const BYTE* pNewData, int nNewStep, REGION16* region, rdpShadowMove* move);
+void shadow_capture_subtract_rect(REGION16* region, const RECTANGLE_16* rect);
+void shadow_capture_apply_move(REGION16* region, const rdpShadowMove* move);
+void shadow_capture_update(rdpShadowCapture* capture, const BYTE* pData, int nStep, REGION16* region);
+void shadow_capture_invalidate(rdpShadowCapture* capture);
 
 rdpShadowCapture* shadow_capture_new(rdpShadowServer* server);
 void shadow_capture_free(rdpShadowCapture* capture);
@@ -36,5 +36,11 @@ int shadow_client_channels_post_connect(rdpShadowClient* client)
 		shadow_client_remdesk_init(client);
 	}
 
+	if (client->context.settings->SupportGraphicsPipeline &&
+			WTSVirtualChannelManagerIsChannelJoined(client->vcm, "drdynvc"))
+	{
+		shadow_client_rdpgfx_init(client);
+	}
+
 	return 1;
 }
@@ -0,0 +1,239 @@
+/**
+ * FreeRDP: A Remote Desktop Protocol Implementation
+ * Shadow Server Tile Classification
+ *
+ * Copyright 2026 agent <agent@local>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <winpr/crt.h>
+
+#include <freerdp/log.h>
+
+#include "shadow.h"
+
+#include "shadow_classify.h"
+
+#define TAG SERVER_TAG("shadow")
+
+/**
+ * Text and UI elements are drawn with few colours and sharp transitions,
+ * photographs and video with many colours and soft ones. A tile is text
+ * when it holds at most MAX_COLORS distinct colours, or when it is not
+ * busy and at least 1 / EDGE_RATIO of its horizontal neighbour pairs
+ * differ in luma by more than EDGE_THRESHOLD. A tile is busy when it
+ * changed in BUSY_UPDATES of the last 16 updates.
+ */
+
+#define CLASSIFY_MAX_COLORS		32
+#define CLASSIFY_TABLE_SIZE		128
+#define CLASSIFY_EDGE_THRESHOLD		64
+#define CLASSIFY_EDGE_RATIO		8
+#define CLASSIFY_BUSY_UPDATES		8
+
+static int shadow_classify_count_bits(UINT16 value)
+{
+	int count = 0;
+
+	while (value)
+	{
+		value &= (value - 1);
+		count++;
+	}
+
+	return count;
+}
+
+int shadow_classify_tile(const BYTE* pData, int nStep, int nWidth, int nHeight, UINT16 history)
+{
+	int x, y;
+	int luma;
+	int prevLuma;
+	int colors = 0;
+	UINT32 edges = 0;
+	UINT32 pairs = 0;
+	UINT32 pixel;
+	UINT32 lastPixel;
+	UINT32 slot;
+	const UINT32* pSrc;
+	UINT32 table[CLASSIFY_TABLE_SIZE];
+
+	ZeroMemory(table, sizeof(table));
+	lastPixel = 0;
+
+	for (y = 0; y < nHeight; y++)
+	{
+		pSrc = (const UINT32*) &pData[y * nStep];
+		prevLuma = -1;
+
+		for (x = 0; x < nWidth; x++)
+		{
+			pixel = (pSrc[x] & 0x00FFFFFF) | 0x01000000;
+
+			if ((pixel != lastPixel) && (colors <= CLASSIFY_MAX_COLORS))
+			{
+				slot = ((pixel * 2654435761U) >> 25) & (CLASSIFY_TABLE_SIZE - 1);
+
+				while (table[slot] && (table[slot] != pixel))
+					slot = (slot + 1) & (CLASSIFY_TABLE_SIZE - 1);
+
+				if (!table[slot])
+				{
+					table[slot] = pixel;
+					colors++;
+				}
+
+				lastPixel = pixel;
+			}
+
+			luma = (((pixel >> 16) & 0xFF) * 2 + ((pixel >> 8) & 0xFF) * 5 + (pixel & 0xFF)) >> 3;
+
+			if (prevLuma >= 0)
+			{
+				if ((luma - prevLuma > CLASSIFY_EDGE_THRESHOLD) ||
+					(prevLuma - luma > CLASSIFY_EDGE_THRESHOLD))
+					edges++;
+
+				pairs++;
+			}
+
+			prevLuma = luma;
+		}
+	}
+
+	if (colors <= CLASSIFY_MAX_COLORS)
+		return SHADOW_CLASSIFY_TEXT;
+
+	if (shadow_classify_count_bits(history) >= CLASSIFY_BUSY_UPDATES)
+		return SHADOW_CLASSIFY_IMAGE;
+
+	if (edges * CLASSIFY_EDGE_RATIO >= pairs)
+		return SHADOW_CLASSIFY_TEXT;
+
+	return SHADOW_CLASSIFY_IMAGE;
+}
+
+/**
+ * Records the update in the tile history and splits the tiles it touches,
+ * clipped to bounds, into a text and an image region. pData is the surface
+ * buffer, bounds and regions are in surface coordinates.
+ */
+
+int shadow_classifier_split(rdpShadowClassifier* classifier, const BYTE* pData, int nStep,
+		const RECTANGLE_16* bounds, REGION16* region, REGION16* textRegion, REGION16* imageRegion)
+{
+	int x, y;
+	int index;
+	int type;
+	int textTiles = 0;
+	int numRects = 0;
+	int rectIndex;
+	const RECTANGLE_16* rects;
+	RECTANGLE_16 rect;
+	RECTANGLE_16 tile;
+
+	if ((bounds->right - bounds->left != classifier->width) ||
+		(bounds->bottom - bounds->top != classifier->height))
+		return -1;
+
+	for (index = 0; index < classifier->tileCols * classifier->tileRows; index++)
+		classifier->history[index] <<= 1;
+
+	rects = region16_rects(region, &numRects);
+
+	for (rectIndex = 0; rectIndex < numRects; rectIndex++)
+	{
+		if (!rectangles_intersection(&rects[rectIndex], bounds, &rect))
+			continue;
+
+		for (y = (rect.top - bounds->top) / SHADOW_CLASSIFY_TILE_SIZE;
+			y <= (rect.bottom - 1 - bounds->top) / SHADOW_CLASSIFY_TILE_SIZE; y++)
+		{
+			for (x = (rect.left - bounds->left) / SHADOW_CLASSIFY_TILE_SIZE;
+				x <= (rect.right - 1 - bounds->left) / SHADOW_CLASSIFY_TILE_SIZE; x++)
+			{
+				classifier->history[y * classifier->tileCols + x] |= 1;
+			}
+		}
+	}
+
+	for (y = 0; y < classifier->tileRows; y++)
+	{
+		for (x = 0; x < classifier->tileCols; x++)
+		{
+			index = y * classifier->tileCols + x;
+
+			if (!(classifier->history[index] & 1))
+				continue;
+
+			tile.left = bounds->left + x * SHADOW_CLASSIFY_TILE_SIZE;
+			tile.top = bounds->top + y * SHADOW_CLASSIFY_TILE_SIZE;
+			tile.right = MIN(tile.left + SHADOW_CLASSIFY_TILE_SIZE, bounds->right);
+			tile.bottom = MIN(tile.top + SHADOW_CLASSIFY_TILE_SIZE, bounds->bottom);
+
+			type = shadow_classify_tile(&pData[tile.top * nStep + tile.left * 4], nStep,
+					tile.right - tile.left, tile.bottom - tile.top, classifier->history[index]);
+
+			if (type == SHADOW_CLASSIFY_TEXT)
+			{
+				region16_union_rect(textRegion, textRegion, &tile);
+				textTiles++;
+			}
+			else
+			{
+				region16_union_rect(imageRegion, imageRegion, &tile);
+			}
+		}
+	}
+
+	return textTiles;
+}
+
+rdpShadowClassifier* shadow_classifier_new(int width, int height)
+{
+	rdpShadowClassifier* classifier;
+
+	classifier = (rdpShadowClassifier*) calloc(1, sizeof(rdpShadowClassifier));
+
+	if (!classifier)
+		return NULL;
+
+	classifier->width = width;
+	classifier->height = height;
+	classifier->tileCols = (width + SHADOW_CLASSIFY_TILE_SIZE - 1) / SHADOW_CLASSIFY_TILE_SIZE;
+	classifier->tileRows = (height + SHADOW_CLASSIFY_TILE_SIZE - 1) / SHADOW_CLASSIFY_TILE_SIZE;
+
+	classifier->history = (UINT16*) calloc(classifier->tileCols * classifier->tileRows, sizeof(UINT16));
+
+	if (!classifier->history)
+	{
+		free(classifier);
+		return NULL;
+	}
+
+	return classifier;
+}
+
+void shadow_classifier_free(rdpShadowClassifier* classifier)
+{
+	if (!classifier)
+		return;
+
+	free(classifier->history);
+	free(classifier);
+}
@@ -0,0 +1,64 @@
+/**
+ * FreeRDP: A Remote Desktop Protocol Implementation
+ * Shadow Server Tile Classification
+ *
+ * Copyright 2026 agent <agent@local>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef FREERDP_SHADOW_SERVER_CLASSIFY_H
+#define FREERDP_SHADOW_SERVER_CLASSIFY_H
+
+#include <freerdp/server/shadow.h>
+
+#include <winpr/crt.h>
+
+#define SHADOW_CLASSIFY_TILE_SIZE		64
+
+#define SHADOW_CLASSIFY_TEXT			0
+#define SHADOW_CLASSIFY_IMAGE			1
+
+/**
+ * Per-client content classification of the shared area in 64x64 tiles.
+ * Every tile keeps one bit per update sent to the client, set when the tile
+ * was part of the update, so that tiles changing in most updates (video,
+ * animations) can be told apart from text and UI that changes now and then.
+ */
+
+struct rdp_shadow_classifier
+{
+	int width;
+	int height;
+	int tileCols;
+	int tileRows;
+	UINT16* history;
+};
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+int shadow_classify_tile(const BYTE* pData, int nStep, int nWidth, int nHeight, UINT16 history);
+
+int shadow_classifier_split(rdpShadowClassifier* classifier, const BYTE* pData, int nStep,
+		const RECTANGLE_16* bounds, REGION16* region, REGION16* textRegion, REGION16* imageRegion);
+
+rdpShadowClassifier* shadow_classifier_new(int width, int height);
+void shadow_classifier_free(rdpShadowClassifier* classifier);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* FREERDP_SHADOW_SERVER_CLASSIFY_H */
@@ -33,6 +33,8 @@
 
 #define TAG CLIENT_TAG("shadow")
 
+#define SHADOW_CLIENT_RTT_MEASURE_INTERVAL	2000
+
 BOOL shadow_client_context_new(freerdp_peer* peer, rdpShadowClient* client)
 {
 	rdpSettings* settings;
@@ -50,7 +52,8 @@ BOOL shadow_client_context_new(freerdp_peer* peer, rdpShadowClient* client)
 	settings->BitmapCacheV3Enabled = TRUE;
 	settings->FrameMarkerCommandEnabled = TRUE;
 	settings->SurfaceFrameMarkerEnabled = TRUE;
-	settings->SupportGraphicsPipeline = FALSE;
+	settings->SupportGraphicsPipeline = server->h264;
+	settings->NetworkAutoDetect = TRUE;
 
 	settings->DrawAllowSkipAlpha = TRUE;
 	settings->DrawAllowColorSubsampling = TRUE;
@@ -85,6 +88,9 @@ BOOL shadow_client_context_new(freerdp_peer* peer, rdpShadowClient* client)
 
 	region16_init(&(client->invalidRegion));
 
+	ZeroMemory(&(client->stats), sizeof(rdpShadowClientStats));
+	client->stats.connectTime = GetTickCount64();
+
 	client->vcm = WTSOpenServerA((LPSTR) peer->context);
 	if (!client->vcm || client->vcm == INVALID_HANDLE_VALUE)
 		goto fail_open_server;
@@ -128,6 +134,8 @@ void shadow_client_context_free(freerdp_peer* peer, rdpShadowClient* client)
 
 	ArrayList_Remove(server->clients, (void*) client);
 
+	shadow_client_rdpgfx_uninit(client);
+
 	DeleteCriticalSection(&(client->lock));
 
 	region16_uninit(&(client->invalidRegion));
@@ -341,17 +349,16 @@ BOOL shadow_client_activate(freerdp_peer* peer)
 
 void shadow_client_surface_frame_acknowledge(rdpShadowClient* client, UINT32 frameId)
 {
-	SURFACE_FRAME* frame;
-	wListDictionary* frameList;
+	shadow_encoder_frame_acknowledge(client->encoder, frameId);
+}
+
+BOOL shadow_client_rtt_measure_response(rdpContext* context, UINT16 sequenceNumber)
+{
+	rdpShadowClient* client = (rdpShadowClient*) context;
 
-	frameList = client->encoder->frameList;
-	frame = (SURFACE_FRAME*) ListDictionary_GetItemValue(frameList, (void*) (size_t) frameId);
+	shadow_encoder_update_rtt(client->encoder, context->autodetect->netCharAverageRTT);
 
-	if (frame)
-	{
-		ListDictionary_Remove(frameList, (void*) (size_t) frameId);
-		free(frame);
-	}
+	return TRUE;
 }
 
 int shadow_client_send_surface_frame_marker(rdpShadowClient* client, UINT32 action, UINT32 id)
@@ -368,22 +375,180 @@ int shadow_client_send_surface_frame_marker(rdpShadowClient* client, UINT32 acti
 	return 1;
 }
 
-int shadow_client_send_surface_bits(rdpShadowClient* client, rdpShadowSurface* surface, int nXSrc, int nYSrc, int nWidth, int nHeight)
+/**
+ * Writes RemoteFX tiles taken from the shared encode cache: the tiles are
+ * packed into as many messages as the multifragment size requires, each one
+ * written with the client's own RemoteFX context (headers, frame index).
+ */
+
+static int shadow_client_send_rfx_tiles(rdpShadowClient* client, SURFACE_BITS_COMMAND* cmd, UINT32 frameId,
+		RFX_RECT* rects, int numRects, rdpShadowEncodeTile** tiles, int numTiles)
+{
+	int i;
+	int count;
+	int status = -1;
+	wStream* s;
+	BOOL first = TRUE;
+	UINT32 tileLength;
+	UINT32 frameSize = 0;
+	UINT32 maxDataSize;
+	RFX_TILE* rfxTiles;
+	RFX_TILE** rfxTilePtrs;
+	RFX_MESSAGE message;
+	rdpContext* context = (rdpContext*) client;
+	rdpUpdate* update = context->update;
+	rdpSettings* settings = context->settings;
+	rdpShadowEncoder* encoder = client->encoder;
+
+	s = encoder->bs;
+	maxDataSize = settings->MultifragMaxRequestSize - 1024; /* reserve enough space for headers */
+
+	rfxTiles = (RFX_TILE*) calloc(numTiles, sizeof(RFX_TILE));
+	rfxTilePtrs = (RFX_TILE**) calloc(numTiles, sizeof(RFX_TILE*));
+
+	if (!rfxTiles || !rfxTilePtrs)
+		goto out;
+
+	for (i = 0; i < numTiles; i++)
+	{
+		rfxTiles[i].xIdx = tiles[i]->xIdx;
+		rfxTiles[i].yIdx = tiles[i]->yIdx;
+		rfxTiles[i].quantIdxY = tiles[i]->quantIdxY;
+		rfxTiles[i].quantIdxCb = tiles[i]->quantIdxCb;
+		rfxTiles[i].quantIdxCr = tiles[i]->quantIdxCr;
+		rfxTiles[i].YLen = tiles[i]->YLen;
+		rfxTiles[i].CbLen = tiles[i]->CbLen;
+		rfxTiles[i].CrLen = tiles[i]->CrLen;
+		rfxTiles[i].YData = tiles[i]->data;
+		rfxTiles[i].CbData = &tiles[i]->data[tiles[i]->YLen];
+		rfxTiles[i].CrData = &tiles[i]->data[tiles[i]->YLen + tiles[i]->CbLen];
+		rfxTilePtrs[i] = &rfxTiles[i];
+	}
+
+	ZeroMemory(&message, sizeof(RFX_MESSAGE));
+	message.numQuant = encoder->rfx->numQuant;
+	message.quantVals = encoder->rfx->quants;
+	message.numRects = numRects;
+	message.rects = rects;
+
+	i = 0;
+
+	while (i < numTiles)
+	{
+		count = 0;
+		message.tilesDataSize = 0;
+		message.tiles = &rfxTilePtrs[i];
+
+		while ((i + count) < numTiles)
+		{
+			tileLength = 19 + tiles[i + count]->YLen + tiles[i + count]->CbLen + tiles[i + count]->CrLen;
+
+			if (count && ((message.tilesDataSize + tileLength) > maxDataSize))
+				break;
+
+			message.tilesDataSize += tileLength;
+			count++;
+		}
+
+		message.numTiles = count;
+		message.frameIdx = encoder->rfx->frameIdx++;
+		i += count;
+
+		Stream_SetPosition(s, 0);
+
+		if (!rfx_write_message(encoder->rfx, s, &message))
+			goto out;
+
+		cmd->bitmapDataLength = Stream_GetPosition(s);
+		cmd->bitmapData = Stream_Buffer(s);
+		frameSize += cmd->bitmapDataLength;
+
+		if (!encoder->frameAck)
+			IFCALL(update->SurfaceBits, update->context, cmd);
+		else
+			IFCALL(update->SurfaceFrameBits, update->context, cmd, first, (i >= numTiles) ? TRUE : FALSE, frameId);
+
+		first = FALSE;
+	}
+
+	status = (int) frameSize;
+
+out:
+	free(rfxTiles);
+	free(rfxTilePtrs);
+
+	return status;
+}
+
+/**
+ * Sends NSCodec tiles taken from the shared encode cache, one surface bits
+ * command per tile.
+ */
+
+static int shadow_client_send_nsc_tiles(rdpShadowClient* client, SURFACE_BITS_COMMAND* cmd, UINT32 frameId,
+		rdpShadowEncodeTile** tiles, int numTiles)
+{
+	int i;
+	UINT32 frameSize = 0;
+	rdpContext* context = (rdpContext*) client;
+	rdpUpdate* update = context->update;
+	rdpShadowEncoder* encoder = client->encoder;
+
+	for (i = 0; i < numTiles; i++)
+	{
+		cmd->destLeft = tiles[i]->x;
+		cmd->destTop = tiles[i]->y;
+		cmd->destRight = cmd->destLeft + tiles[i]->width;
+		cmd->destBottom = cmd->destTop + tiles[i]->height;
+		cmd->width = tiles[i]->width;
+		cmd->height = tiles[i]->height;
+
+		cmd->bitmapDataLength = tiles[i]->length;
+		cmd->bitmapData = tiles[i]->data;
+		frameSize += cmd->bitmapDataLength;
+
+		if (!encoder->frameAck)
+			IFCALL(update->SurfaceBits, update->context, cmd);
+		else
+			IFCALL(update->SurfaceFrameBits, update->context, cmd, (i == 0) ? TRUE : FALSE,
+					((i + 1) == numTiles) ? TRUE : FALSE, frameId);
+	}
+
+	return (int) frameSize;
+}
+
+/**
+ * Sends every rectangle of the (tile aligned) update region in one frame:
+ * RemoteFX encodes all rectangles in a single message set, NSCodec emits one
+ * surface bits command per rectangle between the frame markers. With shared
+ * encoding, tiles are taken from (and added to) the server encode cache.
+ */
+
+int shadow_client_send_surface_bits(rdpShadowClient* client, rdpShadowSurface* surface, REGION16* region)
 {
 	int i;
 	BOOL first;
 	BOOL last;
 	wStream* s;
+	int subX = 0;
+	int subY = 0;
 	int nSrcStep;
 	BYTE* pSrcData;
+	int numRects = 0;
 	int numMessages;
 	UINT32 frameId = 0;
+	UINT32 frameSize = 0;
 	rdpUpdate* update;
 	rdpContext* context;
 	rdpSettings* settings;
 	rdpShadowServer* server;
 	rdpShadowEncoder* encoder;
 	SURFACE_BITS_COMMAND cmd;
+	const RECTANGLE_16* regionRects;
+	rdpShadowEncodeTile** tiles = NULL;
+	int numTiles = 0;
+	int status;
+	BOOL shared;
 
 	context = (rdpContext*) client;
 	update = context->update;
@@ -392,21 +557,21 @@ int shadow_client_send_surface_bits(rdpShadowClient* client, rdpShadowSurface* s
 	server = client->server;
 	encoder = client->encoder;
 
-	pSrcData = surface->data;
+	shared = (server->encodeCache && (surface == server->surface)) ? TRUE : FALSE;
+
+	pSrcData = client->surfaceData;
 	nSrcStep = surface->scanline;
 
+	regionRects = region16_rects(region, &numRects);
+
+	if (numRects < 1)
+		return 1;
+
 	if (server->shareSubRect)
 	{
-		int subX, subY;
-		int subWidth, subHeight;
-
 		subX = server->subRect.left;
 		subY = server->subRect.top;
-		subWidth = server->subRect.right - server->subRect.left;
-		subHeight = server->subRect.bottom - server->subRect.top;
 
-		nXSrc -= subX;
-		nYSrc -= subY;
 		pSrcData = &pSrcData[(subY * nSrcStep) + (subX * 4)];
 	}
 
@@ -415,7 +580,7 @@ int shadow_client_send_surface_bits(rdpShadowClient* client, rdpShadowSurface* s
 
 	if (settings->RemoteFxCodec)
 	{
-		RFX_RECT rect;
+		RFX_RECT* rects;
 		RFX_MESSAGE* messages;
 		RFX_RECT *messageRects = NULL;
 
@@ -423,16 +588,17 @@ int shadow_client_send_surface_bits(rdpShadowClient* client, rdpShadowSurface* s
 
 		s = encoder->bs;
 
-		rect.x = nXSrc;
-		rect.y = nYSrc;
-		rect.width = nWidth;
-		rect.height = nHeight;
+		rects = (RFX_RECT*) malloc(numRects * sizeof(RFX_RECT));
 
-		if (!(messages = rfx_encode_messages(encoder->rfx, &rect, 1, pSrcData,
-				surface->width, surface->height, nSrcStep, &numMessages,
-				settings->MultifragMaxRequestSize)))
+		if (!rects)
+			return -1;
+
+		for (i = 0; i < numRects; i++)
 		{
-			return 0;
+			rects[i].x = regionRects[i].left - subX;
+			rects[i].y = regionRects[i].top - subY;
+			rects[i].width = regionRects[i].right - regionRects[i].left;
+			rects[i].height = regionRects[i].bottom - regionRects[i].top;
 		}
 
 		cmd.codecID = settings->RemoteFxCodecId;
@@ -446,6 +612,30 @@ int shadow_client_send_surface_bits(rdpShadowClient* client, rdpShadowSurface* s
 		cmd.width = surface->width;
 		cmd.height = surface->height;
 
+		if (shared && (shadow_encode_cache_get_tiles(server->encodeCache, encoder, FREERDP_CODEC_REMOTEFX,
+				region, client->surfaceData, client->surfaceFrame, &tiles, &numTiles) > 0))
+		{
+			status = shadow_client_send_rfx_tiles(client, &cmd, frameId, rects, numRects, tiles, numTiles);
+			shadow_encode_cache_release_tiles(tiles, numTiles);
+			free(rects);
+
+			if (status < 0)
+				return -1;
+
+			shadow_encoder_frame_sent(encoder, frameId, (UINT32) status, SHADOW_STATS_CODEC_REMOTEFX);
+
+			return 1;
+		}
+
+		messages = rfx_encode_messages(encoder->rfx, rects, numRects, pSrcData,
+				surface->width, surface->height, nSrcStep, &numMessages,
+				settings->MultifragMaxRequestSize);
+
+		free(rects);
+
+		if (!messages)
+			return 0;
+
 		if (numMessages > 0)
 			messageRects = messages[0].rects;
 
@@ -464,6 +654,7 @@ int shadow_client_send_surface_bits(rdpShadowClient* client, rdpShadowSurface* s
 
 			cmd.bitmapDataLength = Stream_GetPosition(s);
 			cmd.bitmapData = Stream_Buffer(s);
+			frameSize += cmd.bitmapDataLength;
 
 			first = (i == 0) ? TRUE : FALSE;
 			last = ((i + 1) == numMessages) ? TRUE : FALSE;
@@ -479,204 +670,689 @@ int shadow_client_send_surface_bits(rdpShadowClient* client, rdpShadowSurface* s
 	}
 	else if (settings->NSCodec)
 	{
+		int nXSrc, nYSrc;
+		int nWidth, nHeight;
+
 		shadow_encoder_prepare(encoder, FREERDP_CODEC_NSCODEC);
 
 		s = encoder->bs;
-		Stream_SetPosition(s, 0);
-
-		pSrcData = &pSrcData[(nYSrc * nSrcStep) + (nXSrc * 4)];
-
-		nsc_compose_message(encoder->nsc, s, pSrcData, nWidth, nHeight, nSrcStep);
 
 		cmd.bpp = 32;
 		cmd.codecID = settings->NSCodecId;
-		cmd.destLeft = nXSrc;
-		cmd.destTop = nYSrc;
-		cmd.destRight = cmd.destLeft + nWidth;
-		cmd.destBottom = cmd.destTop + nHeight;
-		cmd.width = nWidth;
-		cmd.height = nHeight;
 
-		cmd.bitmapDataLength = Stream_GetPosition(s);
-		cmd.bitmapData = Stream_Buffer(s);
+		if (shared && (shadow_encode_cache_get_tiles(server->encodeCache, encoder, FREERDP_CODEC_NSCODEC,
+				region, client->surfaceData, client->surfaceFrame, &tiles, &numTiles) > 0))
+		{
+			status = shadow_client_send_nsc_tiles(client, &cmd, frameId, tiles, numTiles);
+			shadow_encode_cache_release_tiles(tiles, numTiles);
 
-		first = TRUE;
-		last = TRUE;
+			if (status < 0)
+				return -1;
 
-		if (!encoder->frameAck)
-			IFCALL(update->SurfaceBits, update->context, &cmd);
-		else
-			IFCALL(update->SurfaceFrameBits, update->context, &cmd, first, last, frameId);
+			shadow_encoder_frame_sent(encoder, frameId, (UINT32) status, SHADOW_STATS_CODEC_NSCODEC);
+
+			return 1;
+		}
+
+		for (i = 0; i < numRects; i++)
+		{
+			nXSrc = regionRects[i].left - subX;
+			nYSrc = regionRects[i].top - subY;
+			nWidth = regionRects[i].right - regionRects[i].left;
+			nHeight = regionRects[i].bottom - regionRects[i].top;
+
+			Stream_SetPosition(s, 0);
+
+			nsc_compose_message(encoder->nsc, s, &pSrcData[(nYSrc * nSrcStep) + (nXSrc * 4)],
+					nWidth, nHeight, nSrcStep);
+
+			cmd.destLeft = nXSrc;
+			cmd.destTop = nYSrc;
+			cmd.destRight = cmd.destLeft + nWidth;
+			cmd.destBottom = cmd.destTop + nHeight;
+			cmd.width = nWidth;
+			cmd.height = nHeight;
+
+			cmd.bitmapDataLength = Stream_GetPosition(s);
+			cmd.bitmapData = Stream_Buffer(s);
+			frameSize += cmd.bitmapDataLength;
+
+			first = (i == 0) ? TRUE : FALSE;
+			last = ((i + 1) == numRects) ? TRUE : FALSE;
+
+			if (!encoder->frameAck)
+				IFCALL(update->SurfaceBits, update->context, &cmd);
+			else
+				IFCALL(update->SurfaceFrameBits, update->context, &cmd, first, last, frameId);
+		}
 	}
 
+	shadow_encoder_frame_sent(encoder, frameId, frameSize,
+			settings->RemoteFxCodec ? SHADOW_STATS_CODEC_REMOTEFX : SHADOW_STATS_CODEC_NSCODEC);
+
 	return 1;
 }
 
-int shadow_client_send_bitmap_update(rdpShadowClient* client, rdpShadowSurface* surface, int nXSrc, int nYSrc, int nWidth, int nHeight)
+/**
+ * Splits the tiles touched by region into text and image tiles, see
+ * shadow_classifier_split. Returns the number of text tiles.
+ */
+
+static int shadow_client_classify(rdpShadowClient* client, rdpShadowSurface* surface,
+		REGION16* region, REGION16* textRegion, REGION16* imageRegion)
 {
-	BYTE* data;
-	BYTE* buffer;
-	int yIdx, xIdx, k;
-	int rows, cols;
-	int nSrcStep;
-	BYTE* pSrcData;
-	UINT32 DstSize;
-	UINT32 SrcFormat;
-	BITMAP_DATA* bitmap;
-	rdpUpdate* update;
-	rdpContext* context;
-	rdpSettings* settings;
-	UINT32 maxUpdateSize;
-	UINT32 totalBitmapSize;
-	UINT32 updateSizeEstimate;
-	BITMAP_DATA* bitmapData;
-	BITMAP_UPDATE bitmapUpdate;
-	rdpShadowServer* server;
-	rdpShadowEncoder* encoder;
+	RECTANGLE_16 bounds;
+	rdpShadowServer* server = client->server;
+	rdpShadowEncoder* encoder = client->encoder;
 
-	context = (rdpContext*) client;
-	update = context->update;
-	settings = context->settings;
+	if (server->shareSubRect)
+	{
+		bounds = server->subRect;
+	}
+	else
+	{
+		bounds.left = 0;
+		bounds.top = 0;
+		bounds.right = surface->width;
+		bounds.bottom = surface->height;
+	}
 
-	server = client->server;
-	encoder = client->encoder;
+	if (!encoder->classifier)
+	{
+		encoder->classifier = shadow_classifier_new(bounds.right - bounds.left,
+				bounds.bottom - bounds.top);
 
-	maxUpdateSize = settings->MultifragMaxRequestSize;
+		if (!encoder->classifier)
+			return -1;
+	}
 
-	if (settings->ColorDepth < 32)
-		shadow_encoder_prepare(encoder, FREERDP_CODEC_INTERLEAVED);
-	else
-		shadow_encoder_prepare(encoder, FREERDP_CODEC_PLANAR);
+	return shadow_classifier_split(encoder->classifier, client->surfaceData, surface->scanline,
+			&bounds, region, textRegion, imageRegion);
+}
 
-	pSrcData = surface->data;
-	nSrcStep = surface->scanline;
-	SrcFormat = PIXEL_FORMAT_RGB32;
+/**
+ * Sends the text region in 64x64 ClearCodec tiles, as part of the current
+ * graphics pipeline frame. Tiles of at most 32x32 pixels that were sent
+ * before are hits in the glyph cache.
+ */
 
-	if ((nXSrc % 4) != 0)
-	{
-		nWidth += (nXSrc % 4);
-		nXSrc -= (nXSrc % 4);
-	}
+static int shadow_client_send_gfx_clear(rdpShadowClient* client, rdpShadowSurface* surface,
+		REGION16* region, int nXSrc, int nYSrc, UINT32* frameSize)
+{
+	int x, y;
+	int index;
+	int numRects = 0;
+	int nWidth, nHeight;
+	UINT32 dstSize;
+	BYTE* pTile;
+	BYTE* buffer;
+	const RECTANGLE_16* rects;
+	RDPGFX_WIRE_TO_SURFACE_PDU_1 wireToSurface1;
+	rdpShadowEncoder* encoder = client->encoder;
+	RdpgfxServerContext* rdpgfx = client->rdpgfx;
+
+	if (shadow_encoder_prepare(encoder, FREERDP_CODEC_CLEARCODEC) < 0)
+		return -1;
 
-	if ((nYSrc % 4) != 0)
+	rects = region16_rects(region, &numRects);
+
+	wireToSurface1.surfaceId = 0;
+	wireToSurface1.codecId = RDPGFX_CODECID_CLEARCODEC;
+	wireToSurface1.pixelFormat = PIXEL_FORMAT_XRGB_8888;
+
+	for (index = 0; index < numRects; index++)
 	{
-		nHeight += (nYSrc % 4);
-		nYSrc -= (nYSrc % 4);
+		for (y = rects[index].top; y < rects[index].bottom; y += SHADOW_CLASSIFY_TILE_SIZE)
+		{
+			for (x = rects[index].left; x < rects[index].right; x += SHADOW_CLASSIFY_TILE_SIZE)
+			{
+				nWidth = MIN(SHADOW_CLASSIFY_TILE_SIZE, rects[index].right - x);
+				nHeight = MIN(SHADOW_CLASSIFY_TILE_SIZE, rects[index].bottom - y);
+
+				pTile = &client->surfaceData[(y * surface->scanline) + (x * 4)];
+				buffer = NULL;
+				dstSize = 0;
+
+				if (clear_compress(encoder->clear, pTile, PIXEL_FORMAT_XRGB32, surface->scanline,
+						nWidth, nHeight, &buffer, &dstSize) < 0)
+					return -1;
+
+				wireToSurface1.destRect.left = x - nXSrc;
+				wireToSurface1.destRect.top = y - nYSrc;
+				wireToSurface1.destRect.right = wireToSurface1.destRect.left + nWidth;
+				wireToSurface1.destRect.bottom = wireToSurface1.destRect.top + nHeight;
+				wireToSurface1.bitmapDataLength = dstSize;
+				wireToSurface1.bitmapData = buffer;
+
+				if (rdpgfx->WireToSurface1(rdpgfx, &wireToSurface1) < 0)
+				{
+					free(buffer);
+					return -1;
+				}
+
+				free(buffer);
+
+				*frameSize += dstSize;
+			}
+		}
 	}
 
-	rows = (nHeight / 64) + ((nHeight % 64) ? 1 : 0);
-	cols = (nWidth / 64) + ((nWidth % 64) ? 1 : 0);
+	return 1;
+}
 
-	k = 0;
-	totalBitmapSize = 0;
+/**
+ * Graphics pipeline path: the whole surface is H.264 (AVC420) encoded, with the
+ * invalid region as region of interest. Clients that did not confirm H.264
+ * support get the invalid region RemoteFX encoded when they support RemoteFX,
+ * in ClearCodec tiles otherwise. With tile classification, text tiles are
+ * always sent in ClearCodec tiles.
+ * Pending block moves are sent in the same frame as SurfaceToSurface copies.
+ */
 
-	bitmapUpdate.count = bitmapUpdate.number = rows * cols;
-	bitmapData = (BITMAP_DATA*) malloc(sizeof(BITMAP_DATA) * bitmapUpdate.number);
-	bitmapUpdate.rectangles = bitmapData;
+int shadow_client_send_surface_gfx(rdpShadowClient* client, rdpShadowSurface* surface, REGION16* region,
+		const rdpShadowMove* moves, int numMoves)
+{
+	int index;
+	int status = -1;
+	int numRects = 0;
+	int nSrcStep;
+	int nXSrc = 0;
+	int nYSrc = 0;
+	BYTE* pSrcData;
+	UINT32 width, height;
+	UINT32 frameId;
+	UINT32 frameSize = 0;
+	UINT32 h264Size = 0;
+	BYTE qpVal;
+	BYTE qualityVal;
+	BOOL h264;
+	BOOL lossy = FALSE;
+	int codec = SHADOW_STATS_CODEC_CLEARCODEC;
+	BYTE* pH264Data = NULL;
+	wStream* s = NULL;
+	SYSTEMTIME st;
+	RECTANGLE_16 surfaceRect;
+	const RECTANGLE_16* rects;
+	RDPGFX_RECT16* regionRects = NULL;
+	RFX_RECT* rfxRects = NULL;
+	RFX_MESSAGE* rfxMessage = NULL;
+	RDPGFX_POINT16 destPt;
+	RDPGFX_SURFACE_TO_SURFACE_PDU surfaceToSurface;
+	RDPGFX_START_FRAME_PDU startFrame;
+	RDPGFX_END_FRAME_PDU endFrame;
+	RDPGFX_WIRE_TO_SURFACE_PDU_1 wireToSurface1;
+	REGION16 textRegion;
+	rdpContext* context = (rdpContext*) client;
+	rdpSettings* settings = context->settings;
+	rdpShadowServer* server = client->server;
+	rdpShadowEncoder* encoder = client->encoder;
+	RdpgfxServerContext* rdpgfx = client->rdpgfx;
 
-	if (!bitmapData)
-		return -1;
+	region16_init(&textRegion);
 
-	if ((nWidth % 4) != 0)
+	width = settings->DesktopWidth;
+	height = settings->DesktopHeight;
+
+	pSrcData = client->surfaceData;
+	nSrcStep = surface->scanline;
+
+	if (server->shareSubRect)
 	{
-		nXSrc -= (nWidth % 4);
-		nWidth += (nWidth % 4);
+		nXSrc = server->subRect.left;
+		nYSrc = server->subRect.top;
+		pSrcData = &pSrcData[(nYSrc * nSrcStep) + (nXSrc * 4)];
 	}
 
-	if ((nHeight % 4) != 0)
+	if (!client->gfxSurfaceCreated)
 	{
-		nYSrc -= (nHeight % 4);
-		nHeight += (nHeight % 4);
+		if (shadow_client_rdpgfx_create_surface(client, width, height) < 0)
+			return -1;
+
+		/* a new surface starts out blank on the client */
+		surfaceRect.left = nXSrc;
+		surfaceRect.top = nYSrc;
+		surfaceRect.right = nXSrc + width;
+		surfaceRect.bottom = nYSrc + height;
+		region16_union_rect(region, region, &surfaceRect);
+		numMoves = 0;
 	}
 
-	for (yIdx = 0; yIdx < rows; yIdx++)
+	if (shadow_encoder_init_frame_list(encoder) < 0)
+		return -1;
+
+	h264 = shadow_client_rdpgfx_h264(client);
+
+	/* with a lossy codec, text tiles are sent with ClearCodec and only image tiles are encoded */
+
+	if (server->tileClassify && !client->inLobby && (h264 || settings->RemoteFxCodec))
 	{
-		for (xIdx = 0; xIdx < cols; xIdx++)
-		{
-			bitmap = &bitmapData[k];
+		REGION16 imageRegion;
 
-			bitmap->width = 64;
-			bitmap->height = 64;
-			bitmap->destLeft = nXSrc + (xIdx * 64);
-			bitmap->destTop = nYSrc + (yIdx * 64);
+		region16_init(&imageRegion);
 
-			if ((bitmap->destLeft + bitmap->width) > (nXSrc + nWidth))
-				bitmap->width = (nXSrc + nWidth) - bitmap->destLeft;
+		if (shadow_client_classify(client, surface, region, &textRegion, &imageRegion) > 0)
+			region16_copy(region, &imageRegion);
+		else
+			region16_clear(&textRegion);
 
-			if ((bitmap->destTop + bitmap->height) > (nYSrc + nHeight))
-				bitmap->height = (nYSrc + nHeight) - bitmap->destTop;
+		region16_uninit(&imageRegion);
+	}
 
-			bitmap->destRight = bitmap->destLeft + bitmap->width - 1;
-			bitmap->destBottom = bitmap->destTop + bitmap->height - 1;
-			bitmap->compressed = TRUE;
+	rects = region16_rects(region, &numRects);
 
-			if ((bitmap->width < 4) || (bitmap->height < 4))
-				continue;
+	/* a frame may only hold moves */
 
-			if (settings->ColorDepth < 32)
-			{
-				int bitsPerPixel = settings->ColorDepth;
-				int bytesPerPixel = (bitsPerPixel + 7) / 8;
+	if ((numRects > 0) && h264 && (shadow_encoder_prepare(encoder, FREERDP_CODEC_H264) >= 0))
+	{
+		regionRects = (RDPGFX_RECT16*) calloc(numRects, sizeof(RDPGFX_RECT16));
 
-				DstSize = 64 * 64 * 4;
-				buffer = encoder->grid[k];
+		if (!regionRects)
+			goto out;
 
-				interleaved_compress(encoder->interleaved, buffer, &DstSize, bitmap->width, bitmap->height,
-						pSrcData, SrcFormat, nSrcStep, bitmap->destLeft, bitmap->destTop, NULL, bitsPerPixel);
+		for (index = 0; index < numRects; index++)
+		{
+			regionRects[index].left = rects[index].left - nXSrc;
+			regionRects[index].top = rects[index].top - nYSrc;
+			regionRects[index].right = rects[index].right - nXSrc;
+			regionRects[index].bottom = rects[index].bottom - nYSrc;
+		}
 
-				bitmap->bitmapDataStream = buffer;
-				bitmap->bitmapLength = DstSize;
-				bitmap->bitsPerPixel = bitsPerPixel;
-				bitmap->cbScanWidth = bitmap->width * bytesPerPixel;
-				bitmap->cbUncompressedSize = bitmap->width * bitmap->height * bytesPerPixel;
-			}
-			else
-			{
-				int dstSize;
+		if (h264_compress(encoder->h264, pSrcData, PIXEL_FORMAT_XRGB32, nSrcStep,
+				width, height, regionRects, numRects, &pH264Data, &h264Size) < 0)
+		{
+			WLog_ERR(TAG, "h264_compress failure");
+			goto out;
+		}
 
-				buffer = encoder->grid[k];
-				data = &pSrcData[(bitmap->destTop * nSrcStep) + (bitmap->destLeft * 4)];
+		s = Stream_New(NULL, 4 + (numRects * 10) + h264Size);
 
-				buffer = freerdp_bitmap_compress_planar(encoder->planar, data, SrcFormat,
-						bitmap->width, bitmap->height, nSrcStep, buffer, &dstSize);
+		if (!s)
+			goto out;
 
-				bitmap->bitmapDataStream = buffer;
-				bitmap->bitmapLength = dstSize;
-				bitmap->bitsPerPixel = 32;
-				bitmap->cbScanWidth = bitmap->width * 4;
-				bitmap->cbUncompressedSize = bitmap->width * bitmap->height * 4;
-			}
+		/* RDPGFX_H264_METABLOCK */
 
-			bitmap->cbCompFirstRowSize = 0;
-			bitmap->cbCompMainBodySize = bitmap->bitmapLength;
+		Stream_Write_UINT32(s, numRects); /* numRegionRects (4 bytes) */
 
-			totalBitmapSize += bitmap->bitmapLength;
-			k++;
+		for (index = 0; index < numRects; index++)
+		{
+			Stream_Write_UINT16(s, regionRects[index].left); /* left (2 bytes) */
+			Stream_Write_UINT16(s, regionRects[index].top); /* top (2 bytes) */
+			Stream_Write_UINT16(s, regionRects[index].right); /* right (2 bytes) */
+			Stream_Write_UINT16(s, regionRects[index].bottom); /* bottom (2 bytes) */
 		}
-	}
 
-	bitmapUpdate.count = bitmapUpdate.number = k;
+		shadow_encoder_h264_quality(encoder, &qpVal, &qualityVal);
 
-	updateSizeEstimate = totalBitmapSize + (k * bitmapUpdate.count) + 16;
+		for (index = 0; index < numRects; index++)
+		{
+			Stream_Write_UINT8(s, qpVal); /* qpVal (1 byte) */
+			Stream_Write_UINT8(s, qualityVal); /* qualityVal (1 byte) */
+		}
 
-	if (updateSizeEstimate > maxUpdateSize)
+		Stream_Write(s, pH264Data, h264Size);
+
+		wireToSurface1.surfaceId = 0;
+		wireToSurface1.pixelFormat = PIXEL_FORMAT_XRGB_8888;
+		wireToSurface1.codecId = RDPGFX_CODECID_H264;
+		wireToSurface1.destRect.left = 0;
+		wireToSurface1.destRect.top = 0;
+		wireToSurface1.destRect.right = width;
+		wireToSurface1.destRect.bottom = height;
+		wireToSurface1.bitmapDataLength = (UINT32) Stream_GetPosition(s);
+		wireToSurface1.bitmapData = Stream_Buffer(s);
+		frameSize = wireToSurface1.bitmapDataLength;
+		codec = SHADOW_STATS_CODEC_H264;
+		lossy = TRUE;
+	}
+	else if ((numRects > 0) && settings->RemoteFxCodec &&
+			(shadow_encoder_prepare(encoder, FREERDP_CODEC_REMOTEFX) >= 0))
 	{
-		UINT32 i, j;
-		UINT32 updateSize;
-		UINT32 newUpdateSize;
-		BITMAP_DATA* fragBitmapData;
-
-		fragBitmapData = (BITMAP_DATA*) malloc(sizeof(BITMAP_DATA) * k);
-		bitmapUpdate.rectangles = fragBitmapData;
+		rfxRects = (RFX_RECT*) calloc(numRects, sizeof(RFX_RECT));
 
-		i = j = 0;
-		updateSize = 1024;
+		if (!rfxRects)
+			goto out;
 
-		while (i < k)
+		for (index = 0; index < numRects; index++)
 		{
-			newUpdateSize = updateSize + (bitmapData[i].bitmapLength + 16);
+			rfxRects[index].x = rects[index].left - nXSrc;
+			rfxRects[index].y = rects[index].top - nYSrc;
+			rfxRects[index].width = rects[index].right - rects[index].left;
+			rfxRects[index].height = rects[index].bottom - rects[index].top;
+		}
 
-			if ((newUpdateSize < maxUpdateSize) && ((i + 1) < k))
+		rfxMessage = rfx_encode_message(encoder->rfx, rfxRects, numRects, pSrcData,
+				width, height, nSrcStep);
+
+		if (!rfxMessage)
+		{
+			WLog_ERR(TAG, "rfx_encode_message failure");
+			goto out;
+		}
+
+		s = Stream_New(NULL, 1024);
+
+		if (!s)
+			goto out;
+
+		/* every RemoteFX message of the graphics pipeline starts with the headers */
+		encoder->rfx->state = RFX_STATE_SEND_HEADERS;
+
+		if (!rfx_write_message(encoder->rfx, s, rfxMessage))
+		{
+			WLog_ERR(TAG, "rfx_write_message failure");
+			goto out;
+		}
+
+		wireToSurface1.surfaceId = 0;
+		wireToSurface1.pixelFormat = PIXEL_FORMAT_XRGB_8888;
+		wireToSurface1.codecId = RDPGFX_CODECID_CAVIDEO;
+		wireToSurface1.destRect.left = 0;
+		wireToSurface1.destRect.top = 0;
+		wireToSurface1.destRect.right = width;
+		wireToSurface1.destRect.bottom = height;
+		wireToSurface1.bitmapDataLength = (UINT32) Stream_GetPosition(s);
+		wireToSurface1.bitmapData = Stream_Buffer(s);
+		frameSize = wireToSurface1.bitmapDataLength;
+		codec = SHADOW_STATS_CODEC_REMOTEFX;
+		lossy = TRUE;
+	}
+	else if (numRects > 0)
+	{
+		/* clients without a lossy codec get the whole region in ClearCodec tiles */
+		for (index = 0; index < numRects; index++)
+			region16_union_rect(&textRegion, &textRegion, &rects[index]);
+	}
+
+	/* frames are not tracked once the client suspended frame acknowledgement */
+	encoder->frameAck = rdpgfx->FrameAckSuspended ? FALSE : TRUE;
+
+	if (encoder->frameAck)
+		frameId = (UINT32) shadow_encoder_create_frame_id(encoder);
+	else
+		frameId = ++encoder->frameId;
+
+	GetLocalTime(&st);
+
+	startFrame.frameId = frameId;
+	startFrame.timestamp = st.wMilliseconds | (st.wSecond << 10) |
+			(st.wMinute << 16) | (st.wHour << 22);
+
+	endFrame.frameId = frameId;
+
+	if (rdpgfx->StartFrame(rdpgfx, &startFrame) < 0)
+		goto out;
+
+	/* moves come first, the update repaints what they exposed */
+
+	for (index = 0; index < numMoves; index++)
+	{
+		surfaceToSurface.surfaceIdSrc = 0;
+		surfaceToSurface.surfaceIdDest = 0;
+		surfaceToSurface.rectSrc.left = moves[index].dst.left - moves[index].dx - nXSrc;
+		surfaceToSurface.rectSrc.top = moves[index].dst.top - moves[index].dy - nYSrc;
+		surfaceToSurface.rectSrc.right = moves[index].dst.right - moves[index].dx - nXSrc;
+		surfaceToSurface.rectSrc.bottom = moves[index].dst.bottom - moves[index].dy - nYSrc;
+		destPt.x = moves[index].dst.left - nXSrc;
+		destPt.y = moves[index].dst.top - nYSrc;
+		surfaceToSurface.destPtsCount = 1;
+		surfaceToSurface.destPts = &destPt;
+
+		if (rdpgfx->SurfaceToSurface(rdpgfx, &surfaceToSurface) < 0)
+			goto out;
+	}
+
+	if (!region16_is_empty(&textRegion) &&
+			(shadow_client_send_gfx_clear(client, surface, &textRegion, nXSrc, nYSrc, &frameSize) < 0))
+		goto out;
+
+	if (lossy && (rdpgfx->WireToSurface1(rdpgfx, &wireToSurface1) < 0))
+		goto out;
+
+	if (rdpgfx->EndFrame(rdpgfx, &endFrame) < 0)
+		goto out;
+
+	shadow_encoder_frame_sent(encoder, frameId, frameSize, codec);
+
+	status = 1;
+
+out:
+	if (rfxMessage)
+	{
+		rfxMessage->freeRects = TRUE;
+		rfx_message_free(encoder->rfx, rfxMessage);
+	}
+
+	Stream_Free(s, TRUE);
+	free(regionRects);
+	free(rfxRects);
+	region16_uninit(&textRegion);
+
+	return status;
+}
+
+/**
+ * Splits every rectangle of the (tile aligned) update region into 64x64
+ * bitmaps, all of which are sent in one bitmap update (fragmented as needed).
+ * Tiles beyond the encoder grid go back into the client invalid region and
+ * are sent with the next frame.
+ */
+
+int shadow_client_send_bitmap_update(rdpShadowClient* client, rdpShadowSurface* surface, REGION16* region)
+{
+	BYTE* data;
+	BYTE* buffer;
+	int yIdx, xIdx, k;
+	int rows, cols;
+	int index;
+	int nXSrc, nYSrc;
+	int nWidth, nHeight;
+	int numRects = 0;
+	int maxTiles;
+	int nSrcStep;
+	BYTE* pSrcData;
+	UINT32 DstSize;
+	UINT32 SrcFormat;
+	BITMAP_DATA* bitmap;
+	rdpUpdate* update;
+	rdpContext* context;
+	rdpSettings* settings;
+	UINT32 maxUpdateSize;
+	UINT32 totalBitmapSize;
+	UINT32 updateSizeEstimate;
+	BITMAP_DATA* bitmapData;
+	BITMAP_UPDATE bitmapUpdate;
+	RECTANGLE_16 deferredRect;
+	REGION16 deferredRegion;
+	rdpShadowServer* server;
+	rdpShadowEncoder* encoder;
+	const RECTANGLE_16* regionRects;
+
+	context = (rdpContext*) client;
+	update = context->update;
+	settings = context->settings;
+
+	server = client->server;
+	encoder = client->encoder;
+
+	regionRects = region16_rects(region, &numRects);
+
+	if (numRects < 1)
+		return 1;
+
+	maxUpdateSize = settings->MultifragMaxRequestSize;
+
+	if (settings->ColorDepth < 32)
+		shadow_encoder_prepare(encoder, FREERDP_CODEC_INTERLEAVED);
+	else
+		shadow_encoder_prepare(encoder, FREERDP_CODEC_PLANAR);
+
+	pSrcData = client->surfaceData;
+	nSrcStep = surface->scanline;
+	SrcFormat = PIXEL_FORMAT_RGB32;
+
+	maxTiles = encoder->gridWidth * encoder->gridHeight;
+
+	k = 0;
+	totalBitmapSize = 0;
+
+	bitmapUpdate.count = bitmapUpdate.number = maxTiles;
+	bitmapData = (BITMAP_DATA*) malloc(sizeof(BITMAP_DATA) * bitmapUpdate.number);
+	bitmapUpdate.rectangles = bitmapData;
+
+	if (!bitmapData)
+		return -1;
+
+	region16_init(&deferredRegion);
+
+	for (index = 0; index < numRects; index++)
+	{
+		nXSrc = regionRects[index].left;
+		nYSrc = regionRects[index].top;
+		nWidth = regionRects[index].right - regionRects[index].left;
+		nHeight = regionRects[index].bottom - regionRects[index].top;
+
+		if ((nXSrc % 4) != 0)
+		{
+			nWidth += (nXSrc % 4);
+			nXSrc -= (nXSrc % 4);
+		}
+
+		if ((nYSrc % 4) != 0)
+		{
+			nHeight += (nYSrc % 4);
+			nYSrc -= (nYSrc % 4);
+		}
+
+		rows = (nHeight / 64) + ((nHeight % 64) ? 1 : 0);
+		cols = (nWidth / 64) + ((nWidth % 64) ? 1 : 0);
+
+		if ((nWidth % 4) != 0)
+		{
+			nXSrc -= (nWidth % 4);
+			nWidth += (nWidth % 4);
+		}
+
+		if ((nHeight % 4) != 0)
+		{
+			nYSrc -= (nHeight % 4);
+			nHeight += (nHeight % 4);
+		}
+
+		for (yIdx = 0; yIdx < rows; yIdx++)
+		{
+			for (xIdx = 0; xIdx < cols; xIdx++)
+			{
+				if (k >= maxTiles)
+				{
+					deferredRect.left = nXSrc + (xIdx * 64);
+					deferredRect.top = nYSrc + (yIdx * 64);
+					deferredRect.right = MIN(deferredRect.left + 64, nXSrc + nWidth);
+					deferredRect.bottom = MIN(deferredRect.top + 64, nYSrc + nHeight);
+
+					region16_union_rect(&deferredRegion, &deferredRegion, &deferredRect);
+					continue;
+				}
+
+				bitmap = &bitmapData[k];
+
+				bitmap->width = 64;
+				bitmap->height = 64;
+				bitmap->destLeft = nXSrc + (xIdx * 64);
+				bitmap->destTop = nYSrc + (yIdx * 64);
+
+				if ((bitmap->destLeft + bitmap->width) > (nXSrc + nWidth))
+					bitmap->width = (nXSrc + nWidth) - bitmap->destLeft;
+
+				if ((bitmap->destTop + bitmap->height) > (nYSrc + nHeight))
+					bitmap->height = (nYSrc + nHeight) - bitmap->destTop;
+
+				bitmap->destRight = bitmap->destLeft + bitmap->width - 1;
+				bitmap->destBottom = bitmap->destTop + bitmap->height - 1;
+				bitmap->compressed = TRUE;
+
+				if ((bitmap->width < 4) || (bitmap->height < 4))
+					continue;
+
+				if (settings->ColorDepth < 32)
+				{
+					int bitsPerPixel = settings->ColorDepth;
+					int bytesPerPixel = (bitsPerPixel + 7) / 8;
+
+					DstSize = 64 * 64 * 4;
+					buffer = encoder->grid[k];
+
+					interleaved_compress(encoder->interleaved, buffer, &DstSize, bitmap->width, bitmap->height,
+							pSrcData, SrcFormat, nSrcStep, bitmap->destLeft, bitmap->destTop, NULL, bitsPerPixel);
+
+					bitmap->bitmapDataStream = buffer;
+					bitmap->bitmapLength = DstSize;
+					bitmap->bitsPerPixel = bitsPerPixel;
+					bitmap->cbScanWidth = bitmap->width * bytesPerPixel;
+					bitmap->cbUncompressedSize = bitmap->width * bitmap->height * bytesPerPixel;
+				}
+				else
+				{
+					int dstSize;
+
+					buffer = encoder->grid[k];
+					data = &pSrcData[(bitmap->destTop * nSrcStep) + (bitmap->destLeft * 4)];
+
+					buffer = freerdp_bitmap_compress_planar(encoder->planar, data, SrcFormat,
+							bitmap->width, bitmap->height, nSrcStep, buffer, &dstSize);
+
+					bitmap->bitmapDataStream = buffer;
+					bitmap->bitmapLength = dstSize;
+					bitmap->bitsPerPixel = 32;
+					bitmap->cbScanWidth = bitmap->width * 4;
+					bitmap->cbUncompressedSize = bitmap->width * bitmap->height * 4;
+				}
+
+				bitmap->cbCompFirstRowSize = 0;
+				bitmap->cbCompMainBodySize = bitmap->bitmapLength;
+
+				totalBitmapSize += bitmap->bitmapLength;
+				k++;
+			}
+		}
+
+	}
+
+	if (!region16_is_empty(&deferredRegion))
+	{
+		regionRects = region16_rects(&deferredRegion, &numRects);
+
+		EnterCriticalSection(&(client->lock));
+
+		for (index = 0; index < numRects; index++)
+			region16_union_rect(&(client->invalidRegion), &(client->invalidRegion), &regionRects[index]);
+
+		LeaveCriticalSection(&(client->lock));
+	}
+
+	region16_uninit(&deferredRegion);
+
+	bitmapUpdate.count = bitmapUpdate.number = k;
+
+	updateSizeEstimate = totalBitmapSize + (k * bitmapUpdate.count) + 16;
+
+	if (updateSizeEstimate > maxUpdateSize)
+	{
+		UINT32 i, j;
+		UINT32 updateSize;
+		UINT32 newUpdateSize;
+		BITMAP_DATA* fragBitmapData;
+
+		fragBitmapData = (BITMAP_DATA*) malloc(sizeof(BITMAP_DATA) * k);
+		bitmapUpdate.rectangles = fragBitmapData;
+
+		i = j = 0;
+		updateSize = 1024;
+
+		while (i < k)
+		{
+			newUpdateSize = updateSize + (bitmapData[i].bitmapLength + 16);
+
+			if ((newUpdateSize < maxUpdateSize) && ((i + 1) < k))
 			{
 				CopyMemory(&fragBitmapData[j++], &bitmapData[i++], sizeof(BITMAP_DATA));
 				updateSize = newUpdateSize;
@@ -705,14 +1381,197 @@ int shadow_client_send_bitmap_update(rdpShadowClient* client, rdpShadowSurface*
 
 	free(bitmapData);
 
+	shadow_encoder_count_frame(encoder, (settings->ColorDepth < 32) ?
+			SHADOW_STATS_CODEC_INTERLEAVED : SHADOW_STATS_CODEC_PLANAR, totalBitmapSize);
+
+	return 1;
+}
+
+/**
+ * Sends pending block moves to a client without the graphics pipeline as
+ * screen to screen blits, ahead of the updates repainting what they exposed.
+ */
+
+static int shadow_client_send_scrblt(rdpShadowClient* client, const rdpShadowMove* moves, int numMoves)
+{
+	int index;
+	int status = 1;
+	int subX = 0;
+	int subY = 0;
+	SCRBLT_ORDER scrblt;
+	rdpContext* context = (rdpContext*) client;
+	rdpUpdate* update = context->update;
+	rdpShadowServer* server = client->server;
+
+	if (numMoves < 1)
+		return 0;
+
+	if (server->shareSubRect)
+	{
+		subX = server->subRect.left;
+		subY = server->subRect.top;
+	}
+
+	if (!update->BeginPaint(context))
+		return -1;
+
+	for (index = 0; index < numMoves; index++)
+	{
+		ZeroMemory(&scrblt, sizeof(SCRBLT_ORDER));
+		scrblt.nLeftRect = moves[index].dst.left - subX;
+		scrblt.nTopRect = moves[index].dst.top - subY;
+		scrblt.nWidth = moves[index].dst.right - moves[index].dst.left;
+		scrblt.nHeight = moves[index].dst.bottom - moves[index].dst.top;
+		scrblt.bRop = 0xCC; /* SRCCOPY */
+		scrblt.nXSrc = scrblt.nLeftRect - moves[index].dx;
+		scrblt.nYSrc = scrblt.nTopRect - moves[index].dy;
+
+		if (!update->primary->ScrBlt(context, &scrblt))
+		{
+			status = -1;
+			break;
+		}
+	}
+
+	if (!update->EndPaint(context))
+		status = -1;
+
+	return status;
+}
+
+/**
+ * Whether block moves can be forwarded to the client as such, otherwise they
+ * are sent as damage.
+ */
+
+static BOOL shadow_client_accepts_moves(rdpShadowClient* client)
+{
+	rdpSettings* settings = ((rdpContext*) client)->settings;
+
+	if (client->inLobby)
+		return FALSE;
+
+	if (client->rdpgfx)
+		return client->gfxSurfaceCreated;
+
+	return settings->OrderSupport[NEG_SCRBLT_INDEX] ? TRUE : FALSE;
+}
+
+static UINT64 shadow_client_region_area(REGION16* region)
+{
+	int index;
+	int numRects = 0;
+	UINT64 area = 0;
+	const RECTANGLE_16* rects;
+
+	rects = region16_rects(region, &numRects);
+
+	for (index = 0; index < numRects; index++)
+		area += (rects[index].right - rects[index].left) * (rects[index].bottom - rects[index].top);
+
+	return area;
+}
+
+static void shadow_client_update_stats(rdpShadowClient* client, REGION16* region, int numMoves, UINT64 start)
+{
+	UINT64 pixels = shadow_client_region_area(region);
+	UINT32 elapsed = (UINT32) (GetTickCount64() - start);
+
+	EnterCriticalSection(&(client->lock));
+
+	client->stats.pixels += pixels;
+	client->stats.moves += numMoves;
+	client->stats.encodeTime += elapsed;
+
+	if (elapsed > client->stats.maxEncodeTime)
+		client->stats.maxEncodeTime = elapsed;
+
+	LeaveCriticalSection(&(client->lock));
+}
+
+/**
+ * Copies the statistics of a client, which may be called from any thread.
+ */
+
+int shadow_client_get_stats(rdpShadowClient* client, rdpShadowClientStats* stats)
+{
+	if (!client || !stats)
+		return -1;
+
+	EnterCriticalSection(&(client->lock));
+
+	CopyMemory(stats, &(client->stats), sizeof(rdpShadowClientStats));
+	stats->pendingPixels = (UINT32) shadow_client_region_area(&(client->invalidRegion));
+
+	LeaveCriticalSection(&(client->lock));
+
 	return 1;
 }
 
+/**
+ * Grows every rectangle of the invalid region outwards to the 64x64 tile grid
+ * of the shared area and clips it back to that area: neighbouring dirty tiles
+ * merge into a few large rectangles that the encoders can process in one go.
+ */
+
+static void shadow_client_align_region(REGION16* dst, REGION16* src, const RECTANGLE_16* bounds)
+{
+	int index;
+	int numRects = 0;
+	RECTANGLE_16 rect;
+	const RECTANGLE_16* rects;
+
+	rects = region16_rects(src, &numRects);
+
+	for (index = 0; index < numRects; index++)
+	{
+		rect.left = bounds->left + ((rects[index].left - bounds->left) & ~63);
+		rect.top = bounds->top + ((rects[index].top - bounds->top) & ~63);
+		rect.right = bounds->left + ((rects[index].right - bounds->left + 63) & ~63);
+		rect.bottom = bounds->top + ((rects[index].bottom - bounds->top + 63) & ~63);
+
+		if (rect.right > bounds->right)
+			rect.right = bounds->right;
+
+		if (rect.bottom > bounds->bottom)
+			rect.bottom = bounds->bottom;
+
+		region16_union_rect(dst, dst, &rect);
+	}
+}
+
+/**
+ * Collects the damage and moves of every frame published since the last
+ * call into the invalid region. Called with the server surface locked: the
+ * damage then leads exactly to the frame in its front buffer.
+ */
+
+static BOOL shadow_client_consume_update(rdpShadowClient* client)
+{
+	BOOL consumed;
+	RECTANGLE_16 surfaceRect;
+	rdpShadowServer* server = client->server;
+
+	surfaceRect.left = 0;
+	surfaceRect.top = 0;
+	surfaceRect.right = server->surface->width;
+	surfaceRect.bottom = server->surface->height;
+
+	if (server->shareSubRect)
+		surfaceRect = server->subRect;
+
+	EnterCriticalSection(&(client->lock));
+	consumed = shadow_multiclient_consume(client->updateSubscriber, &(client->invalidRegion), &surfaceRect,
+			client->moves, &(client->numMoves),
+			shadow_client_accepts_moves(client) ? SHADOW_CLIENT_MAX_MOVES : 0);
+	LeaveCriticalSection(&(client->lock));
+
+	return consumed;
+}
+
 int shadow_client_send_surface_update(rdpShadowClient* client)
 {
 	int status = -1;
-	int nXSrc, nYSrc;
-	int nWidth, nHeight;
 	rdpContext* context;
 	rdpSettings* settings;
 	rdpShadowServer* server;
@@ -720,7 +1579,9 @@ int shadow_client_send_surface_update(rdpShadowClient* client)
 	rdpShadowEncoder* encoder;
 	REGION16 invalidRegion;
 	RECTANGLE_16 surfaceRect;
-	const RECTANGLE_16* extents;
+	UINT64 start;
+	int numMoves;
+	rdpShadowMove moves[SHADOW_CLIENT_MAX_MOVES];
 
 	context = (rdpContext*) client;
 	settings = context->settings;
@@ -729,12 +1590,50 @@ int shadow_client_send_surface_update(rdpShadowClient* client)
 
 	surface = client->inLobby ? client->lobby : server->surface;
 
+	if (client->rdpgfx)
+	{
+		status = shadow_client_rdpgfx_ready(client, GetTickCount64());
+
+		/* keep the invalid region until the graphics pipeline is ready */
+		if (status == 0)
+			return 1;
+
+		if (status < 0)
+		{
+			WLog_WARN(TAG, "graphics pipeline capabilities not received, using surface bits");
+			shadow_client_rdpgfx_uninit(client);
+		}
+	}
+
+	/**
+	 * Pin the last published frame of the server surface, along with the
+	 * damage and moves leading to it: the capture thread writes the next
+	 * frame into the other buffer meanwhile.
+	 */
+
+	if (surface == server->surface)
+	{
+		EnterCriticalSection(&(surface->lock));
+		shadow_client_consume_update(client);
+		client->surfaceData = shadow_surface_acquire(surface);
+		client->surfaceFrame = shadow_encode_cache_get_frame(server->encodeCache);
+		LeaveCriticalSection(&(surface->lock));
+	}
+	else
+	{
+		client->surfaceData = surface->data;
+	}
+
 	EnterCriticalSection(&(client->lock));
 
 	region16_init(&invalidRegion);
 	region16_copy(&invalidRegion, &(client->invalidRegion));
 	region16_clear(&(client->invalidRegion));
 
+	numMoves = client->numMoves;
+	CopyMemory(moves, client->moves, numMoves * sizeof(rdpShadowMove));
+	client->numMoves = 0;
+
 	LeaveCriticalSection(&(client->lock));
 
 	surfaceRect.left = 0;
@@ -749,31 +1648,76 @@ int shadow_client_send_surface_update(rdpShadowClient* client)
 		region16_intersect_rect(&invalidRegion, &invalidRegion, &(server->subRect));
 	}
 
-	if (region16_is_empty(&invalidRegion))
+	if (region16_is_empty(&invalidRegion) && (numMoves < 1))
 	{
-		region16_uninit(&invalidRegion);
-		return 1;
+		status = 1;
+		goto out;
 	}
 
-	extents = region16_extents(&invalidRegion);
-
-	nXSrc = extents->left - 0;
-	nYSrc = extents->top - 0;
-	nWidth = extents->right - extents->left;
-	nHeight = extents->bottom - extents->top;
+	start = GetTickCount64();
 
-	//WLog_INFO(TAG, "shadow_client_send_surface_update: x: %d y: %d width: %d height: %d right: %d bottom: %d",
-	//	nXSrc, nYSrc, nWidth, nHeight, nXSrc + nWidth, nYSrc + nHeight);
-
-	if (settings->RemoteFxCodec || settings->NSCodec)
+	if (client->rdpgfx)
+	{
+		status = shadow_client_send_surface_gfx(client, surface, &invalidRegion, moves, numMoves);
+	}
+	else if (shadow_client_send_scrblt(client, moves, numMoves) < 0)
+	{
+		status = -1;
+	}
+	else if (region16_is_empty(&invalidRegion))
 	{
-		status = shadow_client_send_surface_bits(client, surface, nXSrc, nYSrc, nWidth, nHeight);
+		status = 1;
 	}
 	else
 	{
-		status = shadow_client_send_bitmap_update(client, surface, nXSrc, nYSrc, nWidth, nHeight);
+		REGION16 updateRegion;
+
+		region16_init(&updateRegion);
+
+		if (server->shareSubRect)
+			shadow_client_align_region(&updateRegion, &invalidRegion, &(server->subRect));
+		else
+			shadow_client_align_region(&updateRegion, &invalidRegion, &surfaceRect);
+
+		if (settings->RemoteFxCodec || settings->NSCodec)
+		{
+			REGION16 textRegion;
+			REGION16 imageRegion;
+
+			region16_init(&textRegion);
+			region16_init(&imageRegion);
+
+			if (server->tileClassify && !client->inLobby &&
+					(shadow_client_classify(client, surface, &updateRegion, &textRegion, &imageRegion) > 0))
+			{
+				status = shadow_client_send_surface_bits(client, surface, &imageRegion);
+
+				if (status >= 0)
+					status = shadow_client_send_bitmap_update(client, surface, &textRegion);
+			}
+			else
+			{
+				status = shadow_client_send_surface_bits(client, surface, &updateRegion);
+			}
+
+			region16_uninit(&textRegion);
+			region16_uninit(&imageRegion);
+		}
+		else
+			status = shadow_client_send_bitmap_update(client, surface, &updateRegion);
+
+		region16_uninit(&updateRegion);
 	}
 
+	if (status >= 0)
+		shadow_client_update_stats(client, &invalidRegion, numMoves, start);
+
+out:
+	if (surface == server->surface)
+		shadow_surface_release(surface, client->surfaceData);
+
+	client->surfaceData = NULL;
+
 	region16_uninit(&invalidRegion);
 
 	return status;
@@ -945,10 +1889,26 @@ int shadow_client_subsystem_process_message(rdpShadowClient* client, wMessage* m
 	return 1;
 }
 
+static BOOL shadow_client_has_pending_update(rdpShadowClient* client)
+{
+	BOOL pending;
+
+	EnterCriticalSection(&(client->lock));
+	pending = region16_is_empty(&(client->invalidRegion)) ? FALSE : TRUE;
+	LeaveCriticalSection(&(client->lock));
+
+	return pending;
+}
+
 void* shadow_client_thread(rdpShadowClient* client)
 {
 	DWORD status;
 	DWORD nCount;
+	DWORD dwTimeout;
+	DWORD frameDelay;
+	DWORD capsWait;
+	UINT32 rttMeasureTime = 0;
+	UINT16 rttSequenceNumber = 0;
 	wMessage message;
 	HANDLE events[32];
 	HANDLE StopEvent;
@@ -985,6 +1945,7 @@ void* shadow_client_thread(rdpShadowClient* client)
 	peer->update->RefreshRect = (pRefreshRect) shadow_client_refresh_rect;
 	peer->update->SuppressOutput = (pSuppressOutput) shadow_client_suppress_output;
 	peer->update->SurfaceFrameAcknowledge = (pSurfaceFrameAcknowledge) shadow_client_surface_frame_acknowledge;
+	peer->autodetect->RTTMeasureResponse = shadow_client_rtt_measure_response;
 
 	if ((!client->StopEvent) || (!client->vcm) || (!subsystem->updateEvent))
 		goto out;
@@ -993,6 +1954,8 @@ void* shadow_client_thread(rdpShadowClient* client)
 	if (!UpdateSubscriber)
 		goto out;
 
+	client->updateSubscriber = UpdateSubscriber;
+
 	StopEvent = client->StopEvent;
 	UpdateEvent = shadow_multiclient_getevent(UpdateSubscriber);
 	ClientEvent = peer->GetEventHandle(peer);
@@ -1007,7 +1970,30 @@ void* shadow_client_thread(rdpShadowClient* client)
 		events[nCount++] = ChannelEvent;
 		events[nCount++] = MessageQueue_Event(MsgPipe->Out);
 
-		status = WaitForMultipleObjects(nCount, events, FALSE, INFINITE);
+		if (client->rdpgfx && client->gfxCapsEvent)
+			events[nCount++] = client->gfxCapsEvent;
+
+		/**
+		 * Updates that could not be sent because the client is behind, or
+		 * because the graphics pipeline capabilities are pending, stay in the
+		 * invalid region: wake up once the next frame may be sent.
+		 */
+
+		dwTimeout = INFINITE;
+
+		if (client->activated && shadow_client_has_pending_update(client))
+		{
+			dwTimeout = shadow_encoder_frame_delay(encoder);
+			capsWait = shadow_client_rdpgfx_caps_wait(client, GetTickCount64());
+
+			if (capsWait > dwTimeout)
+				dwTimeout = capsWait;
+		}
+
+		if (client->activated && settings->NetworkAutoDetect && (dwTimeout > SHADOW_CLIENT_RTT_MEASURE_INTERVAL))
+			dwTimeout = SHADOW_CLIENT_RTT_MEASURE_INTERVAL;
+
+		status = WaitForMultipleObjects(nCount, events, FALSE, dwTimeout);
 
 		if (WaitForSingleObject(StopEvent, 0) == WAIT_OBJECT_0)
 		{
@@ -1016,27 +2002,25 @@ void* shadow_client_thread(rdpShadowClient* client)
 
 		if (WaitForSingleObject(UpdateEvent, 0) == WAIT_OBJECT_0)
 		{
-			if (client->activated)
-			{
-				int index;
-				int numRects = 0;
-				const RECTANGLE_16* rects;
+			BOOL consumed;
 
-				rects = region16_rects(&(subsystem->invalidRegion), &numRects);
+			EnterCriticalSection(&(server->surface->lock));
+			consumed = shadow_client_consume_update(client);
+			LeaveCriticalSection(&(server->surface->lock));
 
-				for (index = 0; index < numRects; index++)
+			if (consumed && client->activated)
+			{
+				if (shadow_encoder_frame_delay(encoder) == 0)
 				{
-					region16_union_rect(&(client->invalidRegion), &(client->invalidRegion), &rects[index]);
+					shadow_client_send_surface_update(client);
+				}
+				else
+				{
+					EnterCriticalSection(&(client->lock));
+					client->stats.deferredUpdates++;
+					LeaveCriticalSection(&(client->lock));
 				}
-
-				shadow_client_send_surface_update(client);
 			}
-
-			/* 
-			 * The return value of shadow_multiclient_consume is whether or not the subscriber really consumes the event.
-			 * It's not cared currently.
-			 */
-			(void)shadow_multiclient_consume(UpdateSubscriber);
 		}
 
 		if (WaitForSingleObject(ClientEvent, 0) == WAIT_OBJECT_0)
@@ -1067,10 +2051,26 @@ void* shadow_client_thread(rdpShadowClient* client)
 				shadow_client_subsystem_process_message(client, &message);
 			}
 		}
+
+		if (client->activated)
+		{
+			frameDelay = shadow_encoder_frame_delay(encoder);
+
+			if ((frameDelay == 0) && shadow_client_has_pending_update(client))
+				shadow_client_send_surface_update(client);
+
+			if (settings->NetworkAutoDetect &&
+					((GetTickCount() - rttMeasureTime) >= SHADOW_CLIENT_RTT_MEASURE_INTERVAL))
+			{
+				rttMeasureTime = GetTickCount();
+				IFCALL(peer->autodetect->RTTMeasureRequest, context, rttSequenceNumber++);
+			}
+		}
 	}
 
 	if (UpdateSubscriber)
 	{
+		client->updateSubscriber = NULL;
 		shadow_multiclient_release_subscriber(UpdateSubscriber);
 		UpdateSubscriber = NULL;
 	}
@@ -0,0 +1,694 @@
+/**
+ * FreeRDP: A Remote Desktop Protocol Implementation
+ * Shadow Server Encode Cache
+ *
+ * Copyright 2026 agent <agent@local>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <winpr/crt.h>
+#include <winpr/sysinfo.h>
+#include <winpr/interlocked.h>
+
+#include <freerdp/log.h>
+
+#include "shadow.h"
+
+#include "shadow_encode_cache.h"
+
+#define TAG SERVER_TAG("shadow")
+
+/* fewer tiles than this per worker are not worth a thread pool round trip */
+#define SHADOW_ENCODE_CACHE_MIN_WORKER_TILES	4
+
+static void shadow_encode_tile_release(rdpShadowEncodeTile* tile)
+{
+	if (!tile)
+		return;
+
+	if (InterlockedDecrement(&(tile->refCount)) == 0)
+	{
+		free(tile->data);
+		free(tile);
+	}
+}
+
+static rdpShadowEncodeTile* shadow_encode_tile_new(rdpShadowEncodeCache* cache, int index, UINT32 version, UINT32 length)
+{
+	rdpShadowEncodeTile* tile;
+	int tileSize = SHADOW_ENCODE_CACHE_TILE_SIZE;
+
+	tile = (rdpShadowEncodeTile*) calloc(1, sizeof(rdpShadowEncodeTile));
+
+	if (!tile)
+		return NULL;
+
+	tile->data = (BYTE*) malloc(length ? length : 1);
+
+	if (!tile->data)
+	{
+		free(tile);
+		return NULL;
+	}
+
+	tile->refCount = 1;
+	tile->version = version;
+	tile->length = length;
+
+	tile->xIdx = index % cache->tileCols;
+	tile->yIdx = index / cache->tileCols;
+	tile->x = tile->xIdx * tileSize;
+	tile->y = tile->yIdx * tileSize;
+	tile->width = ((tile->x + tileSize) > cache->width) ? (cache->width - tile->x) : tileSize;
+	tile->height = ((tile->y + tileSize) > cache->height) ? (cache->height - tile->y) : tileSize;
+
+	return tile;
+}
+
+static void shadow_encode_cache_store(rdpShadowEncodeProfile* profile, int index, rdpShadowEncodeTile* tile)
+{
+	shadow_encode_tile_release(profile->tiles[index]);
+	profile->tiles[index] = tile;
+}
+
+/**
+ * The profile key covers every codec parameter that changes the bitstream:
+ * the RemoteFX entropy mode and quantization indices, the NSCodec color loss
+ * and chroma subsampling levels.
+ */
+
+static UINT32 shadow_encode_cache_profile_key(rdpShadowEncoder* encoder, UINT32 codecId)
+{
+	UINT32 key = 0;
+
+	if (codecId == FREERDP_CODEC_REMOTEFX)
+	{
+		key = (encoder->rfx->mode & 0xFF);
+		key |= (encoder->rfx->quantIdxY & 0xFF) << 8;
+		key |= (encoder->rfx->quantIdxCb & 0xFF) << 16;
+		key |= (encoder->rfx->quantIdxCr & 0xFF) << 24;
+	}
+	else if (codecId == FREERDP_CODEC_NSCODEC)
+	{
+		key = (encoder->nsc->ColorLossLevel & 0xFF);
+		key |= (encoder->nsc->ChromaSubsamplingLevel & 0xFF) << 8;
+		key |= (encoder->nsc->DynamicColorFidelity ? 1 : 0) << 16;
+	}
+
+	return key;
+}
+
+static rdpShadowEncodeProfile* shadow_encode_cache_get_profile(rdpShadowEncodeCache* cache,
+		rdpShadowEncoder* encoder, UINT32 codecId)
+{
+	int index;
+	UINT32 key;
+	rdpShadowEncodeProfile* profile = NULL;
+
+	key = shadow_encode_cache_profile_key(encoder, codecId);
+
+	EnterCriticalSection(&(cache->lock));
+
+	for (index = 0; index < cache->profileCount; index++)
+	{
+		if ((cache->profiles[index].codecId == codecId) && (cache->profiles[index].key == key))
+		{
+			profile = &(cache->profiles[index]);
+			break;
+		}
+	}
+
+	if (!profile && (cache->profileCount < SHADOW_ENCODE_CACHE_MAX_PROFILES))
+	{
+		profile = &(cache->profiles[cache->profileCount]);
+
+		profile->tiles = (rdpShadowEncodeTile**) calloc(cache->tileCols * cache->tileRows,
+				sizeof(rdpShadowEncodeTile*));
+
+		if (profile->tiles && InitializeCriticalSectionAndSpinCount(&(profile->lock), 4000))
+		{
+			profile->codecId = codecId;
+			profile->key = key;
+			cache->profileCount++;
+		}
+		else
+		{
+			free(profile->tiles);
+			profile->tiles = NULL;
+			profile = NULL;
+		}
+	}
+
+	LeaveCriticalSection(&(cache->lock));
+
+	return profile;
+}
+
+static int shadow_encode_cache_encode_rfx(rdpShadowEncodeCache* cache, rdpShadowEncoder* encoder,
+		rdpShadowEncodeProfile* profile, int* indices, UINT32* versions, int count, BYTE* pSrcData, int nSrcStep)
+{
+	int i;
+	int index;
+	int status;
+	UINT32 frameIdx;
+	RFX_TILE* rfxTile;
+	RFX_RECT* rects;
+	RFX_MESSAGE* message;
+	rdpShadowEncodeTile* tile;
+	int tileSize = SHADOW_ENCODE_CACHE_TILE_SIZE;
+
+	rects = (RFX_RECT*) calloc(count, sizeof(RFX_RECT));
+
+	if (!rects)
+		return -1;
+
+	for (i = 0; i < count; i++)
+	{
+		rects[i].x = (indices[i] % cache->tileCols) * tileSize;
+		rects[i].y = (indices[i] / cache->tileCols) * tileSize;
+		rects[i].width = ((rects[i].x + tileSize) > cache->width) ? (cache->width - rects[i].x) : tileSize;
+		rects[i].height = ((rects[i].y + tileSize) > cache->height) ? (cache->height - rects[i].y) : tileSize;
+	}
+
+	/* the tiles are only encoded here, the frame index is consumed when they are written */
+	frameIdx = encoder->rfx->frameIdx;
+
+	message = rfx_encode_message(encoder->rfx, rects, count, pSrcData,
+			cache->width, cache->height, nSrcStep);
+
+	encoder->rfx->frameIdx = frameIdx;
+
+	free(rects);
+
+	if (!message)
+		return -1;
+
+	for (i = 0; i < message->numTiles; i++)
+	{
+		rfxTile = message->tiles[i];
+		index = (rfxTile->yIdx * cache->tileCols) + rfxTile->xIdx;
+
+		tile = shadow_encode_tile_new(cache, index, versions[index],
+				rfxTile->YLen + rfxTile->CbLen + rfxTile->CrLen);
+
+		if (!tile)
+			break;
+
+		tile->quantIdxY = rfxTile->quantIdxY;
+		tile->quantIdxCb = rfxTile->quantIdxCb;
+		tile->quantIdxCr = rfxTile->quantIdxCr;
+		tile->YLen = rfxTile->YLen;
+		tile->CbLen = rfxTile->CbLen;
+		tile->CrLen = rfxTile->CrLen;
+
+		CopyMemory(tile->data, rfxTile->YData, tile->YLen);
+		CopyMemory(&tile->data[tile->YLen], rfxTile->CbData, tile->CbLen);
+		CopyMemory(&tile->data[tile->YLen + tile->CbLen], rfxTile->CrData, tile->CrLen);
+
+		shadow_encode_cache_store(profile, index, tile);
+	}
+
+	status = (i < message->numTiles) ? -1 : 1;
+
+	message->freeRects = TRUE;
+	rfx_message_free(encoder->rfx, message);
+
+	return status;
+}
+
+static int shadow_encode_cache_encode_nsc_tiles(rdpShadowEncodeCache* cache, NSC_CONTEXT* nsc, wStream* s,
+		rdpShadowEncodeProfile* profile, const int* indices, const UINT32* versions, int count, BYTE* pSrcData, int nSrcStep)
+{
+	int i;
+	int x, y;
+	int width;
+	int height;
+	rdpShadowEncodeTile* tile;
+	int tileSize = SHADOW_ENCODE_CACHE_TILE_SIZE;
+
+	for (i = 0; i < count; i++)
+	{
+		x = (indices[i] % cache->tileCols) * tileSize;
+		y = (indices[i] / cache->tileCols) * tileSize;
+		width = ((x + tileSize) > cache->width) ? (cache->width - x) : tileSize;
+		height = ((y + tileSize) > cache->height) ? (cache->height - y) : tileSize;
+
+		Stream_SetPosition(s, 0);
+
+		nsc_compose_message(nsc, s, &pSrcData[(y * nSrcStep) + (x * 4)],
+				width, height, nSrcStep);
+
+		tile = shadow_encode_tile_new(cache, indices[i], versions[indices[i]], (UINT32) Stream_GetPosition(s));
+
+		if (!tile)
+			return -1;
+
+		CopyMemory(tile->data, Stream_Buffer(s), tile->length);
+
+		/* the workers store distinct indices, the profile lock is held by the caller */
+		shadow_encode_cache_store(profile, indices[i], tile);
+	}
+
+	return 1;
+}
+
+static void CALLBACK shadow_encode_cache_worker_callback(PTP_CALLBACK_INSTANCE instance, void* context, PTP_WORK work)
+{
+	rdpShadowEncodeWorker* worker = (rdpShadowEncodeWorker*) context;
+
+	worker->status = shadow_encode_cache_encode_nsc_tiles(worker->cache, worker->nsc, worker->bs,
+			worker->profile, worker->indices, worker->versions, worker->count, worker->pSrcData, worker->nSrcStep);
+}
+
+static int shadow_encode_cache_encode_nsc(rdpShadowEncodeCache* cache, rdpShadowEncoder* encoder,
+		rdpShadowEncodeProfile* profile, int* indices, UINT32* versions, int count, BYTE* pSrcData, int nSrcStep)
+{
+	int index;
+	int first;
+	int status = 1;
+	int workerCount;
+	int tilesPerWorker;
+	rdpShadowEncodeWorker* worker;
+
+	workerCount = MIN(cache->workerCount, count / SHADOW_ENCODE_CACHE_MIN_WORKER_TILES);
+
+	if (workerCount < 2)
+	{
+		return shadow_encode_cache_encode_nsc_tiles(cache, encoder->nsc, encoder->bs,
+				profile, indices, versions, count, pSrcData, nSrcStep);
+	}
+
+	/* the missing tiles are in row order, contiguous slices are horizontal bands */
+	tilesPerWorker = (count + workerCount - 1) / workerCount;
+
+	for (index = 0; index < workerCount; index++)
+	{
+		worker = &(cache->workers[index]);
+		first = MIN(index * tilesPerWorker, count);
+
+		worker->nsc->ColorLossLevel = encoder->nsc->ColorLossLevel;
+		worker->nsc->ChromaSubsamplingLevel = encoder->nsc->ChromaSubsamplingLevel;
+		worker->nsc->DynamicColorFidelity = encoder->nsc->DynamicColorFidelity;
+
+		worker->profile = profile;
+		worker->indices = &indices[first];
+		worker->versions = versions;
+		worker->count = MIN(first + tilesPerWorker, count) - first;
+		worker->pSrcData = pSrcData;
+		worker->nSrcStep = nSrcStep;
+		worker->status = 1;
+
+		SubmitThreadpoolWork(worker->work);
+	}
+
+	for (index = 0; index < workerCount; index++)
+	{
+		worker = &(cache->workers[index]);
+
+		WaitForThreadpoolWorkCallbacks(worker->work, FALSE);
+
+		if (worker->status < 0)
+			status = -1;
+
+		worker->profile = NULL;
+		worker->indices = NULL;
+		worker->versions = NULL;
+	}
+
+	return status;
+}
+
+/**
+ * Invalidates the cached tiles touched by a region of the server surface.
+ * Subsystems call this once the new content has been written to the surface.
+ */
+
+void shadow_encode_cache_invalidate(rdpShadowEncodeCache* cache, REGION16* region)
+{
+	int index;
+	int numRects = 0;
+	int x, y, x1, y1, x2, y2;
+	RECTANGLE_16 rect;
+	const RECTANGLE_16* rects;
+	int tileSize = SHADOW_ENCODE_CACHE_TILE_SIZE;
+
+	if (!cache)
+		return;
+
+	rects = region16_rects(region, &numRects);
+
+	if (numRects < 1)
+		return;
+
+	EnterCriticalSection(&(cache->lock));
+
+	cache->frameId++;
+
+	for (index = 0; index < numRects; index++)
+	{
+		if (!rectangles_intersection(&rects[index], &(cache->bounds), &rect))
+			continue;
+
+		x1 = (rect.left - cache->bounds.left) / tileSize;
+		y1 = (rect.top - cache->bounds.top) / tileSize;
+		x2 = (rect.right - cache->bounds.left + tileSize - 1) / tileSize;
+		y2 = (rect.bottom - cache->bounds.top + tileSize - 1) / tileSize;
+
+		for (y = y1; y < y2; y++)
+		{
+			for (x = x1; x < x2; x++)
+				cache->tileVersions[(y * cache->tileCols) + x] = cache->frameId;
+		}
+	}
+
+	LeaveCriticalSection(&(cache->lock));
+}
+
+/**
+ * Returns the sequence number of the last invalidated frame.
+ */
+
+UINT32 shadow_encode_cache_get_frame(rdpShadowEncodeCache* cache)
+{
+	UINT32 frameId;
+
+	if (!cache)
+		return 0;
+
+	EnterCriticalSection(&(cache->lock));
+	frameId = cache->frameId;
+	LeaveCriticalSection(&(cache->lock));
+
+	return frameId;
+}
+
+/**
+ * Returns a reference to the encoded tile for every tile of the shared area
+ * touched by region (in surface coordinates), encoding with the codec
+ * context of the given encoder only the tiles that no client with the same
+ * codec settings has encoded for the current frame yet.
+ *
+ * pSurfaceData is the surface buffer pinned by the client and frameId the
+ * frame it holds: once one of the tiles changed in a later frame, the
+ * cached tiles may be newer than the client view and cannot be used.
+ *
+ * Returns 1 on success, 0 if the cache cannot serve this encoder and
+ * a negative value on error. The tiles must be released with
+ * shadow_encode_cache_release_tiles.
+ */
+
+int shadow_encode_cache_get_tiles(rdpShadowEncodeCache* cache, rdpShadowEncoder* encoder, UINT32 codecId,
+		REGION16* region, BYTE* pSurfaceData, UINT32 frameId, rdpShadowEncodeTile*** ppTiles, int* pNumTiles)
+{
+	int index;
+	int status = 1;
+	int numRects = 0;
+	int numTiles = 0;
+	int numMissing = 0;
+	int tileCount;
+	int x, y, x1, y1, x2, y2;
+	int nSrcStep;
+	BYTE* pSrcData;
+	BYTE* marks = NULL;
+	int* indices = NULL;
+	UINT32* versions = NULL;
+	RECTANGLE_16 rect;
+	const RECTANGLE_16* rects;
+	rdpShadowSurface* surface;
+	rdpShadowEncodeTile** tiles = NULL;
+	rdpShadowEncodeProfile* profile;
+	int tileSize = SHADOW_ENCODE_CACHE_TILE_SIZE;
+
+	*ppTiles = NULL;
+	*pNumTiles = 0;
+
+	if (!cache)
+		return 0;
+
+	if ((codecId == FREERDP_CODEC_REMOTEFX) && !encoder->rfx)
+		return 0;
+
+	if ((codecId == FREERDP_CODEC_NSCODEC) && !encoder->nsc)
+		return 0;
+
+	profile = shadow_encode_cache_get_profile(cache, encoder, codecId);
+
+	if (!profile)
+		return 0;
+
+	surface = cache->server->surface;
+	nSrcStep = surface->scanline;
+	pSrcData = &pSurfaceData[(cache->bounds.top * nSrcStep) + (cache->bounds.left * 4)];
+
+	tileCount = cache->tileCols * cache->tileRows;
+
+	marks = (BYTE*) calloc(tileCount, sizeof(BYTE));
+	indices = (int*) calloc(tileCount, sizeof(int));
+	versions = (UINT32*) calloc(tileCount, sizeof(UINT32));
+	tiles = (rdpShadowEncodeTile**) calloc(tileCount, sizeof(rdpShadowEncodeTile*));
+
+	if (!marks || !indices || !versions || !tiles)
+	{
+		status = -1;
+		goto out;
+	}
+
+	rects = region16_rects(region, &numRects);
+
+	for (index = 0; index < numRects; index++)
+	{
+		if (!rectangles_intersection(&rects[index], &(cache->bounds), &rect))
+			continue;
+
+		x1 = (rect.left - cache->bounds.left) / tileSize;
+		y1 = (rect.top - cache->bounds.top) / tileSize;
+		x2 = (rect.right - cache->bounds.left + tileSize - 1) / tileSize;
+		y2 = (rect.bottom - cache->bounds.top + tileSize - 1) / tileSize;
+
+		for (y = y1; y < y2; y++)
+		{
+			for (x = x1; x < x2; x++)
+				marks[(y * cache->tileCols) + x] = 1;
+		}
+	}
+
+	EnterCriticalSection(&(profile->lock));
+
+	EnterCriticalSection(&(cache->lock));
+	CopyMemory(versions, cache->tileVersions, tileCount * sizeof(UINT32));
+	LeaveCriticalSection(&(cache->lock));
+
+	for (index = 0; index < tileCount; index++)
+	{
+		if (!marks[index])
+			continue;
+
+		if (versions[index] > frameId)
+		{
+			status = 0;
+			break;
+		}
+
+		if (!profile->tiles[index] || (profile->tiles[index]->version != versions[index]))
+			indices[numMissing++] = index;
+	}
+
+	if ((status > 0) && (numMissing > 0))
+	{
+		if (codecId == FREERDP_CODEC_REMOTEFX)
+			status = shadow_encode_cache_encode_rfx(cache, encoder, profile, indices, versions, numMissing, pSrcData, nSrcStep);
+		else
+			status = shadow_encode_cache_encode_nsc(cache, encoder, profile, indices, versions, numMissing, pSrcData, nSrcStep);
+	}
+
+	if (status > 0)
+	{
+		for (index = 0; index < tileCount; index++)
+		{
+			if (!marks[index] || !profile->tiles[index])
+				continue;
+
+			tiles[numTiles] = profile->tiles[index];
+			InterlockedIncrement(&(tiles[numTiles]->refCount));
+			numTiles++;
+		}
+	}
+
+	LeaveCriticalSection(&(profile->lock));
+
+	if (status > 0)
+	{
+		*ppTiles = tiles;
+		*pNumTiles = numTiles;
+		tiles = NULL;
+	}
+
+out:
+	free(marks);
+	free(indices);
+	free(versions);
+	free(tiles);
+
+	return status;
+}
+
+void shadow_encode_cache_release_tiles(rdpShadowEncodeTile** tiles, int numTiles)
+{
+	int index;
+
+	if (!tiles)
+		return;
+
+	for (index = 0; index < numTiles; index++)
+		shadow_encode_tile_release(tiles[index]);
+
+	free(tiles);
+}
+
+static int shadow_encode_cache_init_workers(rdpShadowEncodeCache* cache)
+{
+	int index;
+	SYSTEM_INFO sysinfo;
+	rdpShadowEncodeWorker* worker;
+	int tileSize = SHADOW_ENCODE_CACHE_TILE_SIZE;
+
+	GetNativeSystemInfo(&sysinfo);
+	cache->workerCount = MIN((int) sysinfo.dwNumberOfProcessors, SHADOW_ENCODE_CACHE_MAX_WORKERS);
+
+	if (cache->workerCount < 2)
+	{
+		cache->workerCount = 0;
+		return 1;
+	}
+
+	cache->ThreadPool = CreateThreadpool(NULL);
+
+	if (!cache->ThreadPool)
+		return -1;
+
+	InitializeThreadpoolEnvironment(&cache->ThreadPoolEnv);
+	SetThreadpoolCallbackPool(&cache->ThreadPoolEnv, cache->ThreadPool);
+	SetThreadpoolThreadMaximum(cache->ThreadPool, cache->workerCount);
+
+	for (index = 0; index < cache->workerCount; index++)
+	{
+		worker = &(cache->workers[index]);
+		worker->cache = cache;
+
+		worker->nsc = nsc_context_new();
+		worker->bs = Stream_New(NULL, tileSize * tileSize * 4);
+		worker->work = CreateThreadpoolWork((PTP_WORK_CALLBACK) shadow_encode_cache_worker_callback,
+				(void*) worker, &cache->ThreadPoolEnv);
+
+		if (!worker->nsc || !worker->bs || !worker->work)
+			return -1;
+
+		nsc_context_set_pixel_format(worker->nsc, RDP_PIXEL_FORMAT_B8G8R8A8);
+	}
+
+	return 1;
+}
+
+rdpShadowEncodeCache* shadow_encode_cache_new(rdpShadowServer* server, const RECTANGLE_16* bounds)
+{
+	rdpShadowEncodeCache* cache;
+	int tileSize = SHADOW_ENCODE_CACHE_TILE_SIZE;
+
+	cache = (rdpShadowEncodeCache*) calloc(1, sizeof(rdpShadowEncodeCache));
+
+	if (!cache)
+		return NULL;
+
+	cache->server = server;
+
+	CopyMemory(&(cache->bounds), bounds, sizeof(RECTANGLE_16));
+	cache->width = bounds->right - bounds->left;
+	cache->height = bounds->bottom - bounds->top;
+
+	cache->tileCols = (cache->width + (tileSize - 1)) / tileSize;
+	cache->tileRows = (cache->height + (tileSize - 1)) / tileSize;
+
+	cache->tileVersions = (UINT32*) calloc(cache->tileCols * cache->tileRows, sizeof(UINT32));
+
+	if (!cache->tileVersions)
+		goto fail;
+
+	if (!InitializeCriticalSectionAndSpinCount(&(cache->lock), 4000))
+	{
+		free(cache->tileVersions);
+		free(cache);
+		return NULL;
+	}
+
+	if (shadow_encode_cache_init_workers(cache) < 0)
+		goto fail;
+
+	return cache;
+
+fail:
+	WLog_ERR(TAG, "failed to create the encode cache workers");
+	shadow_encode_cache_free(cache);
+	return NULL;
+}
+
+void shadow_encode_cache_free(rdpShadowEncodeCache* cache)
+{
+	int index;
+	int tileIndex;
+	rdpShadowEncodeWorker* worker;
+	rdpShadowEncodeProfile* profile;
+
+	if (!cache)
+		return;
+
+	for (index = 0; index < cache->workerCount; index++)
+	{
+		worker = &(cache->workers[index]);
+
+		if (worker->work)
+			CloseThreadpoolWork(worker->work);
+
+		if (worker->bs)
+			Stream_Free(worker->bs, TRUE);
+
+		if (worker->nsc)
+			nsc_context_free(worker->nsc);
+	}
+
+	if (cache->ThreadPool)
+	{
+		CloseThreadpool(cache->ThreadPool);
+		DestroyThreadpoolEnvironment(&cache->ThreadPoolEnv);
+	}
+
+	for (index = 0; index < cache->profileCount; index++)
+	{
+		profile = &(cache->profiles[index]);
+
+		for (tileIndex = 0; tileIndex < (cache->tileCols * cache->tileRows); tileIndex++)
+			shadow_encode_tile_release(profile->tiles[tileIndex]);
+
+		free(profile->tiles);
+		DeleteCriticalSection(&(profile->lock));
+	}
+
+	DeleteCriticalSection(&(cache->lock));
+
+	free(cache->tileVersions);
+	free(cache);
+}
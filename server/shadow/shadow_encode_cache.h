@@ -0,0 +1,149 @@
+/**
+ * FreeRDP: A Remote Desktop Protocol Implementation
+ * Shadow Server Encode Cache
+ *
+ * Copyright 2026 agent <agent@local>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef FREERDP_SHADOW_SERVER_ENCODE_CACHE_H
+#define FREERDP_SHADOW_SERVER_ENCODE_CACHE_H
+
+#include <freerdp/server/shadow.h>
+#include <freerdp/codec/nsc.h>
+
+#include <winpr/crt.h>
+#include <winpr/pool.h>
+#include <winpr/synch.h>
+#include <winpr/stream.h>
+
+#define SHADOW_ENCODE_CACHE_TILE_SIZE		64
+#define SHADOW_ENCODE_CACHE_MAX_PROFILES	16
+#define SHADOW_ENCODE_CACHE_MAX_WORKERS		16
+
+/**
+ * One encoded 64x64 tile of the shared area, in client coordinates.
+ * RemoteFX tiles hold the Y, Cb and Cr bitstreams back to back, NSCodec
+ * tiles hold a complete NSCodec bitmap stream.
+ */
+
+struct rdp_shadow_encode_tile
+{
+	LONG refCount;
+	UINT32 version;
+
+	UINT16 x;
+	UINT16 y;
+	UINT16 width;
+	UINT16 height;
+	UINT16 xIdx;
+	UINT16 yIdx;
+
+	BYTE quantIdxY;
+	BYTE quantIdxCb;
+	BYTE quantIdxCr;
+	UINT16 YLen;
+	UINT16 CbLen;
+	UINT16 CrLen;
+
+	UINT32 length;
+	BYTE* data;
+};
+typedef struct rdp_shadow_encode_tile rdpShadowEncodeTile;
+
+/**
+ * Clients whose codec settings produce the same bitstream share a profile,
+ * the profile lock serializes encoding so that a tile is encoded once.
+ */
+
+struct rdp_shadow_encode_profile
+{
+	UINT32 codecId;
+	UINT32 key;
+	CRITICAL_SECTION lock;
+	rdpShadowEncodeTile** tiles;
+};
+typedef struct rdp_shadow_encode_profile rdpShadowEncodeProfile;
+
+/**
+ * NSCodec tiles are encoded in parallel, each worker owns a codec context
+ * and encodes one horizontal band of the missing tiles. RemoteFX contexts
+ * already encode their tiles on a thread pool.
+ */
+
+struct rdp_shadow_encode_worker
+{
+	rdpShadowEncodeCache* cache;
+	PTP_WORK work;
+
+	NSC_CONTEXT* nsc;
+	wStream* bs;
+
+	rdpShadowEncodeProfile* profile;
+	const int* indices;
+	const UINT32* versions;
+	int count;
+	BYTE* pSrcData;
+	int nSrcStep;
+	int status;
+};
+typedef struct rdp_shadow_encode_worker rdpShadowEncodeWorker;
+
+struct rdp_shadow_encode_cache
+{
+	rdpShadowServer* server;
+
+	RECTANGLE_16 bounds;
+	int width;
+	int height;
+
+	/**
+	 * Frame sequence number and, for every tile, the frame in which its
+	 * content last changed: a cached tile is valid while its version matches.
+	 */
+	int tileCols;
+	int tileRows;
+	UINT32 frameId;
+	UINT32* tileVersions;
+
+	int profileCount;
+	rdpShadowEncodeProfile profiles[SHADOW_ENCODE_CACHE_MAX_PROFILES];
+
+	int workerCount;
+	rdpShadowEncodeWorker workers[SHADOW_ENCODE_CACHE_MAX_WORKERS];
+	PTP_POOL ThreadPool;
+	TP_CALLBACK_ENVIRON ThreadPoolEnv;
+
+	CRITICAL_SECTION lock;
+};
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+void shadow_encode_cache_invalidate(rdpShadowEncodeCache* cache, REGION16* region);
+UINT32 shadow_encode_cache_get_frame(rdpShadowEncodeCache* cache);
+
+int shadow_encode_cache_get_tiles(rdpShadowEncodeCache* cache, rdpShadowEncoder* encoder, UINT32 codecId,
+		REGION16* region, BYTE* pSurfaceData, UINT32 frameId, rdpShadowEncodeTile*** ppTiles, int* pNumTiles);
+void shadow_encode_cache_release_tiles(rdpShadowEncodeTile** tiles, int numTiles);
+
+rdpShadowEncodeCache* shadow_encode_cache_new(rdpShadowServer* server, const RECTANGLE_16* bounds);
+void shadow_encode_cache_free(rdpShadowEncodeCache* cache);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* FREERDP_SHADOW_SERVER_ENCODE_CACHE_H */
@@ -20,45 +20,386 @@
 #include "config.h"
 #endif
 
+#include <winpr/sysinfo.h>
+
 #include "shadow.h"
 
 #include "shadow_encoder.h"
 
-int shadow_encoder_create_frame_id(rdpShadowEncoder* encoder)
+static const UINT32 shadow_encoder_rfx_quant[10] =
+{
+	6, 6, 6, 6, 7, 7, 8, 8, 8, 9
+};
+
+/* H.264 quantization parameter and quality (0-100) for each quality level */
+
+static const BYTE shadow_encoder_h264_qps[SHADOW_ENCODER_QUALITY_LEVELS] =
+{
+	22, 26, 30, 34
+};
+
+static const BYTE shadow_encoder_h264_qualities[SHADOW_ENCODER_QUALITY_LEVELS] =
+{
+	100, 85, 70, 55
+};
+
+static void shadow_encoder_apply_quality(rdpShadowEncoder* encoder)
 {
-	UINT32 frameId;
-	int inFlightFrames;
-	SURFACE_FRAME* frame;
+	int colorLossLevel;
+	rdpContext* context = (rdpContext*) encoder->client;
+	rdpSettings* settings = context->settings;
 
-	inFlightFrames = ListDictionary_Count(encoder->frameList);
+	if (encoder->rfx && (encoder->rfx->numQuant >= SHADOW_ENCODER_QUALITY_LEVELS))
+	{
+		encoder->rfx->quantIdxY = encoder->qualityLevel;
+		encoder->rfx->quantIdxCb = encoder->qualityLevel;
+		encoder->rfx->quantIdxCr = encoder->qualityLevel;
+	}
 
-	if (inFlightFrames > encoder->frameAck)
+	if (encoder->nsc)
 	{
-		encoder->fps = (100 / (inFlightFrames + 1) * encoder->maxFps) / 100;
+		colorLossLevel = settings->NSCodecColorLossLevel + encoder->qualityLevel;
+
+		if (colorLossLevel < 1)
+			colorLossLevel = 1;
+
+		if (colorLossLevel > 7)
+			colorLossLevel = 7;
+
+		encoder->nsc->ColorLossLevel = colorLossLevel;
 	}
+}
+
+static void shadow_encoder_adapt(rdpShadowEncoder* encoder)
+{
+	UINT32 now;
+	UINT64 bitRate;
+	int qualityLevel;
+	BOOL congested;
+	UINT32 window;
+	UINT32 bandwidthFps;
+	UINT32 inFlightFrames = 0;
+
+	now = GetTickCount();
+
+	if (encoder->frameList)
+		inFlightFrames = ListDictionary_Count(encoder->frameList);
+
+	/* keep just enough frames in flight to cover the base round-trip time */
+	window = 1 + ((encoder->minRtt * encoder->fps) / 1000);
+
+	if (window < 2)
+		window = 2;
+
+	if (window > 8)
+		window = 8;
+
+	encoder->maxInFlightFrames = window;
+
+	/* a round-trip time well above the base one means frames are queueing up */
+	congested = (inFlightFrames >= encoder->maxInFlightFrames) ||
+			(encoder->rtt > ((encoder->minRtt * 2) + 20));
+
+	if (congested)
+		encoder->fps = (encoder->fps * 3) / 4;
 	else
+		encoder->fps++;
+
+	if (encoder->bandwidth && encoder->avgFrameSize)
 	{
-		encoder->fps += 2;
+		/* leave 25% headroom so that the delivery rate estimate can grow */
+		bandwidthFps = (encoder->bandwidth + (encoder->bandwidth / 4)) / encoder->avgFrameSize;
 
-		if (encoder->fps > encoder->maxFps)
-			encoder->fps = encoder->maxFps;
+		if (encoder->fps > (int) bandwidthFps)
+			encoder->fps = (int) bandwidthFps;
 	}
 
+	if (encoder->fps > encoder->maxFps)
+		encoder->fps = encoder->maxFps;
+
 	if (encoder->fps < 1)
 		encoder->fps = 1;
 
-	frame = (SURFACE_FRAME*) malloc(sizeof(SURFACE_FRAME));
+	if (encoder->h264)
+	{
+		/* H.264 rate control follows the measured delivery rate */
+
+		if (encoder->bandwidth)
+		{
+			bitRate = encoder->bandwidth * 8;
+
+			if (congested)
+				bitRate = (bitRate * 3) / 4;
+			else
+				bitRate = bitRate + (bitRate / 4);
+
+			if (bitRate < SHADOW_ENCODER_MIN_BITRATE)
+				bitRate = SHADOW_ENCODER_MIN_BITRATE;
+
+			if (bitRate > SHADOW_ENCODER_MAX_BITRATE)
+				bitRate = SHADOW_ENCODER_MAX_BITRATE;
+
+			encoder->h264->BitRate = bitRate;
+		}
+
+		encoder->h264->FrameRate = (FLOAT) encoder->fps;
+	}
+
+	if ((now - encoder->qualityTime) < 1000)
+		return;
+
+	qualityLevel = encoder->qualityLevel;
+
+	if (congested && (encoder->fps < (encoder->maxFps / 2)))
+		qualityLevel++;
+	else if (!congested && (encoder->fps >= (encoder->maxFps / 2)))
+		qualityLevel--;
+
+	if (qualityLevel < 0)
+		qualityLevel = 0;
+
+	if (qualityLevel > (SHADOW_ENCODER_QUALITY_LEVELS - 1))
+		qualityLevel = SHADOW_ENCODER_QUALITY_LEVELS - 1;
+
+	if (qualityLevel != encoder->qualityLevel)
+	{
+		encoder->qualityLevel = qualityLevel;
+		encoder->qualityTime = now;
+		shadow_encoder_apply_quality(encoder);
+	}
+}
+
+int shadow_encoder_create_frame_id(rdpShadowEncoder* encoder)
+{
+	SHADOW_ENCODER_FRAME* frame;
+
+	frame = (SHADOW_ENCODER_FRAME*) calloc(1, sizeof(SHADOW_ENCODER_FRAME));
 
 	if (!frame)
 		return -1;
 
-	frameId = frame->frameId = ++encoder->frameId;
+	frame->frameId = ++encoder->frameId;
+	frame->sendTime = GetTickCount();
+
 	if (!ListDictionary_Add(encoder->frameList, (void*) (size_t) frame->frameId, frame))
+	{
+		free(frame);
 		return -1;
+	}
 
 	return (int) frame->frameId;
 }
 
+/**
+ * Statistics: the counters live in the client and are updated under the
+ * client lock, which shadow_client_get_stats takes to copy them.
+ */
+
+static void shadow_encoder_update_stats(rdpShadowEncoder* encoder, rdpShadowClientStats* stats)
+{
+	stats->inFlightFrames = encoder->frameList ? (UINT32) ListDictionary_Count(encoder->frameList) : 0;
+	stats->rtt = encoder->rtt;
+	stats->bandwidth = encoder->bandwidth;
+	stats->fps = (UINT32) encoder->fps;
+	stats->qualityLevel = (UINT32) encoder->qualityLevel;
+}
+
+void shadow_encoder_count_frame(rdpShadowEncoder* encoder, int codec, UINT32 size)
+{
+	rdpShadowClient* client = encoder->client;
+	rdpShadowClientStats* stats = &(client->stats);
+
+	EnterCriticalSection(&(client->lock));
+
+	stats->frames++;
+	stats->bytes += size;
+	stats->codecFrames[codec]++;
+	stats->codecBytes[codec] += size;
+	shadow_encoder_update_stats(encoder, stats);
+
+	LeaveCriticalSection(&(client->lock));
+}
+
+void shadow_encoder_frame_sent(rdpShadowEncoder* encoder, UINT32 frameId, UINT32 size, int codec)
+{
+	SHADOW_ENCODER_FRAME* frame = NULL;
+
+	if (frameId && encoder->frameList)
+		frame = (SHADOW_ENCODER_FRAME*) ListDictionary_GetItemValue(encoder->frameList, (void*) (size_t) frameId);
+
+	if (frame)
+		frame->size = size;
+
+	if (encoder->avgFrameSize)
+		encoder->avgFrameSize = ((encoder->avgFrameSize * 3) + size) / 4;
+	else
+		encoder->avgFrameSize = size;
+
+	if (!encoder->avgFrameSize)
+		encoder->avgFrameSize = 1;
+
+	encoder->lastFrameTime = GetTickCount();
+
+	shadow_encoder_count_frame(encoder, codec, size);
+}
+
+void shadow_encoder_frame_acknowledge(rdpShadowEncoder* encoder, UINT32 frameId)
+{
+	UINT32 now;
+	UINT32 sample;
+	SHADOW_ENCODER_FRAME* frame;
+
+	if (!encoder->frameList)
+		return;
+
+	frame = (SHADOW_ENCODER_FRAME*) ListDictionary_Remove(encoder->frameList, (void*) (size_t) frameId);
+
+	if (!frame)
+		return;
+
+	now = GetTickCount();
+	sample = now - frame->sendTime;
+
+	/**
+	 * The delivery rate is only sampled while the client had more frames to
+	 * acknowledge, otherwise idle time would be counted as a slow link.
+	 */
+
+	if (encoder->ackTime)
+	{
+		encoder->ackBytes += frame->size;
+		encoder->ackElapsed += now - encoder->ackTime;
+
+		if (encoder->ackElapsed >= 500)
+		{
+			UINT32 bandwidth;
+
+			bandwidth = (UINT32) ((((UINT64) encoder->ackBytes) * 1000) / encoder->ackElapsed);
+
+			if (bandwidth > encoder->bandwidth)
+				encoder->bandwidth = bandwidth;
+			else
+				encoder->bandwidth = ((encoder->bandwidth * 3) / 4) + (bandwidth / 4);
+
+			encoder->ackBytes = 0;
+			encoder->ackElapsed = 0;
+		}
+	}
+
+	encoder->ackTime = (ListDictionary_Count(encoder->frameList) > 0) ? now : 0;
+
+	free(frame);
+
+	shadow_encoder_update_rtt(encoder, sample);
+
+	EnterCriticalSection(&(encoder->client->lock));
+
+	encoder->client->stats.acks++;
+	encoder->client->stats.ackLatency += sample;
+
+	if (sample > encoder->client->stats.maxAckLatency)
+		encoder->client->stats.maxAckLatency = sample;
+
+	shadow_encoder_update_stats(encoder, &(encoder->client->stats));
+
+	LeaveCriticalSection(&(encoder->client->lock));
+}
+
+void shadow_encoder_update_rtt(rdpShadowEncoder* encoder, UINT32 rtt)
+{
+	if (rtt < 1)
+		rtt = 1; /* GetTickCount granularity */
+
+	if (!encoder->minRtt || (rtt < encoder->minRtt))
+		encoder->minRtt = rtt;
+
+	if (encoder->rtt)
+		encoder->rtt = ((encoder->rtt * 7) + rtt) / 8;
+	else
+		encoder->rtt = rtt;
+
+	shadow_encoder_adapt(encoder);
+}
+
+/**
+ * Returns the quantization parameter and the quality announced in the
+ * H.264 metablock, which follow the bandwidth driven quality level like
+ * the target bit rate of the H.264 encoder does.
+ */
+
+void shadow_encoder_h264_quality(rdpShadowEncoder* encoder, BYTE* qpVal, BYTE* qualityVal)
+{
+	int qualityLevel = encoder->qualityLevel;
+
+	if (qualityLevel < 0)
+		qualityLevel = 0;
+
+	if (qualityLevel > (SHADOW_ENCODER_QUALITY_LEVELS - 1))
+		qualityLevel = SHADOW_ENCODER_QUALITY_LEVELS - 1;
+
+	*qpVal = shadow_encoder_h264_qps[qualityLevel];
+	*qualityVal = shadow_encoder_h264_qualities[qualityLevel];
+}
+
+DWORD shadow_encoder_frame_delay(rdpShadowEncoder* encoder)
+{
+	int index;
+	int count;
+	UINT32 now;
+	UINT32 age;
+	UINT32 elapsed;
+	UINT32 interval;
+	UINT32 expiry = SHADOW_ENCODER_FRAME_TIMEOUT;
+	ULONG_PTR* keys = NULL;
+	SHADOW_ENCODER_FRAME* frame;
+
+	now = GetTickCount();
+
+	if (encoder->frameAck && encoder->frameList)
+	{
+		count = ListDictionary_GetKeys(encoder->frameList, &keys);
+
+		for (index = 0; index < count; index++)
+		{
+			frame = (SHADOW_ENCODER_FRAME*) ListDictionary_GetItemValue(encoder->frameList, (void*) keys[index]);
+
+			if (!frame)
+				continue;
+
+			age = now - frame->sendTime;
+
+			if (age >= SHADOW_ENCODER_FRAME_TIMEOUT)
+			{
+				/* the client stopped acknowledging frames, do not stall forever */
+				ListDictionary_Remove(encoder->frameList, (void*) keys[index]);
+				free(frame);
+
+				EnterCriticalSection(&(encoder->client->lock));
+				encoder->client->stats.ackTimeouts++;
+				shadow_encoder_update_stats(encoder, &(encoder->client->stats));
+				LeaveCriticalSection(&(encoder->client->lock));
+				continue;
+			}
+
+			if ((SHADOW_ENCODER_FRAME_TIMEOUT - age) < expiry)
+				expiry = SHADOW_ENCODER_FRAME_TIMEOUT - age;
+		}
+
+		free(keys);
+
+		if (ListDictionary_Count(encoder->frameList) >= (int) encoder->maxInFlightFrames)
+			return expiry;
+	}
+
+	interval = 1000 / encoder->fps;
+	elapsed = now - encoder->lastFrameTime;
+
+	if (elapsed >= interval)
+		return 0;
+
+	return interval - elapsed;
+}
+
 int shadow_encoder_init_grid(rdpShadowEncoder* encoder)
 {
 	int i, j, k;
@@ -113,33 +454,83 @@ int shadow_encoder_uninit_grid(rdpShadowEncoder* encoder)
 	return 0;
 }
 
-int shadow_encoder_init_rfx(rdpShadowEncoder* encoder)
+int shadow_encoder_init_frame_list(rdpShadowEncoder* encoder)
 {
 	rdpContext* context = (rdpContext*) encoder->client;
 	rdpSettings* settings = context->settings;
 
+	if (encoder->frameList)
+		return 1;
+
+	encoder->fps = 16;
+	encoder->maxFps = 32;
+	encoder->frameId = 0;
+	encoder->maxInFlightFrames = 2;
+	encoder->lastFrameTime = 0;
+	encoder->ackTime = 0;
+	encoder->ackBytes = 0;
+	encoder->ackElapsed = 0;
+
+	encoder->frameList = ListDictionary_New(TRUE);
+
+	if (!encoder->frameList)
+		return -1;
+
+	encoder->frameList->objectValue.fnObjectFree = free;
+	encoder->frameAck = settings->SurfaceFrameMarkerEnabled;
+
+	return 1;
+}
+
+int shadow_encoder_init_rfx(rdpShadowEncoder* encoder)
+{
+	int i, j;
+	UINT32* quants;
+
 	if (!encoder->rfx)
 		encoder->rfx = rfx_context_new(TRUE);
 
 	if (!encoder->rfx)
 		return -1;
 
+	/**
+	 * One quantization table per quality level, the first one being the
+	 * default table used by rfx_encode_messages. Each level coarsens all
+	 * subbands by one more step.
+	 */
+
+	if (encoder->rfx->numQuant < SHADOW_ENCODER_QUALITY_LEVELS)
+	{
+		quants = (UINT32*) realloc(encoder->rfx->quants, SHADOW_ENCODER_QUALITY_LEVELS * 10 * sizeof(UINT32));
+
+		if (!quants)
+			return -1;
+
+		for (i = 0; i < SHADOW_ENCODER_QUALITY_LEVELS; i++)
+		{
+			for (j = 0; j < 10; j++)
+			{
+				quants[(i * 10) + j] = shadow_encoder_rfx_quant[j] + i;
+
+				if (quants[(i * 10) + j] > 15)
+					quants[(i * 10) + j] = 15;
+			}
+		}
+
+		encoder->rfx->quants = quants;
+		encoder->rfx->numQuant = SHADOW_ENCODER_QUALITY_LEVELS;
+	}
+
 	encoder->rfx->mode = RLGR3;
 	encoder->rfx->width = encoder->width;
 	encoder->rfx->height = encoder->height;
 
 	rfx_context_set_pixel_format(encoder->rfx, RDP_PIXEL_FORMAT_B8G8R8A8);
 
-	if (!encoder->frameList)
-	{
-		encoder->fps = 16;
-		encoder->maxFps = 32;
-		encoder->frameId = 0;
-		encoder->frameList = ListDictionary_New(TRUE);
-		if (!encoder->frameList)
-			return -1;
-		encoder->frameAck = settings->SurfaceFrameMarkerEnabled;
-	}
+	if (shadow_encoder_init_frame_list(encoder) < 0)
+		return -1;
+
+	shadow_encoder_apply_quality(encoder);
 
 	encoder->codecs |= FREERDP_CODEC_REMOTEFX;
 
@@ -159,26 +550,51 @@ int shadow_encoder_init_nsc(rdpShadowEncoder* encoder)
 
 	nsc_context_set_pixel_format(encoder->nsc, RDP_PIXEL_FORMAT_B8G8R8A8);
 
-	if (!encoder->frameList)
-	{
-		encoder->fps = 16;
-		encoder->maxFps = 32;
-		encoder->frameId = 0;
-		encoder->frameList = ListDictionary_New(TRUE);
-		if (!encoder->frameList)
-			return -1;
-		encoder->frameAck = settings->SurfaceFrameMarkerEnabled;
-	}
+	if (shadow_encoder_init_frame_list(encoder) < 0)
+		return -1;
 
 	encoder->nsc->ColorLossLevel = settings->NSCodecColorLossLevel;
 	encoder->nsc->ChromaSubsamplingLevel = settings->NSCodecAllowSubsampling ? 1 : 0;
 	encoder->nsc->DynamicColorFidelity = settings->NSCodecAllowDynamicColorFidelity;
 
+	shadow_encoder_apply_quality(encoder);
+
 	encoder->codecs |= FREERDP_CODEC_NSCODEC;
 
 	return 1;
 }
 
+int shadow_encoder_init_h264(rdpShadowEncoder* encoder)
+{
+	SYSTEM_INFO sysinfo;
+
+	if (!encoder->h264)
+		encoder->h264 = h264_context_new(TRUE);
+
+	if (!encoder->h264)
+		return -1;
+
+	/* one encoding thread (and slice) per core, up to four */
+	GetNativeSystemInfo(&sysinfo);
+
+	encoder->h264->NumberOfThreads = sysinfo.dwNumberOfProcessors;
+
+	if (encoder->h264->NumberOfThreads < 1)
+		encoder->h264->NumberOfThreads = 1;
+
+	if (encoder->h264->NumberOfThreads > 4)
+		encoder->h264->NumberOfThreads = 4;
+
+	if (shadow_encoder_init_frame_list(encoder) < 0)
+		return -1;
+
+	encoder->h264->FrameRate = (FLOAT) encoder->fps;
+
+	encoder->codecs |= FREERDP_CODEC_H264;
+
+	return 1;
+}
+
 int shadow_encoder_init_planar(rdpShadowEncoder* encoder)
 {
 	DWORD planarFlags = 0;
@@ -217,6 +633,19 @@ int shadow_encoder_init_interleaved(rdpShadowEncoder* encoder)
 	return 1;
 }
 
+int shadow_encoder_init_clear(rdpShadowEncoder* encoder)
+{
+	if (!encoder->clear)
+		encoder->clear = clear_context_new(TRUE);
+
+	if (!encoder->clear)
+		return -1;
+
+	encoder->codecs |= FREERDP_CODEC_CLEARCODEC;
+
+	return 1;
+}
+
 int shadow_encoder_init(rdpShadowEncoder* encoder)
 {
 	encoder->maxTileWidth = 64;
@@ -271,6 +700,25 @@ int shadow_encoder_uninit_nsc(rdpShadowEncoder* encoder)
 	return 1;
 }
 
+int shadow_encoder_uninit_h264(rdpShadowEncoder* encoder)
+{
+	if (encoder->h264)
+	{
+		h264_context_free(encoder->h264);
+		encoder->h264 = NULL;
+	}
+
+	if (encoder->frameList)
+	{
+		ListDictionary_Free(encoder->frameList);
+		encoder->frameList = NULL;
+	}
+
+	encoder->codecs &= ~FREERDP_CODEC_H264;
+
+	return 1;
+}
+
 int shadow_encoder_uninit_planar(rdpShadowEncoder* encoder)
 {
 	if (encoder->planar)
@@ -297,6 +745,19 @@ int shadow_encoder_uninit_interleaved(rdpShadowEncoder* encoder)
 	return 1;
 }
 
+int shadow_encoder_uninit_clear(rdpShadowEncoder* encoder)
+{
+	if (encoder->clear)
+	{
+		clear_context_free(encoder->clear);
+		encoder->clear = NULL;
+	}
+
+	encoder->codecs &= ~FREERDP_CODEC_CLEARCODEC;
+
+	return 1;
+}
+
 int shadow_encoder_uninit(rdpShadowEncoder* encoder)
 {
 	shadow_encoder_uninit_grid(encoder);
@@ -317,6 +778,11 @@ int shadow_encoder_uninit(rdpShadowEncoder* encoder)
 		shadow_encoder_uninit_nsc(encoder);
 	}
 
+	if (encoder->codecs & FREERDP_CODEC_H264)
+	{
+		shadow_encoder_uninit_h264(encoder);
+	}
+
 	if (encoder->codecs & FREERDP_CODEC_PLANAR)
 	{
 		shadow_encoder_uninit_planar(encoder);
@@ -327,6 +793,17 @@ int shadow_encoder_uninit(rdpShadowEncoder* encoder)
 		shadow_encoder_uninit_interleaved(encoder);
 	}
 
+	if (encoder->codecs & FREERDP_CODEC_CLEARCODEC)
+	{
+		shadow_encoder_uninit_clear(encoder);
+	}
+
+	if (encoder->classifier)
+	{
+		shadow_classifier_free(encoder->classifier);
+		encoder->classifier = NULL;
+	}
+
 	return 1;
 }
 
@@ -373,6 +850,14 @@ int shadow_encoder_prepare(rdpShadowEncoder* encoder, UINT32 codecs)
 			return -1;
 	}
 
+	if ((codecs & FREERDP_CODEC_H264) && !(encoder->codecs & FREERDP_CODEC_H264))
+	{
+		status = shadow_encoder_init_h264(encoder);
+
+		if (status < 0)
+			return -1;
+	}
+
 	if ((codecs & FREERDP_CODEC_PLANAR) && !(encoder->codecs & FREERDP_CODEC_PLANAR))
 	{
 		status = shadow_encoder_init_planar(encoder);
@@ -389,6 +874,14 @@ int shadow_encoder_prepare(rdpShadowEncoder* encoder, UINT32 codecs)
 			return -1;
 	}
 
+	if ((codecs & FREERDP_CODEC_CLEARCODEC) && !(encoder->codecs & FREERDP_CODEC_CLEARCODEC))
+	{
+		status = shadow_encoder_init_clear(encoder);
+
+		if (status < 0)
+			return -1;
+	}
+
 	return 1;
 }
 
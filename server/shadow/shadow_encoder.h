@@ -27,6 +27,20 @@
 
 #include <freerdp/server/shadow.h>
 
+#define SHADOW_ENCODER_QUALITY_LEVELS		4
+#define SHADOW_ENCODER_FRAME_TIMEOUT		5000
+
+#define SHADOW_ENCODER_MIN_BITRATE		256000
+#define SHADOW_ENCODER_MAX_BITRATE		20000000
+
+struct rdp_shadow_encoder_frame
+{
+	UINT32 frameId;
+	UINT32 sendTime;
+	UINT32 size;
+};
+typedef struct rdp_shadow_encoder_frame SHADOW_ENCODER_FRAME;
+
 struct rdp_shadow_encoder
 {
 	rdpShadowClient* client;
@@ -47,14 +61,35 @@ struct rdp_shadow_encoder
 
 	RFX_CONTEXT* rfx;
 	NSC_CONTEXT* nsc;
+	H264_CONTEXT* h264;
 	BITMAP_PLANAR_CONTEXT* planar;
 	BITMAP_INTERLEAVED_CONTEXT* interleaved;
+	CLEAR_CONTEXT* clear;
+	rdpShadowClassifier* classifier;
 
 	int fps;
 	int maxFps;
 	BOOL frameAck;
 	UINT32 frameId;
 	wListDictionary* frameList;
+
+	/**
+	 * Flow control: at most maxInFlightFrames frames may be unacknowledged,
+	 * and frames are paced at least 1000 / fps ms apart. The round-trip time
+	 * and bandwidth estimates are fed by frame acknowledgements and by
+	 * network autodetect, and drive fps and qualityLevel.
+	 */
+	UINT32 maxInFlightFrames;
+	UINT32 lastFrameTime;
+	UINT32 rtt;
+	UINT32 minRtt;
+	UINT32 bandwidth;
+	UINT32 avgFrameSize;
+	UINT32 ackTime;
+	UINT32 ackBytes;
+	UINT32 ackElapsed;
+	UINT32 qualityTime;
+	int qualityLevel;
 };
 
 #ifdef __cplusplus
@@ -63,7 +98,14 @@ extern "C" {
 
 int shadow_encoder_reset(rdpShadowEncoder* encoder);
 int shadow_encoder_prepare(rdpShadowEncoder* encoder, UINT32 codecs);
+int shadow_encoder_init_frame_list(rdpShadowEncoder* encoder);
 int shadow_encoder_create_frame_id(rdpShadowEncoder* encoder);
+void shadow_encoder_count_frame(rdpShadowEncoder* encoder, int codec, UINT32 size);
+void shadow_encoder_frame_sent(rdpShadowEncoder* encoder, UINT32 frameId, UINT32 size, int codec);
+void shadow_encoder_frame_acknowledge(rdpShadowEncoder* encoder, UINT32 frameId);
+void shadow_encoder_update_rtt(rdpShadowEncoder* encoder, UINT32 rtt);
+DWORD shadow_encoder_frame_delay(rdpShadowEncoder* encoder);
+void shadow_encoder_h264_quality(rdpShadowEncoder* encoder, BYTE* qpVal, BYTE* qualityVal);
 
 rdpShadowEncoder* shadow_encoder_new(rdpShadowClient* client);
 void shadow_encoder_free(rdpShadowEncoder* encoder);
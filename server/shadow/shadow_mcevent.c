@@ -20,7 +20,7 @@
 #include "config.h"
 #endif
 
-#include <assert.h>
+#include <winpr/interlocked.h>
 #include <freerdp/log.h>
 #include "shadow.h"
 
@@ -29,7 +29,8 @@
 struct rdp_shadow_multiclient_subscriber
 {
 	rdpShadowMultiClientEvent* ref;
-	BOOL pleaseHandle; /* Indicate if server expects my handling in this turn */
+	HANDLE event; /* Set whenever a new generation is published */
+	LONG generation; /* Last generation consumed by this subscriber */
 };
 
 rdpShadowMultiClientEvent* shadow_multiclient_new()
@@ -38,39 +39,13 @@ rdpShadowMultiClientEvent* shadow_multiclient_new()
 	if (!event)
 		goto out_error;
 
-	event->event = CreateEvent(NULL, TRUE, FALSE, NULL);
-	if (!event->event)
-		goto out_free;
-
-	event->barrierEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
-	if (!event->barrierEvent)
-		goto out_free_event;
-
-	event->doneEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
-	if (!event->doneEvent)
-		goto out_free_barrierEvent;
-
 	event->subscribers = ArrayList_New(TRUE);
 	if (!event->subscribers)
-		goto out_free_doneEvent;
-
-	if (!InitializeCriticalSectionAndSpinCount(&(event->lock), 4000))
-		goto out_free_subscribers;
+		goto out_free;
 
-	event->consuming = 0;
-	event->waiting = 0;
-	event->eventid = 0;
-	SetEvent(event->doneEvent);
+	event->generation = 0;
 	return event;
 
-out_free_subscribers:
-	ArrayList_Free(event->subscribers);
-out_free_doneEvent:
-	CloseHandle(event->doneEvent);
-out_free_barrierEvent:
-	CloseHandle(event->barrierEvent);
-out_free_event:
-	CloseHandle(event->event);
 out_free:
 	free(event);
 out_error:
@@ -82,161 +57,90 @@ void shadow_multiclient_free(rdpShadowMultiClientEvent* event)
 	if (!event)
 		return;
 
-	DeleteCriticalSection(&(event->lock));
-
 	ArrayList_Free(event->subscribers);
-	CloseHandle(event->doneEvent);
-	CloseHandle(event->barrierEvent);
-	CloseHandle(event->event);
 	free(event);
 
 	return;
 }
 
-static void _Publish(rdpShadowMultiClientEvent* event)
+static LONG _NextGeneration(LONG generation)
 {
-	wArrayList* subscribers;
-	struct rdp_shadow_multiclient_subscriber* subscriber = NULL;
-	int i;
+	generation = (LONG) (((UINT32) generation) + 1);
 
-	subscribers = event->subscribers;
+	/* 0 marks a slot being written */
+	if (generation == 0)
+		generation = 1;
 
-	assert(event->consuming == 0);
-
-	/* Count subscribing clients */
-	ArrayList_Lock(subscribers);
-	for (i = 0; i < ArrayList_Count(subscribers); i++)
-	{
-		subscriber = (struct rdp_shadow_multiclient_subscriber *)ArrayList_GetItem(subscribers, i);
-		/* Set flag to subscriber: I acknowledge and please handle */
-		subscriber->pleaseHandle = TRUE;
-		event->consuming++;
-	}
-	ArrayList_Unlock(subscribers);
-
-	if (event->consuming > 0)
-	{
-		event->eventid = (event->eventid & 0xff) + 1;
-		WLog_VRB(TAG, "Server published event %d. %d clients.\n", event->eventid, event->consuming);
-		ResetEvent(event->doneEvent);
-		SetEvent(event->event);
-	}
-
-	return;
+	return generation;
 }
 
-static void _WaitForSubscribers(rdpShadowMultiClientEvent* event)
+/*
+ * The frame slot is invalidated before and stamped with its generation after
+ * the damage is written: a subscriber copying a slot detects a concurrent
+ * rewrite by checking the stamp before and after the copy.
+ */
+void shadow_multiclient_publish(rdpShadowMultiClientEvent* event, REGION16* damage)
 {
-	if (event->consuming > 0)
-	{
-		/* Wait for clients done */
-		WLog_VRB(TAG, "Server wait event %d. %d clients.\n", event->eventid, event->consuming);
-		LeaveCriticalSection(&(event->lock));
-		WaitForSingleObject(event->doneEvent, INFINITE);
-		EnterCriticalSection(&(event->lock));
-		WLog_VRB(TAG, "Server quit event %d. %d clients.\n", event->eventid, event->consuming);
-	}
-
-	/* Last subscriber should have already reset the event */
-	assert(WaitForSingleObject(event->event, 0) != WAIT_OBJECT_0);
-
-	return;
+	shadow_multiclient_publish_move(event, damage, NULL);
 }
 
-void shadow_multiclient_publish(rdpShadowMultiClientEvent* event)
+/*
+ * Same as shadow_multiclient_publish, move (if not NULL) took place before
+ * the damage. The damage still covers the move destination, for the clients
+ * that repaint it instead of applying the move.
+ */
+void shadow_multiclient_publish_move(rdpShadowMultiClientEvent* event, REGION16* damage, const rdpShadowMove* move)
 {
-	if (!event)
-		return;
-
-	EnterCriticalSection(&(event->lock));
-	_Publish(event);
-	LeaveCriticalSection(&(event->lock));
+	int i;
+	int numRects = 0;
+	LONG generation;
+	const RECTANGLE_16* rects;
+	rdpShadowMultiClientFrame* frame;
+	struct rdp_shadow_multiclient_subscriber* subscriber;
 
-	return;
-}
-void shadow_multiclient_wait(rdpShadowMultiClientEvent* event)
-{
 	if (!event)
 		return;
 
-	EnterCriticalSection(&(event->lock));
-	_WaitForSubscribers(event);
-	LeaveCriticalSection(&(event->lock));
+	rects = region16_rects(damage, &numRects);
 
-	return;
-}
-void shadow_multiclient_publish_and_wait(rdpShadowMultiClientEvent* event)
-{
-	if (!event)
+	if ((numRects < 1) && !move)
 		return;
 
-	EnterCriticalSection(&(event->lock));
-	_Publish(event);
-	_WaitForSubscribers(event);
-	LeaveCriticalSection(&(event->lock));
+	generation = _NextGeneration(event->generation);
+	frame = &(event->frames[((UINT32) generation) % SHADOW_MULTICLIENT_FRAMES]);
 
-	return;
-}
-
-static BOOL _Consume(struct rdp_shadow_multiclient_subscriber* subscriber, BOOL wait)
-{
-	rdpShadowMultiClientEvent* event = subscriber->ref;
-	BOOL ret = FALSE;
+	InterlockedExchange(&(frame->generation), 0);
 
-	if (WaitForSingleObject(event->event, 0) == WAIT_OBJECT_0
-			&& subscriber->pleaseHandle)
+	if (numRects > SHADOW_MULTICLIENT_MAX_RECTS)
 	{
-		/* Consume my share. Server is waiting for us */
-		event->consuming--;
-		ret = TRUE;
+		CopyMemory(&(frame->rects[0]), region16_extents(damage), sizeof(RECTANGLE_16));
+		frame->numRects = 1;
+	}
+	else
+	{
+		CopyMemory(frame->rects, rects, numRects * sizeof(RECTANGLE_16));
+		frame->numRects = numRects;
 	}
 
-	assert(event->consuming >= 0);
+	frame->hasMove = move ? TRUE : FALSE;
 
-	if (event->consuming == 0)
-	{
-		/* Last client reset event before notify clients to continue */
-		ResetEvent(event->event);
+	if (move)
+		CopyMemory(&(frame->move), move, sizeof(rdpShadowMove));
 
-		if (event->waiting > 0)
-		{
-			/* Notify other clients to continue */
-			SetEvent(event->barrierEvent);
-		}
-		else
-		{
-			/* Only one client. Notify server directly */
-			SetEvent(event->doneEvent);
-		}
-	}
-	else /* (event->consuming > 0) */
+	InterlockedExchange(&(frame->generation), generation);
+	InterlockedExchange(&(event->generation), generation);
+
+	WLog_VRB(TAG, "Server published generation %d.\n", generation);
+
+	ArrayList_Lock(event->subscribers);
+	for (i = 0; i < ArrayList_Count(event->subscribers); i++)
 	{
-		if (wait) 
-		{
-			/* 
-			 * This client need to wait. That means the client will
-			 * continue waiting for other clients to finish.
-			 * The last client should reset barrierEvent.
-			 */
-			event->waiting++;
-			LeaveCriticalSection(&(event->lock));
-			WaitForSingleObject(event->barrierEvent, INFINITE);
-			EnterCriticalSection(&(event->lock));
-			event->waiting--;
-			if (event->waiting == 0)
-			{
-				/*
-				 * This is last client waiting for barrierEvent.
-				 * We can now discard barrierEvent and notify 
-				 * server to continue.
-				 */
-				ResetEvent(event->barrierEvent);
-				SetEvent(event->doneEvent);
-			}
-		}
+		subscriber = (struct rdp_shadow_multiclient_subscriber *)ArrayList_GetItem(event->subscribers, i);
+		SetEvent(subscriber->event);
 	}
+	ArrayList_Unlock(event->subscribers);
 
-	return ret;
+	return;
 }
 
 void* shadow_multiclient_get_subscriber(rdpShadowMultiClientEvent* event)
@@ -246,39 +150,33 @@ void* shadow_multiclient_get_subscriber(rdpShadowMultiClientEvent* event)
 	if (!event)
 		return NULL;
 
-	EnterCriticalSection(&(event->lock));
-
 	subscriber = (struct rdp_shadow_multiclient_subscriber*) calloc(1, sizeof(struct rdp_shadow_multiclient_subscriber));
 	if (!subscriber)
 		goto out_error;
 
 	subscriber->ref = event;
-	subscriber->pleaseHandle = FALSE;
-
-	if (ArrayList_Add(event->subscribers, subscriber) < 0)
+	subscriber->event = CreateEvent(NULL, TRUE, FALSE, NULL);
+	if (!subscriber->event)
 		goto out_free;
 
-	WLog_VRB(TAG, "Get subscriber %p. Wait event %d. %d clients.\n", (void *)subscriber, event->eventid, event->consuming);
-	(void)_Consume(subscriber, TRUE);
-	WLog_VRB(TAG, "Get subscriber %p. Quit event %d. %d clients.\n", (void *)subscriber, event->eventid, event->consuming);
+	/* New subscribers start at the latest generation */
+	subscriber->generation = InterlockedCompareExchange(&(event->generation), 0, 0);
+
+	if (ArrayList_Add(event->subscribers, subscriber) < 0)
+		goto out_free_event;
 
-	LeaveCriticalSection(&(event->lock));
+	WLog_VRB(TAG, "Get subscriber %p at generation %d.\n", (void *)subscriber, subscriber->generation);
 
 	return subscriber;
 
+out_free_event:
+	CloseHandle(subscriber->event);
 out_free:
 	free(subscriber);
 out_error:
-	LeaveCriticalSection(&(event->lock));
 	return NULL;
 }
 
-/*
- * Consume my share and release my register
- * If we have update event and pleaseHandle flag
- * We need to consume. Anyway we need to clear
- * pleaseHandle flag
- */
 void shadow_multiclient_release_subscriber(void* subscriber)
 {
 	struct rdp_shadow_multiclient_subscriber* s;
@@ -290,42 +188,150 @@ void shadow_multiclient_release_subscriber(void* subscriber)
 	s = (struct rdp_shadow_multiclient_subscriber*)subscriber;
 	event = s->ref;
 
-	EnterCriticalSection(&(event->lock));
-
-	WLog_VRB(TAG, "Release Subscriber %p. Drop event %d. %d clients.\n", subscriber, event->eventid, event->consuming);
-	(void)_Consume(s, FALSE);
-	WLog_VRB(TAG, "Release Subscriber %p. Quit event %d. %d clients.\n", subscriber, event->eventid, event->consuming);
+	WLog_VRB(TAG, "Release subscriber %p at generation %d.\n", subscriber, s->generation);
 
 	ArrayList_Remove(event->subscribers, subscriber);
 
-	LeaveCriticalSection(&(event->lock));
-
+	CloseHandle(s->event);
 	free(subscriber);
 
 	return;
 }
 
-BOOL shadow_multiclient_consume(void* subscriber)
+static BOOL _MoveInBounds(const rdpShadowMove* move, const RECTANGLE_16* bounds)
+{
+	/* both the destination and the source lie in the bounds */
+	return (move->dst.left - MAX(move->dx, 0) >= bounds->left) &&
+			(move->dst.top - MAX(move->dy, 0) >= bounds->top) &&
+			(move->dst.right - MIN(move->dx, 0) <= bounds->right) &&
+			(move->dst.bottom - MIN(move->dy, 0) <= bounds->bottom) &&
+			(move->dst.left < move->dst.right) && (move->dst.top < move->dst.bottom);
+}
+
+static BOOL shadow_multiclient_consume_move(REGION16* damage, const RECTANGLE_16* bounds,
+		const rdpShadowMove* move, rdpShadowMove* moves, int* numMoves, int maxMoves)
+{
+	if (!numMoves || (*numMoves >= maxMoves) || !_MoveInBounds(move, bounds))
+		return FALSE;
+
+	shadow_capture_apply_move(damage, move);
+	CopyMemory(&moves[(*numMoves)++], move, sizeof(rdpShadowMove));
+
+	return TRUE;
+}
+
+/*
+ * Adds the damage of every generation published since the last call to
+ * the damage region. If the subscriber fell behind by more than the ring
+ * size, or a slot was rewritten while being copied, the intermediate frames
+ * are skipped and bounds (the whole view) is added instead.
+ * Block moves are appended to moves, up to maxMoves, and the damage is moved
+ * along with them; the frame damage then leaves out the move destination.
+ * A move that does not fit or leaves the bounds is simply repainted. Moves
+ * pending in the array are dropped when the whole view is refreshed.
+ * Returns whether or not a new generation was consumed.
+ */
+BOOL shadow_multiclient_consume(void* subscriber, REGION16* damage, const RECTANGLE_16* bounds,
+		rdpShadowMove* moves, int* numMoves, int maxMoves)
 {
 	struct rdp_shadow_multiclient_subscriber* s;
 	rdpShadowMultiClientEvent* event;
-	BOOL ret = FALSE;
+	rdpShadowMultiClientFrame* frame;
+	RECTANGLE_16 rects[SHADOW_MULTICLIENT_MAX_RECTS];
+	rdpShadowMove move;
+	BOOL hasMove;
+	REGION16 region;
+	int numRegionRects;
+	const RECTANGLE_16* regionRects;
+	LONG generation;
+	LONG current;
+	UINT32 numRects;
+	UINT32 pending;
+	UINT32 index;
+	BOOL skipped = FALSE;
 
 	if (!subscriber)
-		return ret;
+		return FALSE;
 
 	s = (struct rdp_shadow_multiclient_subscriber*)subscriber;
 	event = s->ref;
 
-	EnterCriticalSection(&(event->lock));
+	/* Reset first: a generation published from now on signals the event again */
+	ResetEvent(s->event);
+
+	current = InterlockedCompareExchange(&(event->generation), 0, 0);
+	pending = ((UINT32) current) - ((UINT32) s->generation);
+
+	if (pending == 0)
+		return FALSE;
+
+	if (pending > SHADOW_MULTICLIENT_FRAMES)
+		skipped = TRUE;
 
-	WLog_VRB(TAG, "Subscriber %p wait event %d. %d clients.\n", subscriber, event->eventid, event->consuming);
-	ret = _Consume(s, TRUE);
-	WLog_VRB(TAG, "Subscriber %p quit event %d. %d clients.\n", subscriber, event->eventid, event->consuming);
+	generation = s->generation;
+
+	while (!skipped && (generation != current))
+	{
+		generation = _NextGeneration(generation);
+		frame = &(event->frames[((UINT32) generation) % SHADOW_MULTICLIENT_FRAMES]);
+
+		if (InterlockedCompareExchange(&(frame->generation), 0, 0) != generation)
+		{
+			skipped = TRUE;
+			break;
+		}
+
+		numRects = frame->numRects;
+
+		if (numRects > SHADOW_MULTICLIENT_MAX_RECTS)
+		{
+			skipped = TRUE;
+			break;
+		}
+
+		CopyMemory(rects, frame->rects, numRects * sizeof(RECTANGLE_16));
+		hasMove = frame->hasMove;
+		CopyMemory(&move, &(frame->move), sizeof(rdpShadowMove));
+
+		if (InterlockedCompareExchange(&(frame->generation), 0, 0) != generation)
+		{
+			skipped = TRUE;
+			break;
+		}
+
+		if (hasMove && shadow_multiclient_consume_move(damage, bounds, &move, moves, numMoves, maxMoves))
+		{
+			region16_init(&region);
+
+			for (index = 0; index < numRects; index++)
+				region16_union_rect(&region, &region, &rects[index]);
+
+			shadow_capture_subtract_rect(&region, &(move.dst));
+			regionRects = region16_rects(&region, &numRegionRects);
+
+			for (index = 0; index < (UINT32) numRegionRects; index++)
+				region16_union_rect(damage, damage, &regionRects[index]);
+
+			region16_uninit(&region);
+			continue;
+		}
+
+		for (index = 0; index < numRects; index++)
+			region16_union_rect(damage, damage, &rects[index]);
+	}
+
+	if (skipped)
+	{
+		WLog_VRB(TAG, "Subscriber %p skipped from generation %d to %d.\n", subscriber, s->generation, current);
+		region16_union_rect(damage, damage, bounds);
+
+		if (numMoves)
+			*numMoves = 0;
+	}
 
-	LeaveCriticalSection(&(event->lock));
+	s->generation = current;
 
-	return ret;
+	return TRUE;
 }
 
 HANDLE shadow_multiclient_getevent(void* subscriber)
@@ -333,5 +339,5 @@ HANDLE shadow_multiclient_getevent(void* subscriber)
 	if (!subscriber)
 		return (HANDLE)NULL;
 
-	return ((struct rdp_shadow_multiclient_subscriber*)subscriber)->ref->event;
+	return ((struct rdp_shadow_multiclient_subscriber*)subscriber)->event;
 }
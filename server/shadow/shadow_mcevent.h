@@ -25,23 +25,37 @@
 #include <winpr/synch.h>
 #include <winpr/collections.h>
 
+#define SHADOW_MULTICLIENT_FRAMES		32
+#define SHADOW_MULTICLIENT_MAX_RECTS	64
+
 /*
- * This file implemented a model that an event is consumed 
- * by multiple clients. All clients should wait others before continue
- * Server should wait for all clients before continue
+ * Frame publication without waiting for the clients: the server publishes
+ * each frame as a new generation along with its damage rectangles, kept in
+ * a ring of the last SHADOW_MULTICLIENT_FRAMES generations. Every client
+ * reads the latest generation and the damage accumulated since the last one
+ * it consumed at its own pace; a client that fell behind by more than the
+ * ring size skips the intermediate frames and refreshes its whole view.
+ * A frame may also carry a block move, which happens before its damage.
+ * Since nobody waits, the pixels of a published frame must stay valid while
+ * clients encode them: subsystems publish through shadow_surface_publish,
+ * which swaps the double-buffered surface under the surface lock, and
+ * clients consume under the same lock before pinning the front buffer.
  */
-struct rdp_shadow_multiclient_event
+struct rdp_shadow_multiclient_frame
 {
-	HANDLE event; /* Kickoff event */
-	HANDLE barrierEvent; /* Represents that all clients have consumed event */
-	HANDLE doneEvent; /* Event handling finished. Server could continue */
-	wArrayList* subscribers;
-	CRITICAL_SECTION lock;
-	int consuming;
-	int waiting;
+	LONG generation; /* 0 while the slot is being written */
+	UINT32 numRects;
+	RECTANGLE_16 rects[SHADOW_MULTICLIENT_MAX_RECTS];
+	BOOL hasMove;
+	rdpShadowMove move;
+};
+typedef struct rdp_shadow_multiclient_frame rdpShadowMultiClientFrame;
 
-	/* For debug */
-	int eventid;
+struct rdp_shadow_multiclient_event
+{
+	LONG generation; /* Latest published generation */
+	rdpShadowMultiClientFrame frames[SHADOW_MULTICLIENT_FRAMES];
+	wArrayList* subscribers; /* Only used to signal the subscriber events */
 };
 
 #ifdef __cplusplus
@@ -50,12 +64,12 @@ extern "C" {
 
 rdpShadowMultiClientEvent* shadow_multiclient_new();
 void shadow_multiclient_free(rdpShadowMultiClientEvent* event);
-void shadow_multiclient_publish(rdpShadowMultiClientEvent* event);
-void shadow_multiclient_wait(rdpShadowMultiClientEvent* event);
-void shadow_multiclient_publish_and_wait(rdpShadowMultiClientEvent* event);
+void shadow_multiclient_publish(rdpShadowMultiClientEvent* event, REGION16* damage);
+void shadow_multiclient_publish_move(rdpShadowMultiClientEvent* event, REGION16* damage, const rdpShadowMove* move);
 void* shadow_multiclient_get_subscriber(rdpShadowMultiClientEvent* event);
 void shadow_multiclient_release_subscriber(void* subscriber);
-BOOL shadow_multiclient_consume(void* subscriber);
+BOOL shadow_multiclient_consume(void* subscriber, REGION16* damage, const RECTANGLE_16* bounds,
+		rdpShadowMove* moves, int* numMoves, int maxMoves);
 HANDLE shadow_multiclient_getevent(void* subscriber);
 
 #ifdef __cplusplus
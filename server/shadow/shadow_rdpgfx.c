@@ -0,0 +1,204 @@
+/**
+ * FreeRDP: A Remote Desktop Protocol Implementation
+ * Shadow Server Graphics Pipeline
+ *
+ * Copyright 2026 agent <agent@local>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <winpr/sysinfo.h>
+
+#include <freerdp/log.h>
+#include "shadow.h"
+
+#include "shadow_rdpgfx.h"
+
+#define TAG SERVER_TAG("shadow")
+
+static int rdpgfx_frame_acknowledge(RdpgfxServerContext* context, RDPGFX_FRAME_ACKNOWLEDGE_PDU* frameAcknowledge)
+{
+	rdpShadowClient* client = (rdpShadowClient*) context->custom;
+
+	if (frameAcknowledge->queueDepth != SUSPEND_FRAME_ACKNOWLEDGEMENT)
+		shadow_encoder_frame_acknowledge(client->encoder, frameAcknowledge->frameId);
+
+	return 1;
+}
+
+static void rdpgfx_on_caps_confirmed(RdpgfxServerContext* context)
+{
+	rdpShadowClient* client = (rdpShadowClient*) context->custom;
+
+	SetEvent(client->gfxCapsEvent);
+}
+
+/**
+ * H.264 (AVC420) is only used when enabled on the server and confirmed
+ * by the client in a version 8.1 capability set.
+ */
+
+BOOL shadow_client_rdpgfx_h264(rdpShadowClient* client)
+{
+	RdpgfxServerContext* rdpgfx = client->rdpgfx;
+
+	if (!client->server->h264 || !rdpgfx || !rdpgfx->CapsConfirmed)
+		return FALSE;
+
+	if (rdpgfx->Caps.version != RDPGFX_CAPVERSION_81)
+		return FALSE;
+
+	return (rdpgfx->Caps.flags & RDPGFX_CAPS_FLAG_H264ENABLED) ? TRUE : FALSE;
+}
+
+/**
+ * Returns 1 once the client confirmed its capabilities, 0 while they may
+ * still arrive and -1 when the client did not send them in time.
+ */
+
+int shadow_client_rdpgfx_ready(rdpShadowClient* client, UINT64 now)
+{
+	RdpgfxServerContext* rdpgfx = client->rdpgfx;
+
+	if (!rdpgfx)
+		return -1;
+
+	if (rdpgfx->CapsConfirmed)
+		return 1;
+
+	if ((now - client->gfxOpenTime) < SHADOW_CLIENT_GFX_CAPS_TIMEOUT)
+		return 0;
+
+	return -1;
+}
+
+/**
+ * Returns how long updates may still wait for the capabilities, in
+ * milliseconds, 0 once they are confirmed or the wait timed out.
+ */
+
+DWORD shadow_client_rdpgfx_caps_wait(rdpShadowClient* client, UINT64 now)
+{
+	UINT64 elapsed;
+
+	if (shadow_client_rdpgfx_ready(client, now) != 0)
+		return 0;
+
+	elapsed = now - client->gfxOpenTime;
+
+	return (DWORD) (SHADOW_CLIENT_GFX_CAPS_TIMEOUT - elapsed);
+}
+
+int shadow_client_rdpgfx_create_surface(rdpShadowClient* client, UINT32 width, UINT32 height)
+{
+	MONITOR_DEF monitor;
+	RDPGFX_RESET_GRAPHICS_PDU resetGraphics;
+	RDPGFX_CREATE_SURFACE_PDU createSurface;
+	RDPGFX_MAP_SURFACE_TO_OUTPUT_PDU surfaceToOutput;
+	RdpgfxServerContext* rdpgfx = client->rdpgfx;
+
+	monitor.left = 0;
+	monitor.top = 0;
+	monitor.right = width - 1;
+	monitor.bottom = height - 1;
+	monitor.flags = MONITOR_PRIMARY;
+
+	resetGraphics.width = width;
+	resetGraphics.height = height;
+	resetGraphics.monitorCount = 1;
+	resetGraphics.monitorDefArray = &monitor;
+
+	if (rdpgfx->ResetGraphics(rdpgfx, &resetGraphics) < 0)
+		return -1;
+
+	/* the client resets its codecs along with the graphics */
+	if (client->encoder->clear)
+		clear_context_reset(client->encoder->clear);
+
+	createSurface.surfaceId = 0;
+	createSurface.width = (UINT16) width;
+	createSurface.height = (UINT16) height;
+	createSurface.pixelFormat = PIXEL_FORMAT_XRGB_8888;
+
+	if (rdpgfx->CreateSurface(rdpgfx, &createSurface) < 0)
+		return -1;
+
+	surfaceToOutput.surfaceId = 0;
+	surfaceToOutput.reserved = 0;
+	surfaceToOutput.outputOriginX = 0;
+	surfaceToOutput.outputOriginY = 0;
+
+	if (rdpgfx->MapSurfaceToOutput(rdpgfx, &surfaceToOutput) < 0)
+		return -1;
+
+	client->gfxSurfaceCreated = TRUE;
+
+	return 1;
+}
+
+int shadow_client_rdpgfx_init(rdpShadowClient* client)
+{
+	RdpgfxServerContext* rdpgfx;
+
+	if (!client->gfxCapsEvent)
+	{
+		client->gfxCapsEvent = CreateEvent(NULL, FALSE, FALSE, NULL);
+
+		if (!client->gfxCapsEvent)
+			return -1;
+	}
+
+	rdpgfx = client->rdpgfx = rdpgfx_server_context_new(client->vcm);
+
+	if (!rdpgfx)
+		return -1;
+
+	rdpgfx->custom = (void*) client;
+
+	rdpgfx->FrameAcknowledge = rdpgfx_frame_acknowledge;
+	rdpgfx->OnCapsConfirmed = rdpgfx_on_caps_confirmed;
+
+	if (rdpgfx->Open(rdpgfx) < 0)
+	{
+		WLog_ERR(TAG, "failed to open the graphics pipeline channel");
+		rdpgfx_server_context_free(rdpgfx);
+		client->rdpgfx = NULL;
+		return -1;
+	}
+
+	client->gfxOpenTime = GetTickCount64();
+
+	return 1;
+}
+
+void shadow_client_rdpgfx_uninit(rdpShadowClient* client)
+{
+	if (client->rdpgfx)
+	{
+		client->rdpgfx->Close(client->rdpgfx);
+		rdpgfx_server_context_free(client->rdpgfx);
+		client->rdpgfx = NULL;
+	}
+
+	if (client->gfxCapsEvent)
+	{
+		CloseHandle(client->gfxCapsEvent);
+		client->gfxCapsEvent = NULL;
+	}
+
+	client->gfxSurfaceCreated = FALSE;
+}
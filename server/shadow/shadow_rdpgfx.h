@@ -0,0 +1,46 @@
+/**
+ * FreeRDP: A Remote Desktop Protocol Implementation
+ * Shadow Server Graphics Pipeline
+ *
+ * Copyright 2026 agent <agent@local>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef FREERDP_SHADOW_SERVER_RDPGFX_H
+#define FREERDP_SHADOW_SERVER_RDPGFX_H
+
+#include <freerdp/server/shadow.h>
+
+#include <winpr/crt.h>
+#include <winpr/synch.h>
+
+#define SHADOW_CLIENT_GFX_CAPS_TIMEOUT		5000
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+int shadow_client_rdpgfx_init(rdpShadowClient* client);
+void shadow_client_rdpgfx_uninit(rdpShadowClient* client);
+
+int shadow_client_rdpgfx_ready(rdpShadowClient* client, UINT64 now);
+DWORD shadow_client_rdpgfx_caps_wait(rdpShadowClient* client, UINT64 now);
+BOOL shadow_client_rdpgfx_h264(rdpShadowClient* client);
+int shadow_client_rdpgfx_create_surface(rdpShadowClient* client, UINT32 width, UINT32 height);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* FREERDP_SHADOW_SERVER_RDPGFX_H */
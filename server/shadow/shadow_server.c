@@ -25,6 +25,7 @@
 #include <winpr/wnd.h>
 #include <winpr/path.h>
 #include <winpr/cmdline.h>
+#include <winpr/sysinfo.h>
 #include <winpr/winsock.h>
 
 #include <freerdp/log.h>
@@ -50,6 +51,13 @@ static COMMAND_LINE_ARGUMENT_A shadow_args[] =
 	{ "auth", COMMAND_LINE_VALUE_BOOL, NULL, BoolValueFalse, NULL, -1, NULL, "Clients must authenticate" },
 	{ "may-view", COMMAND_LINE_VALUE_BOOL, NULL, BoolValueTrue, NULL, -1, NULL, "Clients may view without prompt" },
 	{ "may-interact", COMMAND_LINE_VALUE_BOOL, NULL, BoolValueTrue, NULL, -1, NULL, "Clients may interact without prompt" },
+	{ "h264", COMMAND_LINE_VALUE_BOOL, NULL, BoolValueFalse, NULL, -1, NULL, "H.264 (AVC420) encoding over the graphics pipeline" },
+	{ "shared-encoding", COMMAND_LINE_VALUE_BOOL, NULL, BoolValueFalse, NULL, -1, NULL, "Encode once for all clients with identical codec settings" },
+	{ "tile-classify", COMMAND_LINE_VALUE_BOOL, NULL, BoolValueFalse, NULL, -1, NULL, "Send text tiles lossless and image tiles with RemoteFX, NSCodec or H.264" },
+	{ "x11-damage", COMMAND_LINE_VALUE_BOOL, NULL, BoolValueFalse, NULL, -1, NULL, "Capture X11 damage through XDamage and XShm (experimental)" },
+	{ "stats", COMMAND_LINE_VALUE_REQUIRED, "<seconds>", NULL, NULL, -1, NULL, "Log per-client statistics at this interval" },
+	{ "subsystem", COMMAND_LINE_VALUE_REQUIRED, "<name>", NULL, NULL, -1, NULL, "Screen subsystem (X11, Mac, Win, Synthetic)" },
+	{ "synthetic", COMMAND_LINE_VALUE_REQUIRED, "<scroll|noise|drag|mixed|idle>[,<w>x<h>[,<fps>]]", NULL, NULL, -1, NULL, "Serve a generated screen, scenes combine with '+' (use with -auth)" },
 	{ "version", COMMAND_LINE_VALUE_FLAG | COMMAND_LINE_PRINT_VERSION, NULL, NULL, NULL, -1, NULL, "Print version" },
 	{ "help", COMMAND_LINE_VALUE_FLAG | COMMAND_LINE_PRINT_HELP, NULL, NULL, NULL, -1, "?", "Print help" },
 	{ NULL, 0, NULL, NULL, NULL, -1, NULL, NULL }
@@ -183,6 +191,40 @@ int shadow_server_parse_command_line(rdpShadowServer* server, int argc, char** a
 		{
 			server->mayInteract = arg->Value ? TRUE : FALSE;
 		}
+		CommandLineSwitchCase(arg, "h264")
+		{
+			server->h264 = arg->Value ? TRUE : FALSE;
+		}
+		CommandLineSwitchCase(arg, "shared-encoding")
+		{
+			server->sharedEncoding = arg->Value ? TRUE : FALSE;
+		}
+		CommandLineSwitchCase(arg, "tile-classify")
+		{
+			server->tileClassify = arg->Value ? TRUE : FALSE;
+		}
+		CommandLineSwitchCase(arg, "x11-damage")
+		{
+			server->x11Damage = arg->Value ? TRUE : FALSE;
+		}
+		CommandLineSwitchCase(arg, "stats")
+		{
+			server->statsInterval = (DWORD) atoi(arg->Value) * 1000;
+		}
+		CommandLineSwitchCase(arg, "subsystem")
+		{
+			free(server->subsystemName);
+
+			if (!(server->subsystemName = _strdup(arg->Value)))
+				return -1;
+		}
+		CommandLineSwitchCase(arg, "synthetic")
+		{
+			free(server->syntheticOptions);
+
+			if (!(server->syntheticOptions = _strdup(arg->Value)))
+				return -1;
+		}
 		CommandLineSwitchCase(arg, "rect")
 		{
 			char* p;
@@ -246,6 +288,12 @@ int shadow_server_parse_command_line(rdpShadowServer* server, int argc, char** a
 	}
 	while ((arg = CommandLineFindNextArgumentA(arg)) != NULL);
 
+	if (server->syntheticOptions && !server->subsystemName)
+	{
+		if (!(server->subsystemName = _strdup("Synthetic")))
+			return -1;
+	}
+
 	arg = CommandLineFindArgumentA(shadow_args, "monitors");
 
 	if (arg && (arg->Flags & COMMAND_LINE_ARGUMENT_PRESENT))
@@ -254,7 +302,7 @@ int shadow_server_parse_command_line(rdpShadowServer* server, int argc, char** a
 		int numMonitors;
 		MONITOR_DEF monitors[16];
 
-		numMonitors = shadow_enum_monitors(monitors, 16, 0);
+		numMonitors = shadow_enum_monitors(monitors, 16, server->subsystemName);
 
 		if (arg->Flags & COMMAND_LINE_VALUE_PRESENT)
 		{
@@ -296,10 +344,68 @@ int shadow_server_parse_command_line(rdpShadowServer* server, int argc, char** a
 	return status;
 }
 
+static UINT32 shadow_server_average(UINT64 total, UINT64 count)
+{
+	return count ? (UINT32) (total / count) : 0;
+}
+
+/**
+ * Logs one line of statistics per connected client: totals and averages
+ * since the client connected, then the current flow control state.
+ */
+
+void shadow_server_log_stats(rdpShadowServer* server)
+{
+	int index;
+	UINT32 elapsed;
+	rdpShadowClient* client;
+	rdpShadowClientStats stats;
+
+	ArrayList_Lock(server->clients);
+
+	for (index = 0; index < ArrayList_Count(server->clients); index++)
+	{
+		client = (rdpShadowClient*) ArrayList_GetItem(server->clients, index);
+
+		if (shadow_client_get_stats(client, &stats) < 0)
+			continue;
+
+		elapsed = (UINT32) ((GetTickCount64() - stats.connectTime) / 1000);
+
+		WLog_INFO(TAG, "client %s: %u s, %u frames, %u KB (%u kbit/s), %u Kpixels, %u moves, %u deferred",
+				client->context.peer->hostname, elapsed, (UINT32) stats.frames, (UINT32) (stats.bytes / 1024),
+				shadow_server_average(stats.bytes * 8, ((UINT64) elapsed) * 1000),
+				(UINT32) (stats.pixels / 1000), (UINT32) stats.moves, (UINT32) stats.deferredUpdates);
+
+		WLog_INFO(TAG, "client %s: KB per codec: raw %u rfx %u nsc %u h264 %u planar %u interleaved %u clear %u",
+				client->context.peer->hostname,
+				(UINT32) (stats.codecBytes[SHADOW_STATS_CODEC_UNCOMPRESSED] / 1024),
+				(UINT32) (stats.codecBytes[SHADOW_STATS_CODEC_REMOTEFX] / 1024),
+				(UINT32) (stats.codecBytes[SHADOW_STATS_CODEC_NSCODEC] / 1024),
+				(UINT32) (stats.codecBytes[SHADOW_STATS_CODEC_H264] / 1024),
+				(UINT32) (stats.codecBytes[SHADOW_STATS_CODEC_PLANAR] / 1024),
+				(UINT32) (stats.codecBytes[SHADOW_STATS_CODEC_INTERLEAVED] / 1024),
+				(UINT32) (stats.codecBytes[SHADOW_STATS_CODEC_CLEARCODEC] / 1024));
+
+		WLog_INFO(TAG, "client %s: encode %u us avg %u ms max, ack %u ms avg %u ms max, %u timeouts, "
+				"%u in flight, %u pending pixels, rtt %u ms, bandwidth %u KB/s, %u fps, quality %u",
+				client->context.peer->hostname,
+				shadow_server_average(stats.encodeTime * 1000, stats.frames), stats.maxEncodeTime,
+				shadow_server_average(stats.ackLatency, stats.acks), stats.maxAckLatency,
+				(UINT32) stats.ackTimeouts, stats.inFlightFrames, stats.pendingPixels,
+				stats.rtt, stats.bandwidth / 1024, stats.fps, stats.qualityLevel);
+	}
+
+	ArrayList_Unlock(server->clients);
+}
+
 void* shadow_server_thread(rdpShadowServer* server)
 {
 	DWORD status;
 	DWORD nCount;
+	DWORD dwTimeout;
+	UINT64 now;
+	UINT64 statsTime;
 	HANDLE events[32];
 	HANDLE StopEvent;
 	freerdp_listener* listener;
@@ -311,6 +417,8 @@ void* shadow_server_thread(rdpShadowServer* server)
 
 	shadow_subsystem_start(server->subsystem);
 
+	statsTime = GetTickCount64();
+
 	while (1)
 	{
 		nCount = listener->GetEventHandles(listener, events, 32);
@@ -322,7 +430,22 @@ void* shadow_server_thread(rdpShadowServer* server)
 
 		events[nCount++] = server->StopEvent;
 
-		status = WaitForMultipleObjects(nCount, events, FALSE, INFINITE);
+		dwTimeout = INFINITE;
+
+		if (server->statsInterval)
+		{
+			now = GetTickCount64();
+
+			if (now - statsTime >= server->statsInterval)
+			{
+				shadow_server_log_stats(server);
+				statsTime = now;
+			}
+
+			dwTimeout = (DWORD) (server->statsInterval - (now - statsTime));
+		}
+
+		status = WaitForMultipleObjects(nCount, events, FALSE, dwTimeout);
 
 		if (WaitForSingleObject(server->StopEvent, 0) == WAIT_OBJECT_0)
 		{
@@ -379,6 +502,24 @@ int shadow_server_start(rdpShadowServer* server)
 	if (!server->capture)
 		return -1;
 
+	if (server->sharedEncoding)
+	{
+		RECTANGLE_16 bounds;
+
+		bounds.left = 0;
+		bounds.top = 0;
+		bounds.right = server->surface->width;
+		bounds.bottom = server->surface->height;
+
+		if (server->shareSubRect)
+			CopyMemory(&bounds, &(server->subRect), sizeof(RECTANGLE_16));
+
+		server->encodeCache = shadow_encode_cache_new(server, &bounds);
+
+		if (!server->encodeCache)
+			return -1;
+	}
+
 	if (!server->ipcSocket)
 		status = server->listener->Open(server->listener, NULL, (UINT16) server->port);
 	else
@@ -420,6 +561,12 @@ int shadow_server_stop(rdpShadowServer* server)
 		server->capture = NULL;
 	}
 
+	if (server->encodeCache)
+	{
+		shadow_encode_cache_free(server->encodeCache);
+		server->encodeCache = NULL;
+	}
+
 	return 0;
 }
 
@@ -592,10 +739,13 @@ int shadow_server_init(rdpShadowServer* server)
 	server->listener->info = (void*) server;
 	server->listener->PeerAccepted = shadow_client_accepted;
 
-	server->subsystem = shadow_subsystem_new(NULL);
+	server->subsystem = shadow_subsystem_new(server->subsystemName);
 
 	if (!server->subsystem)
+	{
+		WLog_ERR(TAG, "unknown shadow subsystem: %s", server->subsystemName ? server->subsystemName : "default");
 		goto fail_subsystem_new;
+	}
 
 	status = shadow_subsystem_init(server->subsystem, server);
 
@@ -654,6 +804,12 @@ int shadow_server_uninit(rdpShadowServer* server)
 		server->ipcSocket = NULL;
 	}
 
+	free(server->subsystemName);
+	server->subsystemName = NULL;
+
+	free(server->syntheticOptions);
+	server->syntheticOptions = NULL;
+
 	shadow_subsystem_uninit(server->subsystem);
 
 	return 1;
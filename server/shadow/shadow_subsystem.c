@@ -44,6 +44,8 @@ extern int Mac_ShadowSubsystemEntry(RDP_SHADOW_ENTRY_POINTS* pEntryPoints);
 extern int Win_ShadowSubsystemEntry(RDP_SHADOW_ENTRY_POINTS* pEntryPoints);
 #endif
 
+extern int Synthetic_ShadowSubsystemEntry(RDP_SHADOW_ENTRY_POINTS* pEntryPoints);
+
 
 static RDP_SHADOW_SUBSYSTEM g_Subsystems[] =
 {
@@ -60,6 +62,9 @@ static RDP_SHADOW_SUBSYSTEM g_Subsystems[] =
 	{ "Win", Win_ShadowSubsystemEntry },
 #endif
 
+	/* always available, the default when no platform subsystem is built */
+	{ "Synthetic", Synthetic_ShadowSubsystemEntry },
+
 	{ "", NULL }
 };
 
@@ -80,7 +85,7 @@ pfnShadowSubsystemEntry shadow_subsystem_load_static_entry(const char* name)
 
 	for (index = 0; index < g_SubsystemCount; index++)
 	{
-		if (strcmp(name, g_Subsystems[index].name) == 0)
+		if (_stricmp(name, g_Subsystems[index].name) == 0)
 			return g_Subsystems[index].entry;
 	}
 
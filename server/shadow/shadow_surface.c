@@ -20,6 +20,8 @@
 #include "config.h"
 #endif
 
+#include <freerdp/codec/color.h>
+
 #include "shadow.h"
 
 #include "shadow_surface.h"
@@ -51,14 +53,25 @@ rdpShadowSurface* shadow_surface_new(rdpShadowServer* server, int x, int y, int
 
 	ZeroMemory(surface->data, surface->scanline * surface->height);
 
+	surface->backEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+
+	if (!surface->backEvent)
+	{
+		free (surface->data);
+		free (surface);
+		return NULL;
+	}
+
 	if (!InitializeCriticalSectionAndSpinCount(&(surface->lock), 4000))
 	{
+		CloseHandle(surface->backEvent);
 		free (surface->data);
 		free (surface);
 		return NULL;
 	}
 
 	region16_init(&(surface->invalidRegion));
+	region16_init(&(surface->backDamage));
 
 	return surface;
 }
@@ -69,10 +82,150 @@ void shadow_surface_free(rdpShadowSurface* surface)
 		return;
 
 	free(surface->data);
+	free(surface->backData);
+
+	CloseHandle(surface->backEvent);
 
 	DeleteCriticalSection(&(surface->lock));
 
 	region16_uninit(&(surface->invalidRegion));
+	region16_uninit(&(surface->backDamage));
 
 	free(surface);
 }
+
+/**
+ * Returns the back buffer to capture the next frame into, once no client
+ * reads it anymore, up to date with the last published frame: only the
+ * damage of the frames published since it was the back buffer is copied.
+ * The back buffer belongs to the capture thread until the frame is published.
+ */
+
+BYTE* shadow_surface_begin_frame(rdpShadowSurface* surface)
+{
+	int index;
+	int numRects = 0;
+	const RECTANGLE_16* rects;
+	int size = surface->scanline * surface->height;
+
+	EnterCriticalSection(&(surface->lock));
+
+	if (!surface->backData)
+	{
+		surface->backData = (BYTE*) malloc(size);
+
+		if (!surface->backData)
+		{
+			LeaveCriticalSection(&(surface->lock));
+			return NULL;
+		}
+
+		CopyMemory(surface->backData, surface->data, size);
+		region16_clear(&(surface->backDamage));
+	}
+
+	while (surface->backReaders > 0)
+	{
+		ResetEvent(surface->backEvent);
+		LeaveCriticalSection(&(surface->lock));
+		WaitForSingleObject(surface->backEvent, INFINITE);
+		EnterCriticalSection(&(surface->lock));
+	}
+
+	LeaveCriticalSection(&(surface->lock));
+
+	/* clients only pin the front buffer, nobody else touches the back buffer now */
+
+	rects = region16_rects(&(surface->backDamage), &numRects);
+
+	for (index = 0; index < numRects; index++)
+	{
+		freerdp_image_copy(surface->backData, PIXEL_FORMAT_XRGB32, surface->scanline,
+				rects[index].left, rects[index].top,
+				rects[index].right - rects[index].left, rects[index].bottom - rects[index].top,
+				surface->data, PIXEL_FORMAT_XRGB32, surface->scanline,
+				rects[index].left, rects[index].top, NULL);
+	}
+
+	region16_clear(&(surface->backDamage));
+
+	return surface->backData;
+}
+
+/**
+ * Publishes the frame captured into the back buffer: swaps the buffers,
+ * invalidates the shared encoded tiles and publishes the damage and the move
+ * (if not NULL) to the clients, all at once for the clients that lock the
+ * surface to pick up the damage and pin the buffer it applies to.
+ */
+
+void shadow_surface_publish(rdpShadowSurface* surface, REGION16* damage, const rdpShadowMove* move)
+{
+	BYTE* data;
+	RECTANGLE_16 rect;
+	rdpShadowServer* server = surface->server;
+
+	EnterCriticalSection(&(surface->lock));
+
+	if (surface->backData)
+	{
+		data = surface->data;
+		surface->data = surface->backData;
+		surface->backData = data;
+
+		surface->backReaders = surface->readers;
+		surface->readers = 0;
+
+		rect.left = 0;
+		rect.top = 0;
+		rect.right = surface->width;
+		rect.bottom = surface->height;
+
+		region16_intersect_rect(&(surface->backDamage), damage, &rect);
+	}
+
+	if (server)
+	{
+		shadow_encode_cache_invalidate(server->encodeCache, damage);
+
+		if (server->subsystem)
+			shadow_multiclient_publish_move(server->subsystem->updateEvent, damage, move);
+	}
+
+	LeaveCriticalSection(&(surface->lock));
+}
+
+/**
+ * Pins the last published frame, to be released with shadow_surface_release.
+ */
+
+BYTE* shadow_surface_acquire(rdpShadowSurface* surface)
+{
+	BYTE* data;
+
+	EnterCriticalSection(&(surface->lock));
+	surface->readers++;
+	data = surface->data;
+	LeaveCriticalSection(&(surface->lock));
+
+	return data;
+}
+
+void shadow_surface_release(rdpShadowSurface* surface, BYTE* data)
+{
+	EnterCriticalSection(&(surface->lock));
+
+	if (data == surface->data)
+	{
+		surface->readers--;
+	}
+	else if (data == surface->backData)
+	{
+		surface->backReaders--;
+
+		if (surface->backReaders < 1)
+			SetEvent(surface->backEvent);
+	}
+
+	LeaveCriticalSection(&(surface->lock));
+}
@@ -35,6 +35,19 @@ struct rdp_shadow_surface
 	int scanline;
 	BYTE* data;
 
+	/**
+	 * The server surface is double-buffered: subsystems capture the next
+	 * frame into the back buffer while clients encode from data, the last
+	 * published frame, and both are swapped when the frame is published.
+	 * Clients pin the buffer they encode from, the back buffer is only
+	 * written again once the clients still reading it released it.
+	 */
+	BYTE* backData;
+	int readers;
+	int backReaders;
+	HANDLE backEvent;
+	REGION16 backDamage;
+
 	CRITICAL_SECTION lock;
 	REGION16 invalidRegion;
 };
@@ -46,6 +59,11 @@ extern "C" {
 rdpShadowSurface* shadow_surface_new(rdpShadowServer* server, int x, int y, int width, int height);
 void shadow_surface_free(rdpShadowSurface* surface);
 
+BYTE* shadow_surface_begin_frame(rdpShadowSurface* surface);
+void shadow_surface_publish(rdpShadowSurface* surface, REGION16* damage, const rdpShadowMove* move);
+BYTE* shadow_surface_acquire(rdpShadowSurface* surface);
+void shadow_surface_release(rdpShadowSurface* surface, BYTE* data);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,340 @@
+/**
+ * FreeRDP: A Remote Desktop Protocol Implementation
+ * Shadow Server Capture Tests
+ *
+ * Copyright 2026 agent <agent@local>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <winpr/crt.h>
+#include <winpr/print.h>
+
+#include "shadow_capture.h"
+
+static UINT32 test_capture_rand(UINT32* seed)
+{
+	*seed = (*seed * 1103515245) + 12345;
+	return (*seed >> 16) & 0x7FFF;
+}
+
+static void test_capture_fill(BYTE* pData, int nStep, int nWidth, int nHeight, UINT32* seed)
+{
+	int x, y;
+	UINT32* pixel;
+
+	for (y = 0; y < nHeight; y++)
+	{
+		pixel = (UINT32*) &pData[y * nStep];
+
+		for (x = 0; x < nWidth; x++)
+			pixel[x] = (test_capture_rand(seed) << 16) | test_capture_rand(seed);
+	}
+}
+
+/**
+ * Checks that region holds exactly the 16x16 tiles (clipped to the frame)
+ * flagged in dirty.
+ */
+
+static BOOL test_capture_check_region(REGION16* region, const BYTE* dirty, int nWidth, int nHeight)
+{
+	int tx, ty;
+	int tileCols;
+	int tileRows;
+	BOOL expected;
+	RECTANGLE_16 tile;
+	REGION16 clipped;
+	const RECTANGLE_16* extents;
+
+	tileCols = (nWidth + 15) / 16;
+	tileRows = (nHeight + 15) / 16;
+
+	extents = region16_extents(region);
+
+	if (!region16_is_empty(region) && ((extents->right > nWidth) || (extents->bottom > nHeight)))
+		return FALSE;
+
+	region16_init(&clipped);
+
+	for (ty = 0; ty < tileRows; ty++)
+	{
+		for (tx = 0; tx < tileCols; tx++)
+		{
+			tile.left = tx * 16;
+			tile.top = ty * 16;
+			tile.right = MIN(tile.left + 16, nWidth);
+			tile.bottom = MIN(tile.top + 16, nHeight);
+
+			expected = dirty[(ty * tileCols) + tx] ? TRUE : FALSE;
+
+			/* the whole tile must be in the region, not only part of it */
+			region16_intersect_rect(&clipped, region, &tile);
+
+			if (expected != (region16_is_empty(&clipped) ? FALSE : TRUE))
+			{
+				printf("tile %d,%d: expected %s\n", tx, ty, expected ? "dirty" : "clean");
+				region16_uninit(&clipped);
+				return FALSE;
+			}
+
+			if (expected)
+			{
+				extents = region16_extents(&clipped);
+
+				if ((region16_n_rects(&clipped) != 1) || (extents->left != tile.left) ||
+						(extents->top != tile.top) || (extents->right != tile.right) ||
+						(extents->bottom != tile.bottom))
+				{
+					printf("tile %d,%d: only partially dirty\n", tx, ty);
+					region16_uninit(&clipped);
+					return FALSE;
+				}
+			}
+		}
+	}
+
+	region16_uninit(&clipped);
+
+	return TRUE;
+}
+
+/**
+ * Runs a sequence of frames through shadow_capture_compare and checks every
+ * returned region against the tiles that were actually modified.
+ */
+
+static int test_capture_compare(int nWidth, int nHeight)
+{
+	int i, n;
+	int x, y;
+	int status;
+	int result = -1;
+	int nStep;
+	int tileCols;
+	int tileRows;
+	UINT32 seed = 0x53484457;
+	BYTE* pData = NULL;
+	BYTE* dirty = NULL;
+	REGION16 region;
+	rdpShadowCapture* capture;
+
+	capture = shadow_capture_new(NULL);
+
+	if (!capture)
+		return -1;
+
+	region16_init(&region);
+
+	/* not a multiple of the tile row size, to catch any step confusion */
+	nStep = (nWidth * 4) + 64;
+	tileCols = (nWidth + 15) / 16;
+	tileRows = (nHeight + 15) / 16;
+
+	pData = (BYTE*) malloc(nStep * nHeight);
+	dirty = (BYTE*) malloc(tileCols * tileRows);
+
+	if (!pData || !dirty)
+		goto out;
+
+	test_capture_fill(pData, nStep, nWidth, nHeight, &seed);
+
+	/* the first frame is entirely dirty */
+
+	status = shadow_capture_compare(capture, pData, nStep, nWidth, nHeight, &region);
+	FillMemory(dirty, tileCols * tileRows, 1);
+
+	if ((status != 1) || !test_capture_check_region(&region, dirty, nWidth, nHeight))
+	{
+		printf("%dx%d: first frame not entirely dirty\n", nWidth, nHeight);
+		goto out;
+	}
+
+	/* an identical frame has no damage */
+
+	region16_clear(&region);
+	status = shadow_capture_compare(capture, pData, nStep, nWidth, nHeight, &region);
+
+	if ((status != 0) || !region16_is_empty(&region))
+	{
+		printf("%dx%d: unchanged frame reported as dirty\n", nWidth, nHeight);
+		goto out;
+	}
+
+	/* single pixel changes in random tiles, including the partial edge tiles */
+
+	for (i = 0; i < 32; i++)
+	{
+		ZeroMemory(dirty, tileCols * tileRows);
+
+		for (n = (i % 8) + 1; n > 0; n--)
+		{
+			x = test_capture_rand(&seed) % nWidth;
+			y = test_capture_rand(&seed) % nHeight;
+
+			if (n == 1)
+			{
+				x = nWidth - 1;
+				y = nHeight - 1;
+			}
+
+			pData[(y * nStep) + (x * 4) + (i % 4)] ^= 0x01;
+			dirty[((y / 16) * tileCols) + (x / 16)] = 1;
+		}
+
+		region16_clear(&region);
+		status = shadow_capture_compare(capture, pData, nStep, nWidth, nHeight, &region);
+
+		if ((status != 1) || !test_capture_check_region(&region, dirty, nWidth, nHeight))
+		{
+			printf("%dx%d: frame %d damage mismatch\n", nWidth, nHeight, i);
+			goto out;
+		}
+	}
+
+	/* bytes beyond the frame width are padding and must be ignored */
+
+	if (nStep > (nWidth * 4))
+	{
+		for (y = 0; y < nHeight; y++)
+			pData[(y * nStep) + (nWidth * 4)] ^= 0xFF;
+
+		region16_clear(&region);
+		status = shadow_capture_compare(capture, pData, nStep, nWidth, nHeight, &region);
+
+		if ((status != 0) || !region16_is_empty(&region))
+		{
+			printf("%dx%d: padding reported as dirty\n", nWidth, nHeight);
+			goto out;
+		}
+	}
+
+	/* after an invalidation the whole frame is dirty again */
+
+	shadow_capture_invalidate(capture);
+
+	region16_clear(&region);
+	status = shadow_capture_compare(capture, pData, nStep, nWidth, nHeight, &region);
+	FillMemory(dirty, tileCols * tileRows, 1);
+
+	if ((status != 1) || !test_capture_check_region(&region, dirty, nWidth, nHeight))
+	{
+		printf("%dx%d: invalidated frame not entirely dirty\n", nWidth, nHeight);
+		goto out;
+	}
+
+	result = 0;
+
+out:
+	region16_uninit(&region);
+	free(pData);
+	free(dirty);
+	shadow_capture_free(capture);
+
+	return result;
+}
+
+/**
+ * A frame written without being compared (damage driven capture) and then
+ * registered with shadow_capture_update must not show up in the next diff.
+ */
+
+static int test_capture_update(void)
+{
+	int x, y;
+	int status;
+	int result = -1;
+	int nWidth = 256;
+	int nHeight = 128;
+	int nStep = 256 * 4;
+	UINT32 seed = 0x55504454;
+	BYTE* pData = NULL;
+	BYTE* dirty = NULL;
+	RECTANGLE_16 rect;
+	REGION16 region;
+	REGION16 damage;
+	rdpShadowCapture* capture;
+
+	capture = shadow_capture_new(NULL);
+
+	if (!capture)
+		return -1;
+
+	region16_init(&region);
+	region16_init(&damage);
+
+	pData = (BYTE*) malloc(nStep * nHeight);
+	dirty = (BYTE*) calloc((nWidth / 16) * (nHeight / 16), 1);
+
+	if (!pData || !dirty)
+		goto out;
+
+	test_capture_fill(pData, nStep, nWidth, nHeight, &seed);
+
+	if (shadow_capture_compare(capture, pData, nStep, nWidth, nHeight, &region) != 1)
+		goto out;
+
+	rect.left = 40;
+	rect.top = 20;
+	rect.right = 90;
+	rect.bottom = 50;
+
+	for (y = rect.top; y < rect.bottom; y++)
+	{
+		for (x = rect.left; x < rect.right; x++)
+			pData[(y * nStep) + (x * 4)] ^= 0x80;
+	}
+
+	region16_union_rect(&damage, &damage, &rect);
+	shadow_capture_update(capture, pData, nStep, &damage);
+
+	/* a change elsewhere is still found */
+	pData[(100 * nStep) + (200 * 4)] ^= 0x80;
+	dirty[((100 / 16) * (nWidth / 16)) + (200 / 16)] = 1;
+
+	region16_clear(&region);
+	status = shadow_capture_compare(capture, pData, nStep, nWidth, nHeight, &region);
+
+	if ((status != 1) || !test_capture_check_region(&region, dirty, nWidth, nHeight))
+	{
+		printf("updated tiles reported as dirty\n");
+		goto out;
+	}
+
+	result = 0;
+
+out:
+	region16_uninit(&region);
+	region16_uninit(&damage);
+	free(pData);
+	free(dirty);
+	shadow_capture_free(capture);
+
+	return result;
+}
+
+int TestShadowCapture(int argc, char* argv[])
+{
+	/* small frames are hashed on the calling thread, large ones in bands */
+
+	if (test_capture_compare(200, 150) < 0)
+		return -1;
+
+	if (test_capture_compare(1024, 1030) < 0)
+		return -1;
+
+	if (test_capture_update() < 0)
+		return -1;
+
+	return 0;
+}
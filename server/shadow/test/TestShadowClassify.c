@@ -0,0 +1,292 @@
+/**
+ * FreeRDP: A Remote Desktop Protocol Implementation
+ * Shadow Server Tile Classification Tests
+ *
+ * Copyright 2026 agent <agent@local>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <winpr/crt.h>
+#include <winpr/print.h>
+
+#include "shadow_classify.h"
+
+#define TEST_CLASSIFY_WIDTH		(SHADOW_CLASSIFY_TILE_SIZE * 2)
+#define TEST_CLASSIFY_HEIGHT		SHADOW_CLASSIFY_TILE_SIZE
+#define TEST_CLASSIFY_STEP		(TEST_CLASSIFY_WIDTH * 4)
+
+#define TEST_CLASSIFY_TWO_COLORS	0
+#define TEST_CLASSIFY_SHARP		1
+#define TEST_CLASSIFY_GRADIENT		2
+
+/**
+ * Fills a tile with two colour text-like stripes, with sharp edges between
+ * dark and light pixels of many shades (anti-aliased text), or with a soft
+ * gradient of many colours (a photograph).
+ */
+
+static void test_classify_fill(BYTE* pData, int nStep, int nWidth, int nHeight, int pattern)
+{
+	int x, y;
+	UINT32 shade;
+	UINT32* pixel;
+
+	for (y = 0; y < nHeight; y++)
+	{
+		pixel = (UINT32*) &pData[y * nStep];
+
+		for (x = 0; x < nWidth; x++)
+		{
+			switch (pattern)
+			{
+				case TEST_CLASSIFY_TWO_COLORS:
+					pixel[x] = ((x / 3) & 1) ? 0xFF000000 : 0xFFFFFFFF;
+					break;
+
+				case TEST_CLASSIFY_SHARP:
+					shade = ((x * 7) + (y * 3)) & 0x1F;
+
+					if (x & 1)
+						shade += 0xE0;
+
+					pixel[x] = 0xFF000000 | (shade << 16) | (shade << 8) | shade;
+					break;
+
+				default:
+					pixel[x] = 0xFF000080 | ((x * 4) << 16) | ((y * 4) << 8);
+					break;
+			}
+		}
+	}
+}
+
+static int test_classify_tile(const char* name, int pattern, UINT16 history, int expected)
+{
+	int type;
+	BYTE* pData;
+
+	pData = (BYTE*) malloc(TEST_CLASSIFY_STEP * TEST_CLASSIFY_HEIGHT);
+
+	if (!pData)
+		return -1;
+
+	test_classify_fill(pData, TEST_CLASSIFY_STEP, SHADOW_CLASSIFY_TILE_SIZE, SHADOW_CLASSIFY_TILE_SIZE, pattern);
+
+	type = shadow_classify_tile(pData, TEST_CLASSIFY_STEP, SHADOW_CLASSIFY_TILE_SIZE,
+			SHADOW_CLASSIFY_TILE_SIZE, history);
+
+	free(pData);
+
+	if (type != expected)
+	{
+		printf("%s: classified as %s\n", name, (type == SHADOW_CLASSIFY_TEXT) ? "text" : "image");
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * Updates the tile at column col once, and checks which region it lands in.
+ * The other tile is not part of the update and must not show up.
+ */
+
+static int test_classify_update(rdpShadowClassifier* classifier, const BYTE* pData,
+		const RECTANGLE_16* bounds, int col, int expected)
+{
+	int status;
+	int result = -1;
+	RECTANGLE_16 tile;
+	REGION16 region;
+	REGION16 textRegion;
+	REGION16 imageRegion;
+	REGION16* expectedRegion;
+	REGION16* otherRegion;
+
+	region16_init(&region);
+	region16_init(&textRegion);
+	region16_init(&imageRegion);
+
+	/* a small change inside the tile classifies the whole tile */
+	tile.left = (col * SHADOW_CLASSIFY_TILE_SIZE) + 10;
+	tile.top = 20;
+	tile.right = tile.left + 5;
+	tile.bottom = 30;
+
+	region16_union_rect(&region, &region, &tile);
+
+	status = shadow_classifier_split(classifier, pData, TEST_CLASSIFY_STEP, bounds,
+			&region, &textRegion, &imageRegion);
+
+	if (status != ((expected == SHADOW_CLASSIFY_TEXT) ? 1 : 0))
+		goto out;
+
+	expectedRegion = (expected == SHADOW_CLASSIFY_TEXT) ? &textRegion : &imageRegion;
+	otherRegion = (expected == SHADOW_CLASSIFY_TEXT) ? &imageRegion : &textRegion;
+
+	tile.left = col * SHADOW_CLASSIFY_TILE_SIZE;
+	tile.top = 0;
+	tile.right = tile.left + SHADOW_CLASSIFY_TILE_SIZE;
+	tile.bottom = SHADOW_CLASSIFY_TILE_SIZE;
+
+	if ((region16_n_rects(expectedRegion) != 1) || !region16_is_empty(otherRegion))
+		goto out;
+
+	if (memcmp(region16_extents(expectedRegion), &tile, sizeof(RECTANGLE_16)) != 0)
+		goto out;
+
+	result = 0;
+
+out:
+	region16_uninit(&region);
+	region16_uninit(&textRegion);
+	region16_uninit(&imageRegion);
+
+	return result;
+}
+
+/**
+ * Sharp edged content is text while it changes now and then, and turns into
+ * an image once it changed in 8 of the last 16 updates. It is text again
+ * when the older updates fall out of the history.
+ */
+
+static int test_classify_history(void)
+{
+	int index;
+	int result = -1;
+	BYTE* pData = NULL;
+	RECTANGLE_16 bounds;
+	RECTANGLE_16 other;
+	REGION16 region;
+	REGION16 textRegion;
+	REGION16 imageRegion;
+	rdpShadowClassifier* classifier;
+
+	classifier = shadow_classifier_new(TEST_CLASSIFY_WIDTH, TEST_CLASSIFY_HEIGHT);
+
+	if (!classifier)
+		return -1;
+
+	region16_init(&region);
+	region16_init(&textRegion);
+	region16_init(&imageRegion);
+
+	pData = (BYTE*) malloc(TEST_CLASSIFY_STEP * TEST_CLASSIFY_HEIGHT);
+
+	if (!pData)
+		goto out;
+
+	test_classify_fill(pData, TEST_CLASSIFY_STEP, TEST_CLASSIFY_WIDTH, TEST_CLASSIFY_HEIGHT, TEST_CLASSIFY_SHARP);
+
+	bounds.left = 0;
+	bounds.top = 0;
+	bounds.right = TEST_CLASSIFY_WIDTH;
+	bounds.bottom = TEST_CLASSIFY_HEIGHT;
+
+	for (index = 1; index < 8; index++)
+	{
+		if (test_classify_update(classifier, pData, &bounds, 0, SHADOW_CLASSIFY_TEXT) < 0)
+		{
+			printf("update %d: tile not classified as text\n", index);
+			goto out;
+		}
+	}
+
+	if (test_classify_update(classifier, pData, &bounds, 0, SHADOW_CLASSIFY_IMAGE) < 0)
+	{
+		printf("busy tile not classified as image\n");
+		goto out;
+	}
+
+	/* after 9 updates outside of the shared area only 7 of the last 16 changed the tile */
+
+	other.left = TEST_CLASSIFY_WIDTH;
+	other.top = 0;
+	other.right = TEST_CLASSIFY_WIDTH + 16;
+	other.bottom = 16;
+	region16_union_rect(&region, &region, &other);
+
+	for (index = 0; index < 9; index++)
+	{
+		if ((shadow_classifier_split(classifier, pData, TEST_CLASSIFY_STEP, &bounds,
+				&region, &textRegion, &imageRegion) != 0) ||
+				!region16_is_empty(&textRegion) || !region16_is_empty(&imageRegion))
+		{
+			printf("update outside of the bounds classified\n");
+			goto out;
+		}
+	}
+
+	region16_clear(&region);
+
+	if (test_classify_update(classifier, pData, &bounds, 0, SHADOW_CLASSIFY_TEXT) < 0)
+	{
+		printf("calmed down tile not classified as text\n");
+		goto out;
+	}
+
+	/* the classifier covers the area it was created for only */
+
+	other = bounds;
+	other.right -= 1;
+	region16_union_rect(&region, &region, &other);
+
+	if (shadow_classifier_split(classifier, pData, TEST_CLASSIFY_STEP, &other,
+			&region, &textRegion, &imageRegion) >= 0)
+	{
+		printf("bounds of another size accepted\n");
+		goto out;
+	}
+
+	result = 0;
+
+out:
+	region16_uninit(&region);
+	region16_uninit(&textRegion);
+	region16_uninit(&imageRegion);
+	free(pData);
+	shadow_classifier_free(classifier);
+
+	return result;
+}
+
+int TestShadowClassify(int argc, char* argv[])
+{
+	/* few colours are text, even when changing all the time */
+
+	if (test_classify_tile("two colors", TEST_CLASSIFY_TWO_COLORS, 0, SHADOW_CLASSIFY_TEXT) < 0)
+		return -1;
+
+	if (test_classify_tile("two colors busy", TEST_CLASSIFY_TWO_COLORS, 0xFFFF, SHADOW_CLASSIFY_TEXT) < 0)
+		return -1;
+
+	/* many colours are text only with dense edges */
+
+	if (test_classify_tile("sharp", TEST_CLASSIFY_SHARP, 0x0101, SHADOW_CLASSIFY_TEXT) < 0)
+		return -1;
+
+	if (test_classify_tile("gradient", TEST_CLASSIFY_GRADIENT, 0, SHADOW_CLASSIFY_IMAGE) < 0)
+		return -1;
+
+	/* dense edges do not make a busy tile text */
+
+	if (test_classify_tile("sharp busy", TEST_CLASSIFY_SHARP, 0x5555, SHADOW_CLASSIFY_IMAGE) < 0)
+		return -1;
+
+	if (test_classify_history() < 0)
+		return -1;
+
+	return 0;
+}
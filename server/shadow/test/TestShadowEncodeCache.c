@@ -0,0 +1,381 @@
+/**
+ * FreeRDP: A Remote Desktop Protocol Implementation
+ * Shadow Server Encode Cache Tests
+ *
+ * Copyright 2026 agent <agent@local>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <winpr/crt.h>
+#include <winpr/print.h>
+
+#include "shadow_surface.h"
+#include "shadow_encoder.h"
+#include "shadow_encode_cache.h"
+
+#define TEST_CACHE_WIDTH	256
+#define TEST_CACHE_HEIGHT	192
+#define TEST_CACHE_TILES	((TEST_CACHE_WIDTH / 64) * (TEST_CACHE_HEIGHT / 64))
+
+static UINT32 test_cache_rand(UINT32* seed)
+{
+	*seed = (*seed * 1103515245) + 12345;
+	return (*seed >> 16) & 0x7FFF;
+}
+
+static void test_cache_fill(rdpShadowSurface* surface, const RECTANGLE_16* rect, UINT32* seed)
+{
+	int x, y;
+	UINT32* pixel;
+
+	for (y = rect->top; y < rect->bottom; y++)
+	{
+		pixel = (UINT32*) &surface->data[y * surface->scanline];
+
+		for (x = rect->left; x < rect->right; x++)
+			pixel[x] = 0xFF000000 | ((x * 3) << 16) | ((y * 5) << 8) | (test_cache_rand(seed) & 0x1F);
+	}
+}
+
+static void test_cache_encoder_free(rdpShadowEncoder* encoder)
+{
+	if (!encoder)
+		return;
+
+	if (encoder->rfx)
+		rfx_context_free(encoder->rfx);
+
+	if (encoder->nsc)
+		nsc_context_free(encoder->nsc);
+
+	if (encoder->bs)
+		Stream_Free(encoder->bs, TRUE);
+
+	free(encoder);
+}
+
+static rdpShadowEncoder* test_cache_encoder_new(UINT32 codecId, int quality)
+{
+	rdpShadowEncoder* encoder;
+
+	encoder = (rdpShadowEncoder*) calloc(1, sizeof(rdpShadowEncoder));
+
+	if (!encoder)
+		return NULL;
+
+	encoder->width = TEST_CACHE_WIDTH;
+	encoder->height = TEST_CACHE_HEIGHT;
+
+	encoder->bs = Stream_New(NULL, 64 * 64 * 4);
+
+	if (!encoder->bs)
+		goto fail;
+
+	if (codecId == FREERDP_CODEC_REMOTEFX)
+	{
+		encoder->rfx = rfx_context_new(TRUE);
+
+		if (!encoder->rfx)
+			goto fail;
+
+		encoder->rfx->mode = RLGR3;
+		encoder->rfx->width = encoder->width;
+		encoder->rfx->height = encoder->height;
+
+		rfx_context_set_pixel_format(encoder->rfx, RDP_PIXEL_FORMAT_B8G8R8A8);
+
+		/* a different RLGR mode gives a different bitstream, like a different quality */
+		if (quality > 0)
+			encoder->rfx->mode = RLGR1;
+	}
+	else
+	{
+		encoder->nsc = nsc_context_new();
+
+		if (!encoder->nsc)
+			goto fail;
+
+		nsc_context_set_pixel_format(encoder->nsc, RDP_PIXEL_FORMAT_B8G8R8A8);
+		encoder->nsc->ColorLossLevel = 3 + quality;
+		encoder->nsc->ChromaSubsamplingLevel = 1;
+	}
+
+	return encoder;
+
+fail:
+	test_cache_encoder_free(encoder);
+	return NULL;
+}
+
+/**
+ * Fetches the tiles of region for the current frame, indexed by their
+ * position in the grid.
+ */
+
+static int test_cache_get(rdpShadowEncodeCache* cache, rdpShadowEncoder* encoder, UINT32 codecId,
+		REGION16* region, rdpShadowEncodeTile** grid, rdpShadowEncodeTile*** ppTiles, int* pNumTiles)
+{
+	int index;
+	int status;
+
+	ZeroMemory(grid, TEST_CACHE_TILES * sizeof(rdpShadowEncodeTile*));
+
+	status = shadow_encode_cache_get_tiles(cache, encoder, codecId, region, cache->server->surface->data,
+			shadow_encode_cache_get_frame(cache), ppTiles, pNumTiles);
+
+	if (status != 1)
+	{
+		printf("shadow_encode_cache_get_tiles failed: %d\n", status);
+		return -1;
+	}
+
+	for (index = 0; index < *pNumTiles; index++)
+	{
+		rdpShadowEncodeTile* tile = (*ppTiles)[index];
+		grid[(tile->yIdx * (TEST_CACHE_WIDTH / 64)) + tile->xIdx] = tile;
+	}
+
+	return 1;
+}
+
+/**
+ * The cached RemoteFX tiles must hold the same bitstreams as a RemoteFX
+ * context encoding the frame directly.
+ */
+
+static BOOL test_cache_check_rfx(rdpShadowSurface* surface, rdpShadowEncodeTile** grid)
+{
+	int index;
+	BOOL match = TRUE;
+	RFX_RECT rect;
+	RFX_TILE* rfxTile;
+	RFX_MESSAGE* message;
+	rdpShadowEncodeTile* tile;
+	rdpShadowEncoder* encoder;
+
+	encoder = test_cache_encoder_new(FREERDP_CODEC_REMOTEFX, 0);
+
+	if (!encoder)
+		return FALSE;
+
+	rect.x = rect.y = 0;
+	rect.width = TEST_CACHE_WIDTH;
+	rect.height = TEST_CACHE_HEIGHT;
+
+	message = rfx_encode_message(encoder->rfx, &rect, 1, surface->data,
+			TEST_CACHE_WIDTH, TEST_CACHE_HEIGHT, surface->scanline);
+
+	if (!message)
+	{
+		test_cache_encoder_free(encoder);
+		return FALSE;
+	}
+
+	for (index = 0; index < message->numTiles; index++)
+	{
+		rfxTile = message->tiles[index];
+		tile = grid[(rfxTile->yIdx * (TEST_CACHE_WIDTH / 64)) + rfxTile->xIdx];
+
+		if (!tile || (tile->YLen != rfxTile->YLen) || (tile->CbLen != rfxTile->CbLen) ||
+				(tile->CrLen != rfxTile->CrLen) ||
+				(memcmp(tile->data, rfxTile->YData, rfxTile->YLen) != 0) ||
+				(memcmp(&tile->data[tile->YLen], rfxTile->CbData, rfxTile->CbLen) != 0) ||
+				(memcmp(&tile->data[tile->YLen + tile->CbLen], rfxTile->CrData, rfxTile->CrLen) != 0))
+		{
+			printf("cached tile %d,%d differs from a direct encoding\n", rfxTile->xIdx, rfxTile->yIdx);
+			match = FALSE;
+		}
+	}
+
+	message->freeRects = TRUE;
+	rfx_message_free(encoder->rfx, message);
+	test_cache_encoder_free(encoder);
+
+	return match;
+}
+
+static int test_cache_codec(UINT32 codecId)
+{
+	int index;
+	int status;
+	int result = -1;
+	int numTiles[4] = { 0, 0, 0, 0 };
+	UINT32 frameId;
+	UINT32 seed = 0x45434348;
+	RECTANGLE_16 bounds;
+	RECTANGLE_16 damage;
+	REGION16 region;
+	REGION16 invalid;
+	rdpShadowServer* server = NULL;
+	rdpShadowSurface* surface = NULL;
+	rdpShadowEncodeCache* cache = NULL;
+	rdpShadowEncoder* encoders[3] = { NULL, NULL, NULL };
+	rdpShadowEncodeTile** tiles[4] = { NULL, NULL, NULL, NULL };
+	rdpShadowEncodeTile* first[TEST_CACHE_TILES];
+	rdpShadowEncodeTile* grid[TEST_CACHE_TILES];
+	const char* name = (codecId == FREERDP_CODEC_REMOTEFX) ? "RemoteFX" : "NSCodec";
+
+	region16_init(&region);
+	region16_init(&invalid);
+
+	server = (rdpShadowServer*) calloc(1, sizeof(rdpShadowServer));
+	surface = (rdpShadowSurface*) calloc(1, sizeof(rdpShadowSurface));
+
+	if (!server || !surface)
+		goto out;
+
+	surface->width = TEST_CACHE_WIDTH;
+	surface->height = TEST_CACHE_HEIGHT;
+	surface->scanline = TEST_CACHE_WIDTH * 4;
+	surface->data = (BYTE*) malloc(surface->scanline * surface->height);
+	server->surface = surface;
+
+	if (!surface->data)
+		goto out;
+
+	bounds.left = bounds.top = 0;
+	bounds.right = TEST_CACHE_WIDTH;
+	bounds.bottom = TEST_CACHE_HEIGHT;
+
+	test_cache_fill(surface, &bounds, &seed);
+	region16_union_rect(&region, &region, &bounds);
+
+	cache = shadow_encode_cache_new(server, &bounds);
+
+	/* two clients with the same settings, one with different settings */
+	encoders[0] = test_cache_encoder_new(codecId, 0);
+	encoders[1] = test_cache_encoder_new(codecId, 0);
+	encoders[2] = test_cache_encoder_new(codecId, 1);
+
+	if (!cache || !encoders[0] || !encoders[1] || !encoders[2])
+		goto out;
+
+	shadow_encode_cache_invalidate(cache, &region);
+
+	/* the first client encodes every tile */
+
+	if (test_cache_get(cache, encoders[0], codecId, &region, first, &tiles[0], &numTiles[0]) < 0)
+		goto out;
+
+	if (numTiles[0] != TEST_CACHE_TILES)
+	{
+		printf("%s: %d tiles instead of %d\n", name, numTiles[0], TEST_CACHE_TILES);
+		goto out;
+	}
+
+	if ((codecId == FREERDP_CODEC_REMOTEFX) && !test_cache_check_rfx(surface, first))
+		goto out;
+
+	/* the second client gets the same tiles without encoding */
+
+	if (test_cache_get(cache, encoders[1], codecId, &region, grid, &tiles[1], &numTiles[1]) < 0)
+		goto out;
+
+	for (index = 0; index < TEST_CACHE_TILES; index++)
+	{
+		if (grid[index] != first[index])
+		{
+			printf("%s: tile %d was not shared\n", name, index);
+			goto out;
+		}
+	}
+
+	/* different codec settings do not share the tiles */
+
+	if (test_cache_get(cache, encoders[2], codecId, &region, grid, &tiles[2], &numTiles[2]) < 0)
+		goto out;
+
+	for (index = 0; index < TEST_CACHE_TILES; index++)
+	{
+		if (!grid[index] || (grid[index] == first[index]))
+		{
+			printf("%s: tile %d shared across codec settings\n", name, index);
+			goto out;
+		}
+	}
+
+	/* new content in one tile only re-encodes that tile */
+
+	damage.left = 70;
+	damage.top = 80;
+	damage.right = 100;
+	damage.bottom = 120;
+
+	frameId = shadow_encode_cache_get_frame(cache);
+
+	test_cache_fill(surface, &damage, &seed);
+	region16_union_rect(&invalid, &invalid, &damage);
+	shadow_encode_cache_invalidate(cache, &invalid);
+
+	/* a client still encoding the previous frame cannot use the new tiles */
+
+	status = shadow_encode_cache_get_tiles(cache, encoders[0], codecId, &region, surface->data,
+			frameId, &tiles[3], &numTiles[3]);
+
+	if ((status != 0) || tiles[3])
+	{
+		printf("%s: tiles of a later frame served: %d\n", name, status);
+		goto out;
+	}
+
+	if (test_cache_get(cache, encoders[1], codecId, &region, grid, &tiles[3], &numTiles[3]) < 0)
+		goto out;
+
+	for (index = 0; index < TEST_CACHE_TILES; index++)
+	{
+		/* the damage lies in tile 1,1 */
+		if ((index == (TEST_CACHE_WIDTH / 64) + 1) != (grid[index] != first[index]))
+		{
+			printf("%s: tile %d %s after invalidation\n", name, index,
+					(grid[index] != first[index]) ? "re-encoded" : "not re-encoded");
+			goto out;
+		}
+	}
+
+	if ((codecId == FREERDP_CODEC_REMOTEFX) && !test_cache_check_rfx(surface, grid))
+		goto out;
+
+	result = 0;
+
+out:
+	for (index = 0; index < 4; index++)
+		shadow_encode_cache_release_tiles(tiles[index], numTiles[index]);
+
+	for (index = 0; index < 3; index++)
+		test_cache_encoder_free(encoders[index]);
+
+	shadow_encode_cache_free(cache);
+
+	if (surface)
+		free(surface->data);
+
+	free(surface);
+	free(server);
+
+	region16_uninit(&region);
+	region16_uninit(&invalid);
+
+	return result;
+}
+
+int TestShadowEncodeCache(int argc, char* argv[])
+{
+	if (test_cache_codec(FREERDP_CODEC_REMOTEFX) < 0)
+		return -1;
+
+	if (test_cache_codec(FREERDP_CODEC_NSCODEC) < 0)
+		return -1;
+
+	return 0;
+}
@@ -0,0 +1,234 @@
+/**
+ * FreeRDP: A Remote Desktop Protocol Implementation
+ * Shadow Server Graphics Pipeline Tests
+ *
+ * Copyright 2026 agent <agent@local>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <winpr/crt.h>
+#include <winpr/print.h>
+
+#include "shadow_encoder.h"
+#include "shadow_rdpgfx.h"
+
+struct test_gfx_caps
+{
+	const char* name;
+	BOOL serverH264;
+	BOOL confirmed;
+	UINT32 version;
+	UINT32 flags;
+	BOOL expected;
+};
+typedef struct test_gfx_caps TEST_GFX_CAPS;
+
+/**
+ * H.264 is only used with a confirmed version 8.1 capability set that enables
+ * it, every other client gets planar tiles.
+ */
+
+static const TEST_GFX_CAPS test_gfx_caps[] =
+{
+	{ "caps not confirmed", TRUE, FALSE, RDPGFX_CAPVERSION_81, RDPGFX_CAPS_FLAG_H264ENABLED, FALSE },
+	{ "version 8.0", TRUE, TRUE, RDPGFX_CAPVERSION_8, 0, FALSE },
+	{ "version 8.1 without H.264", TRUE, TRUE, RDPGFX_CAPVERSION_81, RDPGFX_CAPS_FLAG_SMALL_CACHE, FALSE },
+	{ "version 8.1 with H.264", TRUE, TRUE, RDPGFX_CAPVERSION_81, RDPGFX_CAPS_FLAG_H264ENABLED, TRUE },
+	{ "H.264 disabled on the server", FALSE, TRUE, RDPGFX_CAPVERSION_81, RDPGFX_CAPS_FLAG_H264ENABLED, FALSE }
+};
+
+static int test_gfx_h264(rdpShadowClient* client)
+{
+	int index;
+	BOOL status;
+	const TEST_GFX_CAPS* caps;
+	RdpgfxServerContext* rdpgfx = client->rdpgfx;
+
+	for (index = 0; index < (int) (sizeof(test_gfx_caps) / sizeof(test_gfx_caps[0])); index++)
+	{
+		caps = &test_gfx_caps[index];
+
+		client->server->h264 = caps->serverH264;
+		rdpgfx->CapsConfirmed = caps->confirmed;
+		rdpgfx->Caps.version = caps->version;
+		rdpgfx->Caps.flags = caps->flags;
+
+		status = shadow_client_rdpgfx_h264(client);
+
+		if (status != caps->expected)
+		{
+			printf("%s: H.264 %s\n", caps->name, status ? "used" : "not used");
+			return -1;
+		}
+	}
+
+	/* without a graphics pipeline there is nothing to negotiate */
+
+	client->server->h264 = TRUE;
+	client->rdpgfx = NULL;
+	status = shadow_client_rdpgfx_h264(client);
+	client->rdpgfx = rdpgfx;
+
+	if (status)
+	{
+		printf("no graphics pipeline: H.264 used\n");
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * Updates wait for the capabilities, but not forever: a client that never
+ * confirms them falls back to surface bits.
+ */
+
+static int test_gfx_ready(rdpShadowClient* client)
+{
+	int status;
+	RdpgfxServerContext* rdpgfx = client->rdpgfx;
+
+	client->gfxOpenTime = 100000;
+	rdpgfx->CapsConfirmed = FALSE;
+
+	if (shadow_client_rdpgfx_ready(client, client->gfxOpenTime + 10) != 0)
+	{
+		printf("shadow_client_rdpgfx_ready: not waiting for the capabilities\n");
+		return -1;
+	}
+
+	if (shadow_client_rdpgfx_ready(client, client->gfxOpenTime + SHADOW_CLIENT_GFX_CAPS_TIMEOUT - 1) != 0)
+	{
+		printf("shadow_client_rdpgfx_ready: timed out too early\n");
+		return -1;
+	}
+
+	if (shadow_client_rdpgfx_ready(client, client->gfxOpenTime + SHADOW_CLIENT_GFX_CAPS_TIMEOUT) >= 0)
+	{
+		printf("shadow_client_rdpgfx_ready: no timeout without capabilities\n");
+		return -1;
+	}
+
+	/* the client thread sleeps until the capabilities may still arrive */
+
+	if (shadow_client_rdpgfx_caps_wait(client, client->gfxOpenTime + 1000) != SHADOW_CLIENT_GFX_CAPS_TIMEOUT - 1000)
+	{
+		printf("shadow_client_rdpgfx_caps_wait: wrong wait while the capabilities are pending\n");
+		return -1;
+	}
+
+	if (shadow_client_rdpgfx_caps_wait(client, client->gfxOpenTime + SHADOW_CLIENT_GFX_CAPS_TIMEOUT) != 0)
+	{
+		printf("shadow_client_rdpgfx_caps_wait: waiting after the timeout\n");
+		return -1;
+	}
+
+	/* once confirmed, the channel stays usable */
+
+	rdpgfx->CapsConfirmed = TRUE;
+
+	if (shadow_client_rdpgfx_ready(client, client->gfxOpenTime + (SHADOW_CLIENT_GFX_CAPS_TIMEOUT * 2)) != 1)
+	{
+		printf("shadow_client_rdpgfx_ready: confirmed capabilities not ready\n");
+		return -1;
+	}
+
+	if (shadow_client_rdpgfx_caps_wait(client, client->gfxOpenTime + 10) != 0)
+	{
+		printf("shadow_client_rdpgfx_caps_wait: waiting for confirmed capabilities\n");
+		return -1;
+	}
+
+	client->rdpgfx = NULL;
+	status = shadow_client_rdpgfx_ready(client, client->gfxOpenTime);
+	client->rdpgfx = rdpgfx;
+
+	if (status >= 0)
+	{
+		printf("shadow_client_rdpgfx_ready: ready without a graphics pipeline\n");
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * The H.264 metablock announces a lower quality as the encoder quality level
+ * degrades with the bandwidth.
+ */
+
+static int test_gfx_h264_quality(void)
+{
+	int qualityLevel;
+	BYTE qpVal;
+	BYTE qualityVal;
+	BYTE lastQpVal = 0;
+	BYTE lastQualityVal = 101;
+	rdpShadowEncoder encoder;
+
+	ZeroMemory(&encoder, sizeof(rdpShadowEncoder));
+
+	for (qualityLevel = 0; qualityLevel < SHADOW_ENCODER_QUALITY_LEVELS; qualityLevel++)
+	{
+		encoder.qualityLevel = qualityLevel;
+		shadow_encoder_h264_quality(&encoder, &qpVal, &qualityVal);
+
+		if ((qpVal <= lastQpVal) || (qualityVal >= lastQualityVal) || (qpVal > 51) || (qualityVal > 100))
+		{
+			printf("quality level %d: qpVal %u qualityVal %u\n", qualityLevel, qpVal, qualityVal);
+			return -1;
+		}
+
+		lastQpVal = qpVal;
+		lastQualityVal = qualityVal;
+	}
+
+	return 0;
+}
+
+int TestShadowGfx(int argc, char* argv[])
+{
+	int result = -1;
+	rdpShadowClient* client;
+	rdpShadowServer* server;
+	RdpgfxServerContext* rdpgfx;
+
+	client = (rdpShadowClient*) calloc(1, sizeof(rdpShadowClient));
+	server = (rdpShadowServer*) calloc(1, sizeof(rdpShadowServer));
+	rdpgfx = (RdpgfxServerContext*) calloc(1, sizeof(RdpgfxServerContext));
+
+	if (!client || !server || !rdpgfx)
+		goto out;
+
+	client->server = server;
+	client->rdpgfx = rdpgfx;
+
+	if (test_gfx_h264(client) < 0)
+		goto out;
+
+	if (test_gfx_ready(client) < 0)
+		goto out;
+
+	if (test_gfx_h264_quality() < 0)
+		goto out;
+
+	result = 0;
+
+out:
+	free(rdpgfx);
+	free(server);
+	free(client);
+
+	return result;
+}
@@ -0,0 +1,339 @@
+/**
+ * FreeRDP: A Remote Desktop Protocol Implementation
+ * Shadow Server Move Detection Tests
+ *
+ * Copyright 2026 agent <agent@local>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <winpr/crt.h>
+#include <winpr/print.h>
+
+#include "shadow_capture.h"
+
+#define TEST_MOVE_WIDTH		512
+#define TEST_MOVE_HEIGHT	384
+#define TEST_MOVE_STEP		(TEST_MOVE_WIDTH * 4)
+
+static UINT32 test_move_rand(UINT32* seed)
+{
+	*seed = (*seed * 1103515245) + 12345;
+	return (*seed >> 16) & 0x7FFF;
+}
+
+static void test_move_fill(BYTE* pData, const RECTANGLE_16* rect, UINT32* seed)
+{
+	int x, y;
+	UINT32* pixel;
+
+	for (y = rect->top; y < rect->bottom; y++)
+	{
+		pixel = (UINT32*) &pData[y * TEST_MOVE_STEP];
+
+		for (x = rect->left; x < rect->right; x++)
+			pixel[x] = (test_move_rand(seed) << 16) | test_move_rand(seed);
+	}
+}
+
+/**
+ * Copies the content of rect, offset by (-dx, -dy) in the old frame, to rect
+ * in the new frame, like a scrolled window would.
+ */
+
+static void test_move_copy(BYTE* pNew, const BYTE* pOld, const RECTANGLE_16* rect, int dx, int dy)
+{
+	int y;
+
+	for (y = rect->top; y < rect->bottom; y++)
+	{
+		CopyMemory(&pNew[(y * TEST_MOVE_STEP) + (rect->left * 4)],
+				&pOld[((y - dy) * TEST_MOVE_STEP) + ((rect->left - dx) * 4)],
+				(rect->right - rect->left) * 4);
+	}
+}
+
+/**
+ * Builds the new frame from the old one with the given block moved and the
+ * uncovered area redrawn, diffs both frames and looks for the move.
+ */
+
+static int test_move_detect(const char* name, const RECTANGLE_16* block, int dx, int dy, int expected)
+{
+	int status;
+	int result = -1;
+	UINT32 seed = 0x4D4F5645;
+	BYTE* pOld = NULL;
+	BYTE* pNew = NULL;
+	RECTANGLE_16 frame;
+	RECTANGLE_16 moved;
+	RECTANGLE_16 exposed;
+	REGION16 region;
+	rdpShadowMove move;
+	rdpShadowCapture* capture;
+
+	capture = shadow_capture_new(NULL);
+
+	if (!capture)
+		return -1;
+
+	region16_init(&region);
+
+	pOld = (BYTE*) malloc(TEST_MOVE_STEP * TEST_MOVE_HEIGHT);
+	pNew = (BYTE*) malloc(TEST_MOVE_STEP * TEST_MOVE_HEIGHT);
+
+	if (!pOld || !pNew)
+		goto out;
+
+	frame.left = frame.top = 0;
+	frame.right = TEST_MOVE_WIDTH;
+	frame.bottom = TEST_MOVE_HEIGHT;
+
+	test_move_fill(pOld, &frame, &seed);
+	CopyMemory(pNew, pOld, TEST_MOVE_STEP * TEST_MOVE_HEIGHT);
+
+	/* the part of the block whose source lies inside the block moves, the rest is new */
+
+	moved = *block;
+	exposed = *block;
+
+	if (dy < 0)
+	{
+		moved.bottom += dy;
+		exposed.top = moved.bottom;
+	}
+	else if (dy > 0)
+	{
+		moved.top += dy;
+		exposed.bottom = moved.top;
+	}
+	else if (dx < 0)
+	{
+		moved.right += dx;
+		exposed.left = moved.right;
+	}
+	else if (dx > 0)
+	{
+		moved.left += dx;
+		exposed.right = moved.left;
+	}
+
+	if (dx || dy)
+	{
+		test_move_copy(pNew, pOld, &moved, dx, dy);
+		test_move_fill(pNew, &exposed, &seed);
+	}
+	else
+	{
+		/* no move at all, only new content */
+		test_move_fill(pNew, block, &seed);
+	}
+
+	if (shadow_capture_compare(capture, pOld, TEST_MOVE_STEP, TEST_MOVE_WIDTH, TEST_MOVE_HEIGHT, &region) != 1)
+		goto out;
+
+	region16_clear(&region);
+
+	if (shadow_capture_compare(capture, pNew, TEST_MOVE_STEP, TEST_MOVE_WIDTH, TEST_MOVE_HEIGHT, &region) != 1)
+	{
+		printf("%s: no damage\n", name);
+		goto out;
+	}
+
+	ZeroMemory(&move, sizeof(move));
+	status = shadow_capture_detect_move(capture, pOld, TEST_MOVE_STEP, pNew, TEST_MOVE_STEP, &region, &move);
+
+	if (status != expected)
+	{
+		printf("%s: detect_move returned %d instead of %d\n", name, status, expected);
+		goto out;
+	}
+
+	if (status > 0)
+	{
+		if ((move.dx != dx) || (move.dy != dy))
+		{
+			printf("%s: move by %d,%d instead of %d,%d\n", name, move.dx, move.dy, dx, dy);
+			goto out;
+		}
+
+		/* the destination must lie within the moved part and cover most of it */
+
+		if ((move.dst.left < moved.left) || (move.dst.top < moved.top) ||
+				(move.dst.right > moved.right) || (move.dst.bottom > moved.bottom) ||
+				((move.dst.right - move.dst.left) * 2 < (moved.right - moved.left)) ||
+				((move.dst.bottom - move.dst.top) * 2 < (moved.bottom - moved.top)))
+		{
+			printf("%s: destination %d,%d-%d,%d outside of %d,%d-%d,%d\n", name,
+					move.dst.left, move.dst.top, move.dst.right, move.dst.bottom,
+					moved.left, moved.top, moved.right, moved.bottom);
+			goto out;
+		}
+	}
+
+	result = 0;
+
+out:
+	region16_uninit(&region);
+	free(pOld);
+	free(pNew);
+	shadow_capture_free(capture);
+
+	return result;
+}
+
+static BOOL test_move_region_equal(REGION16* region, const RECTANGLE_16* rects, int count)
+{
+	int index;
+	int numRects = 0;
+	const RECTANGLE_16* regionRects;
+
+	regionRects = region16_rects(region, &numRects);
+
+	if (numRects != count)
+		return FALSE;
+
+	for (index = 0; index < count; index++)
+	{
+		if ((regionRects[index].left != rects[index].left) || (regionRects[index].top != rects[index].top) ||
+				(regionRects[index].right != rects[index].right) || (regionRects[index].bottom != rects[index].bottom))
+			return FALSE;
+	}
+
+	return TRUE;
+}
+
+/**
+ * Pending damage inside the move source follows the move, damage inside the
+ * destination that the move overwrites is dropped.
+ */
+
+static int test_move_apply(void)
+{
+	int index;
+	int result = -1;
+	REGION16 region;
+	rdpShadowMove move;
+	RECTANGLE_16 rects[3];
+	RECTANGLE_16 expected[2];
+
+	region16_init(&region);
+
+	move.dst.left = 0;
+	move.dst.top = 100;
+	move.dst.right = 200;
+	move.dst.bottom = 300;
+	move.dx = 0;
+	move.dy = -20;
+
+	/* inside the source, moves up by 20 */
+	rects[0].left = 10;
+	rects[0].top = 150;
+	rects[0].right = 50;
+	rects[0].bottom = 170;
+
+	/* outside of the move, unchanged */
+	rects[1].left = 300;
+	rects[1].top = 0;
+	rects[1].right = 310;
+	rects[1].bottom = 10;
+
+	/* in the destination but not in the source, overwritten by clean source lines */
+	rects[2].left = 0;
+	rects[2].top = 100;
+	rects[2].right = 200;
+	rects[2].bottom = 110;
+
+	for (index = 0; index < 3; index++)
+		region16_union_rect(&region, &region, &rects[index]);
+
+	shadow_capture_apply_move(&region, &move);
+
+	expected[0] = rects[1];
+	expected[1].left = 10;
+	expected[1].top = 130;
+	expected[1].right = 50;
+	expected[1].bottom = 150;
+
+	if (!test_move_region_equal(&region, expected, 2))
+	{
+		printf("shadow_capture_apply_move: unexpected region\n");
+		goto out;
+	}
+
+	/* subtracting a rectangle splits the region around it */
+
+	region16_clear(&region);
+	region16_union_rect(&region, &region, &move.dst);
+
+	rects[0].left = 50;
+	rects[0].top = 150;
+	rects[0].right = 100;
+	rects[0].bottom = 200;
+
+	shadow_capture_subtract_rect(&region, &rects[0]);
+
+	if ((region16_n_rects(&region) != 4) || region16_intersects_rect(&region, &rects[0]))
+	{
+		printf("shadow_capture_subtract_rect: unexpected region\n");
+		goto out;
+	}
+
+	result = 0;
+
+out:
+	region16_uninit(&region);
+
+	return result;
+}
+
+int TestShadowMove(int argc, char* argv[])
+{
+	RECTANGLE_16 block;
+
+	/* a full width window scrolling up and down */
+
+	block.left = 0;
+	block.top = 64;
+	block.right = TEST_MOVE_WIDTH;
+	block.bottom = 320;
+
+	if (test_move_detect("scroll up", &block, 0, -24, 1) < 0)
+		return -1;
+
+	if (test_move_detect("scroll down", &block, 0, 40, 1) < 0)
+		return -1;
+
+	/* a window not aligned on the 16 pixel tiles scrolling sideways */
+
+	block.left = 37;
+	block.top = 21;
+	block.right = 451;
+	block.bottom = 371;
+
+	if (test_move_detect("scroll left", &block, -32, 0, 1) < 0)
+		return -1;
+
+	if (test_move_detect("scroll right", &block, 7, 0, 1) < 0)
+		return -1;
+
+	/* new content without a move */
+
+	if (test_move_detect("no move", &block, 0, 0, 0) < 0)
+		return -1;
+
+	if (test_move_apply() < 0)
+		return -1;
+
+	return 0;
+}
@@ -0,0 +1,203 @@
+/**
+ * FreeRDP: A Remote Desktop Protocol Implementation
+ * Shadow Server Surface Double Buffering Tests
+ *
+ * Copyright 2026 agent <agent@local>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <winpr/crt.h>
+#include <winpr/print.h>
+#include <winpr/synch.h>
+#include <winpr/thread.h>
+
+#include "shadow_surface.h"
+
+#define TEST_SURFACE_WIDTH		128
+#define TEST_SURFACE_HEIGHT		64
+
+static UINT32 test_surface_rand(UINT32* seed)
+{
+	*seed = (*seed * 1103515245) + 12345;
+	return (*seed >> 16) & 0x7FFF;
+}
+
+static void test_surface_fill(rdpShadowSurface* surface, BYTE* pData, const RECTANGLE_16* rect, UINT32* seed)
+{
+	int x, y;
+	UINT32* pixel;
+
+	for (y = rect->top; y < rect->bottom; y++)
+	{
+		pixel = (UINT32*) &pData[y * surface->scanline];
+
+		for (x = rect->left; x < rect->right; x++)
+			pixel[x] = (test_surface_rand(seed) << 16) | test_surface_rand(seed);
+	}
+}
+
+static BOOL test_surface_equal(rdpShadowSurface* surface, const BYTE* pData1, const BYTE* pData2,
+		const RECTANGLE_16* rect)
+{
+	int y;
+	int offset;
+
+	for (y = rect->top; y < rect->bottom; y++)
+	{
+		offset = (y * surface->scanline) + (rect->left * 4);
+
+		if (memcmp(&pData1[offset], &pData2[offset], (rect->right - rect->left) * 4) != 0)
+			return FALSE;
+	}
+
+	return TRUE;
+}
+
+static void* test_surface_capture_thread(void* arg)
+{
+	rdpShadowSurface* surface = (rdpShadowSurface*) arg;
+
+	shadow_surface_begin_frame(surface);
+
+	return NULL;
+}
+
+static void test_surface_publish(rdpShadowSurface* surface, const RECTANGLE_16* rect)
+{
+	REGION16 damage;
+
+	region16_init(&damage);
+	region16_union_rect(&damage, &damage, rect);
+	shadow_surface_publish(surface, &damage, NULL);
+	region16_uninit(&damage);
+}
+
+int TestShadowSurface(int argc, char* argv[])
+{
+	int result = -1;
+	UINT32 seed = 0x53555246;
+	BYTE* pBack;
+	BYTE* pFront;
+	BYTE* pPinned = NULL;
+	HANDLE thread = NULL;
+	RECTANGLE_16 rect1;
+	RECTANGLE_16 rect2;
+	rdpShadowSurface* surface;
+
+	rect1.left = 8;
+	rect1.top = 8;
+	rect1.right = 40;
+	rect1.bottom = 24;
+
+	rect2.left = 64;
+	rect2.top = 32;
+	rect2.right = 120;
+	rect2.bottom = 60;
+
+	surface = shadow_surface_new(NULL, 0, 0, TEST_SURFACE_WIDTH, TEST_SURFACE_HEIGHT);
+
+	if (!surface)
+		return -1;
+
+	/* the first frame is captured aside and becomes the front buffer */
+
+	pFront = surface->data;
+	pBack = shadow_surface_begin_frame(surface);
+
+	if (!pBack || (pBack == pFront))
+	{
+		printf("no back buffer\n");
+		goto out;
+	}
+
+	test_surface_fill(surface, pBack, &rect1, &seed);
+
+	if (!test_surface_equal(surface, surface->data, pFront, &rect1))
+	{
+		printf("front buffer written before the frame was published\n");
+		goto out;
+	}
+
+	test_surface_publish(surface, &rect1);
+
+	if ((surface->data != pBack) || (surface->backData != pFront))
+	{
+		printf("buffers not swapped\n");
+		goto out;
+	}
+
+	/* a client pins the frame, the next one brings the other buffer up to date */
+
+	pPinned = shadow_surface_acquire(surface);
+
+	pBack = shadow_surface_begin_frame(surface);
+
+	if ((pBack != pFront) || !test_surface_equal(surface, pBack, pPinned, &rect1))
+	{
+		printf("back buffer not brought up to date\n");
+		goto out;
+	}
+
+	test_surface_fill(surface, pBack, &rect2, &seed);
+	test_surface_publish(surface, &rect2);
+
+	/* the buffer still pinned is not written until the client releases it */
+
+	if (!(thread = CreateThread(NULL, 0, (LPTHREAD_START_ROUTINE) test_surface_capture_thread, surface, 0, NULL)))
+		goto out;
+
+	if (WaitForSingleObject(thread, 100) != WAIT_TIMEOUT)
+	{
+		printf("pinned buffer reused\n");
+		goto out;
+	}
+
+	if (test_surface_equal(surface, pPinned, surface->data, &rect2))
+	{
+		printf("pinned buffer written\n");
+		goto out;
+	}
+
+	shadow_surface_release(surface, pPinned);
+	pPinned = NULL;
+
+	if (WaitForSingleObject(thread, 5000) != WAIT_OBJECT_0)
+	{
+		printf("released buffer not reused\n");
+		goto out;
+	}
+
+	if (!test_surface_equal(surface, surface->backData, surface->data, &rect1) ||
+			!test_surface_equal(surface, surface->backData, surface->data, &rect2))
+	{
+		printf("released buffer not brought up to date\n");
+		goto out;
+	}
+
+	result = 0;
+
+out:
+	if (pPinned)
+		shadow_surface_release(surface, pPinned);
+
+	if (thread)
+	{
+		WaitForSingleObject(thread, INFINITE);
+		CloseHandle(thread);
+	}
+
+	shadow_surface_free(surface);
+
+	return result;
+}
@@ -254,15 +254,19 @@ static INLINE BOOL Stream_SafeSeek(wStream* s, size_t size) {
 
 /* StreamPool */
 
+/**
+ * Pooled streams are sorted into power of two size classes, each with a
+ * lock-free free list. The allocator state is private to StreamPool.c.
+ */
+
+typedef struct _wStreamPoolPrivate wStreamPoolPrivate;
+
 struct _wStreamPool
 {
-	int aSize;
-	int aCapacity;
-	wStream** aArray;
+	LONG aSize;
+	LONG uSize;
 
-	int uSize;
-	int uCapacity;
-	wStream** uArray;
+	wStreamPoolPrivate* priv;
 
 	CRITICAL_SECTION lock;
 	BOOL synchronized;
@@ -23,6 +23,8 @@
 
 #include <winpr/crt.h>
 #include <winpr/pool.h>
+#include <winpr/sysinfo.h>
+#include <winpr/interlocked.h>
 
 #include "pool.h"
 
@@ -62,24 +64,162 @@ static TP_POOL DEFAULT_POOL =
 {
 	0,    /* DWORD Minimum */
 	500,  /* DWORD Maximum */
-	NULL, /* wArrayList* Threads */
-	NULL, /* wQueue* PendingQueue */
+	NULL, /* TP_WORKER** Workers */
+	0,    /* LONG WorkerCount */
+	0,    /* LONG NextWorker */
+	NULL, /* HANDLE WorkSemaphore */
 	NULL, /* HANDLE TerminateEvent */
-	NULL, /* wCountdownEvent* WorkComplete */
 };
 
+static INIT_ONCE default_pool_once = INIT_ONCE_STATIC_INIT;
+static INIT_ONCE worker_tls_once = INIT_ONCE_STATIC_INIT;
+static DWORD worker_tls_index = TLS_OUT_OF_INDEXES;
+
+static BOOL CALLBACK worker_tls_init(PINIT_ONCE once, PVOID param, PVOID* context)
+{
+	worker_tls_index = TlsAlloc();
+	return (worker_tls_index != TLS_OUT_OF_INDEXES);
+}
+
+static BOOL CALLBACK default_pool_init(PINIT_ONCE once, PVOID param, PVOID* context)
+{
+	return InitializeCriticalSectionAndSpinCount(&DEFAULT_POOL.Lock, 4000);
+}
+
+static TP_WORKER* worker_current(void)
+{
+	if (worker_tls_index == TLS_OUT_OF_INDEXES)
+		return NULL;
+
+	return (TP_WORKER*) TlsGetValue(worker_tls_index);
+}
+
+static BOOL worker_push(TP_WORKER* worker, PTP_WORK work)
+{
+	DWORD index;
+	DWORD capacity;
+	PTP_WORK* items;
+
+	EnterCriticalSection(&worker->Lock);
+
+	if (worker->Count >= worker->Capacity)
+	{
+		capacity = worker->Capacity * 2;
+
+		if (!(items = (PTP_WORK*) calloc(capacity, sizeof(PTP_WORK))))
+		{
+			LeaveCriticalSection(&worker->Lock);
+			return FALSE;
+		}
+
+		for (index = 0; index < worker->Count; index++)
+			items[index] = worker->Items[(worker->Head + index) % worker->Capacity];
+
+		free(worker->Items);
+		worker->Items = items;
+		worker->Capacity = capacity;
+		worker->Head = 0;
+	}
+
+	worker->Items[(worker->Head + worker->Count) % worker->Capacity] = work;
+	worker->Count++;
+
+	LeaveCriticalSection(&worker->Lock);
+
+	return TRUE;
+}
+
+static PTP_WORK worker_pop(TP_WORKER* worker)
+{
+	PTP_WORK work = NULL;
+
+	EnterCriticalSection(&worker->Lock);
+
+	if (worker->Count > 0)
+	{
+		worker->Count--;
+		work = worker->Items[(worker->Head + worker->Count) % worker->Capacity];
+	}
+
+	LeaveCriticalSection(&worker->Lock);
+
+	return work;
+}
+
+static PTP_WORK worker_steal(TP_WORKER* worker)
+{
+	PTP_WORK work = NULL;
+
+	EnterCriticalSection(&worker->Lock);
+
+	if (worker->Count > 0)
+	{
+		work = worker->Items[worker->Head];
+		worker->Head = (worker->Head + 1) % worker->Capacity;
+		worker->Count--;
+	}
+
+	LeaveCriticalSection(&worker->Lock);
+
+	return work;
+}
+
+/**
+ * Called after a WorkSemaphore token has been acquired: every token matches
+ * one queued item, so the item is guaranteed to be found in some deque.
+ */
+
+static PTP_WORK worker_take(PTP_POOL pool, TP_WORKER* self)
+{
+	LONG index;
+	LONG count;
+	LONG start;
+	PTP_WORK work;
+
+	while (1)
+	{
+		if (self && (work = worker_pop(self)))
+			return work;
+
+		count = pool->WorkerCount;
+		start = self ? (LONG) self->Index + 1 : 0;
+
+		for (index = 0; index < count; index++)
+		{
+			if ((work = worker_steal(pool->Workers[(start + index) % count])))
+				return work;
+		}
+
+		SwitchToThread();
+	}
+
+	return NULL;
+}
+
+static void worker_run(PTP_WORK work)
+{
+	TP_CALLBACK_INSTANCE callbackInstance;
+
+	callbackInstance.Work = work;
+	work->WorkCallback(&callbackInstance, work->CallbackParameter, work);
+	CountdownEvent_Signal(work->WorkComplete, 1);
+	ThreadpoolReleaseWork(work);
+}
+
 static void* thread_pool_work_func(void* arg)
 {
 	DWORD status;
 	PTP_POOL pool;
-	PTP_WORK work;
 	HANDLE events[2];
-	PTP_CALLBACK_INSTANCE callbackInstance;
+	TP_WORKER* worker;
+
+	worker = (TP_WORKER*) arg;
+	pool = worker->Pool;
 
-	pool = (PTP_POOL) arg;
+	TlsSetValue(worker_tls_index, worker);
 
 	events[0] = pool->TerminateEvent;
-	events[1] = Queue_Event(pool->PendingQueue);
+	events[1] = pool->WorkSemaphore;
 
 	while (1)
 	{
@@ -91,96 +231,209 @@ static void* thread_pool_work_func(void* arg)
 		if (status != (WAIT_OBJECT_0 + 1))
 			break;
 
-		callbackInstance = (PTP_CALLBACK_INSTANCE) Queue_Dequeue(pool->PendingQueue);
-
-		if (callbackInstance)
-		{
-			work = callbackInstance->Work;
-			work->WorkCallback(callbackInstance, work->CallbackParameter, work);
-			CountdownEvent_Signal(pool->WorkComplete, 1);
-			free(callbackInstance);
-		}
+		worker_run(worker_take(pool, worker));
 	}
 
 	ExitThread(0);
 	return NULL;
 }
 
-static void threads_close(void *thread)
+static void worker_free(TP_WORKER* worker)
 {
-	WaitForSingleObject(thread, INFINITE);
-	CloseHandle(thread);
+	if (worker->Thread)
+	{
+		WaitForSingleObject(worker->Thread, INFINITE);
+		CloseHandle(worker->Thread);
+	}
+
+	DeleteCriticalSection(&worker->Lock);
+	free(worker->Items);
+	free(worker);
 }
 
+/**
+ * Must be called with the pool lock held.
+ */
+
+static BOOL worker_add(PTP_POOL pool)
+{
+	TP_WORKER* worker;
+
+	if (pool->WorkerCount >= TP_POOL_MAX_WORKERS)
+		return FALSE;
+
+	if (!(worker = (TP_WORKER*) calloc(1, sizeof(TP_WORKER))))
+		return FALSE;
+
+	worker->Pool = pool;
+	worker->Index = (DWORD) pool->WorkerCount;
+	worker->Capacity = 64;
+
+	if (!(worker->Items = (PTP_WORK*) calloc(worker->Capacity, sizeof(PTP_WORK))))
+		goto fail_items;
+
+	if (!InitializeCriticalSectionAndSpinCount(&worker->Lock, 4000))
+		goto fail_lock;
+
+	/* publish the slot before the count so that thieves never see a NULL worker */
+	pool->Workers[worker->Index] = worker;
+	InterlockedIncrement(&pool->WorkerCount);
+
+	if (!(worker->Thread = CreateThread(NULL, 0,
+				(LPTHREAD_START_ROUTINE) thread_pool_work_func,
+				(void*) worker, 0, NULL)))
+	{
+		/* keep the slot: its deque stays reachable for submissions and thieves */
+		return FALSE;
+	}
+
+	return TRUE;
+
+fail_lock:
+	free(worker->Items);
+fail_items:
+	free(worker);
+	return FALSE;
+}
+
+static void threads_close(PTP_POOL pool)
+{
+	LONG index;
+
+	SetEvent(pool->TerminateEvent);
+
+	for (index = 0; index < pool->WorkerCount; index++)
+		worker_free(pool->Workers[index]);
+
+	free(pool->Workers);
+	pool->Workers = NULL;
+	pool->WorkerCount = 0;
+}
+
+/**
+ * Must be called with the pool lock held.
+ */
+
 static BOOL InitializeThreadpool(PTP_POOL pool)
 {
-	int index;
-	HANDLE thread;
+	DWORD index;
+	DWORD count;
+	SYSTEM_INFO sysinfo;
 
-	if (pool->Threads)
+	if (pool->Workers)
 		return TRUE;
 
 	pool->Minimum = 0;
 	pool->Maximum = 500;
+	pool->NextWorker = 0;
 
-	if (!(pool->PendingQueue = Queue_New(TRUE, -1, -1)))
-		goto fail_queue_new;
+	if (!InitOnceExecuteOnce(&worker_tls_once, worker_tls_init, NULL, NULL))
+		goto fail_tls;
 
-	if (!(pool->WorkComplete = CountdownEvent_New(0)))
-		goto fail_countdown_event;
+	if (!(pool->WorkSemaphore = CreateSemaphore(NULL, 0, MAXLONG, NULL)))
+		goto fail_work_semaphore;
 
 	if (!(pool->TerminateEvent = CreateEvent(NULL, TRUE, FALSE, NULL)))
 		goto fail_terminate_event;
 
-	if (!(pool->Threads = ArrayList_New(TRUE)))
-		goto fail_thread_array;
+	if (!(pool->Workers = (TP_WORKER**) calloc(TP_POOL_MAX_WORKERS, sizeof(TP_WORKER*))))
+		goto fail_workers;
 
-	pool->Threads->object.fnObjectFree = threads_close;
+	GetSystemInfo(&sysinfo);
+	count = sysinfo.dwNumberOfProcessors;
 
-	for (index = 0; index < 4; index++)
-	{
-		if (!(thread = CreateThread(NULL, 0,
-					(LPTHREAD_START_ROUTINE) thread_pool_work_func,
-					(void*) pool, 0, NULL)))
-		{
-			goto fail_create_threads;
-		}
+	if (count > pool->Maximum)
+		count = pool->Maximum;
 
-		if (ArrayList_Add(pool->Threads, thread) < 0)
+	if (count > TP_POOL_MAX_WORKERS)
+		count = TP_POOL_MAX_WORKERS;
+
+	if (count < 1)
+		count = 1;
+
+	for (index = 0; index < count; index++)
+	{
+		if (!worker_add(pool))
 			goto fail_create_threads;
 	}
 
 	return TRUE;
 
 fail_create_threads:
-	SetEvent(pool->TerminateEvent);
-	ArrayList_Free(pool->Threads);
-	pool->Threads = NULL;
-fail_thread_array:
+	threads_close(pool);
+fail_workers:
 	CloseHandle(pool->TerminateEvent);
 	pool->TerminateEvent = NULL;
 fail_terminate_event:
-	CountdownEvent_Free(pool->WorkComplete);
-	pool->WorkComplete = NULL;
-fail_countdown_event:
-	Queue_Free(pool->PendingQueue);
-	pool->WorkComplete = NULL;
-fail_queue_new:
+	CloseHandle(pool->WorkSemaphore);
+	pool->WorkSemaphore = NULL;
+fail_work_semaphore:
+fail_tls:
 
 	return FALSE;
+}
+
+BOOL ThreadpoolPushWork(PTP_POOL pool, PTP_WORK work)
+{
+	LONG count;
+	TP_WORKER* worker;
+
+	worker = worker_current();
+
+	/* callbacks submitting nested work keep it on their own deque */
+	if (!worker || (worker->Pool != pool))
+	{
+		count = pool->WorkerCount;
 
+		if (count < 1)
+			return FALSE;
+
+		worker = pool->Workers[((DWORD) InterlockedIncrement(&pool->NextWorker)) % count];
+	}
+
+	if (!worker_push(worker, work))
+		return FALSE;
+
+	return ReleaseSemaphore(pool->WorkSemaphore, 1, NULL);
+}
+
+/**
+ * Runs one pending item if there is one; used by worker threads that block
+ * on other work objects so that nested waits cannot starve the pool.
+ */
+
+BOOL ThreadpoolHelpWork(PTP_POOL pool)
+{
+	TP_WORKER* worker;
+
+	worker = worker_current();
+
+	if (!worker || (worker->Pool != pool))
+		return FALSE;
+
+	if (WaitForSingleObject(pool->WorkSemaphore, 0) != WAIT_OBJECT_0)
+		return FALSE;
+
+	worker_run(worker_take(pool, worker));
+
+	return TRUE;
 }
 
 PTP_POOL GetDefaultThreadpool()
 {
+	BOOL status;
 	PTP_POOL pool = NULL;
 
 	pool = &DEFAULT_POOL;
 
-	if (!InitializeThreadpool(pool))
+	if (!InitOnceExecuteOnce(&default_pool_once, default_pool_init, NULL, NULL))
 		return NULL;
 
-	return pool;
+	EnterCriticalSection(&pool->Lock);
+	status = InitializeThreadpool(pool);
+	LeaveCriticalSection(&pool->Lock);
+
+	return status ? pool : NULL;
 }
 
 #endif
@@ -197,15 +450,28 @@ PTP_POOL CreateThreadpool(PVOID reserved)
 	if (pCreateThreadpool)
 		return pCreateThreadpool(reserved);
 #else
+	BOOL status;
+
 	if (!(pool = (PTP_POOL) calloc(1, sizeof(TP_POOL))))
 		return NULL;
 
-	if (!InitializeThreadpool(pool))
+	if (!InitializeCriticalSectionAndSpinCount(&pool->Lock, 4000))
 	{
 		free(pool);
 		return NULL;
 	}
 
+	EnterCriticalSection(&pool->Lock);
+	status = InitializeThreadpool(pool);
+	LeaveCriticalSection(&pool->Lock);
+
+	if (!status)
+	{
+		DeleteCriticalSection(&pool->Lock);
+		free(pool);
+		return NULL;
+	}
+
 	return pool;
 #endif
 }
@@ -218,22 +484,19 @@ VOID CloseThreadpool(PTP_POOL ptpp)
 	if (pCloseThreadpool)
 		pCloseThreadpool(ptpp);
 #else
-	SetEvent(ptpp->TerminateEvent);
+	threads_close(ptpp);
 
-	ArrayList_Free(ptpp->Threads);
-	Queue_Free(ptpp->PendingQueue);
-	CountdownEvent_Free(ptpp->WorkComplete);
+	CloseHandle(ptpp->WorkSemaphore);
 	CloseHandle(ptpp->TerminateEvent);
 
 	if (ptpp == &DEFAULT_POOL)
 	{
-		ptpp->Threads = NULL;
-		ptpp->PendingQueue = NULL;
-		ptpp->WorkComplete = NULL;
+		ptpp->WorkSemaphore = NULL;
 		ptpp->TerminateEvent = NULL;
 	}
 	else
 	{
+		DeleteCriticalSection(&ptpp->Lock);
 		free(ptpp);
 	}
 #endif
@@ -247,22 +510,27 @@ BOOL SetThreadpoolThreadMinimum(PTP_POOL ptpp, DWORD cthrdMic)
 	if (pSetThreadpoolThreadMinimum)
 		return pSetThreadpoolThreadMinimum(ptpp, cthrdMic);
 #else
-	HANDLE thread;
+	BOOL status = TRUE;
+
+	EnterCriticalSection(&ptpp->Lock);
 
 	ptpp->Minimum = cthrdMic;
 
-	while (ArrayList_Count(ptpp->Threads) < ptpp->Minimum)
-	{
-		if (!(thread = CreateThread(NULL, 0,
-				(LPTHREAD_START_ROUTINE) thread_pool_work_func,
-				(void*) ptpp, 0, NULL)))
-		{
-			return FALSE;
-		}
+	if (ptpp->Maximum < ptpp->Minimum)
+		ptpp->Maximum = ptpp->Minimum;
 
-		if (ArrayList_Add(ptpp->Threads, thread) < 0)
-			return FALSE;
+	if (ptpp->Minimum > TP_POOL_MAX_WORKERS)
+		status = FALSE;
+
+	while (status && ((DWORD) ptpp->WorkerCount < ptpp->Minimum))
+	{
+		if (!worker_add(ptpp))
+			status = FALSE;
 	}
+
+	LeaveCriticalSection(&ptpp->Lock);
+
+	return status;
 #endif
 	return TRUE;
 }
@@ -275,7 +543,18 @@ VOID SetThreadpoolThreadMaximum(PTP_POOL ptpp, DWORD cthrdMost)
 	if (pSetThreadpoolThreadMaximum)
 		pSetThreadpoolThreadMaximum(ptpp, cthrdMost);
 #else
+	/**
+	 * Workers are never retired while they may own queued items,
+	 * the maximum only bounds the number of threads the pool will create.
+	 */
+	EnterCriticalSection(&ptpp->Lock);
+
 	ptpp->Maximum = cthrdMost;
+
+	if (ptpp->Minimum > ptpp->Maximum)
+		ptpp->Minimum = ptpp->Maximum;
+
+	LeaveCriticalSection(&ptpp->Lock);
 #endif
 }
 
@@ -30,14 +30,36 @@ struct _TP_CALLBACK_INSTANCE
 	PTP_WORK Work;
 };
 
+#define TP_POOL_MAX_WORKERS	512
+
+/**
+ * Each worker owns a deque of pending work items: the owner pushes and pops
+ * at the tail (LIFO, cache friendly), idle workers steal from the head (FIFO).
+ */
+
+struct _TP_WORKER
+{
+	PTP_POOL Pool;
+	DWORD Index;
+	HANDLE Thread;
+	CRITICAL_SECTION Lock;
+	PTP_WORK* Items;
+	DWORD Capacity;
+	DWORD Head;
+	DWORD Count;
+};
+typedef struct _TP_WORKER TP_WORKER;
+
 struct _TP_POOL
 {
 	DWORD Minimum;
 	DWORD Maximum;
-	wArrayList* Threads;
-	wQueue* PendingQueue;
+	TP_WORKER** Workers;
+	LONG WorkerCount;
+	LONG NextWorker;
+	HANDLE WorkSemaphore;
 	HANDLE TerminateEvent;
-	wCountdownEvent* WorkComplete;
+	CRITICAL_SECTION Lock;
 };
 
 struct _TP_WORK
@@ -45,6 +67,8 @@ struct _TP_WORK
 	PVOID CallbackParameter;
 	PTP_WORK_CALLBACK WorkCallback;
 	PTP_CALLBACK_ENVIRON CallbackEnvironment;
+	wCountdownEvent* WorkComplete;
+	LONG RefCount;
 };
 
 struct _TP_TIMER
@@ -72,6 +96,10 @@ struct _TP_CLEANUP_GROUP
 PTP_POOL GetDefaultThreadpool(void);
 PTP_CALLBACK_ENVIRON GetDefaultThreadpoolEnvironment(void);
 
+BOOL ThreadpoolPushWork(PTP_POOL pool, PTP_WORK work);
+BOOL ThreadpoolHelpWork(PTP_POOL pool);
+void ThreadpoolReleaseWork(PTP_WORK work);
+
 #endif
 
 #endif /* WINPR_POOL_PRIVATE_H */
@@ -0,0 +1,413 @@
+/**
+ * WinPR: Windows Portable Runtime
+ * Thread Pool API (Worker) Tests
+ *
+ * Copyright 2026 agent <agent@local>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <winpr/crt.h>
+#include <winpr/pool.h>
+#include <winpr/synch.h>
+#include <winpr/thread.h>
+#include <winpr/sysinfo.h>
+#include <winpr/interlocked.h>
+
+#define TEST_NESTED_SUBMITS	8
+#define TEST_WAIT_TIMEOUT	10000
+
+struct test_pool_nested
+{
+	TP_CALLBACK_ENVIRON environment;
+	LONG innerCount;
+	LONG failures;
+};
+typedef struct test_pool_nested TEST_POOL_NESTED;
+
+struct test_pool_barrier
+{
+	LONG count;
+	LONG expected;
+	LONG failures;
+	HANDLE event;
+};
+typedef struct test_pool_barrier TEST_POOL_BARRIER;
+
+struct test_pool_blocker
+{
+	HANDLE started;
+	HANDLE release;
+};
+typedef struct test_pool_blocker TEST_POOL_BLOCKER;
+
+struct test_pool_waiter
+{
+	PTP_WORK work;
+	HANDLE thread;
+};
+typedef struct test_pool_waiter TEST_POOL_WAITER;
+
+static DWORD test_pool_processors(void)
+{
+	SYSTEM_INFO sysinfo;
+
+	GetSystemInfo(&sysinfo);
+
+	return (sysinfo.dwNumberOfProcessors > 0) ? sysinfo.dwNumberOfProcessors : 1;
+}
+
+static void* test_pool_wait_thread(void* arg)
+{
+	TEST_POOL_WAITER* waiter = (TEST_POOL_WAITER*) arg;
+
+	WaitForThreadpoolWorkCallbacks(waiter->work, FALSE);
+
+	return NULL;
+}
+
+/**
+ * Waits for the callbacks of work on another thread, so that a wait that
+ * never returns fails the test instead of hanging it.
+ */
+
+static BOOL test_pool_wait_start(TEST_POOL_WAITER* waiter, PTP_WORK work)
+{
+	waiter->work = work;
+	waiter->thread = CreateThread(NULL, 0, (LPTHREAD_START_ROUTINE) test_pool_wait_thread,
+			(void*) waiter, 0, NULL);
+
+	return waiter->thread ? TRUE : FALSE;
+}
+
+static BOOL test_pool_wait_end(TEST_POOL_WAITER* waiter, DWORD timeout)
+{
+	if (WaitForSingleObject(waiter->thread, timeout) != WAIT_OBJECT_0)
+		return FALSE;
+
+	CloseHandle(waiter->thread);
+	waiter->thread = NULL;
+
+	return TRUE;
+}
+
+static void CALLBACK test_pool_inner_callback(PTP_CALLBACK_INSTANCE instance, void* context, PTP_WORK work)
+{
+	TEST_POOL_NESTED* nested = (TEST_POOL_NESTED*) context;
+
+	InterlockedIncrement(&nested->innerCount);
+}
+
+static void CALLBACK test_pool_outer_callback(PTP_CALLBACK_INSTANCE instance, void* context, PTP_WORK work)
+{
+	int index;
+	PTP_WORK inner;
+	TEST_POOL_NESTED* nested = (TEST_POOL_NESTED*) context;
+
+	inner = CreateThreadpoolWork((PTP_WORK_CALLBACK) test_pool_inner_callback, nested, &nested->environment);
+
+	if (!inner)
+	{
+		InterlockedIncrement(&nested->failures);
+		return;
+	}
+
+	for (index = 0; index < TEST_NESTED_SUBMITS; index++)
+		SubmitThreadpoolWork(inner);
+
+	WaitForThreadpoolWorkCallbacks(inner, FALSE);
+	CloseThreadpoolWork(inner);
+}
+
+/**
+ * More callbacks than workers each submit work and wait for it: with every
+ * worker blocked in a wait, the nested work can only run on the waiters.
+ */
+
+static int test_pool_nested_wait(PTP_POOL pool)
+{
+	int index;
+	int result = -1;
+	LONG outerCount;
+	PTP_WORK outer = NULL;
+	TEST_POOL_WAITER waiter;
+	TEST_POOL_NESTED nested;
+
+	ZeroMemory(&nested, sizeof(TEST_POOL_NESTED));
+	ZeroMemory(&waiter, sizeof(TEST_POOL_WAITER));
+
+	InitializeThreadpoolEnvironment(&nested.environment);
+	SetThreadpoolCallbackPool(&nested.environment, pool);
+
+	outer = CreateThreadpoolWork((PTP_WORK_CALLBACK) test_pool_outer_callback, &nested, &nested.environment);
+
+	if (!outer)
+		goto out;
+
+	outerCount = (LONG) test_pool_processors() * 4;
+
+	for (index = 0; index < outerCount; index++)
+		SubmitThreadpoolWork(outer);
+
+	if (!test_pool_wait_start(&waiter, outer))
+		goto out;
+
+	if (!test_pool_wait_end(&waiter, TEST_WAIT_TIMEOUT))
+	{
+		printf("nested wait: deadlock\n");
+		goto out;
+	}
+
+	if (nested.failures || (nested.innerCount != outerCount * TEST_NESTED_SUBMITS))
+	{
+		printf("nested wait: %d of %d nested callbacks ran\n",
+				(int) nested.innerCount, (int) (outerCount * TEST_NESTED_SUBMITS));
+		goto out;
+	}
+
+	result = 0;
+
+out:
+	/* deadlocked workers and waiter are left behind */
+	if (waiter.thread)
+		return -1;
+
+	if (outer)
+		CloseThreadpoolWork(outer);
+
+	DestroyThreadpoolEnvironment(&nested.environment);
+
+	return result;
+}
+
+static void CALLBACK test_pool_blocked_callback(PTP_CALLBACK_INSTANCE instance, void* context, PTP_WORK work)
+{
+	TEST_POOL_BLOCKER* blocker = (TEST_POOL_BLOCKER*) context;
+
+	SetEvent(blocker->started);
+	WaitForSingleObject(blocker->release, INFINITE);
+}
+
+static void CALLBACK test_pool_count_callback(PTP_CALLBACK_INSTANCE instance, void* context, PTP_WORK work)
+{
+	InterlockedIncrement((LONG*) context);
+}
+
+/**
+ * Waiting for the callbacks of one work object returns once they are done,
+ * even though the callback of another work object is still running.
+ */
+
+static int test_pool_wait_isolation(PTP_POOL pool)
+{
+	int index;
+	int result = -1;
+	LONG count = 0;
+	PTP_WORK blocked = NULL;
+	PTP_WORK quick = NULL;
+	TEST_POOL_WAITER waiter;
+	TEST_POOL_BLOCKER blocker;
+	TP_CALLBACK_ENVIRON environment;
+
+	ZeroMemory(&waiter, sizeof(TEST_POOL_WAITER));
+	ZeroMemory(&blocker, sizeof(TEST_POOL_BLOCKER));
+
+	InitializeThreadpoolEnvironment(&environment);
+	SetThreadpoolCallbackPool(&environment, pool);
+
+	/* one worker stays blocked, another one runs the other work */
+	if (!SetThreadpoolThreadMinimum(pool, 2))
+		goto out;
+
+	blocker.started = CreateEvent(NULL, TRUE, FALSE, NULL);
+	blocker.release = CreateEvent(NULL, TRUE, FALSE, NULL);
+
+	if (!blocker.started || !blocker.release)
+		goto out;
+
+	blocked = CreateThreadpoolWork((PTP_WORK_CALLBACK) test_pool_blocked_callback, &blocker, &environment);
+	quick = CreateThreadpoolWork((PTP_WORK_CALLBACK) test_pool_count_callback, &count, &environment);
+
+	if (!blocked || !quick)
+		goto out;
+
+	SubmitThreadpoolWork(blocked);
+
+	if (WaitForSingleObject(blocker.started, TEST_WAIT_TIMEOUT) != WAIT_OBJECT_0)
+	{
+		printf("wait isolation: work not started\n");
+		goto out;
+	}
+
+	for (index = 0; index < 16; index++)
+		SubmitThreadpoolWork(quick);
+
+	if (!test_pool_wait_start(&waiter, quick))
+		goto out;
+
+	if (!test_pool_wait_end(&waiter, TEST_WAIT_TIMEOUT))
+	{
+		printf("wait isolation: waited on unrelated work\n");
+		goto out;
+	}
+
+	if (count != 16)
+	{
+		printf("wait isolation: %d of 16 callbacks ran\n", (int) count);
+		goto out;
+	}
+
+	SetEvent(blocker.release);
+
+	if (!test_pool_wait_start(&waiter, blocked) || !test_pool_wait_end(&waiter, TEST_WAIT_TIMEOUT))
+	{
+		printf("wait isolation: released work not completed\n");
+		goto out;
+	}
+
+	result = 0;
+
+out:
+	if (blocker.release)
+		SetEvent(blocker.release);
+
+	if (waiter.thread)
+	{
+		WaitForSingleObject(waiter.thread, INFINITE);
+		CloseHandle(waiter.thread);
+	}
+
+	if (blocked)
+	{
+		WaitForThreadpoolWorkCallbacks(blocked, FALSE);
+		CloseThreadpoolWork(blocked);
+	}
+
+	if (quick)
+	{
+		WaitForThreadpoolWorkCallbacks(quick, FALSE);
+		CloseThreadpoolWork(quick);
+	}
+
+	if (blocker.started)
+		CloseHandle(blocker.started);
+
+	if (blocker.release)
+		CloseHandle(blocker.release);
+
+	DestroyThreadpoolEnvironment(&environment);
+
+	return result;
+}
+
+static void CALLBACK test_pool_barrier_callback(PTP_CALLBACK_INSTANCE instance, void* context, PTP_WORK work)
+{
+	TEST_POOL_BARRIER* barrier = (TEST_POOL_BARRIER*) context;
+
+	if (InterlockedIncrement(&barrier->count) == barrier->expected)
+		SetEvent(barrier->event);
+
+	if (WaitForSingleObject(barrier->event, TEST_WAIT_TIMEOUT) != WAIT_OBJECT_0)
+		InterlockedIncrement(&barrier->failures);
+}
+
+/**
+ * Raising the thread minimum adds workers: as many callbacks as the new
+ * minimum, more than the pool started with, all run at the same time.
+ */
+
+static int test_pool_grow(void)
+{
+	int index;
+	int result = -1;
+	PTP_POOL pool;
+	PTP_WORK work = NULL;
+	TEST_POOL_BARRIER barrier;
+	TP_CALLBACK_ENVIRON environment;
+
+	ZeroMemory(&barrier, sizeof(TEST_POOL_BARRIER));
+
+	if (!(pool = CreateThreadpool(NULL)))
+		return -1;
+
+	InitializeThreadpoolEnvironment(&environment);
+	SetThreadpoolCallbackPool(&environment, pool);
+
+	barrier.expected = (LONG) test_pool_processors() + 4;
+
+	if (!SetThreadpoolThreadMinimum(pool, (DWORD) barrier.expected))
+	{
+		printf("SetThreadpoolThreadMinimum failure\n");
+		goto out;
+	}
+
+	if (!(barrier.event = CreateEvent(NULL, TRUE, FALSE, NULL)))
+		goto out;
+
+	work = CreateThreadpoolWork((PTP_WORK_CALLBACK) test_pool_barrier_callback, &barrier, &environment);
+
+	if (!work)
+		goto out;
+
+	for (index = 0; index < barrier.expected; index++)
+		SubmitThreadpoolWork(work);
+
+	WaitForThreadpoolWorkCallbacks(work, FALSE);
+
+	if (barrier.failures)
+	{
+		printf("pool growth: %d of %d callbacks ran at the same time\n",
+				(int) (barrier.expected - barrier.failures), (int) barrier.expected);
+		goto out;
+	}
+
+	result = 0;
+
+out:
+	if (work)
+		CloseThreadpoolWork(work);
+
+	if (barrier.event)
+		CloseHandle(barrier.event);
+
+	DestroyThreadpoolEnvironment(&environment);
+	CloseThreadpool(pool);
+
+	return result;
+}
+
+int TestPoolWorkers(int argc, char* argv[])
+{
+	PTP_POOL pool;
+
+	if (!(pool = CreateThreadpool(NULL)))
+	{
+		printf("CreateThreadpool failure\n");
+		return -1;
+	}
+
+	/* the pool is not closed after a failure, its workers may be stuck */
+
+	if (test_pool_nested_wait(pool) < 0)
+		return -1;
+
+	if (test_pool_wait_isolation(pool) < 0)
+		return -1;
+
+	if (test_pool_grow() < 0)
+		return -1;
+
+	CloseThreadpool(pool);
+
+	return 0;
+}
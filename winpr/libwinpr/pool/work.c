@@ -23,6 +23,7 @@
 
 #include <winpr/crt.h>
 #include <winpr/pool.h>
+#include <winpr/interlocked.h>
 
 #include "pool.h"
 #include "../log.h"
@@ -61,6 +62,25 @@ static void module_init()
 
 #endif
 
+#ifndef _WIN32
+
+/**
+ * Every queued submission holds a reference on the work object: a waiter may
+ * wake as soon as the countdown is signalled and close the work while the
+ * worker is still leaving the countdown lock, so the last reference frees it.
+ */
+
+void ThreadpoolReleaseWork(PTP_WORK work)
+{
+	if (InterlockedDecrement(&work->RefCount) != 0)
+		return;
+
+	CountdownEvent_Free(work->WorkComplete);
+	free(work);
+}
+
+#endif
+
 #ifdef WINPR_THREAD_POOL
 
 PTP_WORK CreateThreadpoolWork(PTP_WORK_CALLBACK pfnwk, PVOID pv, PTP_CALLBACK_ENVIRON pcbe)
@@ -84,6 +104,13 @@ PTP_WORK CreateThreadpoolWork(PTP_WORK_CALLBACK pfnwk, PVOID pv, PTP_CALLBACK_EN
 			pcbe = GetDefaultThreadpoolEnvironment();
 
 		work->CallbackEnvironment = pcbe;
+		work->RefCount = 1;
+
+		if (!(work->WorkComplete = CountdownEvent_New(0)))
+		{
+			free(work);
+			return NULL;
+		}
 	}
 
 #endif
@@ -99,7 +126,8 @@ VOID CloseThreadpoolWork(PTP_WORK pwk)
 		pCloseThreadpoolWork(pwk);
 
 #else
-	free(pwk);
+	if (pwk)
+		ThreadpoolReleaseWork(pwk);
 #endif
 }
 
@@ -113,15 +141,15 @@ VOID SubmitThreadpoolWork(PTP_WORK pwk)
 
 #else
 	PTP_POOL pool;
-	PTP_CALLBACK_INSTANCE callbackInstance;
 	pool = pwk->CallbackEnvironment->Pool;
-	callbackInstance = (PTP_CALLBACK_INSTANCE) malloc(sizeof(TP_CALLBACK_INSTANCE));
+	InterlockedIncrement(&pwk->RefCount);
+	CountdownEvent_AddCount(pwk->WorkComplete, 1);
 
-	if (callbackInstance)
+	if (!ThreadpoolPushWork(pool, pwk))
 	{
-		callbackInstance->Work = pwk;
-		CountdownEvent_AddCount(pool->WorkComplete, 1);
-		Queue_Enqueue(pool->PendingQueue, callbackInstance);
+		WLog_ERR(TAG, "error submitting work");
+		CountdownEvent_Signal(pwk->WorkComplete, 1);
+		ThreadpoolReleaseWork(pwk);
 	}
 
 #endif
@@ -152,7 +180,14 @@ VOID WaitForThreadpoolWorkCallbacks(PTP_WORK pwk, BOOL fCancelPendingCallbacks)
 	HANDLE event;
 	PTP_POOL pool;
 	pool = pwk->CallbackEnvironment->Pool;
-	event = CountdownEvent_WaitHandle(pool->WorkComplete);
+	event = CountdownEvent_WaitHandle(pwk->WorkComplete);
+
+	/* a worker waiting on nested work runs pending items instead of blocking */
+	while (!CountdownEvent_IsSet(pwk->WorkComplete))
+	{
+		if (!ThreadpoolHelpWork(pool))
+			break;
+	}
 
 	if (WaitForSingleObject(event, INFINITE) != WAIT_OBJECT_0)
 		WLog_ERR(TAG, "error waiting on work completion");
@@ -22,121 +22,510 @@
 #endif
 
 #include <winpr/crt.h>
+#include <winpr/thread.h>
+#include <winpr/interlocked.h>
 
 #include <winpr/collections.h>
 
+#define STREAM_POOL_MIN_SIZE		4096
+#define STREAM_POOL_CLASSES		16
+
+#define STREAM_POOL_CACHE_CLASSES	5
+#define STREAM_POOL_CACHE_DEPTH		8
+
+#define STREAM_POOL_SLOT_SHIFT		10
+#define STREAM_POOL_SLOT_MASK		((1 << STREAM_POOL_SLOT_SHIFT) - 1)
+#define STREAM_POOL_SLOT_CHUNKS		1024
+#define STREAM_POOL_NO_SLOT		0xFFFFFFFF
+
+#define STREAM_POOL_PAGE_SHIFT		12
+#define STREAM_POOL_PAGE_TOMBSTONE	((ULONG_PTR) -1)
+
+typedef struct _wStreamPoolEntry wStreamPoolEntry;
+typedef struct _wStreamPoolCache wStreamPoolCache;
+typedef struct _wStreamPoolMap wStreamPoolMap;
+
 /**
- * Methods
+ * Header of a pooled stream. Its slot index is kept for the lifetime of the
+ * pool: a discarded stream only frees its buffer and the header is recycled
+ * by the next allocation, so a lock-free pop following a stale list head
+ * never reads freed memory.
+ */
+
+struct _wStreamPoolEntry
+{
+	wStream s;
+	DWORD index;
+	DWORD next;
+	wStreamPoolEntry* spare;
+};
+
+#define STREAM_POOL_ENTRY(_s)	((wStreamPoolEntry*) (_s))
+
+/**
+ * Streams of the small size classes returned by a thread, reused by the same
+ * thread without touching the shared free lists.
+ */
+
+struct _wStreamPoolCache
+{
+	DWORD count[STREAM_POOL_CACHE_CLASSES];
+	wStream* streams[STREAM_POOL_CACHE_CLASSES][STREAM_POOL_CACHE_DEPTH];
+	wStreamPoolCache* next;
+};
+
+/**
+ * Open addressing table mapping buffer pages to the streams owning them.
+ * A page can be shared by the end of one buffer and the start of another,
+ * lookups check every entry of the page against the stream bounds.
  */
 
-void StreamPool_ShiftUsed(wStreamPool* pool, int index, int count)
+struct _wStreamPoolPage
 {
-	if (count > 0)
+	ULONG_PTR page;
+	wStream* stream;
+};
+typedef struct _wStreamPoolPage wStreamPoolPage;
+
+struct _wStreamPoolMap
+{
+	UINT32 capacity;
+	UINT32 used;
+	UINT32 live;
+	wStreamPoolPage* pages;
+};
+
+struct _wStreamPoolPrivate
+{
+	LONGLONG freeList[STREAM_POOL_CLASSES];
+
+	DWORD cacheIndex;
+	wStreamPoolCache* caches;
+
+	LONG slotCount;
+	wStreamPoolEntry** slots[STREAM_POOL_SLOT_CHUNKS];
+	wStreamPoolEntry* spares;
+
+	wStreamPoolMap* map;
+};
+
+void StreamPool_MapStream(wStream* s);
+void StreamPool_UnmapStream(wStream* s);
+
+/**
+ * Size classes
+ */
+
+static size_t StreamPool_ClassSize(int index)
+{
+	return ((size_t) STREAM_POOL_MIN_SIZE) << index;
+}
+
+/**
+ * Smallest class able to hold size bytes, STREAM_POOL_CLASSES if none is.
+ */
+
+static int StreamPool_TakeClass(size_t size)
+{
+	int index = 0;
+
+	while ((index < STREAM_POOL_CLASSES) && (StreamPool_ClassSize(index) < size))
+		index++;
+
+	return index;
+}
+
+/**
+ * Largest class a buffer of the given capacity can serve, -1 if none.
+ */
+
+static int StreamPool_ReturnClass(size_t capacity)
+{
+	int index = 0;
+
+	if (capacity < STREAM_POOL_MIN_SIZE)
+		return -1;
+
+	while (((index + 1) < STREAM_POOL_CLASSES) && (StreamPool_ClassSize(index + 1) <= capacity))
+		index++;
+
+	return index;
+}
+
+/**
+ * Free lists
+ *
+ * Each list head packs the slot index of the top stream plus one in its low
+ * 32 bits and a modification tag in its high 32 bits, which lets a single
+ * 64-bit compare and exchange detect a concurrent pop and push of the same
+ * stream (ABA). Stream headers are not freed before the pool, a stale read
+ * of the next index is therefore harmless and caught by the tag.
+ */
+
+static wStreamPoolEntry* StreamPool_GetSlot(wStreamPool* pool, DWORD index)
+{
+	return pool->priv->slots[index >> STREAM_POOL_SLOT_SHIFT][index & STREAM_POOL_SLOT_MASK];
+}
+
+static void StreamPool_Push(wStreamPool* pool, int index, wStream* s)
+{
+	LONGLONG head;
+	LONGLONG next;
+	wStreamPoolEntry* entry = STREAM_POOL_ENTRY(s);
+	LONGLONG volatile* list = &pool->priv->freeList[index];
+
+	do
 	{
-		if (pool->uSize + count > pool->uCapacity)
-		{
-			int new_cap;
-			wStream **new_arr;
-
-			new_cap = pool->uCapacity * 2;
-			new_arr = (wStream**) realloc(pool->uArray, sizeof(wStream*) * new_cap);
-			if (!new_arr)
-				return;
-			pool->uCapacity = new_cap;
-			pool->uArray = new_arr;
-		}
+		head = *list;
+		entry->next = (DWORD) head;
+		next = (LONGLONG) (((((ULONGLONG) head >> 32) + 1) << 32) | (entry->index + 1));
+	}
+	while (InterlockedCompareExchange64(list, next, head) != head);
+}
+
+static wStream* StreamPool_Pop(wStreamPool* pool, int index)
+{
+	DWORD top;
+	LONGLONG head;
+	LONGLONG next;
+	wStreamPoolEntry* entry;
+	LONGLONG volatile* list = &pool->priv->freeList[index];
+
+	do
+	{
+		head = *list;
+		top = (DWORD) head;
+
+		if (!top)
+			return NULL;
 
-		MoveMemory(&pool->uArray[index + count], &pool->uArray[index], (pool->uSize - index) * sizeof(wStream*));
-		pool->uSize += count;
+		entry = StreamPool_GetSlot(pool, top - 1);
+		next = (LONGLONG) (((((ULONGLONG) head >> 32) + 1) << 32) | entry->next);
 	}
-	else if (count < 0)
+	while (InterlockedCompareExchange64(list, next, head) != head);
+
+	return &entry->s;
+}
+
+static wStreamPoolCache* StreamPool_GetCache(wStreamPool* pool)
+{
+	wStreamPoolCache* cache;
+	wStreamPoolPrivate* priv = pool->priv;
+
+	if (priv->cacheIndex == TLS_OUT_OF_INDEXES)
+		return NULL;
+
+	cache = (wStreamPoolCache*) TlsGetValue(priv->cacheIndex);
+
+	if (!cache)
 	{
-		if (pool->uSize - index + count > 0)
-		{
-			MoveMemory(&pool->uArray[index], &pool->uArray[index - count],
-					(pool->uSize - index + count) * sizeof(wStream*));
-		}
+		cache = (wStreamPoolCache*) calloc(1, sizeof(wStreamPoolCache));
+
+		if (!cache)
+			return NULL;
+
+		EnterCriticalSection(&pool->lock);
+		cache->next = priv->caches;
+		priv->caches = cache;
+		LeaveCriticalSection(&pool->lock);
 
-		pool->uSize += count;
+		TlsSetValue(priv->cacheIndex, cache);
 	}
+
+	return cache;
 }
 
 /**
- * Adds a used stream to the pool.
+ * Page map, accessed with the pool lock held.
  */
 
-void StreamPool_AddUsed(wStreamPool* pool, wStream* s)
+static UINT32 StreamPool_Hash(ULONG_PTR page)
+{
+	return (UINT32) (((UINT64) page * 0x9E3779B97F4A7C15ULL) >> 32);
+}
+
+static void StreamPool_MapPut(wStreamPoolMap* map, ULONG_PTR page, wStream* s)
 {
-	if ((pool->uSize + 1) >= pool->uCapacity)
+	UINT32 index;
+	wStreamPoolPage* entry;
+
+	index = StreamPool_Hash(page) & (map->capacity - 1);
+
+	while (1)
 	{
-		int new_cap;
-		wStream **new_arr;
+		entry = &map->pages[index];
 
-		new_cap = pool->uCapacity * 2;
-		new_arr = (wStream**) realloc(pool->uArray, sizeof(wStream*) * new_cap);
-		if (!new_arr)
-			return;
-		pool->uCapacity = new_cap;
-		pool->uArray = new_arr;
+		if (!entry->page || (entry->page == STREAM_POOL_PAGE_TOMBSTONE))
+			break;
+
+		index = (index + 1) & (map->capacity - 1);
 	}
 
-	pool->uArray[(pool->uSize)++] = s;
+	if (!entry->page)
+		map->used++;
+
+	map->live++;
+	entry->stream = s;
+	entry->page = page;
 }
 
-/**
- * Removes a used stream from the pool.
- */
+static void StreamPool_MapFree(wStreamPoolMap* map)
+{
+	if (map)
+	{
+		free(map->pages);
+		free(map);
+	}
+}
 
-void StreamPool_RemoveUsed(wStreamPool* pool, wStream* s)
+static BOOL StreamPool_MapResize(wStreamPool* pool, UINT32 live)
 {
-	int index;
-	BOOL found = FALSE;
+	UINT32 index;
+	wStreamPoolPage* entry;
+	wStreamPoolMap* map;
+	wStreamPoolMap* old = pool->priv->map;
+
+	map = (wStreamPoolMap*) calloc(1, sizeof(wStreamPoolMap));
+
+	if (!map)
+		return FALSE;
 
-	for (index = 0; index < pool->uSize; index++)
+	map->capacity = 256;
+
+	while (map->capacity < (live * 2))
+		map->capacity *= 2;
+
+	map->pages = (wStreamPoolPage*) calloc(map->capacity, sizeof(wStreamPoolPage));
+
+	if (!map->pages)
 	{
-		if (pool->uArray[index] == s)
+		free(map);
+		return FALSE;
+	}
+
+	if (old)
+	{
+		for (index = 0; index < old->capacity; index++)
 		{
-			found = TRUE;
-			break;
+			entry = &old->pages[index];
+
+			if (entry->page && (entry->page != STREAM_POOL_PAGE_TOMBSTONE))
+				StreamPool_MapPut(map, entry->page, entry->stream);
 		}
 	}
 
-	if (found)
-		StreamPool_ShiftUsed(pool, index, -1);
+	pool->priv->map = map;
+	StreamPool_MapFree(old);
+
+	return TRUE;
 }
 
-void StreamPool_ShiftAvailable(wStreamPool* pool, int index, int count)
+static BOOL StreamPool_MapInsert(wStreamPool* pool, wStream* s)
 {
-	if (count > 0)
+	ULONG_PTR page;
+	ULONG_PTR first;
+	ULONG_PTR last;
+	UINT32 count;
+	wStreamPoolMap* map = pool->priv->map;
+
+	first = ((ULONG_PTR) Stream_Buffer(s)) >> STREAM_POOL_PAGE_SHIFT;
+	last = ((ULONG_PTR) Stream_Buffer(s) + Stream_Capacity(s) - 1) >> STREAM_POOL_PAGE_SHIFT;
+	count = (UINT32) (last - first + 1);
+
+	if (!map || (((map->used + count) * 4) > (map->capacity * 3)))
 	{
-		if (pool->aSize + count > pool->aCapacity)
+		if (!StreamPool_MapResize(pool, (map ? map->live : 0) + count))
+			return FALSE;
+
+		map = pool->priv->map;
+	}
+
+	for (page = first; page <= last; page++)
+		StreamPool_MapPut(map, page, s);
+
+	return TRUE;
+}
+
+static void StreamPool_MapRemove(wStreamPool* pool, wStream* s, ULONG_PTR buffer, size_t capacity)
+{
+	UINT32 index;
+	ULONG_PTR page;
+	ULONG_PTR last;
+	wStreamPoolPage* entry;
+	wStreamPoolMap* map = pool->priv->map;
+
+	if (!map)
+		return;
+
+	page = buffer >> STREAM_POOL_PAGE_SHIFT;
+	last = (buffer + capacity - 1) >> STREAM_POOL_PAGE_SHIFT;
+
+	for (; page <= last; page++)
+	{
+		index = StreamPool_Hash(page) & (map->capacity - 1);
+
+		while (map->pages[index].page)
 		{
-			int new_cap;
-			wStream **new_arr;
-
-			new_cap = pool->aCapacity * 2;
-			new_arr = (wStream**) realloc(pool->aArray, sizeof(wStream*) * new_cap);
-			if (!new_arr)
-				return;
-			pool->aCapacity = new_cap;
-			pool->aArray = new_arr;
+			entry = &map->pages[index];
+
+			if ((entry->page == page) && (entry->stream == s))
+			{
+				entry->page = STREAM_POOL_PAGE_TOMBSTONE;
+				map->live--;
+				break;
+			}
+
+			index = (index + 1) & (map->capacity - 1);
 		}
+	}
+}
+
+/**
+ * Called by Stream_EnsureCapacity around the reallocation of a pooled stream.
+ */
+
+void StreamPool_MapStream(wStream* s)
+{
+	wStreamPool* pool = s->pool;
 
-		MoveMemory(&pool->aArray[index + count], &pool->aArray[index], (pool->aSize - index) * sizeof(wStream*));
-		pool->aSize += count;
+	EnterCriticalSection(&pool->lock);
+	StreamPool_MapInsert(pool, s);
+	LeaveCriticalSection(&pool->lock);
+}
+
+void StreamPool_UnmapStream(wStream* s)
+{
+	wStreamPool* pool = s->pool;
+
+	EnterCriticalSection(&pool->lock);
+	StreamPool_MapRemove(pool, s, (ULONG_PTR) Stream_Buffer(s), Stream_Capacity(s));
+	LeaveCriticalSection(&pool->lock);
+}
+
+/**
+ * Frees the buffer of a stream, called with the pool lock held.
+ *
+ * Headers owning a slot are kept on the spare list for reuse, others were
+ * never reachable from a free list and are freed.
+ */
+
+static void StreamPool_Recycle(wStreamPool* pool, wStreamPoolEntry* entry)
+{
+	free(entry->s.buffer);
+	entry->s.buffer = entry->s.pointer = NULL;
+	entry->s.length = entry->s.capacity = 0;
+
+	if (entry->index == STREAM_POOL_NO_SLOT)
+	{
+		free(entry);
+		return;
+	}
+
+	entry->spare = pool->priv->spares;
+	pool->priv->spares = entry;
+}
+
+/**
+ * Allocates a new stream and registers it with the pool.
+ */
+
+static wStream* StreamPool_Alloc(wStreamPool* pool, size_t size)
+{
+	DWORD index;
+	BYTE* buffer;
+	wStreamPoolEntry** chunk;
+	wStreamPoolEntry* entry;
+	wStreamPoolPrivate* priv = pool->priv;
+
+	buffer = (BYTE*) malloc(size);
+
+	if (!buffer)
+		return NULL;
+
+	EnterCriticalSection(&pool->lock);
+
+	if ((entry = priv->spares) != NULL)
+	{
+		priv->spares = entry->spare;
 	}
-	else if (count < 0)
+	else
 	{
-		if (pool->aSize - index + count > 0)
+		entry = (wStreamPoolEntry*) calloc(1, sizeof(wStreamPoolEntry));
+
+		if (!entry)
 		{
-			MoveMemory(&pool->aArray[index], &pool->aArray[index - count],
-					(pool->aSize - index + count) * sizeof(wStream*));
+			LeaveCriticalSection(&pool->lock);
+			free(buffer);
+			return NULL;
 		}
 
-		pool->aSize += count;
+		entry->index = STREAM_POOL_NO_SLOT;
+		index = (DWORD) priv->slotCount;
+
+		if ((index >> STREAM_POOL_SLOT_SHIFT) < STREAM_POOL_SLOT_CHUNKS)
+		{
+			chunk = priv->slots[index >> STREAM_POOL_SLOT_SHIFT];
+
+			if (!chunk)
+			{
+				chunk = (wStreamPoolEntry**) calloc(1 << STREAM_POOL_SLOT_SHIFT, sizeof(wStreamPoolEntry*));
+				priv->slots[index >> STREAM_POOL_SLOT_SHIFT] = chunk;
+			}
+
+			if (chunk)
+			{
+				chunk[index & STREAM_POOL_SLOT_MASK] = entry;
+				entry->index = index;
+				priv->slotCount++;
+			}
+		}
 	}
+
+	entry->s.buffer = entry->s.pointer = buffer;
+	entry->s.length = entry->s.capacity = size;
+	entry->s.count = 0;
+	entry->s.pool = pool;
+
+	if (!StreamPool_MapInsert(pool, &entry->s))
+	{
+		StreamPool_Recycle(pool, entry);
+		LeaveCriticalSection(&pool->lock);
+		return NULL;
+	}
+
+	LeaveCriticalSection(&pool->lock);
+
+	return &entry->s;
 }
 
+/**
+ * Unregisters a stream and releases its buffer, called with the pool lock held.
+ */
+
+static void StreamPool_Discard(wStreamPool* pool, wStream* s)
+{
+	StreamPool_MapRemove(pool, s, (ULONG_PTR) Stream_Buffer(s), Stream_Capacity(s));
+	StreamPool_Recycle(pool, STREAM_POOL_ENTRY(s));
+}
+
+static void StreamPool_DiscardCache(wStreamPool* pool, wStreamPoolCache* cache)
+{
+	int index;
+
+	for (index = 0; index < STREAM_POOL_CACHE_CLASSES; index++)
+	{
+		while (cache->count[index] > 0)
+		{
+			StreamPool_Discard(pool, cache->streams[index][--(cache->count[index])]);
+			InterlockedDecrement(&pool->aSize);
+		}
+	}
+}
+
+/**
+ * Methods
+ */
+
 /**
  * Gets a stream from the pool.
  */
@@ -144,50 +533,44 @@ void StreamPool_ShiftAvailable(wStreamPool* pool, int index, int count)
 wStream* StreamPool_Take(wStreamPool* pool, size_t size)
 {
 	int index;
-	int foundIndex;
 	wStream* s = NULL;
-
-	if (pool->synchronized)
-		EnterCriticalSection(&pool->lock);
+	wStreamPoolCache* cache;
 
 	if (size == 0)
 		size = pool->defaultSize;
 
-	foundIndex = -1;
+	index = StreamPool_TakeClass(size);
 
-	for (index = 0; index < pool->aSize; index++)
+	if (index < STREAM_POOL_CLASSES)
 	{
-		s = pool->aArray[index];
-
-		if (Stream_Capacity(s) >= size)
+		if (index < STREAM_POOL_CACHE_CLASSES)
 		{
-			foundIndex = index;
-			break;
+			cache = StreamPool_GetCache(pool);
+
+			if (cache && (cache->count[index] > 0))
+				s = cache->streams[index][--(cache->count[index])];
 		}
-	}
 
-	if (foundIndex < 0)
-	{
-		s = Stream_New(NULL, size);
 		if (!s)
-			goto out_fail;
-	}
-	else
-	{
-		Stream_SetPosition(s, 0);
-		StreamPool_ShiftAvailable(pool, foundIndex, -1);
+			s = StreamPool_Pop(pool, index);
+
+		if (s)
+			InterlockedDecrement(&pool->aSize);
+		else
+			size = StreamPool_ClassSize(index);
 	}
 
-	if (s)
+	if (!s)
 	{
-		s->pool = pool;
-		s->count = 1;
-		StreamPool_AddUsed(pool, s);
+		s = StreamPool_Alloc(pool, size);
+
+		if (!s)
+			return NULL;
 	}
 
-out_fail:
-	if (pool->synchronized)
-		LeaveCriticalSection(&pool->lock);
+	Stream_SetPosition(s, 0);
+	s->count = 1;
+	InterlockedIncrement(&pool->uSize);
 
 	return s;
 }
@@ -198,40 +581,35 @@ out_fail:
 
 void StreamPool_Return(wStreamPool* pool, wStream* s)
 {
-	if (pool->synchronized)
-		EnterCriticalSection(&pool->lock);
+	int index;
+	wStreamPoolCache* cache;
+
+	InterlockedDecrement(&pool->uSize);
 
-	if ((pool->aSize + 1) >= pool->aCapacity)
+	index = StreamPool_ReturnClass(Stream_Capacity(s));
+
+	if ((index < 0) || (STREAM_POOL_ENTRY(s)->index == STREAM_POOL_NO_SLOT))
 	{
-		int new_cap;
-		wStream **new_arr;
-
-		new_cap = pool->aCapacity * 2;
-		new_arr = (wStream**) realloc(pool->aArray, sizeof(wStream*) * new_cap);
-		if (!new_arr)
-			goto out_fail;
-		pool->aCapacity = new_cap;
-		pool->aArray = new_arr;
+		EnterCriticalSection(&pool->lock);
+		StreamPool_Discard(pool, s);
+		LeaveCriticalSection(&pool->lock);
+		return;
 	}
-	else if ((pool->aSize + 1) * 3 < pool->aCapacity)
+
+	InterlockedIncrement(&pool->aSize);
+
+	if (index < STREAM_POOL_CACHE_CLASSES)
 	{
-		int new_cap;
-		wStream **new_arr;
-
-		new_cap = pool->aCapacity / 2;
-		new_arr = (wStream**) realloc(pool->aArray, sizeof(wStream*) * new_cap);
-		if (!new_arr)
-			goto out_fail;
-		pool->aCapacity = new_cap;
-		pool->aArray = new_arr;
-	}
+		cache = StreamPool_GetCache(pool);
 
-	pool->aArray[(pool->aSize)++] = s;
-	StreamPool_RemoveUsed(pool, s);
+		if (cache && (cache->count[index] < STREAM_POOL_CACHE_DEPTH))
+		{
+			cache->streams[index][(cache->count[index])++] = s;
+			return;
+		}
+	}
 
-out_fail:
-	if (pool->synchronized)
-		LeaveCriticalSection(&pool->lock);
+	StreamPool_Push(pool, index, s);
 }
 
 /**
@@ -259,11 +637,7 @@ void StreamPool_Unlock(wStreamPool* pool)
 void Stream_AddRef(wStream* s)
 {
 	if (s->pool)
-	{
-		StreamPool_Lock(s->pool);
-		s->count++;
-		StreamPool_Unlock(s->pool);
-	}
+		InterlockedIncrement((LONG volatile*) &s->count);
 }
 
 /**
@@ -272,15 +646,9 @@ void Stream_AddRef(wStream* s)
 
 void Stream_Release(wStream* s)
 {
-	DWORD count;
-
 	if (s->pool)
 	{
-		StreamPool_Lock(s->pool);
-		count = --(s->count);
-		StreamPool_Unlock(s->pool);
-
-		if (count == 0)
+		if (InterlockedDecrement((LONG volatile*) &s->count) == 0)
 			StreamPool_Return(s->pool, s);
 	}
 }
@@ -291,26 +659,47 @@ void Stream_Release(wStream* s)
 
 wStream* StreamPool_Find(wStreamPool* pool, BYTE* ptr)
 {
-	int index;
+	UINT32 index;
+	ULONG_PTR page;
 	wStream* s = NULL;
-	BOOL found = FALSE;
+	wStreamPoolPage* entry;
+	wStreamPoolMap* map;
 
 	EnterCriticalSection(&pool->lock);
 
-	for (index = 0; index < pool->uSize; index++)
+	map = pool->priv->map;
+
+	if (!map)
+		goto out;
+
+	page = ((ULONG_PTR) ptr) >> STREAM_POOL_PAGE_SHIFT;
+	index = StreamPool_Hash(page) & (map->capacity - 1);
+
+	while (1)
 	{
-		s = pool->uArray[index];
+		entry = &map->pages[index];
 
-		if ((ptr >= Stream_Buffer(s)) && (ptr < (Stream_Buffer(s) + Stream_Capacity(s))))
+		if (!entry->page)
 		{
-			found = TRUE;
+			s = NULL;
 			break;
 		}
+
+		if (entry->page == page)
+		{
+			s = entry->stream;
+
+			if (s && (ptr >= Stream_Buffer(s)) && (ptr < (Stream_Buffer(s) + Stream_Capacity(s))) && (s->count > 0))
+				break;
+		}
+
+		index = (index + 1) & (map->capacity - 1);
 	}
 
+out:
 	LeaveCriticalSection(&pool->lock);
 
-	return (found) ? s : NULL;
+	return s;
 }
 
 /**
@@ -343,21 +732,34 @@ void StreamPool_Release(wStreamPool* pool, BYTE* ptr)
 
 /**
  * Releases the streams currently cached in the pool.
+ *
+ * Streams cached by other threads are released by StreamPool_Free.
  */
 
 void StreamPool_Clear(wStreamPool* pool)
 {
-	if (pool->synchronized)
-		EnterCriticalSection(&pool->lock);
+	int index;
+	wStream* s;
+	wStreamPoolCache* cache = NULL;
+
+	EnterCriticalSection(&pool->lock);
 
-	while (pool->aSize > 0)
+	for (index = 0; index < STREAM_POOL_CLASSES; index++)
 	{
-		(pool->aSize)--;
-		Stream_Free(pool->aArray[pool->aSize], TRUE);
+		while ((s = StreamPool_Pop(pool, index)) != NULL)
+		{
+			StreamPool_Discard(pool, s);
+			InterlockedDecrement(&pool->aSize);
+		}
 	}
 
-	if (pool->synchronized)
-		LeaveCriticalSection(&pool->lock);
+	if (pool->priv->cacheIndex != TLS_OUT_OF_INDEXES)
+		cache = (wStreamPoolCache*) TlsGetValue(pool->priv->cacheIndex);
+
+	if (cache)
+		StreamPool_DiscardCache(pool, cache);
+
+	LeaveCriticalSection(&pool->lock);
 }
 
 /**
@@ -375,28 +777,22 @@ wStreamPool* StreamPool_New(BOOL synchronized, size_t defaultSize)
 		pool->synchronized = synchronized;
 		pool->defaultSize = defaultSize;
 
-		pool->aSize = 0;
-		pool->aCapacity = 32;
-		pool->aArray = (wStream**) calloc(pool->aCapacity, sizeof(wStream*));
+		pool->priv = (wStreamPoolPrivate*) calloc(1, sizeof(wStreamPoolPrivate));
 
-		if (!pool->aArray)
+		if (!pool->priv)
 		{
 			free(pool);
 			return NULL;
 		}
 
-		pool->uSize = 0;
-		pool->uCapacity = 32;
-		pool->uArray = (wStream**) calloc(pool->uCapacity, sizeof(wStream*));
-
-		if (!pool->uArray)
+		if (!InitializeCriticalSectionAndSpinCount(&pool->lock, 4000))
 		{
-			free(pool->aArray);
+			free(pool->priv);
 			free(pool);
 			return NULL;
 		}
 
-		InitializeCriticalSectionAndSpinCount(&pool->lock, 4000);
+		pool->priv->cacheIndex = (synchronized) ? TlsAlloc() : TLS_OUT_OF_INDEXES;
 	}
 
 	return pool;
@@ -404,15 +800,44 @@ wStreamPool* StreamPool_New(BOOL synchronized, size_t defaultSize)
 
 void StreamPool_Free(wStreamPool* pool)
 {
+	int index;
+	wStreamPoolCache* cache;
+	wStreamPoolEntry* entry;
+	wStreamPoolPrivate* priv;
+
 	if (pool)
 	{
+		priv = pool->priv;
+
 		StreamPool_Clear(pool);
 
-		DeleteCriticalSection(&pool->lock);
+		while (priv->caches)
+		{
+			cache = priv->caches;
+			priv->caches = cache->next;
+			StreamPool_DiscardCache(pool, cache);
+			free(cache);
+		}
+
+		if (priv->cacheIndex != TLS_OUT_OF_INDEXES)
+			TlsFree(priv->cacheIndex);
+
+		/* streams still in use keep their header, as before they are not owned by the pool */
+		while (priv->spares)
+		{
+			entry = priv->spares;
+			priv->spares = entry->spare;
+			free(entry);
+		}
+
+		for (index = 0; index < STREAM_POOL_SLOT_CHUNKS; index++)
+			free(priv->slots[index]);
 
-		free(pool->aArray);
-		free(pool->uArray);
+		StreamPool_MapFree(priv->map);
+
+		DeleteCriticalSection(&pool->lock);
 
+		free(priv);
 		free(pool);
 	}
 }
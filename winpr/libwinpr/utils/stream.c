@@ -25,6 +25,9 @@
 #include <winpr/crt.h>
 #include <winpr/stream.h>
 
+void StreamPool_MapStream(wStream* s);
+void StreamPool_UnmapStream(wStream* s);
+
 BOOL Stream_EnsureCapacity(wStream* s, size_t size)
 {
 	if (s->capacity < size)
@@ -46,14 +49,24 @@ BOOL Stream_EnsureCapacity(wStream* s, size_t size)
 
 		position = Stream_GetPosition(s);
 
+		if (s->pool)
+			StreamPool_UnmapStream(s);
+
 		new_buf = (BYTE*) realloc(s->buffer, new_capacity);
 		if (!new_buf)
+		{
+			if (s->pool)
+				StreamPool_MapStream(s);
 			return FALSE;
+		}
 		s->buffer = new_buf;
 		s->capacity = new_capacity;
 		s->length = new_capacity;
 		ZeroMemory(&s->buffer[old_capacity], s->capacity - old_capacity);
 
+		if (s->pool)
+			StreamPool_MapStream(s);
+
 		Stream_SetPosition(s, position);
 	}
 	return TRUE;
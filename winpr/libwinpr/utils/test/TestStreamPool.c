@@ -1,44 +1,109 @@
 
 #include <winpr/crt.h>
+#include <winpr/synch.h>
+#include <winpr/thread.h>
 #include <winpr/stream.h>
 #include <winpr/collections.h>
 
 #define BUFFER_SIZE 16384
 
+#define THREAD_COUNT 4
+#define THREAD_ITERATIONS 100000
+
+static BOOL stream_pool_check(wStreamPool* pool, int aSize, int uSize)
+{
+	printf("StreamPool: aSize: %d uSize: %d\n", pool->aSize, pool->uSize);
+
+	if ((pool->aSize != aSize) || (pool->uSize != uSize))
+	{
+		printf("StreamPool: expected aSize: %d uSize: %d\n", aSize, uSize);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+static void* stream_pool_thread(void* arg)
+{
+	int index;
+	wStream* s[3];
+	wStreamPool* pool = (wStreamPool*) arg;
+
+	for (index = 0; index < THREAD_ITERATIONS; index++)
+	{
+		s[0] = StreamPool_Take(pool, 0);
+		s[1] = StreamPool_Take(pool, 1024 * (index % 64));
+		s[2] = StreamPool_Take(pool, 0);
+
+		if (!s[0] || !s[1] || !s[2])
+			return (void*) (size_t) 1;
+
+		Stream_Write_UINT32(s[1], index);
+		StreamPool_AddRef(pool, Stream_Buffer(s[1]) + 2);
+
+		if (StreamPool_Find(pool, Stream_Buffer(s[0]) + 100) != s[0])
+			return (void*) (size_t) 1;
+
+		Stream_Release(s[2]);
+		Stream_Release(s[0]);
+		Stream_Release(s[1]);
+		StreamPool_Release(pool, Stream_Buffer(s[1]));
+
+		/* discard cached streams while other threads pop the free lists */
+		if ((index % 1024) == 0)
+			StreamPool_Clear(pool);
+	}
+
+	return NULL;
+}
+
+
 int TestStreamPool(int argc, char* argv[])
 {
+	int index;
+	BYTE* buffer;
+	DWORD status;
 	wStream* s[5];
 	wStreamPool* pool;
+	HANDLE threads[THREAD_COUNT];
 
 	pool = StreamPool_New(TRUE, BUFFER_SIZE);
 
+	if (!pool)
+		return -1;
+
 	s[0] = StreamPool_Take(pool, 0);
 	s[1] = StreamPool_Take(pool, 0);
 	s[2] = StreamPool_Take(pool, 0);
 
-	printf("StreamPool: aSize: %d uSize: %d\n", pool->aSize, pool->uSize);
+	if (!stream_pool_check(pool, 0, 3))
+		return -1;
 
 	Stream_Release(s[0]);
 	Stream_Release(s[1]);
 	Stream_Release(s[2]);
 
-	printf("StreamPool: aSize: %d uSize: %d\n", pool->aSize, pool->uSize);
+	if (!stream_pool_check(pool, 3, 0))
+		return -1;
 
 	s[3] = StreamPool_Take(pool, 0);
 	s[4] = StreamPool_Take(pool, 0);
 
-	printf("StreamPool: aSize: %d uSize: %d\n", pool->aSize, pool->uSize);
+	if (!stream_pool_check(pool, 1, 2))
+		return -1;
 
 	Stream_Release(s[3]);
 	Stream_Release(s[4]);
 
-	printf("StreamPool: aSize: %d uSize: %d\n", pool->aSize, pool->uSize);
+	if (!stream_pool_check(pool, 3, 0))
+		return -1;
 
 	s[2] = StreamPool_Take(pool, 0);
 	s[3] = StreamPool_Take(pool, 0);
 	s[4] = StreamPool_Take(pool, 0);
 
-	printf("StreamPool: aSize: %d uSize: %d\n", pool->aSize, pool->uSize);
+	if (!stream_pool_check(pool, 0, 3))
+		return -1;
 
 	Stream_AddRef(s[2]);
 
@@ -61,13 +126,15 @@ int TestStreamPool(int argc, char* argv[])
 	Stream_Release(s[4]);
 	Stream_Release(s[4]);
 
-	printf("StreamPool: aSize: %d uSize: %d\n", pool->aSize, pool->uSize);
+	if (!stream_pool_check(pool, 3, 0))
+		return -1;
 
 	s[2] = StreamPool_Take(pool, 0);
 	s[3] = StreamPool_Take(pool, 0);
 	s[4] = StreamPool_Take(pool, 0);
 
-	printf("StreamPool: aSize: %d uSize: %d\n", pool->aSize, pool->uSize);
+	if (!stream_pool_check(pool, 0, 3))
+		return -1;
 
 	StreamPool_AddRef(pool, s[2]->buffer + 1024);
 
@@ -78,7 +145,8 @@ int TestStreamPool(int argc, char* argv[])
 	StreamPool_AddRef(pool, s[4]->buffer + 1024 * 2);
 	StreamPool_AddRef(pool, s[4]->buffer + 1024 * 3);
 
-	printf("StreamPool: aSize: %d uSize: %d\n", pool->aSize, pool->uSize);
+	if (!stream_pool_check(pool, 0, 3))
+		return -1;
 
 	StreamPool_Release(pool, s[2]->buffer + 2048);
 	StreamPool_Release(pool, s[2]->buffer + 2048 * 2);
@@ -92,7 +160,68 @@ int TestStreamPool(int argc, char* argv[])
 	StreamPool_Release(pool, s[4]->buffer + 2048 * 3);
 	StreamPool_Release(pool, s[4]->buffer + 2048 * 4);
 
-	printf("StreamPool: aSize: %d uSize: %d\n", pool->aSize, pool->uSize);
+	if (!stream_pool_check(pool, 3, 0))
+		return -1;
+
+	s[0] = StreamPool_Take(pool, 0);
+	s[1] = StreamPool_Take(pool, 0);
+
+	if (!s[0] || !s[1])
+		return -1;
+
+	if ((StreamPool_Find(pool, Stream_Buffer(s[0])) != s[0]) ||
+		(StreamPool_Find(pool, Stream_Buffer(s[1]) + BUFFER_SIZE - 1) != s[1]))
+	{
+		printf("StreamPool_Find: stream in use not found\n");
+		return -1;
+	}
+
+	Stream_Release(s[1]);
+
+	if (StreamPool_Find(pool, Stream_Buffer(s[1])))
+	{
+		printf("StreamPool_Find: returned a stream not in use\n");
+		return -1;
+	}
+
+	buffer = Stream_Buffer(s[0]);
+
+	if (!Stream_EnsureCapacity(s[0], BUFFER_SIZE * 16))
+		return -1;
+
+	if ((StreamPool_Find(pool, Stream_Buffer(s[0]) + BUFFER_SIZE * 8) != s[0]) ||
+		((buffer != Stream_Buffer(s[0])) && (StreamPool_Find(pool, buffer) == s[0])))
+	{
+		printf("StreamPool_Find: stream not remapped after reallocation\n");
+		return -1;
+	}
+
+	Stream_Release(s[0]);
+
+	for (index = 0; index < THREAD_COUNT; index++)
+	{
+		if (!(threads[index] = CreateThread(NULL, 0, (LPTHREAD_START_ROUTINE) stream_pool_thread, (void*) pool, 0, NULL)))
+			return -1;
+	}
+
+	for (index = 0; index < THREAD_COUNT; index++)
+	{
+		WaitForSingleObject(threads[index], INFINITE);
+
+		if (!GetExitCodeThread(threads[index], &status) || status)
+		{
+			printf("StreamPool: thread %d failed\n", index);
+			return -1;
+		}
+
+		CloseHandle(threads[index]);
+	}
+
+	if (pool->uSize != 0)
+	{
+		printf("StreamPool: %d streams still in use after threads completed\n", pool->uSize);
+		return -1;
+	}
 
 	StreamPool_Free(pool);
 